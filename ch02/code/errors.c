@@ -4,18 +4,62 @@
 #include <gavran/infrastructure.h>
 
 #include <assert.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
 #define MAX_ERRORS 64
 #define MAX_ERRORS_MSG_BUFFER 2048
+#define MAX_ERRORS_SEGMENTS (MAX_ERRORS * 4)
+#define MAX_ERRORS_ARGS (MAX_ERRORS * 8)
+
+// errors keep their format strings and raw arguments, the messages
+// are only formatted when someone asks for them. Most errors are
+// cleared without being read.
+typedef struct error_record {
+  const char *file;
+  const char *func;
+  uint32_t line;
+  uint16_t first_segment;
+  uint16_t number_of_segments;
+} error_record_t;
+
+// a single errors_append_message call
+typedef struct error_segment {
+  const char *format;
+  uint16_t first_arg;
+  uint16_t number_of_args;
+  uint32_t padding;
+} error_segment_t;
+
+typedef union error_arg {
+  long long i;
+  unsigned long long u;
+  double d;
+  const void *p;
+} error_arg_t;
 
 _Thread_local static char _messages_buffer[MAX_ERRORS_MSG_BUFFER];
 _Thread_local static const char *_errors_messages_buffer[MAX_ERRORS];
 _Thread_local static int _errors_messages_codes[MAX_ERRORS];
 
+_Thread_local static error_record_t _errors[MAX_ERRORS];
+_Thread_local static size_t _errors_offsets[MAX_ERRORS];
+_Thread_local static error_segment_t
+    _errors_segments[MAX_ERRORS_SEGMENTS];
+_Thread_local static error_arg_t _errors_args[MAX_ERRORS_ARGS];
+// copies of the strings passed as arguments, they may not outlive
+// the call
+_Thread_local static char _strings_buffer[MAX_ERRORS_MSG_BUFFER];
+
 _Thread_local static size_t _errors_count;
+_Thread_local static size_t _errors_formatted;
 _Thread_local static size_t _errors_buffer_len;
+_Thread_local static size_t _segments_count;
+_Thread_local static size_t _args_count;
+_Thread_local static size_t _strings_len;
+_Thread_local static bool _errors_discarding;
 _Thread_local static uint32_t _out_of_memory;
 
 // end::declarations[]
@@ -46,6 +90,196 @@ __attribute__((__format__(__printf__, 4, 5))) static bool try_sprintf(
 }
 // end::try_sprintf[]
 
+// tag::error_spec[]
+typedef enum error_arg_kind {
+  error_arg_none,
+  error_arg_int,
+  error_arg_uint,
+  error_arg_double,
+  error_arg_ptr,
+  error_arg_str,
+} error_arg_kind_t;
+
+typedef struct error_spec {
+  const char *start;        // the '%'
+  const char *prefix_end;   // after the flags, width and precision
+  const char *length;       // the length modifier, if any
+  const char *end;          // after the conversion
+  char conversion;
+  bool has_precision;
+  uint8_t stars;            // width and precision taken as arguments
+  uint8_t kind;
+  int precision;
+} error_spec_t;
+
+static const char *error_skip_number(const char *cur, uint8_t *stars,
+                                     int *value) {
+  if (*cur == '*') {
+    (*stars)++;
+    return cur + 1;
+  }
+  *value = 0;
+  while (*cur >= '0' && *cur <= '9') {
+    *value = *value * 10 + *cur++ - '0';
+  }
+  return cur;
+}
+
+static error_arg_kind_t error_spec_kind(char conversion) {
+  switch (conversion) {
+    case 'd':
+    case 'i':
+    case 'c':
+      return error_arg_int;
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+      return error_arg_uint;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      return error_arg_double;
+    case 'p':
+      return error_arg_ptr;
+    case 's':
+      return error_arg_str;
+    default:
+      return error_arg_none;
+  }
+}
+
+// finds the next conversion in the format, "%%" is literal text
+static bool error_next_spec(const char *cur, error_spec_t *spec) {
+  while (*cur && (cur[0] != '%' || cur[1] == '%'))
+    cur += cur[0] == '%' ? 2 : 1;
+  if (!*cur) return false;
+  int ignored;
+  spec->start = cur++;
+  spec->stars = 0;
+  while (*cur && strchr("-+ #0", *cur)) cur++;
+  cur = error_skip_number(cur, &spec->stars, &ignored);
+  spec->has_precision = *cur == '.';
+  spec->precision = -1;
+  if (spec->has_precision) {
+    uint8_t stars = spec->stars;
+    cur = error_skip_number(cur + 1, &spec->stars, &spec->precision);
+    if (stars != spec->stars) spec->precision = -1;  // an argument
+  }
+  spec->prefix_end = spec->length = cur;
+  while (*cur && strchr("hljztL", *cur)) cur++;
+  spec->conversion = *cur;
+  spec->end = *cur ? cur + 1 : cur;
+  error_arg_kind_t kind = error_spec_kind(spec->conversion);
+  spec->kind = (uint8_t)kind;
+  return true;
+}
+// end::error_spec[]
+
+// tag::error_capture[]
+static long long error_capture_int(error_spec_t *spec, va_list *ap) {
+  size_t len = (size_t)(spec->end - 1 - spec->length);
+  if (len == 2 && spec->length[0] == 'l')
+    return va_arg(*ap, long long);
+  if (len == 2) return (signed char)va_arg(*ap, int);  // hh
+  if (len == 0) return va_arg(*ap, int);
+  switch (spec->length[0]) {
+    case 'h':
+      return (short)va_arg(*ap, int);
+    case 'l':
+      return va_arg(*ap, long);
+    case 'j':
+      return (long long)va_arg(*ap, intmax_t);
+    default:  // z and t
+      return (long long)va_arg(*ap, ptrdiff_t);
+  }
+}
+
+static unsigned long long error_capture_uint(error_spec_t *spec,
+                                             va_list *ap) {
+  size_t len = (size_t)(spec->end - 1 - spec->length);
+  if (len == 2 && spec->length[0] == 'l')
+    return va_arg(*ap, unsigned long long);
+  if (len == 2) return (unsigned char)va_arg(*ap, unsigned int);
+  if (len == 0) return va_arg(*ap, unsigned int);
+  switch (spec->length[0]) {
+    case 'h':
+      return (unsigned short)va_arg(*ap, unsigned int);
+    case 'l':
+      return va_arg(*ap, unsigned long);
+    case 'j':
+      return (unsigned long long)va_arg(*ap, uintmax_t);
+    default:  // z and t
+      return va_arg(*ap, size_t);
+  }
+}
+
+static bool error_capture_str(int precision, const char *str,
+                              error_arg_t *arg) {
+  if (!str) {
+    arg->p = 0;
+    return true;
+  }
+  size_t len = precision >= 0 ? strnlen(str, (size_t)precision)
+                              : strlen(str);
+  if (_strings_len + len + 1 > MAX_ERRORS_MSG_BUFFER) return false;
+  char *copy = _strings_buffer + _strings_len;
+  memcpy(copy, str, len);
+  copy[len] = 0;
+  _strings_len += len + 1;
+  arg->p = copy;
+  return true;
+}
+
+static bool error_capture_args(const char *format, va_list *ap) {
+  error_spec_t spec;
+  const char *cur = format;
+  while (error_next_spec(cur, &spec)) {
+    cur = spec.end;
+    if (_args_count + spec.stars + 1 > MAX_ERRORS_ARGS) return false;
+    int precision = spec.precision;
+    for (uint8_t i = 0; i < spec.stars; i++) {
+      precision = va_arg(*ap, int);  // the precision comes last
+      _errors_args[_args_count++].i = precision;
+    }
+    if (!spec.has_precision) precision = -1;
+    if (spec.precision >= 0) precision = spec.precision;
+    error_arg_t *arg = &_errors_args[_args_count++];
+    switch (spec.kind) {
+      case error_arg_int:
+        arg->i = error_capture_int(&spec, ap);
+        break;
+      case error_arg_uint:
+        arg->u = error_capture_uint(&spec, ap);
+        break;
+      case error_arg_double:
+        if (*spec.length == 'L') {
+          arg->d = (double)va_arg(*ap, long double);
+        } else {
+          arg->d = va_arg(*ap, double);
+        }
+        break;
+      case error_arg_ptr:
+        arg->p = va_arg(*ap, void *);
+        break;
+      case error_arg_str:
+        if (!error_capture_str(precision, va_arg(*ap, const char *),
+                               arg))
+          return false;
+        break;
+      default:  // not something we can hold on to
+        return false;
+    }
+  }
+  return true;
+}
+// end::error_capture[]
+
 // tag::errors_push_new[]
 op_result_t *errors_push_new(const char *file, uint32_t line,
                              const char *func, int32_t code) {
@@ -53,68 +287,188 @@ op_result_t *errors_push_new(const char *file, uint32_t line,
   if (_errors_count >= MAX_ERRORS) {
     // we have no space any longer for errors, ignoring
     _out_of_memory |= 1;
+    _errors_discarding = true;
     return 0;
   }
 
   // <2>
   size_t index = _errors_count++;
   _errors_messages_codes[index] = code;
+  _errors_messages_buffer[index] = 0;
+  _errors[index] = (error_record_t){
+      .file = file,
+      .func = func,
+      .line = line,
+      .first_segment = (uint16_t)_segments_count};
+  _errors_discarding = false;
+  return 0;
+}
+// end::errors_push_new[]
+
+// tag::errors_append_message[]
+op_result_t *errors_append_message(const char *format, ...) {
+  if (!_errors_count || _errors_discarding) return 0;
+
+  // <1>
+  size_t args = _args_count, strings = _strings_len;
+  bool captured = _segments_count < MAX_ERRORS_SEGMENTS;
+  if (captured) {
+    va_list ap;
+    va_start(ap, format);
+    captured = error_capture_args(format, &ap);
+    va_end(ap);
+  }
+  if (!captured) {
+    // <2>
+    _args_count = args;
+    _strings_len = strings;
+    _out_of_memory |= 2;
+    return 0;
+  }
+
+  error_record_t *error = &_errors[_errors_count - 1];
+  _errors_segments[_segments_count++] = (error_segment_t){
+      .format = format,
+      .first_arg = (uint16_t)args,
+      .number_of_args = (uint16_t)(_args_count - args)};
+  error->number_of_segments++;
+  if (_errors_formatted == _errors_count) {  // must be redone
+    _errors_formatted--;
+    _errors_buffer_len = _errors_offsets[_errors_formatted];
+  }
+  return 0;  // simply to allow it to be used in comma operator
+}
+// end::errors_append_message[]
+
+// tag::errors_format[]
+// the formats are rebuilt from the captured ones, they can't be
+// literals
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wformat-nonliteral"
+static bool error_format_spec(char **msg, char *end, size_t *chars,
+                              error_spec_t *spec, error_arg_t **arg) {
+  char format[64];
+  size_t prefix = (size_t)(spec->prefix_end - spec->start);
+  if (prefix + 16 >= sizeof(format)) return false;
+  // the starred width and precision are written into the format
+  char *cur = format;
+  for (const char *c = spec->start; c < spec->prefix_end; c++) {
+    if (*c != '*') {
+      *cur++ = *c;
+      continue;
+    }
+    int value = (int)(*arg)++->i;
+    if (c > spec->start && c[-1] == '.' && value < 0) {
+      cur--;  // a negative precision is as if there was none
+      continue;
+    }
+    cur += snprintf(cur, 12, "%d", value);
+  }
+  switch (spec->kind) {
+    case error_arg_int:
+      if (spec->conversion == 'c') {
+        *cur++ = 'c';
+        *cur = 0;
+        return try_sprintf(msg, end, chars, format, (int)(*arg)++->i);
+      }
+      memcpy(cur, "lld", 4);
+      cur[2] = spec->conversion;
+      return try_sprintf(msg, end, chars, format, (*arg)++->i);
+    case error_arg_uint:
+      memcpy(cur, "llu", 4);
+      cur[2] = spec->conversion;
+      return try_sprintf(msg, end, chars, format, (*arg)++->u);
+    case error_arg_double:
+      cur[0] = spec->conversion;
+      cur[1] = 0;
+      return try_sprintf(msg, end, chars, format, (*arg)++->d);
+    case error_arg_ptr:
+      memcpy(cur, "p", 2);
+      return try_sprintf(msg, end, chars, format, (*arg)++->p);
+    default:
+      memcpy(cur, "s", 2);
+      return try_sprintf(msg, end, chars, format,
+                         (const char *)(*arg)++->p);
+  }
+}
+#pragma clang diagnostic pop
 
+// the text between conversions, where "%%" is a single '%'
+static bool error_format_text(char **msg, char *end, size_t *chars,
+                              const char *text, const char *stop) {
+  while (text < stop) {
+    const char *pct = memchr(text, '%', (size_t)(stop - text));
+    int len = (int)((pct ? pct + 1 : stop) - text);  // keeps a '%'
+    if (!try_sprintf(msg, end, chars, "%.*s", len, text))
+      return false;
+    text = pct ? pct + 2 : stop;
+  }
+  return true;
+}
+
+static bool error_format_segment(char **msg, char *end, size_t *chars,
+                                 error_segment_t *segment) {
+  error_arg_t *arg = &_errors_args[segment->first_arg];
+  error_spec_t spec;
+  const char *cur = segment->format;
+  while (error_next_spec(cur, &spec)) {
+    if (!error_format_text(msg, end, chars, cur, spec.start) ||
+        !error_format_spec(msg, end, chars, &spec, &arg))
+      return false;
+    cur = spec.end;
+  }
+  return error_format_text(msg, end, chars, cur, cur + strlen(cur));
+}
+
+static void errors_format_one(size_t index) {
+  error_record_t *error = &_errors[index];
+  _errors_offsets[index] = _errors_buffer_len;
   char *msg = (_messages_buffer + _errors_buffer_len);
   char *end = _messages_buffer + MAX_ERRORS_MSG_BUFFER;
   char *start = msg;
 
   char stack_buffer[128];
+  int code = _errors_messages_codes[index];
   int rc = strerror_r(code, stack_buffer, 128);
   if (rc) strcpy(stack_buffer, "Unknown code");
 
   size_t chars_written = 0;
   // <3>
-  if (!try_sprintf(&msg, end, &chars_written, "%s()", func) ||
+  if (!try_sprintf(&msg, end, &chars_written, "%s()", error->func) ||
       !try_sprintf(&msg, end, &chars_written, "%-*c - %s:%i",
-                   (int)(30 - chars_written), ' ', file, line) ||
+                   (int)(30 - chars_written), ' ', error->file,
+                   error->line) ||
       !try_sprintf(&msg, end, &chars_written, "%*c - %3i %-20s |  ",
                    (int)(50 - chars_written), ' ', code,
-                   stack_buffer))
-    goto oom;
-
-  _errors_buffer_len += (size_t)(msg - start);
+                   stack_buffer)) {
+    _out_of_memory |= 2;
+    _errors_messages_buffer[index] = 0;
+    return;
+  }
+  if (error->number_of_segments) msg--;  // over the last space
+  for (size_t i = 0; i < error->number_of_segments; i++) {
+    char *segment_start = msg;
+    if (!error_format_segment(&msg, end, &chars_written,
+            &_errors_segments[error->first_segment + i])) {
+      msg = segment_start;
+      *msg = 0;  // undo possible overwrite of null terminator
+      _out_of_memory |= 2;
+    }
+  }
+  _errors_buffer_len += (size_t)(msg - start) + 1;
   _errors_messages_buffer[index] = start;
-  return 0;
-oom:
-  _out_of_memory |= 2;
-  _errors_messages_buffer[index] = 0;
-  return 0;
 }
-// end::errors_push_new[]
-
-// tag::errors_append_message[]
-op_result_t *errors_append_message(const char *format, ...) {
-  if (!_errors_count && _errors_buffer_len) return 0;
-
-  // <1>
-  char *msg = (_messages_buffer + _errors_buffer_len) - 1;
-  char *end = _messages_buffer + MAX_ERRORS_MSG_BUFFER;
-  size_t chars_written = 0;
 
-  va_list ap;
-  va_start(ap, format);
-  bool ret = try_vsprintf(&msg, end, &chars_written, format, ap);
-  va_end(ap);
-  if (!ret) {
-    // <2>
-    *msg = 0;  // undo possible overwrite of null terminator
-    _out_of_memory |= 2;
-    return 0;
+static void errors_format(void) {
+  while (_errors_formatted < _errors_count) {
+    errors_format_one(_errors_formatted++);
   }
-
-  _errors_buffer_len += chars_written;
-  return 0;  // simply to allow it to be used in comma operator
 }
-// end::errors_append_message[]
+// end::errors_format[]
 
 // tag::rest[]
 const char **errors_get_messages(size_t *number_of_errors) {
+  errors_format();
   *number_of_errors = _errors_count;
   return (const char **)_errors_messages_buffer;
 }
@@ -125,6 +479,7 @@ int *errors_get_codes(size_t *number_of_errors) {
 }
 
 void errors_print_all(void) {
+  errors_format();
   for (size_t i = 0; i < _errors_count; i++) {
     printf("%s\n", _errors_messages_buffer[i]);
   }
@@ -143,12 +498,19 @@ void errors_clear(void) {
   memset(_errors_messages_codes, 0,
          sizeof(int32_t *) * _errors_count);
   memset(_errors_messages_buffer, 0, sizeof(char *) * _errors_count);
-  memset(_messages_buffer, 0, _errors_buffer_len);
   _errors_buffer_len = 0;
   _errors_count = 0;
+  _errors_formatted = 0;
+  _segments_count = 0;
+  _args_count = 0;
+  _strings_len = 0;
+  _errors_discarding = false;
 }
 
 size_t errors_get_count() { return _errors_count; }
 
-uint32_t errors_get_oom_flag() { return _out_of_memory; }
+uint32_t errors_get_oom_flag() {
+  errors_format();  // running out of room is found while formatting
+  return _out_of_memory;
+}
 // end::rest[]
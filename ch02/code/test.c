@@ -136,6 +136,53 @@ describe(errors_and_resource_usage) {
     }
   }
 
+  it("Keeps copies of the strings it will format later") {
+    {
+      char buffer[32];
+      strcpy(buffer, "from the stack");
+      errors_push(EIO, msg("Testing errors"), with(buffer, "%s"));
+      memset(buffer, 'x', sizeof(buffer) - 1);
+    }
+    size_t count;
+    const char** msgs = errors_get_messages(&count);
+    assert(count == 1);
+    assert(strstr(msgs[0], "| Testing errors, buffer = "));
+    assert(strstr(msgs[0], "buffer = from the stack"));
+  }
+
+  it("Formats the arguments the way printf does") {
+    errors_push(EIO, msg("100%% done"));
+    errors_append_message(" [%*.*s] [%-*.*s]", 6, 3, "abcdef", 5, 2,
+                          "xyz");
+    errors_append_message(" %zu %lld %c", (size_t)42, -7LL, 'z');
+    size_t count;
+    const char** msgs = errors_get_messages(&count);
+    assert(count == 1);
+    assert(strstr(msgs[0], "| 100% done [   abc] [xy   ] 42 -7 z"));
+  }
+
+  it("Forgets the errors cleared before they are read") {
+    errors_push(EIO, msg("Cleared"));
+    errors_clear();
+    errors_push(EINVAL, msg("Kept"), with(7, "%d"));
+    size_t count;
+    const char** msgs = errors_get_messages(&count);
+    assert(count == 1);
+    assert(strstr(msgs[0], "| Kept, 7 = 7"));
+    assert(!strstr(msgs[0], "Cleared"));
+  }
+
+  it("Can append to an error that was already read") {
+    errors_push(EIO, msg("First"));
+    size_t count;
+    const char** msgs = errors_get_messages(&count);
+    assert(strstr(msgs[0], "| First"));
+    errors_append_message(", then %s", "more");
+    msgs = errors_get_messages(&count);
+    assert(count == 1);
+    assert(strstr(msgs[0], "| First, then more"));
+  }
+
   it("Will translate codes to strings") {
     errors_push(EINVAL, msg("Testing errors"));
 
@@ -226,8 +226,93 @@ void defer_pal_disable_writes(cancel_defer_t *cd) {
 }
 // end::pal_enable_writes[]
 
+// tag::pal_prefetch[]
+// tells the kernel the range is about to be read. The reads go
+// through the mapping when there is one, to the file otherwise.
+result_t pal_prefetch(file_handle_t *handle, span_t *map,
+                      uint64_t offset, size_t size) {
+  if (map) {
+    if (madvise(map->address + offset, size, MADV_WILLNEED) == -1) {
+      failed(errno, msg("Unable to advise the kernel on page usage"),
+             with(offset, "%lu"), with(size, "%zu"));
+    }
+    return success();
+  }
+  int rc = posix_fadvise(handle->fd, (off_t)offset, (off_t)size,
+                         POSIX_FADV_WILLNEED);
+  if (rc) {
+    failed(rc, msg("Unable to advise the kernel on file usage"),
+           with(handle->filename, "%s"), with(offset, "%lu"),
+           with(size, "%zu"));
+  }
+  return success();
+}
+// end::pal_prefetch[]
+
+// tag::pal_faults[]
+#ifdef GAVRAN_FAULTS
+#define PAL_FAULTS_BLOCK_SIZE 4096
+
+// one plan for the whole process, set before the I/O it should
+// affect. It isn't locked, the tests that use it do their I/O on one
+// thread.
+static pal_faults_t *pal_faults;
+
+void pal_set_faults(pal_faults_t *faults) { pal_faults = faults; }
+
+static bool pal_faults_match(file_handle_t *handle) {
+  if (!pal_faults->file_suffix) return true;
+  size_t len = strlen(handle->filename);
+  size_t suffix = strlen(pal_faults->file_suffix);
+  return len >= suffix && !strcmp(handle->filename + len - suffix,
+                                  pal_faults->file_suffix);
+}
+
+// reduces the size to what actually reaches the disk
+static result_t pal_faults_write(file_handle_t *handle,
+                                 size_t *size) {
+  if (!pal_faults->crashed && pal_faults_match(handle)) {
+    pal_faults->writes++;
+    if (pal_faults->writes == pal_faults->crash_at_write) {
+      pal_faults->crashed = true;
+      *size = MIN(*size - 1, pal_faults->torn_write_size) &
+              ~(size_t)(PAL_FAULTS_BLOCK_SIZE - 1);
+      return success();
+    }
+  }
+  if (!pal_faults->crashed) return success();
+  *size = 0;
+  if (pal_faults->fail_after_crash) {
+    failed(EIO, msg("Simulated crash, write was dropped"),
+           with(handle->filename, "%s"));
+  }
+  return success();
+}
+
+static result_t pal_faults_fsync(file_handle_t *handle, bool *skip) {
+  *skip = pal_faults->crashed;
+  if (!pal_faults->crashed) {
+    if (pal_faults_match(handle)) pal_faults->fsyncs++;
+    return success();
+  }
+  if (pal_faults->fail_after_crash) {
+    failed(EIO, msg("Simulated crash, fsync was dropped"),
+           with(handle->filename, "%s"));
+  }
+  return success();
+}
+#endif
+// end::pal_faults[]
+
 // tag::pal_fsync[]
 result_t pal_fsync(file_handle_t *handle) {
+#ifdef GAVRAN_FAULTS
+  if (pal_faults) {
+    bool skip;
+    ensure(pal_faults_fsync(handle, &skip));
+    if (skip) return success();
+  }
+#endif
   if (fdatasync(handle->fd) == -1) {
     failed(errno, msg("Failed to sync file"),
            with(handle->filename, "%s"), with(handle->fd, "%i"));
@@ -295,6 +380,9 @@ result_t pal_set_file_size(file_handle_t *handle,
 result_t pal_write_file(file_handle_t *handle, uint64_t offset,
                         const char *buffer, size_t size) {
   errors_assert_empty();
+#ifdef GAVRAN_FAULTS
+  if (pal_faults) ensure(pal_faults_write(handle, &size));
+#endif
   while (size) {
     ssize_t result = pwrite(handle->fd, buffer, size, (off_t)offset);
     if (result == -1) {
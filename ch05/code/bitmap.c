@@ -144,9 +144,6 @@ bool bitmap_search(bitmap_search_state_t *search) {
       search->input.near_position / 64 >= search->input.bitmap_size)
     return false;
 
-  search->internal.current_word     = search->input.bitmap[0];
-  search->internal.previous_set_bit = ULONG_MAX;
-
   search->internal.search_offset = search->input.near_position / 64;
 
   void *old_bitmap  = search->input.bitmap;
@@ -156,6 +153,11 @@ bool bitmap_search(bitmap_search_state_t *search) {
   search->input.bitmap_size -= search->internal.search_offset;
   search->internal.search_offset *= 64;  //  pages instead of words
 
+  // the scan state is relative to the (possibly shifted) bitmap
+  search->internal.index            = 0;
+  search->internal.current_word     = search->input.bitmap[0];
+  search->internal.previous_set_bit = ULONG_MAX;
+
   if (bitmap_search_smallest_nearby(search)) {
     search->output.found_position += search->internal.search_offset;
     return true;
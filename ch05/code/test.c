@@ -6,6 +6,7 @@
 #include <unistd.h>
 
 #include <gavran/db.h>
+#include <gavran/internal.h>
 #include <gavran/test.h>
 
 #include "test.config.h"
@@ -129,5 +130,24 @@ describe(allocation_tests) {
     assert(txn_allocate_page(&tx, &p, 0));
     assert(p.page_num == page_num);  // page is reused
   }
+
+  it("can search the bitmap from the near position") {
+    // free words before the near position, which is in use
+    uint64_t bitmap[4] = {0, 0, ULONG_MAX, 0};
+    bitmap_search_state_t search = {.input = {.bitmap = bitmap,
+        .bitmap_size    = 4,
+        .space_required = 1,
+        .near_position  = 128}};
+    assert(bitmap_search(&search));
+    assert(search.output.found_position == 192);
+
+    // the state of the last search isn't carried to the next one
+    uint64_t used[4]    = {1, ULONG_MAX, ULONG_MAX, ULONG_MAX};
+    search.input.bitmap = used;
+    search.input.bitmap_size   = 4;
+    search.input.near_position = 0;
+    assert(bitmap_search(&search));
+    assert(search.output.found_position == 1);
+  }
 }
 // end::tests[]
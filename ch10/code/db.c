@@ -153,6 +153,8 @@ db_increase_file_size(txn_t *tx, uint64_t new_size) {
       sizeof(span_t)));
   tx->state->map = new_map;
   tx->state->number_of_pages = new_size / PAGE_SIZE;
+  tx->state->db->file_growths++;
+  probe(db_increase_file_size, tx->state->tx_id, new_size);
   return success();
 }
 
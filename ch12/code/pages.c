@@ -17,6 +17,7 @@ result_t pages_get(txn_t *tx, page_t *p) {
     return success();
   }
   // <2>
+  probe(pages_get_miss, p->page_num, p->number_of_pages);
   void *buffer;
   uint64_t pages = MAX(1, p->number_of_pages);
   ensure(mem_alloc_page_aligned(&buffer, pages * PAGE_SIZE));
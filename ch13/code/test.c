@@ -307,5 +307,105 @@ describe(log_shipping) {
       assert(strcmp("Hello Remotely", p.address) == 0);
     }
   }
+
+  it("can ship an entry that spans several pages") {
+    db_t src, dst;
+
+    char key[32];
+    randombytes_buf(key, 32);
+
+    db_options_t dst_options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_log_shipping_target};
+    memcpy(dst_options.encryption_key, key, 32);
+    assert(db_create("/tmp/db/try-dst", &dst_options, &dst));
+    defer(db_close, dst);
+
+    // encrypted, so the pages aren't compressed in the log
+    db_and_error_state_t state = {.db = &dst};
+    db_options_t src_options   = {.minimum_size = 4 * 1024 * 1024,
+        .wal_write_callback                   = ship_wal_logs,
+        .wal_write_callback_state             = &state};
+    memcpy(src_options.encryption_key, key, 32);
+    assert(db_create("/tmp/db/try-src", &src_options, &src));
+    defer(db_close, src);
+
+    char* data;
+    assert(mem_calloc((void*)&data, 4 * PAGE_SIZE));
+    defer(free, data);
+    randombytes_buf(data, 4 * PAGE_SIZE);
+    uint64_t page;
+    {
+      txn_t w;
+      assert(txn_create(&src, TX_WRITE, &w));
+      defer(txn_close, w);
+      page_t p = {.number_of_pages = 4};
+      assert(txn_allocate_page(&w, &p, 0));
+      page                                 = p.page_num;
+      p.metadata->overflow.page_flags      = page_flags_overflow;
+      p.metadata->overflow.number_of_pages = 4;
+      memcpy(p.address, data, 4 * PAGE_SIZE);
+      assert(txn_commit(&w));
+    }
+    assert(!state.has_errors);
+    {
+      txn_t r;
+      assert(txn_create(&dst, TX_READ, &r));
+      defer(txn_close, r);
+      page_t p = {.page_num = page};
+      assert(txn_get_page(&r, &p));
+      assert(p.number_of_pages == 4);
+      assert(memcmp(data, p.address, 4 * PAGE_SIZE) == 0);
+    }
+  }
+
+  it("can ship a change that runs to the end of the page") {
+    db_t src, dst;
+    db_options_t dst_options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_log_shipping_target};
+    assert(db_create("/tmp/db/try-dst", &dst_options, &dst));
+    defer(db_close, dst);
+
+    db_and_error_state_t state = {.db = &dst};
+    db_options_t src_options   = {.minimum_size = 4 * 1024 * 1024,
+        .wal_write_callback                   = ship_wal_logs,
+        .wal_write_callback_state             = &state};
+    assert(db_create("/tmp/db/try-src", &src_options, &src));
+    defer(db_close, src);
+
+    uint64_t page;
+    {
+      txn_t w;
+      assert(txn_create(&src, TX_WRITE, &w));
+      defer(txn_close, w);
+      page_t p = {.number_of_pages = 1};
+      assert(txn_allocate_page(&w, &p, 0));
+      page                                 = p.page_num;
+      p.metadata->overflow.page_flags      = page_flags_overflow;
+      p.metadata->overflow.number_of_pages = 1;
+      assert(txn_commit(&w));
+    }
+    size_t words_in_page = PAGE_SIZE / sizeof(uint64_t);
+    {  // shipped as a diff from the previous version
+      txn_t w;
+      assert(txn_create(&src, TX_WRITE, &w));
+      defer(txn_close, w);
+      page_t p = {.page_num = page};
+      assert(txn_modify_page(&w, &p));
+      uint64_t* words = p.address;
+      for (size_t i = 1000; i < words_in_page; i++) words[i] = i;
+      assert(txn_commit(&w));
+    }
+    assert(!state.has_errors);
+    {
+      txn_t r;
+      assert(txn_create(&dst, TX_READ, &r));
+      defer(txn_close, r);
+      page_t p = {.page_num = page};
+      assert(txn_get_page(&r, &p));
+      uint64_t* words = p.address;
+      assert(words[1000] == 1000);
+      assert(words[words_in_page - 1] == words_in_page - 1);
+    }
+  }
 }
 // end::tests13[]
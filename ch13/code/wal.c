@@ -83,11 +83,12 @@ static void *wal_diff_page(uint64_t *restrict origin,
         break;
       }
     }
+    size_t diff_len = i - diff_start;
     if (i == size) i--;  // reached the end of the buffer, go back
     void *required_write = current + sizeof(wal_page_diff_t);
     wal_page_diff_t diff = {
         .offset = (uint32_t)(diff_start * sizeof(uint64_t)),
-        .length = (int32_t)((i - diff_start) * sizeof(uint64_t))};
+        .length = (int32_t)(diff_len * sizeof(uint64_t))};
     if (zeroes) {
       diff.length = -diff.length;  // indicates zero fill
     } else {
@@ -172,8 +173,14 @@ static result_t wal_prepare_txn_buffer(
   // <1>
   size_t tx_header_size =
       sizeof(wal_txn_t) + pages * sizeof(wal_txn_page_t);
+  // entries may span several pages, all of which may be written
+  uint64_t data_pages = 0;
+  size_t iter_state   = 0;
+  page_t *entry;
+  while (pagesmap_get_next(tx->modified_pages, &iter_state, &entry))
+    data_pages += MAX(1, entry->number_of_pages);
   uint64_t total_size =
-      (TO_PAGES(tx_header_size) + pages) * PAGE_SIZE;
+      (TO_PAGES(tx_header_size) + data_pages) * PAGE_SIZE;
   size_t cancel_defer = 0;
   wal_txn_t *wt;
   ensure(mem_alloc_page_aligned((void *)&wt, total_size));
@@ -225,31 +232,41 @@ result_t wal_append(txn_state_t *tx) {
     skip_free_buffer = 1;
     txn_buffer       = tx->shipped_wal_record;
   } else {
+    uint64_t start = db_hooks_latency_start(tx->db);
     ensure(wal_prepare_txn_buffer(tx, &txn_buffer));
+    db_hooks_latency(tx->db, db_latency_wal_prepare, start);
+    start             = db_hooks_latency_start(tx->db);
     const size_t size = crypto_generichash_BYTES;
     ensure(!crypto_generichash(txn_buffer->hash_blake2b, size,
                (uint8_t *)txn_buffer + size,
                txn_buffer->page_aligned_tx_size - size, 0, 0),
         msg("Unable to compute hash for transaction"),
         with(txn_buffer->tx_id, "%lu"));
+    db_hooks_latency(tx->db, db_latency_wal_hash, start);
   }
 
   wal_state_t *wal = &tx->db->wal_state;
   wal_file_state_t *cur_file =
       &wal->files[wal->current_append_file_index];
+  uint64_t start = db_hooks_latency_start(tx->db);
   ensure(wal_increase_file_size_if_needed(
       cur_file, txn_buffer->page_aligned_tx_size));
   ensure(pal_write_file(cur_file->handle, cur_file->last_write_pos,
       (char *)txn_buffer, txn_buffer->page_aligned_tx_size));
+  db_hooks_latency(tx->db, db_latency_wal_write, start);
+  probe(wal_append, tx->tx_id, txn_buffer->page_aligned_tx_size,
+      cur_file->last_write_pos);
   cur_file->last_write_pos += txn_buffer->page_aligned_tx_size;
   cur_file->last_tx_id = tx->tx_id;
   // <2>
   if (tx->db->options.wal_write_callback) {
     span_t wal_record = {.address = txn_buffer,
         .size                     = txn_buffer->page_aligned_tx_size};
+    start = db_hooks_latency_start(tx->db);
     tx->db->options.wal_write_callback(
         tx->db->options.wal_write_callback_state, txn_buffer->tx_id,
         &wal_record);
+    db_hooks_latency(tx->db, db_latency_log_shipping, start);
   }
   return success();
 }
@@ -843,6 +860,9 @@ result_t wal_checkpoint(db_state_t *db, uint64_t tx_id) {
     // the current log is still in use, switch to the other one
     db->wal_state.current_append_file_index = other_index;
   }
+  db->checkpoints++;
+  probe(wal_checkpoint, tx_id,
+      db->wal_state.current_append_file_index);
   return success();
 }
 // end::wal_checkpoint[]
@@ -62,6 +62,34 @@ describe(hash) {
     assert(3 == varint_get_length(4470));
   }
 
+  it("can decode many varints at once") {
+    uint64_t values[64], decoded[64];
+    uint8_t buffer[64 * 9];
+    uint8_t *cur = buffer;
+    for (size_t i = 0; i < 64; i++) {
+      // every length, including the 9 bytes ones
+      values[i] = i % 10 == 9 ? UINT64_MAX - i : (1UL << i) + i;
+      cur       = varint_encode(values[i], cur);
+    }
+    uint8_t *end   = cur;
+    uint8_t *start = buffer;
+    assert(varint_decode_many(&start, end, decoded, 64) == 64);
+    assert(start == end);
+    for (size_t i = 0; i < 64; i++) {
+      assert(decoded[i] == values[i]);
+    }
+    // stops at the end of the run, the last values byte by byte
+    start = buffer;
+    assert(varint_decode_many(&start, end, decoded, 100) == 64);
+    assert(start == end);
+    assert(decoded[63] == values[63]);
+    // or at the count asked for
+    start = buffer;
+    assert(varint_decode_many(&start, end, decoded, 2) == 2);
+    assert(start == buffer + varint_get_length(values[0]) +
+                        varint_get_length(values[1]));
+  }
+
   it("can write and read multiple values") {
     db_t db;
     db_options_t options = {.minimum_size = 4 * 1024 * 1024};
@@ -77,8 +77,8 @@ uint8_t* varint_encode(uint64_t n, uint8_t* buf) {
     memcpy(buf, &n, sizeof(uint64_t));
     buf += sizeof(uint64_t);
   } else {
-    *buf = 8 << 4;
-    n    = bswap_64(n);
+    *buf++ = 8 << 4;
+    n      = bswap_64(n);
     memcpy(buf, &n, sizeof(uint64_t));
     buf += sizeof(uint64_t);
   }
@@ -89,10 +89,48 @@ uint8_t* varint_decode(uint8_t* buf, uint64_t* value) {
   uint8_t header = *buf++;
   uint8_t n      = header >> 4;
 
-  uint64_t result = (uint64_t)((header & 0x0F) << (n * 8));
+  uint64_t result =
+      n < 8 ? (uint64_t)(header & 0x0F) << (n * 8) : 0;
   for (size_t i = 1; i <= n; i++) {
     result += ((uint64_t)*buf++) << ((n - i) * 8);
   }
   *value = result;
   return buf;
-}
\ No newline at end of file
+}
+
+// tag::varint_decode_many[]
+// by the length nibble, the shift and mask that right align the
+// bytes after the header when read as one big endian word
+static const uint8_t varint_shifts[9] = {
+    0, 56, 48, 40, 32, 24, 16, 8, 0};
+static const uint64_t varint_masks[9] = {0, 0xFF, 0xFFFF, 0xFFFFFF,
+    0xFFFFFFFF, 0xFFFFFFFFFF, 0xFFFFFFFFFFFF, 0xFFFFFFFFFFFFFF,
+    UINT64_MAX};
+
+// a single unaligned load and a byte swap, without a loop over the
+// length. Reads 9 bytes regardless of the length.
+static inline uint64_t varint_decode_word(uint8_t* buf, uint8_t n) {
+  uint64_t raw;
+  memcpy(&raw, buf + 1, sizeof(uint64_t));
+  raw = (bswap_64(raw) >> varint_shifts[n]) & varint_masks[n];
+  uint64_t high = buf[0] & (n < 8 ? 0x0F : 0);
+  return raw | high << ((n * 8) & 63);
+}
+
+size_t varint_decode_many(
+    uint8_t** buf, uint8_t* end, uint64_t* values, size_t max) {
+  uint8_t* cur = *buf;
+  size_t count = 0;
+  for (; count < max && cur < end; count++) {
+    uint8_t n = cur[0] >> 4;
+    if (n > 8 || end - cur < 9) {  // too close to the end to load
+      cur = varint_decode(cur, &values[count]);
+      continue;
+    }
+    values[count] = varint_decode_word(cur, n);
+    cur += 1 + n;
+  }
+  *buf = cur;
+  return count;
+}
+// end::varint_decode_many[]
@@ -113,9 +113,11 @@ static result_t container_defrag_page(
     void *end = varint_decode(tmp + offset, &item_sz) + item_sz;
     uint16_t entry_size = (uint16_t)(end - (tmp + offset));
     metadata->container.ceiling -= entry_size;
-    memcpy(p->address + metadata->container.ceiling,
-        tmp + positions[i], entry_size);
-    positions[i] = (int16_t)metadata->container.ceiling;
+    memcpy(p->address + metadata->container.ceiling, tmp + offset,
+        entry_size);
+    bool is_reference = positions[i] < 0;
+    positions[i]      = (int16_t)metadata->container.ceiling;
+    if (is_reference) positions[i] *= -1;
   }
   // clear old values
   memset(p->address + metadata->container.floor, 0,
@@ -304,6 +306,7 @@ static result_t container_item_put_large(
 
 // tag::container_item_put[]
 result_t container_item_put(txn_t *tx, container_item_t *item) {
+  counted_op(tx->state->db, db_op_container_item_put);
   if (item->data.size > CONTAINER_ITEM_SMALL_MAX_SIZE) {
     ensure(container_item_put_large(tx, item));
     return success();
@@ -315,8 +318,41 @@ result_t container_item_put(txn_t *tx, container_item_t *item) {
 }
 // end::container_item_put[]
 
+// tag::container_item_put_many[]
+result_t container_item_put_many(
+    txn_t *tx, container_item_t *items, size_t count) {
+  uint64_t page_num = 0, container_id = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (items[i].data.size > CONTAINER_ITEM_SMALL_MAX_SIZE) {
+      ensure(container_item_put_large(tx, &items[i]));
+      continue;
+    }
+    uint64_t required = container_get_total_size(items[i].data.size);
+    bool fits         = false;
+    if (page_num && container_id == items[i].container_id) {
+      // keep filling the page we used last, before searching
+      page_metadata_t *metadata;
+      ensure(txn_get_metadata(tx, page_num, &metadata));
+      ensure(container_page_can_fit_item_size(
+          tx, page_num, metadata, required, &fits));
+    }
+    if (!fits) {
+      container_id = items[i].container_id;
+      ensure(container_find_small_space_to_allocate(
+          tx, container_id, required, &page_num));
+    }
+    span_t span = {.size = items[i].data.size};
+    ensure(container_add_item_to_page(
+        tx, &span, page_num, &items[i].item_id, /*is_ref*/ false));
+    memcpy(span.address, items[i].data.address, items[i].data.size);
+  }
+  return success();
+}
+// end::container_item_put_many[]
+
 // tag::container_item_get[]
 result_t container_item_get(txn_t *tx, container_item_t *item) {
+  counted_op(tx->state->db, db_op_container_item_get);
   if (item->item_id % PAGE_SIZE == 0) {
     // large item
     page_t p = {.page_num = item->item_id / PAGE_SIZE};
@@ -386,9 +422,10 @@ static result_t container_item_del_finalize(
 
 // tag::container_item_del[]
 result_t container_item_del(txn_t *tx, container_item_t *item) {
+  counted_op(tx->state->db, db_op_container_item_del);
   if (item->item_id % PAGE_SIZE == 0) {
     // large item
-    page_t p = {.page_num = item->item_id};
+    page_t p = {.page_num = item->item_id / PAGE_SIZE};
     ensure(txn_get_page(tx, &p));
     assert(p.metadata->overflow.page_flags == page_flags_overflow);
     assert(p.metadata->overflow.is_container_value);
@@ -402,11 +439,12 @@ result_t container_item_del(txn_t *tx, container_item_t *item) {
     ensure(txn_modify_page(tx, &p));
     assert(p.metadata->container.page_flags == page_flags_container);
     int16_t *positions = p.address;
+    int16_t offset     = positions[index];
+    if (offset < 0) offset *= -1;  // reference to a large item
     uint64_t size;
-    void *end =
-        varint_decode(p.address + positions[index], &size) + size;
-    item->data.size = (size_t)(end - p.address - positions[index]);
-    memset(p.address + positions[index], 0, item->data.size);
+    void *end = varint_decode(p.address + offset, &size) + size;
+    item->data.size = (size_t)(end - p.address - offset);
+    memset(p.address + offset, 0, item->data.size);
     positions[index] = 0;
     p.metadata->container.free_space +=
         (uint16_t)(item->data.size + sizeof(uint16_t));
@@ -571,6 +609,7 @@ static result_t container_item_update_small(
 // tag::container_item_update[]
 result_t container_item_update(
     txn_t *tx, container_item_t *item, bool *in_place) {
+  counted_op(tx->state->db, db_op_container_item_update);
   *in_place = true;
   if (item->item_id % PAGE_SIZE == 0) {
     if (item->data.size <= CONTAINER_ITEM_SMALL_MAX_SIZE) {
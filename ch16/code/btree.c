@@ -1,9 +1,14 @@
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <gavran/db.h>
 #include <gavran/internal.h>
 
+// the high bit of a leaf's flags marks a value stored inline, right
+// after the flags. The stored val is then the size of the value.
+#define BTREE_FLAGS_INLINE (0x80)
+
 // tag::btree_validate_key[]
 static result_t btree_validate_key(span_t* key) {
   ensure(key->size > 0);
@@ -38,7 +43,7 @@ static void btree_search_pos_in_page(page_t* p, btree_val_t* kvp) {
   int16_t high = max_pos - 1, low = 0;
   uint16_t* positions = p->address;
   kvp->position       = 0;  // to handle empty pages (after split)
-  kvp->last_match     = 0;
+  kvp->last_match     = max_pos ? 0 : -1;  // empty never matches
   while (low <= high) {
     kvp->position = (low + high) >> 1;
     uint64_t ks;
@@ -103,12 +108,14 @@ static result_t btree_defrag(txn_t* tx, page_t* p) {
   for (size_t i = 0; i < max_pos; i++) {
     uint64_t size;
     uint16_t cur_pos = positions[i];
-    void* end        = varint_decode(
+    uint8_t* end     = varint_decode(
         varint_decode(buffer + cur_pos, &size) + size, &size);
     if (p->metadata->tree.page_flags == page_flags_tree_leaf) {
-      end++;  // flags
+      uint8_t flags = *end++;
+      if (flags & BTREE_FLAGS_INLINE) end += size;
     }
-    uint16_t entry_size = (uint16_t)(end - (buffer + cur_pos));
+    uint16_t entry_size =
+        (uint16_t)(end - ((uint8_t*)buffer + cur_pos));
     p->metadata->tree.ceiling -= entry_size;
     positions[i] = p->metadata->tree.ceiling;
     memcpy(p->address + p->metadata->tree.ceiling, buffer + cur_pos,
@@ -124,6 +131,8 @@ static result_t btree_set_in_page(
 static void* btree_insert_to_page(
     page_t* p, int16_t pos, uint16_t req_size);
 
+static uint64_t btree_remove_entry(page_t* p, uint16_t pos);
+
 // tag::btree_create_root_page[]
 static result_t btree_create_root_page(txn_t* tx, page_t* p) {
   page_t new = {.number_of_pages = 1};
@@ -156,9 +165,31 @@ static void btree_get_entry_at(page_t* p, uint16_t pos, span_t* key,
   uint8_t* end        = varint_decode(key->address + key->size, val);
   if (p->metadata->tree.page_flags == page_flags_tree_leaf) {
     *flags = *end++;
+    if (*flags & BTREE_FLAGS_INLINE) end += *val;
   }
   entry->size = (size_t)(end - (uint8_t*)entry->address);
 }
+// splits the raw val & flags of a leaf entry into the caller's view
+static void btree_get_inline(
+    span_t* entry, uint64_t* val, uint8_t* flags, span_t* data) {
+  if (!(*flags & BTREE_FLAGS_INLINE)) {
+    memset(data, 0, sizeof(span_t));
+    return;
+  }
+  data->size    = *val;
+  data->address = (uint8_t*)entry->address + entry->size - *val;
+  *val          = 0;
+  *flags &= (uint8_t)~BTREE_FLAGS_INLINE;
+}
+static size_t btree_get_stored_val(
+    btree_val_t* set, uint64_t* val, uint8_t* flags) {
+  *val   = set->data.address ? set->data.size : set->val;
+  *flags = set->data.address ? set->flags | BTREE_FLAGS_INLINE
+                             : set->flags;
+  return varint_get_length(set->key.size) + set->key.size +
+         varint_get_length(*val) + 1 /*flags*/ +
+         (set->data.address ? set->data.size : 0);
+}
 static uint64_t btree_get_val_at(page_t* p, uint16_t pos) {
   span_t key, entry;
   uint64_t val;
@@ -191,7 +222,19 @@ static result_t btree_split_page_in_half(page_t* p, page_t* other,
   uint64_t val;
   uint8_t flags;
   span_t key, entry;
-  for (uint16_t idx = max_pos / 2, o_idx = 0; idx < max_pos;
+  // split by size, not by count, the keys vary widely in size
+  size_t total = 0, used = 0;
+  for (uint16_t idx = 0; idx < max_pos; idx++) {
+    btree_get_entry_at(p, idx, &key, &val, &entry, &flags);
+    total += entry.size + sizeof(uint16_t);
+  }
+  uint16_t half = 0;
+  while (half < max_pos - 1 && used < total / 2) {
+    btree_get_entry_at(p, half++, &key, &val, &entry, &flags);
+    used += entry.size + sizeof(uint16_t);
+  }
+  half = MAX(1, half);
+  for (uint16_t idx = half, o_idx = 0; idx < max_pos;
        idx++, o_idx++) {
     btree_get_entry_at(p, idx, &key, &val, &entry, &flags);
     other->metadata->tree.ceiling -= entry.size;
@@ -203,8 +246,8 @@ static result_t btree_split_page_in_half(page_t* p, page_t* other,
     memset(entry.address, 0, entry.size);
     p->metadata->tree.free_space += sizeof(uint16_t) + entry.size;
   }
-  size_t removed = (max_pos - (max_pos / 2));
-  memset(positions + (max_pos / 2), 0, removed * sizeof(uint16_t));
+  size_t removed = (max_pos - half);
+  memset(positions + half, 0, removed * sizeof(uint16_t));
   p->metadata->tree.floor -= removed * sizeof(uint16_t);
   btree_get_entry_at(other, 0, &ref->key, &val, &entry, &flags);
   if (memcmp(ref->key.address, set->key.address,
@@ -243,6 +286,8 @@ static result_t btree_split_page(
       max_pos == (uint16_t)(~set->position) && set->last_match > 0;
   bool seq_write_down = (~set->position == 0) && set->last_match < 0;
   btree_val_t ref = {.tree_id = set->tree_id, .val = other.page_num};
+  probe(btree_split_page, set->tree_id, p->page_num, other.page_num,
+      seq_write_up ? 1 : seq_write_down ? -1 : 0);
   if (seq_write_up) {  // optimization: no split req
     ref.key = set->key;
     memcpy(p, &other, sizeof(page_t));
@@ -270,26 +315,25 @@ static result_t btree_append_to_page(
     }
     if (req_size + sizeof(uint16_t) >  // check again, defrag helped?
         (p->metadata->tree.ceiling - p->metadata->tree.floor)) {
-      if (set->position >= 0) {  // remove existing entry in page
-        uint16_t max_pos = p->metadata->tree.floor / sizeof(uint16_t);
-        p->metadata->tree.floor -= sizeof(uint16_t);
-        uint16_t pos        = (uint16_t)(~set->position);
-        uint16_t* positions = p->address;
-        memmove(positions + pos, positions + pos + 1,
-            ((max_pos - pos - 1) * sizeof(uint16_t)));
-        positions[max_pos - 1] = 0;
-      }
       ensure(btree_split_page(tx, p, set));
       btree_search_pos_in_page(p, set);  // adjust pos
+      if (req_size + sizeof(uint16_t) >  // moved entries left holes
+          (p->metadata->tree.ceiling - p->metadata->tree.floor)) {
+        ensure(btree_defrag(tx, p));
+      }
     }
   }
+  uint64_t val;
+  uint8_t flags;
+  btree_get_stored_val(set, &val, &flags);
   void* dst =
       btree_insert_to_page(p, set->position, (uint16_t)req_size);
   uint8_t* key_start = varint_encode(set->key.size, dst);
   memcpy(key_start, set->key.address, set->key.size);
-  uint8_t* end = varint_encode(set->val, key_start + set->key.size);
+  uint8_t* end = varint_encode(val, key_start + set->key.size);
   if (p->metadata->tree.page_flags == page_flags_tree_leaf) {
-    *end = set->flags;
+    *end++ = flags;
+    if (set->data.address) memcpy(end, set->data.address, val);
   }
   return success();
 }
@@ -307,21 +351,25 @@ static result_t btree_try_update_in_place(page_t* p, size_t req_size,
     old->has_val = true;
     old->val     = old_val;
     old->flags   = flags;
+    btree_get_inline(&entry, &old->val, &old->flags, &old->data);
+    old->data = (span_t){0};  // about to be overwritten
   }
   if (req_size <= entry.size) {  // can fit old location
-    uint8_t* val_end =
-        varint_encode(set->val, key.address + key.size);
+    uint64_t val;
+    btree_get_stored_val(set, &val, &flags);
+    uint8_t* val_end = varint_encode(val, key.address + key.size);
     if (p->metadata->tree.page_flags == page_flags_tree_leaf) {
-      *val_end++ = set->flags;
+      *val_end++ = flags;
+      if (set->data.address) {
+        memmove(val_end, set->data.address, val);
+        val_end += val;
+      }
     }
     size_t diff =
         (size_t)(((uint8_t*)entry.address + entry.size) - val_end);
     memset(val_end, 0, diff);
     p->metadata->tree.free_space += (uint16_t)diff;
     *updated = true;
-  } else {
-    memset(entry.address, 0, entry.size);  // reset value
-    p->metadata->tree.free_space -= (uint16_t)entry.size;
   }
   return success();
 }
@@ -332,14 +380,17 @@ static result_t btree_set_in_page(txn_t* tx, uint64_t page_num,
     btree_val_t* set, btree_val_t* old) {
   page_t p = {.page_num = page_num};
   ensure(txn_modify_page(tx, &p));
-  size_t req_size = varint_get_length(set->key.size) + set->key.size +
-                    varint_get_length(set->val) + 1 /*flags*/;
+  uint64_t val;
+  uint8_t flags;
+  size_t req_size = btree_get_stored_val(set, &val, &flags);
   if (set->position >= 0) {  // update
     bool updated = false;
     ensure(
         btree_try_update_in_place(&p, req_size, set, old, &updated));
     if (updated) return success();
     // need to insert this again...
+    btree_remove_entry(&p, (uint16_t)set->position);
+    set->position = ~set->position;
   } else {  // insert
     if (old) old->has_val = false;
   }
@@ -394,8 +445,21 @@ result_t btree_drop(txn_t* tx, uint64_t tree_id) {
 // end::btree_drop[]
 
 // tag::btree_set[]
+size_t btree_inline_max_size(txn_t* tx) {
+  uint32_t max = tx->state->db->options.inline_max_size;
+  return max ? max : BTREE_INLINE_MAX_SIZE;
+}
+
 result_t btree_set(txn_t* tx, btree_val_t* set, btree_val_t* old) {
+  counted_op(tx->state->db, db_op_btree_set);
   assert(btree_validate_key(&set->key));
+  ensure(!(set->flags & BTREE_FLAGS_INLINE),
+      msg("The high bit of the flags is reserved"),
+      with(set->flags, "%d"));
+  ensure(!set->data.address ||
+             set->data.size <= btree_inline_max_size(tx),
+      msg("Value is too large to store inline"),
+      with(set->data.size, "%zu"));
   page_t p;
   ensure(btree_get_leaf_page_for(tx, set, &p));
   ensure(btree_set_in_page(tx, p.page_num, set, old));
@@ -403,23 +467,199 @@ result_t btree_set(txn_t* tx, btree_val_t* set, btree_val_t* old) {
 }
 // end::btree_set[]
 
+// tag::btree_bulk[]
+static result_t btree_bulk_new_page(
+    btree_bulk_t* bulk, uint8_t level) {
+  page_t* p = &bulk->levels[level];
+  uint64_t hint = p->page_num ? p->page_num : bulk->tree_id;
+  memset(p, 0, sizeof(page_t));
+  p->number_of_pages = 1;
+  ensure(txn_allocate_page(bulk->tx, p, hint));
+  btree_init_metadata(p->metadata,
+      level ? page_flags_tree_branch : page_flags_tree_leaf);
+  return success();
+}
+
+static result_t btree_bulk_append_at(btree_bulk_t* bulk,
+    uint8_t level, span_t* key, uint64_t val) {
+  if (level == bulk->depth) {  // first page in a new level
+    ensure(level < BTREE_BULK_MAX_DEPTH, msg("Tree is too deep"));
+    ensure(btree_bulk_new_page(bulk, level));
+    bulk->depth++;
+  }
+  page_t* p       = &bulk->levels[level];
+  size_t req_size = varint_get_length(key->size) + key->size +
+                    varint_get_length(val) + (level ? 0 : 1);
+  if (req_size + sizeof(uint16_t) >
+      (size_t)(p->metadata->tree.ceiling - p->metadata->tree.floor)) {
+    // page is full, the next one is referenced from the parent
+    uint64_t full = p->page_num;
+    ensure(btree_bulk_new_page(bulk, level));
+    if (level + 1 == bulk->depth) {
+      span_t leftmost = {.address = key->address, .size = 0};
+      ensure(btree_bulk_append_at(bulk, level + 1, &leftmost, full));
+    }
+    ensure(btree_bulk_append_at(bulk, level + 1, key, p->page_num));
+  }
+  uint16_t max_pos = p->metadata->tree.floor / sizeof(uint16_t);
+  uint8_t* dst =
+      btree_insert_to_page(p, (int16_t)~max_pos, (uint16_t)req_size);
+  dst = varint_encode(key->size, dst);
+  memcpy(dst, key->address, key->size);
+  dst = varint_encode(val, dst + key->size);
+  if (!level) *dst = 0;  // flags
+  return success();
+}
+
+result_t btree_bulk_append(
+    btree_bulk_t* bulk, span_t* key, uint64_t val) {
+  ensure(btree_validate_key(key));
+  if (!bulk->depth) {
+    page_metadata_t* root;
+    ensure(txn_get_metadata(bulk->tx, bulk->tree_id, &root));
+    ensure(root->tree.page_flags == page_flags_tree_leaf &&
+               root->tree.floor == 0,
+        msg("Bulk loading requires an empty tree"),
+        with(bulk->tree_id, "%lu"));
+  } else {
+    page_t* leaf     = &bulk->levels[0];
+    uint16_t max_pos = leaf->metadata->tree.floor / sizeof(uint16_t);
+    span_t last, entry;
+    uint64_t last_val;
+    uint8_t flags;
+    if (max_pos) {
+      btree_get_entry_at(
+          leaf, max_pos - 1, &last, &last_val, &entry, &flags);
+      ensure(memcmp(last.address, key->address,
+                 MIN(last.size, key->size)) < 0,
+          msg("Bulk loaded keys must be unique and sorted"),
+          with(key->size, "%zu"));
+    }
+  }
+  ensure(btree_bulk_append_at(bulk, 0, key, val));
+  return success();
+}
+
+result_t btree_bulk_finish(btree_bulk_t* bulk) {
+  if (!bulk->depth) return success();  // nothing was added
+  // the root page number is the tree id, so it must hold the top
+  page_t* top = &bulk->levels[bulk->depth - 1];
+  page_t root = {.page_num = bulk->tree_id};
+  ensure(txn_modify_page(bulk->tx, &root));
+  memcpy(root.address, top->address, PAGE_SIZE);
+  memcpy(root.metadata, top->metadata, sizeof(page_metadata_t));
+  ensure(txn_free_page(bulk->tx, top));
+  bulk->depth = 0;
+  return success();
+}
+// end::btree_bulk[]
+
 // tag::btree_get[]
-result_t btree_get(txn_t* tx, btree_val_t* kvp) {
-  assert(btree_validate_key(&kvp->key));
-  page_t p;
-  ensure(btree_get_leaf_page_for(tx, kvp, &p));
+// expects the position of the key in the leaf to be set
+static void btree_get_from_leaf(page_t* p, btree_val_t* kvp) {
   if (kvp->last_match != 0) {
     kvp->has_val = false;
-    return success();
+    return;
   }
   span_t key, entry;
-  btree_get_entry_at(&p, (uint16_t)kvp->position, &key, &kvp->val,
+  btree_get_entry_at(p, (uint16_t)kvp->position, &key, &kvp->val,
       &entry, &kvp->flags);
+  btree_get_inline(&entry, &kvp->val, &kvp->flags, &kvp->data);
   kvp->has_val = true;
+}
+
+result_t btree_get(txn_t* tx, btree_val_t* kvp) {
+  counted_op(tx->state->db, db_op_btree_get);
+  assert(btree_validate_key(&kvp->key));
+  page_t p;
+  ensure(btree_get_leaf_page_for(tx, kvp, &p));
+  btree_get_from_leaf(&p, kvp);
   return success();
 }
 // end::btree_get[]
 
+// tag::btree_get_many[]
+static int btree_get_many_cmp(const void* a, const void* b) {
+  span_t* x = &(*(btree_val_t* const*)a)->key;
+  span_t* y = &(*(btree_val_t* const*)b)->key;
+  int rc    = memcmp(x->address, y->address, MIN(x->size, y->size));
+  if (rc) return rc;
+  return (x->size > y->size) - (x->size < y->size);
+}
+
+static uint64_t btree_get_many_child(page_t* p, btree_val_t* kvp) {
+  btree_search_pos_in_page(p, kvp);
+  if (kvp->position < 0) kvp->position = ~kvp->position;
+  if (kvp->last_match) kvp->position--;  // went too far
+  uint16_t max_pos = p->metadata->tree.floor / sizeof(uint16_t);
+  uint16_t pos     = MIN(max_pos - 1, (uint16_t)kvp->position);
+  return btree_get_val_at(p, pos);
+}
+
+// only a hint to the kernel, a page that is already in memory is
+// left as is
+static result_t btree_get_many_prefetch(
+    txn_t* tx, uint64_t page_num) {
+  txn_state_t* state = tx->state;
+  span_t* map =
+      state->flags & db_flags_avoid_mmap_io ? 0 : &state->map;
+  ensure(pal_prefetch(
+      state->db->handle, map, page_num * PAGE_SIZE, PAGE_SIZE));
+  return success();
+}
+
+// the keys are sorted, so those under the same child are next to
+// each other and share its page
+static result_t btree_get_many_in(
+    txn_t* tx, page_t* p, btree_val_t** keys, size_t n) {
+  if (p->metadata->tree.page_flags == page_flags_tree_leaf) {
+    for (size_t i = 0; i < n; i++) {
+      btree_search_pos_in_page(p, keys[i]);
+      btree_get_from_leaf(p, keys[i]);
+    }
+    return success();
+  }
+  size_t start   = 0;
+  uint64_t child = btree_get_many_child(p, keys[0]);
+  while (start < n) {
+    size_t end         = start + 1;
+    uint64_t next_page = 0;
+    while (end < n) {
+      next_page = btree_get_many_child(p, keys[end]);
+      if (next_page != child) break;
+      end++;
+    }
+    if (end < n) {  // read by the kernel while we search the child
+      ensure(btree_get_many_prefetch(tx, next_page));
+    }
+    page_t page = {.page_num = child};
+    ensure(txn_get_page(tx, &page));
+    ensure(btree_get_many_in(tx, &page, keys + start, end - start));
+    child = next_page;
+    start = end;
+  }
+  return success();
+}
+
+result_t btree_get_many(
+    txn_t* tx, uint64_t tree_id, btree_val_t* kvps, size_t n) {
+  if (!n) return success();
+  btree_val_t** keys;
+  ensure(mem_alloc((void*)&keys, n * sizeof(btree_val_t*)));
+  defer(free, keys);
+  for (size_t i = 0; i < n; i++) {
+    assert(btree_validate_key(&kvps[i].key));
+    kvps[i].tree_id = tree_id;
+    keys[i]         = &kvps[i];
+  }
+  qsort(keys, n, sizeof(btree_val_t*), btree_get_many_cmp);
+  page_t root = {.page_num = tree_id};
+  ensure(txn_get_page(tx, &root));
+  ensure(btree_get_many_in(tx, &root, keys, n));
+  return success();
+}
+// end::btree_get_many[]
+
 // tag::btree_cursor_at[]
 static result_t btree_cursor_at(btree_cursor_t* c, bool start) {
   page_t p             = {.page_num = c->tree_id};
@@ -494,18 +734,16 @@ static result_t btree_iterate(btree_cursor_t* c, int8_t step) {
   ensure(txn_get_page(c->tx, &p));
   while (true) {
     assert(p.metadata->tree.page_flags == page_flags_tree_leaf);
-    uint16_t* positions = p.address;
-    uint16_t max_pos    = p.metadata->tree.floor / sizeof(uint16_t);
+    uint16_t max_pos = p.metadata->tree.floor / sizeof(uint16_t);
     if (pos < 0) {
       pos = ~pos;
       if (step < 0) pos--;  // moving to prev, but was on > item
     }
     if (pos >= 0 && pos < max_pos) {  // still same page
-      c->key.address =
-          varint_decode(p.address + positions[pos], &c->key.size);
-      uint8_t* end =
-          varint_decode(c->key.address + c->key.size, &c->val);
-      c->flags   = *end++;
+      span_t entry;
+      btree_get_entry_at(
+          &p, (uint16_t)pos, &c->key, &c->val, &entry, &c->flags);
+      btree_get_inline(&entry, &c->val, &c->flags, &c->data);
       c->has_val = true;
       ensure(btree_stack_push(&c->stack, p.page_num, pos + step));
       return success();
@@ -608,8 +846,8 @@ static result_t btree_balance_entries(
   p2->metadata->tree.floor -= p2_pos * sizeof(uint16_t);
   memmove(p2->address, p2->address + p2_pos * sizeof(uint16_t),
       (max_p2_pos - p2_pos) * sizeof(uint16_t));
-  memset(p2->address + p2->metadata->tree.floor * sizeof(uint16_t), 0,
-      (max_p2_pos - p2->metadata->tree.floor) * sizeof(uint16_t));
+  memset(p2->address + p2->metadata->tree.floor, 0,
+      p2_pos * sizeof(uint16_t));
   return success();
 }
 // end::btree_balance_entries[]
@@ -711,6 +949,7 @@ static result_t btree_maybe_merge_pages(txn_t* tx, page_t* p) {
 
 // tag::btree_del[]
 result_t btree_del(txn_t* tx, btree_val_t* del) {
+  counted_op(tx->state->db, db_op_btree_del);
   assert(btree_validate_key(&del->key));
   page_t p;
   ensure(btree_get_leaf_page_for(tx, del, &p));
@@ -720,7 +959,12 @@ result_t btree_del(txn_t* tx, btree_val_t* del) {
   }
   del->has_val = true;
   ensure(txn_modify_page(tx, &p));
-  del->val = btree_remove_entry(&p, (uint16_t)del->position);
+  span_t key, entry;
+  btree_get_entry_at(&p, (uint16_t)del->position, &key, &del->val,
+      &entry, &del->flags);
+  btree_get_inline(&entry, &del->val, &del->flags, &del->data);
+  del->data = (span_t){0};  // removed with the entry
+  btree_remove_entry(&p, (uint16_t)del->position);
   ensure(btree_maybe_merge_pages(tx, &p));
   return success();
 }
@@ -290,6 +290,58 @@ describe(btree) {
     }
   }
 
+  it("split and merge pages of keys that vary in size") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t tree_id;
+    assert(create_btree(&db, &tree_id));
+
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+
+    // runs of large keys followed by many small ones, so merging
+    // pages moves only a few of the entries of the sibling
+    char buffer[500];
+    memset(buffer, 'x', sizeof(buffer));
+    for (uint32_t k = 0; k < 3000; k++) {
+      sprintf(buffer, "%05d", k);
+      buffer[5]       = 'x';
+      btree_val_t set = {.tree_id = tree_id,
+          .key = {.address = buffer, .size = k % 110 < 10 ? 500 : 5},
+          .val = k};
+      assert(btree_set(&w, &set, 0));
+      tree_id = set.tree_id;
+    }
+
+    for (uint32_t k = 1000; k < 2000; k++) {
+      sprintf(buffer, "%05d", k);
+      buffer[5]       = 'x';
+      btree_val_t del = {.tree_id = tree_id,
+          .key = {.address = buffer, .size = k % 110 < 10 ? 500 : 5}};
+      assert(btree_del(&w, &del));
+      assert(del.has_val);
+      assert(del.val == k);
+    }
+
+    btree_cursor_t it = {.tree_id = tree_id, .tx = &w};
+    assert(btree_cursor_at_start(&it));
+    defer(btree_free_cursor, it);
+    for (uint32_t k = 0; k < 3000; k++) {
+      if (k == 1000) k = 2000;
+      sprintf(buffer, "%05d", k);
+      assert(btree_get_next(&it));
+      assert(it.has_val);
+      assert(it.val == k);
+      assert(it.key.size == (k % 110 < 10 ? 500u : 5u));
+      assert(memcmp(it.key.address, buffer, 5) == 0);
+    }
+    assert(btree_get_next(&it));
+    assert(!it.has_val);
+  }
+
   it("read, write, del") {
     db_t db;
     db_options_t options = {.minimum_size = 4 * 1024 * 1024};
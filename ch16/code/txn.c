@@ -6,6 +6,7 @@
 // tag::txn_create_working_set[]
 result_t txn_create(db_t *db, db_flags_t flags, txn_t *tx) {
   errors_assert_empty();
+  counted_op(db->state, db_op_txn_create);
   if (db->state->options.flags & db_flags_page_need_txn_working_set) {
     ensure(pagesmap_new(8, &tx->working_set));
   } else {
@@ -16,6 +17,7 @@ result_t txn_create(db_t *db, db_flags_t flags, txn_t *tx) {
   if (flags == TX_READ) {
     tx->state = db->state->last_write_tx;
     tx->state->usages++;
+    probe(txn_create, tx->state->tx_id, flags);
     return success();
   }
   if ((db->state->options.flags & db_flags_log_shipping_target)) {
@@ -50,6 +52,7 @@ result_t txn_create(db_t *db, db_flags_t flags, txn_t *tx) {
 
   tx->state    = state;
   cancel_defer = 1;
+  probe(txn_create, state->tx_id, flags);
   return success();
 }
 // end::txn_create[]
@@ -239,10 +242,12 @@ static result_t txn_decrypt_page(txn_t *tx, page_t *page) {
 result_t txn_raw_get_page(txn_t *tx, page_t *page) {
   errors_assert_empty();
   page->address = 0;
-  if (!(tx->state->flags & TX_COMMITED) &&
-      pagesmap_lookup(tx->state->modified_pages, page))
+  if ((!(tx->state->flags & TX_COMMITED) &&
+          pagesmap_lookup(tx->state->modified_pages, page)) ||
+      pagesmap_lookup(tx->working_set, page)) {
+    db_hooks_page_access(tx, page, false);
     return success();
-  if (pagesmap_lookup(tx->working_set, page)) return success();
+  }
   txn_state_t *prev = tx->state;
   while (prev) {
     if (pagesmap_lookup(prev->modified_pages, page)) break;
@@ -262,7 +267,7 @@ result_t txn_raw_get_page(txn_t *tx, page_t *page) {
       ensure(txn_ensure_page_is_valid(tx, page));
     }
   }
-
+  db_hooks_page_access(tx, page, false);
   return success();
 }
 // end::txn_raw_get_page[]
@@ -276,6 +281,7 @@ result_t txn_raw_modify_page(txn_t *tx, page_t *page) {
       with(tx->state->flags, "%d"));
 
   if (pagesmap_lookup(tx->state->modified_pages, page)) {
+    db_hooks_page_access(tx, page, true);
     return success();
   }
   // end::txn_raw_modify_page[]
@@ -298,6 +304,7 @@ result_t txn_raw_modify_page(txn_t *tx, page_t *page) {
   ensure(pagesmap_put_new(&tx->state->modified_pages, page),
       msg("Failed to allocate entry"));
   done = 1;
+  db_hooks_page_access(tx, page, true);
   return success();
 }
 
@@ -389,14 +396,20 @@ static result_t txn_finalize_modified_pages(txn_t *tx) {
 // tag::txn_commit[]
 result_t txn_commit(txn_t *tx) {
   errors_assert_empty();
+  counted_op(tx->state->db, db_op_txn_commit);
+  ensure(db_hooks_before_commit(tx));
   if (!tx->state->modified_pages->count) return success();
+  db_state_t *db = tx->state->db;
+  uint64_t start = db_hooks_latency_start(db);
 
   // <1>
   if (!(tx->state->flags & txn_flags_apply_log)) {
     page_metadata_t *header;
     ensure(txn_modify_metadata(tx, 0, &header));
     header->file_header.last_tx_id = tx->state->tx_id;
+    uint64_t finalize_start        = db_hooks_latency_start(db);
     ensure(txn_finalize_modified_pages(tx));
+    db_hooks_latency(db, db_latency_finalize_pages, finalize_start);
   }
 
   ensure(wal_append(tx->state));
@@ -412,6 +425,7 @@ result_t txn_commit(txn_t *tx) {
   tx->state->db->last_tx_id             = tx->state->tx_id;
   tx->state->db->map                    = tx->state->map;
   tx->state->db->number_of_pages        = tx->state->number_of_pages;
+  db_hooks_after_commit(tx->state);
 
   // <2>
   while (tx->state->on_rollback) {
@@ -419,7 +433,10 @@ result_t txn_commit(txn_t *tx) {
     tx->state->on_rollback  = cur->next;
     free(cur);
   }
-
+  db_hooks_latency(db, db_latency_commit, start);
+  probe(txn_commit, tx->state->tx_id,
+      tx->state->modified_pages->count,
+      start ? db_latency_now() - start : 0);
   return success();
 }
 
@@ -470,14 +487,22 @@ static void txn_free_registered_transactions(db_state_t *state) {
 static result_t txn_write_state_to_disk(txn_state_t *s) {
   size_t iter_state = 0;
   page_t *current;
+  uint64_t start = db_hooks_latency_start(s->db);
   while (
       pagesmap_get_next(s->modified_pages, &iter_state, &current)) {
     ensure(pages_write(s->db, current));
   }
+  db_hooks_latency(s->db, db_latency_gc_writeback, start);
+  probe(txn_gc_writeback, s->tx_id, s->modified_pages->count,
+      start ? db_latency_now() - start : 0);
   // <1>
   if (wal_will_checkpoint(s->db, s->tx_id)) {
+    start = db_hooks_latency_start(s->db);
     ensure(pal_fsync(s->db->handle));
+    db_hooks_latency(s->db, db_latency_gc_fsync, start);
+    start = db_hooks_latency_start(s->db);
     ensure(wal_checkpoint(s->db, s->tx_id));
+    db_hooks_latency(s->db, db_latency_checkpoint, start);
   }
   return success();
 }
@@ -540,6 +565,7 @@ static result_t txn_gc(txn_state_t *state) {
 // tag::working_set_txn_close[]
 implementation_detail void txn_clear_working_set(txn_t *tx) {
   if (tx->working_set) {
+    db_hooks_clear_working_set(tx);
     size_t iter_state = 0;
     page_t *p;
     while (pagesmap_get_next(tx->working_set, &iter_state, &p)) {
@@ -553,7 +579,9 @@ implementation_detail void txn_clear_working_set(txn_t *tx) {
 }
 result_t txn_close(txn_t *tx) {
   if (!tx || !tx->state) return success();
+  counted_op(tx->state->db, db_op_txn_close);
   db_state_t *db = tx->state->db;
+  probe(txn_close, tx->state->tx_id, tx->state->flags);
   if (tx->state->tx_id == db->active_write_tx) {
     db->active_write_tx = 0;
   }
@@ -20,8 +20,32 @@ typedef struct hash_bucket {
 static_assert(sizeof(hash_bucket_t) == 64, "Bad size");
 
 #define BUCKETS_IN_PAGE (PAGE_SIZE / sizeof(hash_bucket_t))
+// the directory uses the low bits of the key, so the location in
+// the page comes from the high bits. An entry keeps its location
+// when its page is split or merged, and keys inserted in bucket
+// order don't cluster in the page.
+#define KEY_TO_LOCATION(num) ((num >> 32) % BUCKETS_IN_PAGE)
+// set on every hash page. The location used to be (key >> depth),
+// and pages written then have a zero layout. Their entries are in
+// other buckets, so such a hash is refused rather than misread, it
+// has to be rebuilt by copying it to a new one.
+#define HASH_PAGE_LAYOUT_HIGH_BITS (1)
 // end::hash_page_decl[]
 
+// tag::hash_decode_entry[]
+// an entry is the key and value varints, followed by the flags. The
+// rest of the page can be read past the bucket while decoding.
+static inline uint8_t* hash_decode_entry(
+    hash_bucket_t* buckets, uint8_t* cur, uint64_t* k, uint64_t* v) {
+  uint64_t kv[2];
+  varint_decode_many(
+      &cur, (uint8_t*)(buckets + BUCKETS_IN_PAGE), kv, 2);
+  *k = kv[0];
+  *v = kv[1];
+  return cur;
+}
+// end::hash_decode_entry[]
+
 // Taken from:
 // https://gist.github.com/degski/6e2069d6035ae04d5d6f64981c995ec2#file-invertible_hash_functions-hpp-L43
 implementation_detail uint64_t hash_permute_key(uint64_t x) {
@@ -36,6 +60,9 @@ static result_t hash_id_to_dir_root(
   page_t hash = {.page_num = hash_id};
   ensure(txn_get_page(tx, &hash));
   assert(hash.metadata->common.page_flags == page_flags_hash);
+  ensure(hash.metadata->hash.layout == HASH_PAGE_LAYOUT_HIGH_BITS,
+      msg("The hash has an older layout and must be rebuilt"),
+      with(hash_id, "%lu"));
   hash_root->page_num = hash.metadata->hash.dir_page_num;
   ensure(txn_get_page(tx, hash_root));
   return success();
@@ -46,6 +73,7 @@ result_t hash_create(txn_t* tx, uint64_t* hash_id) {
   page_t p = {.number_of_pages = 1};
   ensure(txn_allocate_page(tx, &p, 0));
   p.metadata->hash.page_flags   = page_flags_hash;
+  p.metadata->hash.layout       = HASH_PAGE_LAYOUT_HIGH_BITS;
   p.metadata->hash.dir_page_num = p.page_num;
   *hash_id                      = p.page_num;
   return success();
@@ -56,15 +84,14 @@ result_t hash_create(txn_t* tx, uint64_t* hash_id) {
 static bool hash_get_from_page(
     page_t* p, uint64_t hashed_key, hash_val_t* kvp) {
   hash_bucket_t* buckets = p->address;
-  uint64_t location =
-      (hashed_key >> p->metadata->hash.depth) % BUCKETS_IN_PAGE;
+  uint64_t location = KEY_TO_LOCATION(hashed_key);
   for (size_t i = 0; i < HASH_OVERFLOW_CHAIN_SIZE; i++) {
     uint64_t idx = (location + i) % BUCKETS_IN_PAGE;
     uint8_t* end = buckets[idx].data + buckets[idx].bytes_used;
     uint8_t* cur = buckets[idx].data;
     while (cur < end) {
       uint64_t k, v;
-      cur           = varint_decode(varint_decode(cur, &k), &v);
+      cur           = hash_decode_entry(buckets, cur, &k, &v);
       uint8_t flags = *cur++;
       if (k == kvp->key) {
         kvp->val   = v;
@@ -99,7 +126,7 @@ implementation_detail bool hash_page_get_next(
   }
   uint8_t* start = buckets[idx].data + offset;
   uint8_t* end =
-      varint_decode(varint_decode(start, &it->key), &it->val);
+      hash_decode_entry(buckets, start, &it->key, &it->val);
   it->flags     = *end++;
   it->has_val   = true;
   uint32_t size = (uint32_t)(end - start);
@@ -118,8 +145,7 @@ implementation_detail bool hash_page_get_next(
 static bool hash_append_to_page(hash_bucket_t* buckets,
     page_metadata_t* metadata, uint64_t hashed_key, uint8_t* buffer,
     size_t size) {
-  uint64_t location =
-      (hashed_key >> metadata->hash.depth) % BUCKETS_IN_PAGE;
+  uint64_t location = KEY_TO_LOCATION(hashed_key);
   for (size_t i = 0; i < HASH_OVERFLOW_CHAIN_SIZE; i++) {
     uint64_t idx = (location + i) % BUCKETS_IN_PAGE;
     if (buckets[idx].bytes_used + size > HASH_BUCKET_DATA_SIZE) {
@@ -183,8 +209,7 @@ static bool hash_set_in_page(page_t* p, uint64_t hashed_key,
   if (old) {
     old->has_val = false;
   }
-  uint64_t location =
-      (hashed_key >> p->metadata->hash.depth) % BUCKETS_IN_PAGE;
+  uint64_t location = KEY_TO_LOCATION(hashed_key);
   for (size_t i = 0; i < HASH_OVERFLOW_CHAIN_SIZE; i++) {
     uint64_t idx = (location + i) % BUCKETS_IN_PAGE;
     uint8_t* end = buckets[idx].data + buckets[idx].bytes_used;
@@ -192,7 +217,7 @@ static bool hash_set_in_page(page_t* p, uint64_t hashed_key,
     while (cur < end) {
       uint64_t k, v;
       uint8_t* start   = cur;
-      cur              = varint_decode(varint_decode(cur, &k), &v);
+      cur              = hash_decode_entry(buckets, cur, &k, &v);
       uint8_t old_flag = *cur++;
       if (k != set->key) continue;
       if (old) {
@@ -218,7 +243,7 @@ static bool hash_set_in_page(page_t* p, uint64_t hashed_key,
 
 // tag::hash_compact_buckets[]
 static void hash_compact_buckets(
-    hash_bucket_t* buckets, uint64_t start_idx, uint8_t depth) {
+    hash_bucket_t* buckets, uint64_t start_idx) {
   size_t max_overflow = 0;
   for (size_t i = 0; i < HASH_OVERFLOW_CHAIN_SIZE; i++) {
     uint64_t idx = (start_idx + i) % BUCKETS_IN_PAGE;
@@ -234,10 +259,9 @@ static void hash_compact_buckets(
     while (cur < end) {
       uint64_t k, v;
       uint8_t* start = cur;
-      cur            = varint_decode(varint_decode(cur, &k), &v);
+      cur            = hash_decode_entry(buckets, cur, &k, &v);
       cur++;  // flags
-      uint64_t k_idx =
-          (hash_permute_key(k) >> depth) % BUCKETS_IN_PAGE;
+      uint64_t k_idx = KEY_TO_LOCATION(hash_permute_key(k));
       if (k_idx == idx) continue;
       uint8_t size = (uint8_t)(cur - start);
       if (buckets[k_idx].bytes_used + size > HASH_BUCKET_DATA_SIZE) {
@@ -267,8 +291,7 @@ static bool hash_remove_from_page(
   assert(p->metadata->hash.depth < 64);
   hash_bucket_t* buckets = p->address;
   del->has_val           = false;
-  uint64_t location =
-      (hashed_key >> p->metadata->hash.depth) % BUCKETS_IN_PAGE;
+  uint64_t location = KEY_TO_LOCATION(hashed_key);
   for (size_t i = 0; i < HASH_OVERFLOW_CHAIN_SIZE; i++) {
     uint64_t idx = (location + i) % BUCKETS_IN_PAGE;
     uint8_t* end = buckets[idx].data + buckets[idx].bytes_used;
@@ -276,7 +299,7 @@ static bool hash_remove_from_page(
     while (cur < end) {
       uint64_t k, v;
       uint8_t* start = cur;
-      cur            = varint_decode(varint_decode(cur, &k), &v);
+      cur            = hash_decode_entry(buckets, cur, &k, &v);
       uint8_t flags  = *cur++;
       if (k == del->key) {
         del->has_val = true;
@@ -287,8 +310,7 @@ static bool hash_remove_from_page(
         p->metadata->hash.bytes_used -= (uint16_t)(cur - start);
 
         if (buckets[idx].overflowed) {
-          hash_compact_buckets(
-              buckets, idx, p->metadata->hash_dir.depth);
+          hash_compact_buckets(buckets, idx);
         }
         return true;
       }
@@ -301,6 +323,7 @@ static bool hash_remove_from_page(
 
 // tag::hash_get[]
 result_t hash_get(txn_t* tx, hash_val_t* kvp) {
+  counted_op(tx->state->db, db_op_hash_get);
   page_t hash_root = {0};
   ensure(hash_id_to_dir_root(tx, kvp->hash_id, &hash_root));
   uint64_t hashed_key = hash_permute_key(kvp->key);
@@ -322,18 +345,36 @@ result_t hash_get(txn_t* tx, hash_val_t* kvp) {
 // tag::hash_split_page_entries[]
 static result_t hash_split_page_entries(
     void* address, uint8_t depth, page_t* pages[2]) {
-  hash_val_t it                       = {0};
-  uint64_t mask                       = 1 << (depth - 1);
+  hash_bucket_t* src                  = address;
+  uint64_t mask                       = 1UL << (depth - 1);
   pages[0]->metadata->hash.page_flags = page_flags_hash;
+  pages[0]->metadata->hash.layout     = HASH_PAGE_LAYOUT_HIGH_BITS;
   pages[0]->metadata->hash.depth      = depth;
   memcpy(pages[1]->metadata, pages[0]->metadata,
       sizeof(page_metadata_t));
-  while (hash_page_get_next(address, &it)) {
-    uint64_t hashed_key = hash_permute_key(it.key);
-    if (hashed_key & mask) {
-      ensure(hash_set_in_page(pages[1], hashed_key, &it, 0));
-    } else {
-      ensure(hash_set_in_page(pages[0], hashed_key, &it, 0));
+  // entries keep their bucket, so the split always fits
+  for (size_t idx = 0; idx < BUCKETS_IN_PAGE; idx++) {
+    uint8_t* end = src[idx].data + src[idx].bytes_used;
+    uint8_t* cur = src[idx].data;
+    while (cur < end) {
+      uint64_t k, v;
+      uint8_t* start = cur;
+      cur            = hash_decode_entry(src, cur, &k, &v);
+      cur++;  // flags
+      uint64_t hashed_key    = hash_permute_key(k);
+      page_t* p              = pages[(hashed_key & mask) != 0];
+      hash_bucket_t* buckets = p->address;
+      uint8_t size           = (uint8_t)(cur - start);
+      uint8_t* dst = buckets[idx].data + buckets[idx].bytes_used;
+      memcpy(dst, start, size);
+      buckets[idx].bytes_used += size;
+      p->metadata->hash.number_of_entries++;
+      p->metadata->hash.bytes_used += size;
+      // mark the chain from the entry's location to here
+      for (uint64_t i = KEY_TO_LOCATION(hashed_key); i != idx;
+           i = (i + 1) % BUCKETS_IN_PAGE) {
+        buckets[i].overflowed = true;
+      }
     }
   }
   return success();
@@ -382,6 +423,8 @@ static result_t hash_expand_directory(txn_t* tx, page_t* dir) {
   memcpy(new.metadata, dir->metadata, sizeof(page_metadata_t));
   new.metadata->hash_dir.depth++;
   new.metadata->hash_dir.number_of_buckets *= 2;
+  probe(hash_expand_directory, dir->page_num, new.page_num,
+      new.metadata->hash_dir.number_of_buckets);
   ensure(txn_free_page(tx, dir));
   memcpy(dir, &new, sizeof(page_t));
   return success();
@@ -395,6 +438,8 @@ static result_t hash_split_page(
     ensure(hash_expand_directory(tx, dir));
   }
   uint32_t bit = 1 << page->metadata->hash.depth;
+  probe(hash_split_page, set->hash_id, page->page_num,
+      page->metadata->hash.depth);
 
   page_t new_page      = {.number_of_pages = 1};
   page_t* pages_ptr[2] = {page, &new_page};
@@ -441,6 +486,7 @@ static result_t hash_set_small(txn_t* tx, page_t* p,
 
 // tag::hash_set[]
 result_t hash_set(txn_t* tx, hash_val_t* set, hash_val_t* old) {
+  counted_op(tx->state->db, db_op_hash_set);
   page_t hash_root = {0};
   ensure(hash_id_to_dir_root(tx, set->hash_id, &hash_root));
   ensure(txn_modify_page(tx, &hash_root));
@@ -532,9 +578,12 @@ static result_t hash_convert_directory_to_hash(txn_t* tx,
   memset(buffer, 0, PAGE_SIZE);
   page_metadata_t temp_metadata = {
       .hash = {.page_flags = page_flags_hash,
+          .layout          = HASH_PAGE_LAYOUT_HIGH_BITS,
           .dir_page_num    = kvp->hash_id}};
   page_t dst = {.address = buffer, .metadata = &temp_metadata};
-  ensure(hash_merge_pages_work(page, &sibling, &dst, &hashed_key));
+  if (!hash_merge_pages_work(page, &sibling, &dst, &hashed_key)) {
+    return success();  // doesn't fit, keep both pages
+  }
   ensure(txn_free_page(tx, dir));
   if (page->page_num == kvp->hash_id) {
     ensure(txn_free_page(tx, &sibling));
@@ -558,6 +607,7 @@ static result_t hash_merge_pages(txn_t* tx, hash_val_t* kvp,
       1;
   page_metadata_t merged_metadata = {
       .hash = {.page_flags = page_flags_hash,
+          .layout          = HASH_PAGE_LAYOUT_HIGH_BITS,
           .depth           = new_depth,
           .dir_page_num    = dir->page_num}};
   void* buffer;
@@ -566,7 +616,9 @@ static result_t hash_merge_pages(txn_t* tx, hash_val_t* kvp,
   page_t dst = {.address = buffer, .metadata = &merged_metadata};
   // <1>
   uint64_t hashed_key;
-  ensure(hash_merge_pages_work(page, sibling, &dst, &hashed_key));
+  if (!hash_merge_pages_work(page, sibling, &dst, &hashed_key)) {
+    return success();  // doesn't fit, keep both pages
+  }
   // <2>
   uint64_t new_page_id;
   if (kvp->hash_id == page->page_num) {
@@ -606,6 +658,9 @@ static result_t hash_maybe_merge_pages(txn_t* tx, uint64_t index,
   if (joined_size > (PAGE_SIZE / 4) * 3) {  // no point in merging
     return success();
   }
+  if (sibling.metadata->hash.depth != page->metadata->hash.depth) {
+    return success();  // the sibling was split further
+  }
   // <2>
   if (dir->metadata->hash_dir.number_of_buckets == 2) {
     ensure(hash_convert_directory_to_hash(
@@ -623,6 +678,7 @@ static result_t hash_maybe_merge_pages(txn_t* tx, uint64_t index,
 
 // tag::hash_del[]
 result_t hash_del(txn_t* tx, hash_val_t* del) {
+  counted_op(tx->state->db, db_op_hash_del);
   page_t hash_root = {0};
   ensure(hash_id_to_dir_root(tx, del->hash_id, &hash_root));
   uint64_t hashed_key = hash_permute_key(del->key);
@@ -10,6 +10,20 @@ typedef enum __attribute__((__packed__)) hash_multi_flags {
   hash_multi_nested = 3
 } hash_multi_flags_t;
 
+// tag::hash_multi_decode_packed[]
+// a packed list is converted to a nested hash once it is larger than
+// this, so all its values are decoded at once, into a buffer on the
+// stack
+#define HASH_MULTI_PACKED_MAX_SIZE (128)
+
+static size_t hash_multi_decode_packed(
+    container_item_t *item, uint64_t *values) {
+  uint8_t *cur = item->data.address;
+  return varint_decode_many(&cur, cur + item->data.size, values,
+      HASH_MULTI_PACKED_MAX_SIZE);
+}
+// end::hash_multi_decode_packed[]
+
 // tag::hash_multi_set_single[]
 static result_t hash_multi_set_single(txn_t *tx, hash_val_t *set,
     hash_val_t *existing, uint64_t container_id) {
@@ -73,16 +87,15 @@ static result_t hash_multi_write_nested_hash(
 // end::hash_multi_write_nested_hash[]
 
 // tag::hash_multi_set_convert_to_nested[]
-static result_t hash_multi_set_convert_to_nested(
-    txn_t *tx, hash_val_t *set, container_item_t *item) {
+static result_t hash_multi_set_convert_to_nested(txn_t *tx,
+    hash_val_t *set, container_item_t *item, uint64_t *values,
+    size_t count) {
   uint64_t nested_hash;
   ensure(hash_create(tx, &nested_hash));
   hash_val_t nested = {.hash_id = nested_hash, .key = set->val};
   ensure(hash_set(tx, &nested, 0));
-  void *start = item->data.address;
-  void *end   = start + item->data.size;
-  while (start < end) {
-    start = varint_decode(start, &nested.key);
+  for (size_t i = 0; i < count; i++) {
+    nested.key = values[i];
     ensure(hash_set(tx, &nested, 0));
   }
   uint64_t old_val = set->val;
@@ -103,17 +116,16 @@ static result_t hash_multi_set_packed(txn_t *tx, hash_val_t *set,
   container_item_t item = {
       .container_id = container_id, .item_id = existing->val};
   ensure(container_item_get(tx, &item));
-  void *end   = item.data.address + item.data.size;
-  void *start = item.data.address;
-  while (start < end) {
-    uint64_t v;
-    start = varint_decode(start, &v);
-    if (v == set->val) return success();  // value already exists
+  uint64_t values[HASH_MULTI_PACKED_MAX_SIZE];
+  size_t count = hash_multi_decode_packed(&item, values);
+  for (size_t i = 0; i < count; i++) {
+    if (values[i] == set->val) return success();  // already exists
   }
   span_t new_val = {
       .size = item.data.size + varint_get_length(set->val)};
-  if (new_val.size > 128) {
-    return hash_multi_set_convert_to_nested(tx, set, &item);
+  if (new_val.size > HASH_MULTI_PACKED_MAX_SIZE) {
+    return hash_multi_set_convert_to_nested(
+        tx, set, &item, values, count);
   }
   ensure(txn_alloc_temp(tx, new_val.size, &new_val.address));
   memcpy(new_val.address, item.data.address, item.data.size);
@@ -179,34 +191,31 @@ static result_t hash_multi_del_packed(txn_t *tx, hash_val_t *del,
   container_item_t item = {
       .container_id = container_id, .item_id = existing->val};
   ensure(container_item_get(tx, &item));
-  void *end   = item.data.address + item.data.size;
-  void *start = item.data.address;
-  while (start < end) {
-    uint64_t v;
-    void *cur = varint_decode(start, &v);
-    if (v == del->val) {  // found the value
-      span_t buf = {.size = (size_t)(start - item.data.address)};
-      ensure(txn_alloc_temp(tx, item.data.size, &buf.address));
-      memcpy(buf.address, item.data.address, buf.size);
-      memcpy(buf.address + buf.size, cur, (size_t)(end - cur));
-      buf.size += (size_t)(end - cur);
-      if (buf.size == 0) {  // completely empty
-        ensure(container_item_del(tx, &item));
-        ensure(hash_del(tx, del));
-        return success();
-      }
-      item.data = buf;
-      bool in_place;
-      ensure(container_item_update(tx, &item, &in_place));
-      if (in_place == false) {
-        existing->val = item.item_id;
-        ensure(hash_set(tx, existing, 0));
-      }
-      return success();
-    }
-    start = cur;
+  uint64_t values[HASH_MULTI_PACKED_MAX_SIZE];
+  size_t count = hash_multi_decode_packed(&item, values);
+  size_t found = 0;
+  while (found < count && values[found] != del->val) found++;
+  if (found == count) return success();  // value not found, no change
+  if (count == 1) {  // completely empty
+    ensure(container_item_del(tx, &item));
+    ensure(hash_del(tx, del));
+    return success();
+  }
+  void *buf;
+  ensure(txn_alloc_temp(tx, item.data.size, &buf));
+  uint8_t *end = buf;
+  for (size_t i = 0; i < count; i++) {
+    if (i != found) end = varint_encode(values[i], end);
   }
-  return success();  // value not found, no change
+  item.data = (span_t){
+      .address = buf, .size = (size_t)(end - (uint8_t *)buf)};
+  bool in_place;
+  ensure(container_item_update(tx, &item, &in_place));
+  if (in_place == false) {
+    existing->val = item.item_id;
+    ensure(hash_set(tx, existing, 0));
+  }
+  return success();
 }
 // end::hash_multi_del_packed[]
 
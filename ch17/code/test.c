@@ -133,6 +133,83 @@ result_t multiple_vals_hash(uint64_t amount) {
   }
   return success();
 }
+static uint64_t reverse_bits(uint64_t x) {
+  uint64_t r = 0;
+  for (size_t i = 0; i < 64; i++, x >>= 1) r = (r << 1) | (x & 1);
+  return r;
+}
+
+// the directory picks a page by the low bits of the permuted key,
+// so this puts the keys of each page next to each other
+static int by_bucket_order(const void* a, const void* b) {
+  uint64_t x = reverse_bits(hash_permute_key(*(const uint64_t*)a));
+  uint64_t y = reverse_bits(hash_permute_key(*(const uint64_t*)b));
+  return (x > y) - (x < y);
+}
+
+result_t hash_in_bucket_order(uint64_t amount) {
+  db_t db;
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+  ensure(db_create("/tmp/db/try", &options, &db));
+  defer(db_close, db);
+
+  uint64_t* keys;
+  ensure(mem_calloc((void*)&keys, amount * sizeof(uint64_t)));
+  defer(free, keys);
+  for (size_t i = 0; i < amount; i++) keys[i] = i + 1;
+  qsort(keys, amount, sizeof(uint64_t), by_bucket_order);
+
+  txn_t tx;
+  ensure(txn_create(&db, TX_WRITE, &tx));
+  defer(txn_close, tx);
+  uint64_t hash_id;
+  ensure(hash_create(&tx, &hash_id));
+  for (size_t i = 0; i < amount; i++) {
+    hash_val_t set = {.hash_id = hash_id, .key = keys[i], .val = i};
+    ensure(hash_set(&tx, &set, 0));
+  }
+  for (size_t i = 0; i < amount; i++) {
+    hash_val_t get = {.hash_id = hash_id, .key = keys[i]};
+    ensure(hash_get(&tx, &get));
+    ensure(get.has_val && get.val == i);
+  }
+  return success();
+}
+
+describe(hash_layout) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("can add keys in the order of their pages") {
+    assert(hash_in_bucket_order(50000));
+  }
+
+  it("refuses a hash written with an older layout") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    uint64_t hash_id;
+    assert(hash_create(&tx, &hash_id));
+    hash_val_t set = {.hash_id = hash_id, .key = 1, .val = 2};
+    assert(hash_set(&tx, &set, 0));
+    page_metadata_t* metadata;
+    assert(txn_modify_metadata(&tx, hash_id, &metadata));
+    metadata->hash.layout = 0;  // as pages were written before it
+
+    hash_val_t get = {.hash_id = hash_id, .key = 1};
+    assert(!hash_get(&tx, &get));
+    errors_clear();
+  }
+}
+
 describe(multiple_vals) {
   before_each() {
     errors_clear();
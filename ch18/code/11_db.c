@@ -16,6 +16,8 @@ result_t db_create(const char *path, db_options_t *options,
   ensure(pal_create_file(path, &db->state->handle,
                          pal_file_creation_flags_none));
   memcpy(&db->state->options, &owned_options, sizeof(db_options_t));
+  ensure(db_row_cache_init(db->state));
+  ensure(db_page_trace_init(db->state));
   ensure(pal_set_file_size(db->state->handle,
                            owned_options.minimum_size, UINT64_MAX));
   db->state->map.size = db->state->handle->size;
@@ -51,6 +53,9 @@ implementation_detail result_t db_validate_options(
   options->wal_write_callback_state =
       user_options->wal_write_callback_state;
   options->wal_write_callback = user_options->wal_write_callback;
+  options->inline_max_size    = user_options->inline_max_size;
+  options->row_cache_size     = user_options->row_cache_size;
+  options->page_trace_size    = user_options->page_trace_size;
   memcpy(options->encryption_key, user_options->encryption_key,
          crypto_aead_xchacha20poly1305_ietf_KEYBYTES);
   if (!sodium_is_zero(options->encryption_key,
@@ -72,6 +77,13 @@ implementation_detail result_t db_validate_options(
         with(options->minimum_size, "%lu"));
   }
 
+  if (options->inline_max_size > BTREE_INLINE_LIMIT) {
+    failed(EINVAL,
+           msg("The inline_max_size cannot be more than "
+               "BTREE_INLINE_LIMIT"),
+           with(options->inline_max_size, "%u"));
+  }
+
   if (options->wal_size < 128 * 1024) {
     failed(EINVAL,
            msg("The wal_size cannot be less than the minimum "
@@ -112,6 +124,8 @@ result_t db_close(db_t *db) {
     db->state->last_write_tx = cur->prev_tx;
     txn_free_single_tx_state(cur);
   }
+  db_row_cache_free(db->state);
+  db_page_trace_free(db->state);
   free(db->state->first_read_bitmap);
   free(db->state->default_read_tx);
   free(db->state);
@@ -125,6 +125,13 @@ static result_t db_is_new_file(db_t *db, bool *is_new) {
 
 // tag::db_init[]
 implementation_detail result_t db_init(db_t *db) {
+  db->state->hooks.before_commit = table_stats_before_commit;
+  if (db->state->options.flags & db_flags_latency_stats)
+    db->state->hooks.latency = db_latency_record;
+  if (db->state->options.flags & db_flags_sys_counters) {
+    db->state->hooks.op_begin = db_op_begin;
+    db->state->hooks.op_end   = db_op_end;
+  }
   // <1>
   if ((db->state->options.flags & db_flags_log_shipping_target) ==
       db_flags_log_shipping_target)
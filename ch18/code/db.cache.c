@@ -0,0 +1,228 @@
+#include <sodium.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gavran/db.h>
+#include <gavran/internal.h>
+
+// tag::db_row_cache_entries[]
+// copies made for a transaction sit in its working set next to the
+// pages, tagged so they can't be mistaken for one. They aren't pages,
+// the working set frees them but doesn't wipe them.
+#define DB_ROW_CACHE_COPY (1UL << 63)
+
+static db_row_cache_entry_t **db_row_cache_bucket(
+    db_row_cache_t *cache, uint64_t page_num) {
+  return &cache->buckets[hash_permute_key(page_num) &
+                         (cache->number_of_buckets - 1)];
+}
+
+static void db_row_cache_unlink(
+    db_row_cache_t *cache, db_row_cache_entry_t *entry) {
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    cache->newest = entry->older;
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    cache->oldest = entry->newer;
+  entry->newer = entry->older = 0;
+}
+
+static void db_row_cache_link(
+    db_row_cache_t *cache, db_row_cache_entry_t *entry) {
+  entry->newer = 0;
+  entry->older = cache->newest;
+  if (cache->newest) cache->newest->newer = entry;
+  cache->newest = entry;
+  if (!cache->oldest) cache->oldest = entry;
+}
+
+static void db_row_cache_drop(db_row_cache_t *cache,
+    db_row_cache_entry_t **link, db_row_cache_entry_t *entry) {
+  *link = entry->next;
+  db_row_cache_unlink(cache, entry);
+  cache->used -= sizeof(db_row_cache_entry_t) + entry->size;
+  if (cache->wipe) sodium_memzero(entry->data, entry->size);
+  free(entry);
+}
+
+static db_row_cache_entry_t *db_row_cache_lookup(
+    db_row_cache_t *cache, container_item_t *item) {
+  db_row_cache_entry_t *cur =
+      *db_row_cache_bucket(cache, item->item_id / PAGE_SIZE);
+  while (cur) {
+    if (cur->item_id == item->item_id &&
+        cur->container_id == item->container_id)
+      return cur;
+    cur = cur->next;
+  }
+  return 0;
+}
+// end::db_row_cache_entries[]
+
+static void db_row_cache_invalidate(txn_state_t *state);
+static void db_row_cache_wipe_copies(txn_t *tx);
+
+// tag::db_row_cache_init[]
+implementation_detail result_t db_row_cache_init(db_state_t *db) {
+  // with mmap the rows are read in place, there is nothing to save
+  if (!db->options.row_cache_size ||
+      !(db->options.flags & db_flags_page_need_txn_working_set))
+    return success();
+  db_row_cache_t *cache;
+  ensure(mem_calloc((void *)&cache, sizeof(db_row_cache_t)));
+  defer(free, cache);
+  cache->capacity = db->options.row_cache_size;
+  cache->wipe = (db->options.flags & db_flags_encrypted) != 0;
+  cache->number_of_buckets = next_power_of_two(
+      MIN(1024 * 1024, MAX(64, cache->capacity / 512)));
+  ensure(mem_calloc((void *)&cache->buckets,
+      cache->number_of_buckets * sizeof(db_row_cache_entry_t *)));
+  db->row_cache          = cache;
+  db->hooks.after_commit = db_row_cache_invalidate;
+  if (cache->wipe) {
+    db->hooks.clear_working_set = db_row_cache_wipe_copies;
+  }
+  cache = 0;
+  return success();
+}
+
+implementation_detail void db_row_cache_free(db_state_t *db) {
+  db_row_cache_t *cache = db->row_cache;
+  if (!cache) return;
+  while (cache->newest) {
+    db_row_cache_entry_t *entry = cache->newest;
+    cache->newest               = entry->older;
+    if (cache->wipe) sodium_memzero(entry->data, entry->size);
+    free(entry);
+  }
+  free(cache->buckets);
+  free(cache);
+  db->row_cache = 0;
+}
+// end::db_row_cache_init[]
+
+// tag::db_row_cache_invalidate[]
+// called once the commit is visible, rows on any page it modified
+// are stale
+static void db_row_cache_invalidate(txn_state_t *state) {
+  db_row_cache_t *cache = state->db->row_cache;
+  if (!cache || !cache->used) return;
+  size_t iter_state = 0;
+  page_t *p;
+  while (pagesmap_get_next(state->modified_pages, &iter_state, &p)) {
+    for (uint64_t i = 0; i < MAX(1, p->number_of_pages); i++) {
+      uint64_t page_num = p->page_num + i;
+      db_row_cache_entry_t **link =
+          db_row_cache_bucket(cache, page_num);
+      while (*link) {
+        db_row_cache_entry_t *entry = *link;
+        if (entry->item_id / PAGE_SIZE == page_num)
+          db_row_cache_drop(cache, link, entry);
+        else
+          link = &entry->next;
+      }
+    }
+  }
+}
+// end::db_row_cache_invalidate[]
+
+// tag::db_row_cache_get[]
+static result_t db_row_cache_put(
+    db_row_cache_t *cache, container_item_t *item) {
+  size_t size = sizeof(db_row_cache_entry_t) + item->data.size;
+  if (size > cache->capacity / 16) return success();  // not worth it
+  while (cache->used + size > cache->capacity) {
+    db_row_cache_entry_t *oldest = cache->oldest;
+    db_row_cache_entry_t **link =
+        db_row_cache_bucket(cache, oldest->item_id / PAGE_SIZE);
+    while (*link != oldest) link = &(*link)->next;
+    db_row_cache_drop(cache, link, oldest);
+  }
+  db_row_cache_entry_t *entry;
+  ensure(mem_alloc((void *)&entry, size));
+  entry->container_id = item->container_id;
+  entry->item_id      = item->item_id;
+  entry->size         = item->data.size;
+  memcpy(entry->data, item->data.address, item->data.size);
+  db_row_cache_entry_t **bucket =
+      db_row_cache_bucket(cache, item->item_id / PAGE_SIZE);
+  entry->next = *bucket;
+  *bucket     = entry;
+  db_row_cache_link(cache, entry);
+  cache->used += size;
+  return success();
+}
+
+// the row must stay valid until the transaction is closed, even if
+// the entry is evicted, so the transaction gets its own copy. The
+// size is kept ahead of the row.
+static result_t db_row_cache_copy(
+    txn_t *tx, db_row_cache_entry_t *entry, container_item_t *item) {
+  page_t copy = {.page_num = DB_ROW_CACHE_COPY | item->item_id};
+  ensure(mem_alloc(&copy.address, sizeof(size_t) + entry->size));
+  memcpy(copy.address, &entry->size, sizeof(size_t));
+  memcpy((uint8_t *)copy.address + sizeof(size_t), entry->data,
+      entry->size);
+  if (flopped(pagesmap_put_new(&tx->working_set, &copy))) {
+    free(copy.address);
+    return failure_code();
+  }
+  item->data.address = (uint8_t *)copy.address + sizeof(size_t);
+  item->data.size    = entry->size;
+  return success();
+}
+
+// with an encrypted file, the working set wipes the pages, and this
+// the copies
+static void db_row_cache_wipe_copies(txn_t *tx) {
+  size_t iter_state = 0;
+  page_t *p;
+  while (pagesmap_get_next(tx->working_set, &iter_state, &p)) {
+    if (!(p->page_num & DB_ROW_CACHE_COPY)) continue;
+    size_t size;
+    memcpy(&size, p->address, sizeof(size_t));
+    sodium_memzero(p->address, sizeof(size_t) + size);
+  }
+}
+
+// moves the entry to the front of the LRU and counts the hits and
+// misses, without locks, see db_options_t.row_cache_size
+implementation_detail result_t db_row_cache_get(
+    txn_t *tx, container_item_t *item) {
+  db_row_cache_t *cache = tx->state->db->row_cache;
+  // only the newest snapshot matches the cache, large items are
+  // read from their own pages
+  if (!cache || tx->state != tx->state->db->last_write_tx ||
+      !(item->item_id % PAGE_SIZE)) {
+    ensure(container_item_get(tx, item));
+    return success();
+  }
+  page_t page = {.page_num = item->item_id / PAGE_SIZE};
+  if (!pagesmap_lookup(tx->working_set, &page)) {  // not decoded yet
+    page_t copy = {.page_num = DB_ROW_CACHE_COPY | item->item_id};
+    if (pagesmap_lookup(tx->working_set, &copy)) {
+      memcpy(&item->data.size, copy.address, sizeof(size_t));
+      item->data.address = (uint8_t *)copy.address + sizeof(size_t);
+      return success();
+    }
+    db_row_cache_entry_t *entry = db_row_cache_lookup(cache, item);
+    if (entry) {
+      cache->hits++;
+      db_row_cache_unlink(cache, entry);
+      db_row_cache_link(cache, entry);
+      ensure(db_row_cache_copy(tx, entry, item));
+      return success();
+    }
+  }
+  ensure(container_item_get(tx, item));
+  if (item->data.size + sizeof(size_t) <= PAGE_SIZE &&
+      !db_row_cache_lookup(cache, item)) {
+    cache->misses++;
+    ensure(db_row_cache_put(cache, item));
+  }
+  return success();
+}
+// end::db_row_cache_get[]
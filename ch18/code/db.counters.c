@@ -0,0 +1,179 @@
+#include <string.h>
+#include <unistd.h>
+
+#include <gavran/db.h>
+#include <gavran/internal.h>
+
+// tag::db_sys_wrap[]
+// the ch18 build links with --wrap for each of these (see the
+// makefile), so the calls that the code of every chapter makes come
+// through here, while those inside libc and the other libraries
+// don't. They are counted only within a counted_op. The build has
+// _FILE_OFFSET_BITS=64, so the I/O calls link to their 64 bit names.
+static _Thread_local sys_counters_t *db_sys_counters_current;
+
+static void db_sys_count(sys_counter_t counter) {
+  if (db_sys_counters_current)
+    db_sys_counters_current->calls[counter]++;
+}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunknown-warning-option"
+#pragma clang diagnostic ignored "-Wreserved-identifier"
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+int __real_posix_memalign(void **ptr, size_t alignment, size_t size);
+void __real_free(void *ptr);
+ssize_t __real_pread64(
+    int fd, void *buf, size_t count, off_t offset);
+ssize_t __real_pwrite64(
+    int fd, const void *buf, size_t count, off_t offset);
+void *__real_mmap64(
+    void *addr, size_t len, int prot, int flags, int fd, off_t off);
+int __real_munmap(void *addr, size_t length);
+int __real_mprotect(void *addr, size_t length, int prot);
+int __real_fdatasync(int fd);
+int __real_fsync(int fd);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t count, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+char *__wrap_strdup(const char *s);
+int __wrap_posix_memalign(void **ptr, size_t alignment, size_t size);
+void __wrap_free(void *ptr);
+ssize_t __wrap_pread64(
+    int fd, void *buf, size_t count, off_t offset);
+ssize_t __wrap_pwrite64(
+    int fd, const void *buf, size_t count, off_t offset);
+void *__wrap_mmap64(
+    void *addr, size_t len, int prot, int flags, int fd, off_t off);
+int __wrap_munmap(void *addr, size_t length);
+int __wrap_mprotect(void *addr, size_t length, int prot);
+int __wrap_fdatasync(int fd);
+int __wrap_fsync(int fd);
+
+void *__wrap_malloc(size_t size) {
+  db_sys_count(sys_counter_alloc);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  db_sys_count(sys_counter_alloc);
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  db_sys_count(sys_counter_alloc);
+  return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s) {
+  db_sys_count(sys_counter_alloc);
+  return __real_strdup(s);
+}
+
+int __wrap_posix_memalign(void **ptr, size_t alignment, size_t size) {
+  db_sys_count(sys_counter_posix_memalign);
+  return __real_posix_memalign(ptr, alignment, size);
+}
+
+void __wrap_free(void *ptr) {
+  if (ptr) db_sys_count(sys_counter_free);
+  __real_free(ptr);
+}
+
+ssize_t __wrap_pread64(
+    int fd, void *buf, size_t count, off_t offset) {
+  db_sys_count(sys_counter_pread);
+  return __real_pread64(fd, buf, count, offset);
+}
+
+ssize_t __wrap_pwrite64(
+    int fd, const void *buf, size_t count, off_t offset) {
+  db_sys_count(sys_counter_pwrite);
+  return __real_pwrite64(fd, buf, count, offset);
+}
+
+void *__wrap_mmap64(
+    void *addr, size_t len, int prot, int flags, int fd, off_t off) {
+  db_sys_count(sys_counter_mmap);
+  return __real_mmap64(addr, len, prot, flags, fd, off);
+}
+
+int __wrap_munmap(void *addr, size_t length) {
+  db_sys_count(sys_counter_munmap);
+  return __real_munmap(addr, length);
+}
+
+int __wrap_mprotect(void *addr, size_t length, int prot) {
+  db_sys_count(sys_counter_mprotect);
+  return __real_mprotect(addr, length, prot);
+}
+
+int __wrap_fdatasync(int fd) {
+  db_sys_count(sys_counter_fsync);
+  return __real_fdatasync(fd);
+}
+
+int __wrap_fsync(int fd) {
+  db_sys_count(sys_counter_fsync);
+  return __real_fsync(fd);
+}
+#pragma clang diagnostic pop
+// end::db_sys_wrap[]
+
+// tag::db_op_scope[]
+// the counting itself is thread local, the totals are only touched
+// once, when the outermost call is done
+implementation_detail void db_op_begin(
+    db_op_scope_t *scope, db_state_t *db, db_op_t op) {
+  if (db_sys_counters_current) return;
+  memset(&scope->counters, 0, sizeof(sys_counters_t));
+  scope->db               = db;
+  scope->op               = op;
+  db_sys_counters_current = &scope->counters;
+}
+
+implementation_detail void db_op_end(db_op_scope_t *scope) {
+  db_sys_counters_current  = 0;
+  db_op_counters_t *totals = &scope->db->sys_stats.ops[scope->op];
+  __atomic_fetch_add(&totals->calls, 1, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < sys_counter_number_of_counters; i++) {
+    if (!scope->counters.calls[i]) continue;
+    __atomic_fetch_add(
+        &totals->sys[i], scope->counters.calls[i], __ATOMIC_RELAXED);
+  }
+}
+// end::db_op_scope[]
+
+// tag::db_get_sys_stats[]
+result_t db_get_sys_stats(db_t *db, db_sys_stats_t *stats) {
+  ensure(db && db->state, msg("The database is not open"));
+  uint64_t *src = (uint64_t *)&db->state->sys_stats;
+  uint64_t *dst = (uint64_t *)stats;
+  for (size_t i = 0; i < sizeof(db_sys_stats_t) / sizeof(uint64_t);
+       i++)
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  return success();
+}
+
+const char *db_op_name(db_op_t op) {
+  static const char *names[] = {"txn_create", "txn_commit",
+      "txn_close", "container_item_put", "container_item_get",
+      "container_item_update", "container_item_del", "hash_set",
+      "hash_get", "hash_del", "btree_set", "btree_get", "btree_del",
+      "table_set", "table_get", "table_update", "table_del",
+      "table_scan_next", "table_range_next"};
+  if (op >= db_op_number_of_ops) return "unknown";
+  return names[op];
+}
+
+const char *db_sys_counter_name(sys_counter_t counter) {
+  static const char *names[] = {"alloc", "posix_memalign", "free",
+      "pread", "pwrite", "mmap", "munmap", "mprotect", "fsync"};
+  if (counter >= sys_counter_number_of_counters) return "unknown";
+  return names[counter];
+}
+// end::db_get_sys_stats[]
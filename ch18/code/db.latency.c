@@ -0,0 +1,64 @@
+#include <string.h>
+
+#include <gavran/db.h>
+#include <gavran/internal.h>
+
+// tag::db_latency_record[]
+// values below 8 get a bucket each, after that every power of two
+// is split into 8 linear sub buckets
+static size_t db_latency_bucket(uint64_t ns) {
+  if (ns < DB_LATENCY_SUB_BUCKETS) return ns;
+  uint64_t msb = 63 - (uint64_t)__builtin_clzll(ns);
+  uint64_t sub = (ns >> (msb - 3)) & (DB_LATENCY_SUB_BUCKETS - 1);
+  size_t bucket = (msb - 2) * DB_LATENCY_SUB_BUCKETS + sub;
+  return MIN(bucket, DB_LATENCY_BUCKETS - 1);
+}
+
+static uint64_t db_latency_bucket_limit(size_t bucket) {
+  size_t row = bucket / DB_LATENCY_SUB_BUCKETS;
+  if (!row) return bucket;
+  uint64_t sub   = bucket % DB_LATENCY_SUB_BUCKETS;
+  uint64_t shift = row - 1;
+  return ((DB_LATENCY_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+implementation_detail void db_latency_record(
+    db_state_t *db, db_latency_phase_t phase, uint64_t start) {
+  uint64_t ns                  = db_latency_now() - start;
+  db_latency_histogram_t *hist = &db->latency.phases[phase];
+  hist->count++;
+  hist->total_ns += ns;
+  hist->max_ns = MAX(hist->max_ns, ns);
+  hist->buckets[db_latency_bucket(ns)]++;
+}
+// end::db_latency_record[]
+
+// tag::db_get_latency_stats[]
+result_t db_get_latency_stats(db_t *db, db_latency_stats_t *stats) {
+  ensure(db && db->state, msg("The database is not open"));
+  memcpy(stats, &db->state->latency, sizeof(db_latency_stats_t));
+  return success();
+}
+
+uint64_t db_latency_percentile(
+    db_latency_histogram_t *histogram, double fraction) {
+  if (!histogram->count) return 0;
+  uint64_t target = (uint64_t)(fraction * (double)histogram->count);
+  target          = MAX(1, MIN(target, histogram->count));
+  uint64_t seen   = 0;
+  for (size_t i = 0; i < DB_LATENCY_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= target)
+      return MIN(db_latency_bucket_limit(i), histogram->max_ns);
+  }
+  return histogram->max_ns;
+}
+
+const char *db_latency_phase_name(db_latency_phase_t phase) {
+  static const char *names[] = {"commit", "finalize_pages",
+      "wal_prepare", "wal_hash", "wal_write", "log_shipping",
+      "gc_writeback", "gc_fsync", "checkpoint"};
+  if (phase >= db_latency_number_of_phases) return "unknown";
+  return names[phase];
+}
+// end::db_get_latency_stats[]
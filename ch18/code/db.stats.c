@@ -0,0 +1,98 @@
+#include <string.h>
+
+#include <gavran/db.h>
+#include <gavran/internal.h>
+
+// tag::db_stats_transactions[]
+// the chain runs from the default read transaction to the last
+// committed one, each holds the pages it modified until it is freed
+static void db_stats_transactions(db_state_t *db, db_stats_t *stats) {
+  uint64_t usages = 0;
+  for (txn_state_t *s = db->default_read_tx; s; s = s->next_tx) {
+    usages += s->usages;
+    if (s == db->default_read_tx) continue;
+    stats->pending_transactions++;
+    size_t iter_state = 0;
+    page_t *p;
+    while (pagesmap_get_next(s->modified_pages, &iter_state, &p)) {
+      if (!p->address) continue;  // moved to a later transaction
+      stats->pending_version_bytes +=
+          MAX(1, p->number_of_pages) * PAGE_SIZE;
+    }
+  }
+  // a committed write transaction holds a usage until it is closed
+  if (db->active_write_tx && db->active_write_tx == db->last_tx_id)
+    usages--;
+  stats->open_read_transactions = usages;
+}
+// end::db_stats_transactions[]
+
+// tag::db_stats_free_pages[]
+static result_t db_stats_free_pages(db_t *db, db_stats_t *stats) {
+  txn_t tx;
+  ensure(txn_create(db, TX_READ, &tx));
+  defer(txn_close, tx);
+  page_metadata_t *header;
+  ensure(txn_get_metadata(&tx, 0, &header));
+  page_t bitmap = {
+      .page_num = header->file_header.free_space_bitmap_start};
+  ensure(txn_get_page(&tx, &bitmap));
+  uint64_t *words = bitmap.address;
+  uint64_t bits   = MIN(header->file_header.number_of_pages,
+      bitmap.number_of_pages * (uint64_t)BITS_IN_PAGE);
+  uint64_t busy   = 0;
+  for (uint64_t i = 0; i < bits / 64; i++)
+    busy += (uint64_t)__builtin_popcountll(words[i]);
+  for (uint64_t i = bits & ~63UL; i < bits; i++)
+    busy += bitmap_is_set(words, i);
+  stats->free_pages = bits - busy;
+  return success();
+}
+// end::db_stats_free_pages[]
+
+// tag::db_get_stats[]
+result_t db_get_stats(db_t *db, db_stats_t *stats) {
+  ensure(db && db->state, msg("The database is not open"));
+  db_state_t *state = db->state;
+  memset(stats, 0, sizeof(db_stats_t));
+  stats->file_size        = state->map.size;
+  stats->number_of_pages  = state->number_of_pages;
+  stats->last_tx_id       = state->last_tx_id;
+  stats->oldest_active_tx = state->oldest_active_tx;
+  stats->wal_current_file =
+      state->wal_state.current_append_file_index;
+  for (size_t i = 0; i < 2; i++) {
+    wal_file_state_t *file       = &state->wal_state.files[i];
+    stats->wal_write_position[i] = file->last_write_pos;
+    stats->wal_file_size[i]      = file->span.size;
+  }
+  stats->checkpoints  = state->checkpoints;
+  stats->file_growths = state->file_growths;
+  // before we open a transaction of our own
+  db_stats_transactions(state, stats);
+  ensure(db_stats_free_pages(db, stats));
+  return success();
+}
+
+void db_stats_counters(db_stats_t *stats,
+    db_stats_counter_t counters[DB_STATS_NUMBER_OF_COUNTERS]) {
+  db_stats_counter_t all[DB_STATS_NUMBER_OF_COUNTERS] = {
+      {"file_size", stats->file_size},
+      {"number_of_pages", stats->number_of_pages},
+      {"free_pages", stats->free_pages},
+      {"last_tx_id", stats->last_tx_id},
+      {"oldest_active_tx", stats->oldest_active_tx},
+      {"open_read_transactions", stats->open_read_transactions},
+      {"pending_transactions", stats->pending_transactions},
+      {"pending_version_bytes", stats->pending_version_bytes},
+      {"wal_current_file", stats->wal_current_file},
+      {"wal_0_write_position", stats->wal_write_position[0]},
+      {"wal_1_write_position", stats->wal_write_position[1]},
+      {"wal_0_file_size", stats->wal_file_size[0]},
+      {"wal_1_file_size", stats->wal_file_size[1]},
+      {"checkpoints", stats->checkpoints},
+      {"file_growths", stats->file_growths},
+  };
+  memcpy(counters, all, sizeof(all));
+}
+// end::db_get_stats[]
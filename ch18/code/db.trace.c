@@ -0,0 +1,117 @@
+#include <string.h>
+
+#include <gavran/db.h>
+#include <gavran/internal.h>
+
+// tag::db_page_trace_init[]
+implementation_detail result_t db_page_trace_init(db_state_t *db) {
+  if (!db->options.page_trace_size) return success();
+  uint64_t size = 64;
+  while (size < db->options.page_trace_size) size <<= 1;
+  db_page_trace_t *trace;
+  ensure(mem_calloc((void *)&trace,
+      sizeof(db_page_trace_t) + size * sizeof(db_page_trace_slot_t)));
+  trace->mask           = size - 1;
+  db->page_trace        = trace;
+  db->hooks.page_access = db_page_trace_record;
+  return success();
+}
+
+implementation_detail void db_page_trace_free(db_state_t *db) {
+  free(db->page_trace);
+  db->page_trace = 0;
+}
+// end::db_page_trace_init[]
+
+// tag::db_page_trace_record[]
+// finds the metadata page the way txn_raw_get_page would, but only
+// where it is already in memory
+static bool db_page_trace_peek(txn_t *tx, page_t *page) {
+  if (!(tx->state->flags & TX_COMMITED) &&
+      pagesmap_lookup(tx->state->modified_pages, page))
+    return true;
+  if (pagesmap_lookup(tx->working_set, page)) return true;
+  for (txn_state_t *prev = tx->state; prev; prev = prev->prev_tx) {
+    if (pagesmap_lookup(prev->modified_pages, page)) return true;
+  }
+  db_state_t *db = tx->state->db;
+  if (db->options.flags & db_flags_page_need_txn_working_set)
+    return false;  // not read yet, or still encrypted in the map
+  page->address = tx->state->map.address + page->page_num * PAGE_SIZE;
+  return true;
+}
+
+static uint8_t db_page_trace_flags(txn_t *tx, uint64_t page_num) {
+  page_t metadata = {.page_num = page_num & PAGES_IN_METADATA_MASK};
+  if (metadata.page_num == page_num)
+    return page_flags_metadata;
+  if ((tx->state->flags & txn_flags_apply_log) ||
+      !db_page_trace_peek(tx, &metadata))
+    return DB_PAGE_TRACE_UNKNOWN_FLAGS;
+  page_metadata_t *entries = metadata.address;
+  size_t index              = page_num & ~PAGES_IN_METADATA_MASK;
+  return entries[index].common.page_flags;
+}
+
+// each writer claims its own slot, so there are no locks. The slot is
+// marked as in progress until the entry is complete, and a reader
+// that sees the mark change under it drops the entry.
+implementation_detail void db_page_trace_record(
+    txn_t *tx, page_t *page, bool write) {
+  uint64_t info = db_page_trace_flags(tx, page->page_num);
+  if (write) info |= 1 << 8;
+
+  db_page_trace_t *trace = tx->state->db->page_trace;
+  uint64_t pos =
+      __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+  db_page_trace_slot_t *slot = &trace->slots[pos & trace->mask];
+  __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&slot->tx_id, tx->state->tx_id, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->page_num, page->page_num, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->info, info, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+// end::db_page_trace_record[]
+
+// tag::db_page_trace_read[]
+result_t db_page_trace_read(db_t *db, uint64_t *position,
+    db_page_access_t *entries, size_t count, size_t *read,
+    uint64_t *lost) {
+  ensure(db && db->state, msg("The database is not open"));
+  db_page_trace_t *trace = db->state->page_trace;
+  ensure(trace, msg("Page tracing is not enabled, see "
+                    "db_options_t.page_trace_size"));
+  *read         = 0;
+  *lost         = 0;
+  uint64_t pos  = *position;
+  uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+  uint64_t size = trace->mask + 1;
+  if (head - pos > size) {  // lapped, these are already gone
+    *lost += head - size - pos;
+    pos = head - size;
+  }
+  while (pos < head && *read < count) {
+    db_page_trace_slot_t *slot = &trace->slots[pos & trace->mask];
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq < pos + 1) break;  // still being written
+    if (seq == pos + 1) {
+      db_page_access_t *e = &entries[*read];
+      memset(e, 0, sizeof(db_page_access_t));
+      e->tx_id = __atomic_load_n(&slot->tx_id, __ATOMIC_RELAXED);
+      e->page_num =
+          __atomic_load_n(&slot->page_num, __ATOMIC_RELAXED);
+      uint64_t info = __atomic_load_n(&slot->info, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+      e->page_flags = (uint8_t)info;
+      e->write      = (info >> 8) & 1;
+      if (seq == pos + 1) (*read)++;
+    }
+    if (seq != pos + 1) (*lost)++;  // overwritten by a newer one
+    pos++;
+  }
+  *position = pos;
+  return success();
+}
+// end::db_page_trace_read[]
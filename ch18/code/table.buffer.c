@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <gavran/db.h>
+#include <gavran/internal.h>
+
+// tag::table_buffer[]
+implementation_detail bool table_is_buffered(
+    table_schema_t *schema, size_t i) {
+  return schema->buffer_ids && schema->buffer_ids[i];
+}
+
+// the buffer is checked first, it holds the latest writes
+implementation_detail result_t table_buffer_get(
+    txn_t *tx, table_schema_t *schema, size_t i, btree_val_t *kvp) {
+  kvp->tree_id = schema->buffer_ids[i];
+  ensure(btree_get(tx, kvp));
+  if (kvp->has_val) {
+    kvp->has_val = !(kvp->flags & TABLE_BUFFER_TOMBSTONE);
+    return success();
+  }
+  kvp->tree_id = schema->index_ids[i];
+  ensure(btree_get(tx, kvp));
+  return success();
+}
+
+static result_t table_buffer_is_full(
+    txn_t *tx, uint64_t buffer_id, bool *full) {
+  page_t root = {.page_num = buffer_id};
+  ensure(txn_get_page(tx, &root));
+  tree_page_t *tree = &root.metadata->tree;
+  *full             = tree->page_flags == page_flags_tree_branch &&
+          tree->floor / sizeof(uint16_t) >= TABLE_BUFFER_MAX_LEAVES;
+  return success();
+}
+
+static result_t table_buffer_write(txn_t *tx, table_schema_t *schema,
+    size_t i, span_t *key, uint64_t val, uint8_t flags) {
+  btree_val_t set = {.tree_id = schema->buffer_ids[i],
+      .key                    = *key,
+      .val                    = val,
+      .flags                  = flags};
+  ensure(btree_set(tx, &set, 0));
+  bool full;
+  ensure(table_buffer_is_full(tx, schema->buffer_ids[i], &full));
+  if (full) ensure(table_buffer_merge(tx, schema, i));
+  return success();
+}
+
+implementation_detail result_t table_buffer_put(txn_t *tx,
+    table_schema_t *schema, size_t i, span_t *key, uint64_t item_id) {
+  ensure(table_buffer_write(tx, schema, i, key, item_id, 0));
+  return success();
+}
+
+implementation_detail result_t table_buffer_remove(
+    txn_t *tx, table_schema_t *schema, size_t i, span_t *key) {
+  ensure(table_buffer_write(
+      tx, schema, i, key, 0, TABLE_BUFFER_TOMBSTONE));
+  return success();
+}
+// end::table_buffer[]
+
+// tag::table_buffer_merge[]
+typedef struct table_buffer_entry {
+  size_t offset;
+  size_t size;
+  uint64_t val;
+  uint8_t flags;
+  uint8_t padding[7];
+} table_buffer_entry_t;
+
+typedef struct table_buffer_batch {
+  table_buffer_entry_t *entries;
+  uint8_t *keys;
+  size_t count;
+  size_t used;
+} table_buffer_batch_t;
+
+static result_t table_buffer_batch_free(table_buffer_batch_t *batch) {
+  free(batch->entries);
+  free(batch->keys);
+  return success();
+}
+enable_defer(table_buffer_batch_free);
+
+// the cursor can't run over a tree we modify, so we copy the
+// buffered writes out first
+static result_t table_buffer_collect(
+    txn_t *tx, uint64_t buffer_id, table_buffer_batch_t *batch) {
+  size_t capacity = 0, keys_capacity = 0;
+  btree_cursor_t it = {.tx = tx, .tree_id = buffer_id};
+  defer(btree_free_cursor, it);
+  ensure(btree_cursor_at_start(&it));
+  while (true) {
+    ensure(btree_get_next(&it));
+    if (it.has_val == false) break;
+    if (batch->count == capacity) {
+      capacity = MAX(64, capacity * 2);
+      ensure(mem_realloc((void *)&batch->entries,
+          capacity * sizeof(table_buffer_entry_t)));
+    }
+    if (batch->used + it.key.size > keys_capacity) {
+      keys_capacity = MAX(4096, (batch->used + it.key.size) * 2);
+      ensure(mem_realloc((void *)&batch->keys, keys_capacity));
+    }
+    memcpy(batch->keys + batch->used, it.key.address, it.key.size);
+    table_buffer_entry_t *entry = &batch->entries[batch->count++];
+    entry->offset               = batch->used;
+    entry->size                 = it.key.size;
+    entry->val                  = it.val;
+    entry->flags                = it.flags;
+    batch->used += it.key.size;
+  }
+  return success();
+}
+
+implementation_detail result_t table_buffer_merge(
+    txn_t *tx, table_schema_t *schema, size_t i) {
+  table_buffer_batch_t batch = {0};
+  defer(table_buffer_batch_free, batch);
+  ensure(table_buffer_collect(tx, schema->buffer_ids[i], &batch));
+  // the writes are in key order, so the index is modified one leaf
+  // after another, instead of a random leaf per write
+  for (size_t e = 0; e < batch.count; e++) {
+    table_buffer_entry_t *entry = &batch.entries[e];
+    span_t key = {.address = batch.keys + entry->offset,
+        .size              = entry->size};
+    btree_val_t kvp = {.tree_id = schema->index_ids[i],
+        .key                    = key,
+        .val                    = entry->val};
+    if (entry->flags & TABLE_BUFFER_TOMBSTONE) {
+      ensure(btree_del(tx, &kvp));
+    } else {
+      ensure(btree_set(tx, &kvp, 0));
+    }
+    btree_val_t del = {.tree_id = schema->buffer_ids[i], .key = key};
+    ensure(btree_del(tx, &del));
+  }
+  return success();
+}
+
+result_t table_merge_buffers(txn_t *tx, table_schema_t *schema) {
+  for (size_t i = 1; i < schema->count; i++) {
+    if (!table_is_buffered(schema, i)) continue;
+    ensure(table_buffer_merge(tx, schema, i));
+  }
+  return success();
+}
+// end::table_buffer_merge[]
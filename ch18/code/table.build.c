@@ -0,0 +1,287 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gavran/db.h>
+#include <gavran/internal.h>
+
+// tag::table_build_runs[]
+typedef struct table_build_run {
+  table_index_options_t *options;
+  table_index_entry_t *entries;
+  size_t count;
+  size_t pos;  // next entry to merge
+  bool failed;
+  uint8_t padding[7];
+} table_build_run_t;
+
+static int table_build_cmp(table_index_options_t *options,
+    table_index_entry_t *x, table_index_entry_t *y) {
+  return options->type == index_type_hash
+             ? table_index_entry_cmp_order(x, y)
+             : table_index_entry_cmp_key(x, y);
+}
+
+// runs on its own thread, touching only the run and the rows
+static void *table_build_sort_run(void *arg) {
+  table_build_run_t *run = arg;
+  for (size_t i = 0; i < run->count; i++) {
+    if (flopped(run->options->extract(run->options->state,
+            &run->entries[i].row, &run->entries[i].key))) {
+      errors_clear();  // thread local, reported by the caller
+      run->failed = true;
+      return 0;
+    }
+    if (run->options->type == index_type_hash) {
+      // same bucket order as table_set_many uses
+      run->entries[i].order = table_hash_order(&run->entries[i].key);
+    }
+  }
+  qsort(run->entries, run->count, sizeof(table_index_entry_t),
+      run->options->type == index_type_hash
+          ? table_index_entry_cmp_order
+          : table_index_entry_cmp_key);
+  return 0;
+}
+
+static result_t table_build_sort_runs(table_index_options_t *options,
+    table_build_run_t *runs, size_t number_of_runs) {
+  size_t threads = MAX(1, options->threads);
+  pthread_t *handles;
+  ensure(mem_calloc((void *)&handles, threads * sizeof(pthread_t)));
+  defer(free, handles);
+  for (size_t start = 0; start < number_of_runs; start += threads) {
+    size_t wave = MIN(threads, number_of_runs - start);
+    size_t started = 0;
+    int rc         = 0;
+    for (; started < wave; started++) {
+      rc = pthread_create(&handles[started], 0, table_build_sort_run,
+          &runs[start + started]);
+      if (rc) break;
+    }
+    for (size_t i = 0; i < started; i++) {
+      pthread_join(handles[i], 0);
+    }
+    if (rc) {
+      failed(rc, msg("Unable to start a sorting thread"));
+    }
+  }
+  for (size_t i = 0; i < number_of_runs; i++) {
+    ensure(!runs[i].failed, msg("Failed to extract an index key"),
+        with(i, "%zu"));
+  }
+  return success();
+}
+// end::table_build_runs[]
+
+// tag::table_build_merge[]
+typedef struct table_build_heap {
+  table_build_run_t **runs;
+  size_t count;
+  table_index_options_t *options;
+} table_build_heap_t;
+
+static table_index_entry_t *table_build_head(table_build_run_t *run) {
+  return &run->entries[run->pos];
+}
+
+static bool table_build_less(
+    table_build_heap_t *heap, size_t a, size_t b) {
+  return table_build_cmp(heap->options,
+             table_build_head(heap->runs[a]),
+             table_build_head(heap->runs[b])) < 0;
+}
+
+static void table_build_sift_down(
+    table_build_heap_t *heap, size_t i) {
+  while (true) {
+    size_t min = i, l = i * 2 + 1, r = i * 2 + 2;
+    if (l < heap->count && table_build_less(heap, l, min)) min = l;
+    if (r < heap->count && table_build_less(heap, r, min)) min = r;
+    if (min == i) return;
+    table_build_run_t *tmp = heap->runs[i];
+    heap->runs[i]          = heap->runs[min];
+    heap->runs[min]        = tmp;
+    i                      = min;
+  }
+}
+
+static result_t table_build_merge(txn_t *tx, table_schema_t *schema,
+    table_index_options_t *options, table_build_run_t *runs,
+    size_t number_of_runs) {
+  table_build_heap_t heap = {.options = options};
+  ensure(mem_calloc((void *)&heap.runs,
+      number_of_runs * sizeof(table_build_run_t *)));
+  defer(free, heap.runs);
+  for (size_t i = 0; i < number_of_runs; i++) {
+    if (runs[i].count) heap.runs[heap.count++] = &runs[i];
+  }
+  for (size_t i = heap.count; i > 0; i--) {
+    table_build_sift_down(&heap, i - 1);
+  }
+  btree_bulk_t bulk = {
+      .tx = tx, .tree_id = schema->index_ids[schema->count]};
+  table_index_entry_t *prev = 0;
+  while (heap.count) {
+    table_build_run_t *run     = heap.runs[0];
+    table_index_entry_t *entry = table_build_head(run);
+    if (options->type == index_type_btree) {
+      // the btree sees a key and its prefixes as the same key
+      ensure(!prev || memcmp(prev->key.address, entry->key.address,
+                          MIN(prev->key.size, entry->key.size)),
+          msg("Duplicate value"), with(entry->item_id, "%lu"));
+      ensure(btree_bulk_append(&bulk, &entry->key, entry->item_id));
+      prev = entry;
+    } else {
+      ensure(table_index_add(tx, schema, schema->count, &entry->key,
+          &entry->row, entry->item_id));
+    }
+    if (++run->pos == run->count) {
+      heap.runs[0] = heap.runs[--heap.count];
+    }
+    table_build_sift_down(&heap, 0);
+  }
+  ensure(btree_bulk_finish(&bulk));
+  return success();
+}
+// end::table_build_merge[]
+
+// tag::table_add_index[]
+// the schema may point into the database, as table_get_schema returns
+// it, so the new index is added to a copy that has room for it
+static result_t table_build_copy_array(
+    void **dst, void *src, size_t size, size_t count) {
+  if (!src) return success();  // optional, and not in use
+  ensure(mem_calloc(dst, size * (count + 1)));
+  memcpy(*dst, src, size * count);
+  return success();
+}
+
+static result_t table_build_free_schema(table_schema_t *copy) {
+  free(copy->name);
+  free(copy->types);
+  free(copy->index_ids);
+  free(copy->covers);
+  free(copy->keys);
+  free(copy->buffer_ids);
+  return success();
+}
+enable_defer(table_build_free_schema);
+
+static result_t table_build_copy_schema(
+    table_schema_t *schema, table_schema_t *copy) {
+  memset(copy, 0, sizeof(table_schema_t));
+  copy->stats_id = schema->stats_id;
+  copy->count    = schema->count;
+  ensure(mem_duplicate_string(&copy->name, schema->name));
+  ensure(table_build_copy_array((void *)&copy->types, schema->types,
+      sizeof(index_type_t), schema->count));
+  ensure(table_build_copy_array((void *)&copy->index_ids,
+      schema->index_ids, sizeof(uint64_t), schema->count));
+  ensure(table_build_copy_array((void *)&copy->covers,
+      schema->covers, sizeof(table_field_t), schema->count));
+  ensure(table_build_copy_array((void *)&copy->keys, schema->keys,
+      sizeof(table_key_t), schema->count));
+  ensure(table_build_copy_array((void *)&copy->buffer_ids,
+      schema->buffer_ids, sizeof(uint64_t), schema->count));
+  return success();
+}
+
+// a transaction is never shared between threads, so the rows are
+// read by a single scan, and only the key extraction and the sort
+// of the runs are parallel
+static result_t table_build_collect_rows(txn_t *tx,
+    table_schema_t *schema, span_t **rows, uint64_t **ids,
+    size_t *count) {
+  table_scan_t scan = {.tx = tx, .schema = schema};
+  defer(table_scan_close, scan);
+  size_t capacity = 0;
+  *count          = 0;
+  do {
+    ensure(table_scan_next(&scan));
+    if (*count + scan.count > capacity) {
+      capacity = MAX(capacity * 2, *count + scan.count);
+      ensure(mem_realloc((void *)rows, capacity * sizeof(span_t)));
+      ensure(mem_realloc((void *)ids, capacity * sizeof(uint64_t)));
+    }
+    memcpy(*rows + *count, scan.rows, scan.count * sizeof(span_t));
+    memcpy(*ids + *count, scan.item_ids,
+        scan.count * sizeof(uint64_t));
+    *count += scan.count;
+  } while (scan.count);
+  return success();
+}
+
+result_t table_add_index(txn_t *tx, table_schema_t *table,
+    table_index_options_t *options) {
+  ensure(options->extract, msg("A key extractor is required"));
+  ensure(!table_is_clustered(table),
+      msg("Clustered tables do not support secondary indexes"),
+      with(table->name, "%s"));
+  table_schema_t copy;
+  ensure(table_build_copy_schema(table, &copy));
+  defer(table_build_free_schema, copy);
+  table_schema_t *schema = &copy;
+  size_t i               = schema->count;
+  switch (options->type) {
+    case index_type_btree:
+      ensure(btree_create(tx, &schema->index_ids[i]));
+      break;
+    case index_type_hash:
+      ensure(hash_create(tx, &schema->index_ids[i]));
+      break;
+    case index_type_container:
+    case index_type_clustered:
+    default:
+      failed(EINVAL, msg("Only btree and hash indexes can be added"));
+  }
+  schema->types[i] = options->type;
+  if (schema->covers) {
+    memset(&schema->covers[i], 0, sizeof(table_field_t));
+  }
+  if (schema->keys) {
+    memset(&schema->keys[i], 0, sizeof(table_key_t));
+  }
+  if (schema->buffer_ids) schema->buffer_ids[i] = 0;
+
+  // <1>
+  span_t *rows  = 0;
+  uint64_t *ids = 0;
+  defer(free, rows);
+  defer(free, ids);
+  size_t count;
+  ensure(table_build_collect_rows(tx, schema, &rows, &ids, &count));
+
+  // <2>
+  size_t run_size = MAX(1024,
+      options->bytes_per_run / sizeof(table_index_entry_t));
+  size_t number_of_runs = (count + run_size - 1) / run_size;
+  table_index_entry_t *entries;
+  ensure(mem_calloc(
+      (void *)&entries, MAX(1, count) * sizeof(table_index_entry_t)));
+  defer(free, entries);
+  table_build_run_t *runs;
+  ensure(mem_calloc((void *)&runs,
+      MAX(1, number_of_runs) * sizeof(table_build_run_t)));
+  defer(free, runs);
+  for (size_t r = 0; r < number_of_runs; r++) {
+    runs[r].options = options;
+    runs[r].entries = entries + r * run_size;
+    runs[r].count   = MIN(run_size, count - r * run_size);
+  }
+  for (size_t e = 0; e < count; e++) {
+    entries[e].row     = rows[e];
+    entries[e].item_id = ids[e];
+  }
+  ensure(table_build_sort_runs(options, runs, number_of_runs));
+
+  // <3>
+  ensure(
+      table_build_merge(tx, schema, options, runs, number_of_runs));
+  schema->count++;
+  ensure(table_schema_update(tx, schema));
+  ensure(table_stats_analyze_added(tx, schema, i));
+  ensure(table_get_schema(tx, schema->name, table));
+  return success();
+}
+// end::table_add_index[]
@@ -1,5 +1,6 @@
 #include <gavran/db.h>
 #include <gavran/internal.h>
+#include <stdlib.h>
 #include <string.h>
 
 static index_type_t root_types[2] = {
@@ -15,17 +16,31 @@ table_schema_t table_root_schema() {
 }
 
 result_t table_create_anonymous(txn_t *tx, table_schema_t *schema) {
-  ensure(schema->count > 1);
+  ensure(schema->count > 0);  // indexes may be added later
   ensure(schema->types[0] == index_type_container);
   ensure(container_create(tx, &schema->index_ids[0]));
   for (size_t i = 1; i < schema->count; i++) {
+    ensure(!table_is_buffered(schema, i) ||
+               (schema->types[i] == index_type_btree &&
+                   !table_is_covering(schema, i)),
+        msg("Only btree indexes without covers can be buffered"),
+        with(i, "%zu"));
     switch (schema->types[i]) {
       case index_type_btree:
         ensure(btree_create(tx, &schema->index_ids[i]));
+        if (table_is_buffered(schema, i)) {
+          ensure(btree_create(tx, &schema->buffer_ids[i]));
+        }
         break;
       case index_type_hash:
         ensure(hash_create(tx, &schema->index_ids[i]));
         break;
+      case index_type_clustered:
+        ensure(i == 1 && schema->count == 2,
+            msg("A clustered table has only its primary key index"),
+            with(i, "%zu"));
+        ensure(btree_create(tx, &schema->index_ids[i]));
+        break;
       case index_type_container:
         failed(EINVAL,
             msg("container must appear only as the first element"));
@@ -41,10 +56,15 @@ result_t table_drop_anonymous(txn_t *tx, table_schema_t *schema) {
   ensure(schema->types[0] == index_type_container);
 
   ensure(container_drop(tx, schema->index_ids[0]));
+  table_stats_dropped(tx, schema->index_ids[0]);
 
   for (size_t i = 1; i < schema->count; i++) {
+    if (table_is_buffered(schema, i)) {
+      ensure(btree_drop(tx, schema->buffer_ids[i]));
+    }
     switch (schema->types[i]) {
       case index_type_btree:
+      case index_type_clustered:
         ensure(btree_drop(tx, schema->index_ids[i]));
         break;
       case index_type_hash:
@@ -60,19 +80,27 @@ result_t table_drop_anonymous(txn_t *tx, table_schema_t *schema) {
   return success();
 }
 
-result_t table_create(txn_t *tx, table_schema_t *schema) {
-  ensure(table_create_anonymous(tx, schema));
-
-  size_t name_len = strlen(schema->name) + 1;
-  size_t size =
-      name_len + sizeof(uint16_t) +
+static result_t table_schema_encode(
+    table_schema_t *schema, span_t *row) {
+  size_t name_len   = strlen(schema->name) + 1;
+  size_t buffers_len =
+      schema->buffer_ids ? schema->count * sizeof(uint64_t) : 0;
+  // each block is written when any of the ones after it is
+  size_t stats_len =
+      schema->stats_id || buffers_len ? sizeof(uint64_t) : 0;
+  size_t keys_len = schema->keys || stats_len
+                         ? schema->count * sizeof(table_key_t)
+                         : 0;
+  // the keys follow the covers, which are written for them as well
+  size_t covers_len = schema->covers || keys_len
+                          ? schema->count * sizeof(table_field_t)
+                          : 0;
+  size_t indexes_len =
       schema->count * (sizeof(index_type_t) + sizeof(uint64_t));
-  void *buffer;
-  ensure(mem_calloc(&buffer, size));
-  defer(free, buffer);
-  span_t entries[2] = {{.address = buffer, .size = size},
-      {.address = schema->name, .size = name_len}};
-  void *cur         = buffer;
+  row->size = sizeof(uint16_t) + indexes_len + name_len + covers_len +
+              keys_len + stats_len + buffers_len;
+  ensure(mem_calloc(&row->address, row->size));
+  void *cur = row->address;
   memcpy(cur, &schema->count, sizeof(uint16_t));
   cur += sizeof(uint16_t);
   memcpy(cur, schema->types, sizeof(index_type_t) * schema->count);
@@ -80,6 +108,25 @@ result_t table_create(txn_t *tx, table_schema_t *schema) {
   memcpy(cur, schema->index_ids, sizeof(uint64_t) * schema->count);
   cur += sizeof(uint64_t) * schema->count;
   memcpy(cur, schema->name, name_len);
+  cur += name_len;
+  if (schema->covers) memcpy(cur, schema->covers, covers_len);
+  cur += covers_len;
+  if (schema->keys) memcpy(cur, schema->keys, keys_len);
+  cur += keys_len;
+  if (stats_len) memcpy(cur, &schema->stats_id, stats_len);
+  cur += stats_len;
+  if (buffers_len) memcpy(cur, schema->buffer_ids, buffers_len);
+  return success();
+}
+
+result_t table_create(txn_t *tx, table_schema_t *schema) {
+  ensure(table_create_anonymous(tx, schema));
+  ensure(table_stats_create(tx, schema));
+
+  span_t entries[2] = {{0},
+      {.address = schema->name, .size = strlen(schema->name) + 1}};
+  ensure(table_schema_encode(schema, &entries[0]));
+  defer(free, entries[0].address);
 
   table_schema_t root = table_root_schema();
   table_item_t item   = {
@@ -89,6 +136,30 @@ result_t table_create(txn_t *tx, table_schema_t *schema) {
   return success();
 }
 
+implementation_detail result_t table_schema_update(
+    txn_t *tx, table_schema_t *schema) {
+  table_schema_t root = table_root_schema();
+  span_t name         = {
+      .address = schema->name, .size = strlen(schema->name) + 1};
+  btree_val_t kvp = {.key = name, .tree_id = root.index_ids[1]};
+  ensure(btree_get(tx, &kvp));
+  ensure(kvp.has_val, msg("No such table"), with(schema->name, "%s"));
+  container_item_t old = {
+      .container_id = root.index_ids[0], .item_id = kvp.val};
+  ensure(container_item_get(tx, &old));
+
+  span_t old_entries[2] = {old.data, name};
+  span_t entries[2]     = {{0}, name};
+  ensure(table_schema_encode(schema, &entries[0]));
+  defer(free, entries[0].address);
+  table_item_t item = {.schema = &root,
+      .item_id                 = kvp.val,
+      .entries                 = entries,
+      .number_of_entries       = 2};
+  ensure(table_update(tx, &item, old_entries));
+  return success();
+}
+
 result_t table_get_schema(
     txn_t *tx, char *table_name, table_schema_t *schema) {
   table_schema_t root = table_root_schema();
@@ -107,6 +178,22 @@ result_t table_get_schema(
   schema->types     = item.data.address + sizeof(uint16_t);
   schema->index_ids = item.data.address + sizeof(uint16_t) +
                       (sizeof(index_type_t) * schema->count);
+  schema->name      = (char *)(schema->index_ids + schema->count);
+  void *covers      = schema->name + strlen(schema->name) + 1;
+  void *keys        = covers + schema->count * sizeof(table_field_t);
+  void *end         = item.data.address + item.data.size;
+  schema->covers    = keys <= end ? covers : 0;
+  void *stats_id    = keys + schema->count * sizeof(table_key_t);
+  schema->keys      = stats_id <= end ? keys : 0;
+  void *buffer_ids  = stats_id + sizeof(uint64_t);
+  schema->stats_id  = 0;
+  if (buffer_ids <= end) {
+    memcpy(&schema->stats_id, stats_id, sizeof(uint64_t));
+  }
+  schema->buffer_ids = 0;
+  if (buffer_ids + schema->count * sizeof(uint64_t) <= end) {
+    schema->buffer_ids = buffer_ids;
+  }
   return success();
 }
 
@@ -180,64 +267,315 @@ static result_t table_ensure_item(table_item_t *item) {
   return success();
 }
 
+static bool table_entry_changed(span_t *a, span_t *b) {
+  return a->size != b->size ||
+         memcmp(a->address, b->address, a->size) != 0;
+}
+
+// tag::table_hash_ref[]
+#define TABLE_HASH_REF_MAX_SIZE                                  \
+  (10 /*item_id*/ + 3 /* entry_size*/ + 512 /*entry_bytes*/ + \
+      10 /*next_id*/)
+
+static size_t table_hash_ref_encode(
+    uint8_t *buffer, uint64_t item_id, span_t *key, uint64_t next) {
+  uint8_t *end =
+      varint_encode(key->size, varint_encode(item_id, buffer));
+  memcpy(end, key->address, key->size);
+  end = varint_encode(next, end + key->size);
+  return (size_t)(end - buffer);
+}
+
+implementation_detail void table_hash_ref_decode(
+    span_t *ref, uint64_t *item_id, span_t *key, uint64_t *next) {
+  uint64_t header[2];  // the item id and the key size
+  uint8_t *cur = ref->address;
+  varint_decode_many(&cur, ref->address + ref->size, header, 2);
+  key->address = cur;
+  *item_id     = header[0];
+  key->size = header[1];
+  *next     = 0;
+  if (key->address + key->size != ref->address + ref->size) {
+    varint_decode(key->address + key->size, next);
+  }
+}
+// end::table_hash_ref[]
+
+// tag::table_hash_index_add[]
+static result_t table_hash_index_add(txn_t *tx,
+    table_schema_t *schema, size_t i, span_t *key, uint64_t item_id) {
+  ensure(key->size < 512);
+  table_scan_refs_changed(tx, schema->index_ids[0]);
+  hash_val_t get = {.hash_id = schema->index_ids[i],
+      .key                   = table_compute_hash_for(key)};
+  ensure(hash_get(tx, &get));
+  uint8_t buffer[TABLE_HASH_REF_MAX_SIZE];
+  container_item_t ref = {.container_id = schema->index_ids[0],
+      .data                             = {.address = buffer,
+          .size = table_hash_ref_encode(
+              buffer, item_id, key, get.has_val ? get.val : 0)}};
+  ensure(container_item_put(tx, &ref));
+  get.val = ref.item_id;
+  ensure(hash_set(tx, &get, 0));
+  return success();
+}
+// end::table_hash_index_add[]
+
+// tag::table_hash_index_remove[]
+static result_t table_hash_relink(txn_t *tx, table_schema_t *schema,
+    size_t i, span_t *key, uint64_t *chain, size_t count,
+    uint64_t next) {
+  while (count--) {  // point the previous ref past the removed one
+    container_item_t ref = {.container_id = schema->index_ids[0],
+        .item_id                          = chain[count]};
+    ensure(container_item_get(tx, &ref));
+    uint64_t ref_item_id, ignored;
+    span_t ref_key;
+    table_hash_ref_decode(
+        &ref.data, &ref_item_id, &ref_key, &ignored);
+    uint8_t buffer[TABLE_HASH_REF_MAX_SIZE];
+    ref.data.size =
+        table_hash_ref_encode(buffer, ref_item_id, &ref_key, next);
+    ref.data.address = buffer;
+    bool in_place;
+    ensure(container_item_update(tx, &ref, &in_place));
+    if (ref.item_id == chain[count]) return success();
+    next = ref.item_id;  // moved, so its own parent must be updated
+  }
+  hash_val_t head = {.hash_id = schema->index_ids[i],
+      .key = table_compute_hash_for(key), .val = next};
+  if (next) {
+    ensure(hash_set(tx, &head, 0));
+  } else {
+    ensure(hash_del(tx, &head));
+  }
+  return success();
+}
+
+static result_t table_hash_index_remove(txn_t *tx,
+    table_schema_t *schema, size_t i, span_t *key, uint64_t item_id) {
+  table_scan_refs_changed(tx, schema->index_ids[0]);
+  hash_val_t get = {.hash_id = schema->index_ids[i],
+      .key                   = table_compute_hash_for(key)};
+  ensure(hash_get(tx, &get));
+  uint64_t *chain = 0;
+  defer(free, chain);
+  size_t count = 0;
+  uint64_t cur = get.has_val ? get.val : 0;
+  while (cur) {
+    container_item_t ref = {
+        .container_id = schema->index_ids[0], .item_id = cur};
+    ensure(container_item_get(tx, &ref));
+    uint64_t ref_item_id, next;
+    span_t ref_key;
+    table_hash_ref_decode(&ref.data, &ref_item_id, &ref_key, &next);
+    if (ref_item_id == item_id) {
+      ensure(container_item_del(tx, &ref));
+      ensure(
+          table_hash_relink(tx, schema, i, key, chain, count, next));
+      return success();
+    }
+    ensure(
+        mem_realloc((void *)&chain, (count + 1) * sizeof(uint64_t)));
+    chain[count++] = cur;
+    cur            = next;
+  }
+  return success();  // not found, nothing to do
+}
+// end::table_hash_index_remove[]
+
+// tag::table_hash_index_collect[]
+implementation_detail result_t table_hash_index_collect(txn_t *tx,
+    table_schema_t *schema, size_t i, span_t *key,
+    uint64_t **item_ids, size_t *count) {
+  hash_val_t get = {.hash_id = schema->index_ids[i],
+      .key                   = table_compute_hash_for(key)};
+  ensure(hash_get(tx, &get));
+  uint64_t cur = get.has_val ? get.val : 0;
+  while (cur) {  // the chain holds every key sharing the hash
+    container_item_t ref = {
+        .container_id = schema->index_ids[0], .item_id = cur};
+    ensure(container_item_get(tx, &ref));
+    uint64_t ref_item_id;
+    span_t ref_key;
+    table_hash_ref_decode(&ref.data, &ref_item_id, &ref_key, &cur);
+    if (table_entry_changed(key, &ref_key)) continue;
+    if ((*count & (*count - 1)) == 0) {
+      size_t size = *count ? *count * 2 : 8;
+      ensure(mem_realloc((void *)item_ids, size * sizeof(uint64_t)));
+    }
+    (*item_ids)[(*count)++] = ref_item_id;
+  }
+  return success();
+}
+// end::table_hash_index_collect[]
+
+// tag::table_covering[]
+implementation_detail bool table_is_covering(
+    table_schema_t *schema, size_t i) {
+  return schema->covers && schema->covers[i].size &&
+         schema->types[i] == index_type_btree;
+}
+
+// A covering index stores the key followed by the covered bytes.
+// Zeros in the key are escaped as 0x00 0xFF and the key ends with
+// 0x00 0x00, so no key is a prefix of another and the order is kept.
+// The encoded key alone (row == 0) finds the stored entry.
+implementation_detail result_t table_index_key(
+    table_schema_t *schema, size_t i, span_t *key, span_t *row,
+    uint8_t *buffer, span_t *out) {
+  if (!table_is_covering(schema, i)) {
+    *out = *key;
+    return success();
+  }
+  table_field_t *field = &schema->covers[i];
+  ensure(key->size * 2 + 2 + field->size <=
+             TABLE_COVERING_KEY_MAX_SIZE,
+      msg("Key is too large for a covering index"),
+      with(key->size, "%zu"), with(field->size, "%d"));
+  uint8_t *cur = table_key_append_string(buffer, key);
+  if (row) {
+    ensure(row->size >= (size_t)field->offset + field->size,
+        msg("Row is too small for the covered field"),
+        with(row->size, "%zu"), with(i, "%zu"));
+    memcpy(cur, row->address + field->offset, field->size);
+    cur += field->size;
+  }
+  out->address = buffer;
+  out->size    = (size_t)(cur - buffer);
+  return success();
+}
+
+static bool table_index_changed(table_schema_t *schema, size_t i,
+    span_t *entries, span_t *old_entries) {
+  if (table_entry_changed(&entries[i], &old_entries[i])) return true;
+  if (!table_is_covering(schema, i)) return false;
+  table_field_t *field = &schema->covers[i];
+  size_t required      = (size_t)field->offset + field->size;
+  if (entries[0].size < required || old_entries[0].size < required)
+    return true;
+  return memcmp(entries[0].address + field->offset,
+             old_entries[0].address + field->offset,
+             field->size) != 0;
+}
+// end::table_covering[]
+
+// tag::table_index_add_remove[]
+implementation_detail result_t table_index_add(txn_t *tx,
+    table_schema_t *schema, size_t i, span_t *key, span_t *row,
+    uint64_t item_id) {
+  switch (schema->types[i]) {
+    case index_type_btree: {
+      uint8_t buffer[TABLE_COVERING_KEY_MAX_SIZE];
+      btree_val_t set = {
+          .tree_id = schema->index_ids[i], .val = item_id};
+      ensure(table_index_key(schema, i, key, row, buffer, &set.key));
+      if (table_is_buffered(schema, i)) {
+        // the leaf is only read here, the write is buffered
+        btree_val_t get = {.key = set.key};
+        ensure(table_buffer_get(tx, schema, i, &get));
+        ensure(get.has_val == false || get.val == item_id,
+            msg("Duplicate value"));
+        ensure(table_buffer_put(tx, schema, i, &set.key, item_id));
+        return success();
+      }
+      if (table_is_covering(schema, i)) {
+        // an update in place would keep the old covered bytes
+        btree_val_t get = {.tree_id = set.tree_id,
+            .key = {.address = buffer,
+                .size = set.key.size - schema->covers[i].size}};
+        ensure(btree_get(tx, &get));
+        ensure(get.has_val == false || get.val == item_id,
+            msg("Duplicate value"));
+        if (get.has_val) ensure(btree_del(tx, &get));
+      }
+      btree_val_t old = {0};
+      ensure(btree_set(tx, &set, &old));
+      ensure(old.has_val == false || old.val == item_id,
+          msg("Duplicate value"));
+      return success();
+    }
+    case index_type_hash:
+      return table_hash_index_add(tx, schema, i, key, item_id);
+    case index_type_container:
+    case index_type_clustered:
+      failed(EINVAL,
+          msg("container must appear only as the first element"));
+    default:
+      failed(EINVAL, msg("Uknown index type"));
+  }
+}
+
+static result_t table_index_remove(txn_t *tx, table_schema_t *schema,
+    size_t i, span_t *key, uint64_t item_id) {
+  switch (schema->types[i]) {
+    case index_type_btree: {
+      uint8_t buffer[TABLE_COVERING_KEY_MAX_SIZE];
+      btree_val_t del = {.tree_id = schema->index_ids[i]};
+      ensure(table_index_key(schema, i, key, 0, buffer, &del.key));
+      if (table_is_buffered(schema, i)) {
+        ensure(table_buffer_remove(tx, schema, i, &del.key));
+        return success();
+      }
+      ensure(btree_del(tx, &del));
+      return success();
+    }
+    case index_type_hash:
+      return table_hash_index_remove(tx, schema, i, key, item_id);
+    case index_type_container:
+    case index_type_clustered:
+      failed(EINVAL,
+          msg("container must appear only as the first element"));
+    default:
+      failed(EINVAL, msg("Uknown index type"));
+  }
+}
+// end::table_index_add_remove[]
+
 result_t table_set(txn_t *tx, table_item_t *item) {
+  counted_op(tx->state->db, db_op_table_set);
   ensure(table_ensure_item(item));
+  span_t *entries = item->entries;
+  void *keys      = 0;
+  defer(free, keys);
+  ensure(table_key_derive(item->schema, &entries, &keys));
+  table_item_t derived = *item;
+  derived.entries      = entries;
+  if (table_is_clustered(item->schema)) {
+    ensure(table_clustered_set(tx, &derived));
+    item->item_id = derived.item_id;
+    ensure(table_stats_record(tx, item->schema, &derived, 1, 1));
+    return success();
+  }
 
   container_item_t c_item = {
       .container_id = item->schema->index_ids[0],
-      .data         = item->entries[0]};
+      .data         = entries[0]};
   ensure(container_item_put(tx, &c_item));
+  item->item_id = c_item.item_id;
 
   for (size_t i = 1; i < item->number_of_entries; i++) {
-    switch (item->schema->types[i]) {
-      case index_type_btree: {
-        btree_val_t set = {
-            .key     = item->entries[i],
-            .tree_id = item->schema->index_ids[i],
-            .val     = c_item.item_id,
-        };
-        btree_val_t old = {0};
-        ensure(btree_set(tx, &set, &old));
-        ensure(old.has_val == false, msg("Duplicate value"));
-        break;
-      }
-      case index_type_hash: {
-        ensure(item->entries[i].size < 512);
-        uint8_t buffer[10 /*item_id*/ + 3 /* entry_size*/ +
-                       512 /*entry_bytes*/ +
-                       10 /*next_id*/];  // max size of entry
-        uint8_t *end = varint_encode(item->entries[i].size,
-            varint_encode(c_item.item_id, buffer));
-        memcpy(end, item->entries[i].address, item->entries[i].size);
-        end += item->entries[i].size;
-
-        hash_val_t get = {.hash_id = item->schema->index_ids[i],
-            .key = table_compute_hash_for(&item->entries[i])};
-        ensure(hash_get(tx, &get));
-        end = varint_encode(get.has_val ? get.val : 0, end);
-        container_item_t ref = {
-            .container_id = item->schema->index_ids[0],
-            .data         = {
-                .address = buffer, .size = (size_t)(end - buffer)}};
-        ensure(container_item_put(tx, &ref));
-        hash_val_t set = {
-            .key = table_compute_hash_for(&item->entries[i]),
-            .val = ref.item_id};
-        ensure(hash_set(tx, &set, 0));
-        break;
-      }
-      case index_type_container:
-        failed(EINVAL,
-            msg("container must appear only as the first element"));
-      default:
-        failed(EINVAL, msg("Uknown index type"));
-    }
+    ensure(table_index_add(tx, item->schema, i, &entries[i],
+        &entries[0], c_item.item_id));
   }
+  ensure(table_stats_record(tx, item->schema, &derived, 1, 1));
   return success();
 }
 
 result_t table_del(txn_t *tx, table_item_t *item) {
+  counted_op(tx->state->db, db_op_table_del);
   ensure(table_ensure_item(item));
+  span_t *entries = item->entries;
+  void *keys      = 0;
+  defer(free, keys);
+  ensure(table_key_derive(item->schema, &entries, &keys));
+  if (table_is_clustered(item->schema)) {
+    table_item_t derived = *item;
+    derived.entries      = entries;
+    ensure(table_clustered_del(tx, &derived));
+    ensure(table_stats_record(tx, item->schema, 0, 0, -1));
+    return success();
+  }
 
   container_item_t c_item = {
       .container_id = item->schema->index_ids[0],
@@ -245,32 +583,241 @@ result_t table_del(txn_t *tx, table_item_t *item) {
   ensure(container_item_del(tx, &c_item));
 
   for (size_t i = 1; i < item->number_of_entries; i++) {
-    switch (item->schema->types[i]) {
-      case index_type_btree: {
-        btree_val_t del = {
-            .key     = item->entries[i],
-            .tree_id = item->schema->index_ids[i],
-        };
-        ensure(btree_del(tx, &del));
-        break;
-      }
-      case index_type_hash: {
-        hash_val_t del = {
-            .key = table_compute_hash_for(&item->entries[i])};
-        ensure(hash_del(tx, &del));
-        break;
+    ensure(table_index_remove(
+        tx, item->schema, i, &entries[i], item->item_id));
+  }
+  // the sketches only grow, table_analyze forgets removed keys
+  ensure(table_stats_record(tx, item->schema, 0, 0, -1));
+  return success();
+}
+
+// tag::table_set_many[]
+static uint64_t table_reverse_bits(uint64_t x) {
+  x = ((x >> 1) & 0x5555555555555555UL) |
+      ((x & 0x5555555555555555UL) << 1);
+  x = ((x >> 2) & 0x3333333333333333UL) |
+      ((x & 0x3333333333333333UL) << 2);
+  x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FUL) |
+      ((x & 0x0F0F0F0F0F0F0F0FUL) << 4);
+  return __builtin_bswap64(x);
+}
+
+implementation_detail uint64_t table_hash_key(span_t *key) {
+  return hash_permute_key(table_compute_hash_for(key));
+}
+
+implementation_detail uint64_t table_hash_order(span_t *key) {
+  // hash buckets are selected by the low bits of the permuted
+  // key, reversing them makes entries sharing a bucket adjacent
+  return table_reverse_bits(table_hash_key(key));
+}
+
+implementation_detail int table_index_entry_cmp_key(
+    const void *a, const void *b) {
+  const table_index_entry_t *x = a;
+  const table_index_entry_t *y = b;
+  int rc = memcmp(x->key.address, y->key.address,
+      MIN(x->key.size, y->key.size));
+  if (rc) return rc;
+  return (x->key.size > y->key.size) - (x->key.size < y->key.size);
+}
+
+implementation_detail int table_index_entry_cmp_order(
+    const void *a, const void *b) {
+  const table_index_entry_t *x = a;
+  const table_index_entry_t *y = b;
+  return (x->order > y->order) - (x->order < y->order);
+}
+
+static result_t table_set_many_index(txn_t *tx,
+    table_schema_t *schema, size_t i, table_item_t *rows,
+    size_t number_of_rows, table_index_entry_t *entries) {
+  bool is_hash = schema->types[i] == index_type_hash;
+  for (size_t r = 0; r < number_of_rows; r++) {
+    entries[r].key     = rows[r].entries[i];
+    entries[r].row     = rows[r].entries[0];
+    entries[r].item_id = rows[r].item_id;
+    if (!is_hash) continue;
+    entries[r].order = table_hash_order(&rows[r].entries[i]);
+  }
+  qsort(entries, number_of_rows, sizeof(table_index_entry_t),
+      is_hash ? table_index_entry_cmp_order
+              : table_index_entry_cmp_key);
+  for (size_t r = 0; r < number_of_rows; r++) {
+    ensure(table_index_add(tx, schema, i, &entries[r].key,
+        &entries[r].row, entries[r].item_id));
+  }
+  return success();
+}
+
+static result_t table_set_many_clustered(
+    txn_t *tx, table_item_t *rows, size_t number_of_rows) {
+  table_index_entry_t *entries;
+  ensure(mem_calloc((void *)&entries,
+      sizeof(table_index_entry_t) * number_of_rows));
+  defer(free, entries);
+  for (size_t r = 0; r < number_of_rows; r++) {
+    entries[r].key   = rows[r].entries[1];
+    entries[r].order = r;
+  }
+  // appending in key order keeps touching the same leaf
+  qsort(entries, number_of_rows, sizeof(table_index_entry_t),
+      table_index_entry_cmp_key);
+  for (size_t r = 0; r < number_of_rows; r++) {
+    ensure(table_clustered_set(tx, &rows[entries[r].order]),
+        with(entries[r].order, "%zu"));
+  }
+  return success();
+}
+
+static result_t table_set_many_rows(txn_t *tx,
+    table_schema_t *schema, table_item_t *rows,
+    size_t number_of_rows) {
+  if (table_is_clustered(schema)) {
+    for (size_t r = 0; r < number_of_rows; r++) {
+      rows[r].schema = schema;
+      ensure(table_ensure_item(&rows[r]), with(r, "%zu"));
+    }
+    ensure(table_set_many_clustered(tx, rows, number_of_rows));
+    ensure(table_stats_record(tx, schema, rows, number_of_rows,
+        (int64_t)number_of_rows));
+    return success();
+  }
+  container_item_t *items;
+  ensure(mem_calloc(
+      (void *)&items, sizeof(container_item_t) * number_of_rows));
+  defer(free, items);
+  for (size_t r = 0; r < number_of_rows; r++) {
+    rows[r].schema = schema;
+    ensure(table_ensure_item(&rows[r]), with(r, "%zu"));
+    items[r].container_id = schema->index_ids[0];
+    items[r].data         = rows[r].entries[0];
+  }
+  // <1>
+  ensure(container_item_put_many(tx, items, number_of_rows));
+  for (size_t r = 0; r < number_of_rows; r++) {
+    rows[r].item_id = items[r].item_id;
+  }
+  // <2>
+  table_index_entry_t *entries;
+  ensure(mem_calloc((void *)&entries,
+      sizeof(table_index_entry_t) * number_of_rows));
+  defer(free, entries);
+  for (size_t i = 1; i < schema->count; i++) {
+    ensure(table_set_many_index(
+        tx, schema, i, rows, number_of_rows, entries));
+  }
+  ensure(table_stats_record(
+      tx, schema, rows, number_of_rows, (int64_t)number_of_rows));
+  return success();
+}
+
+result_t table_set_many(txn_t *tx, table_schema_t *schema,
+    table_item_t *rows, size_t number_of_rows) {
+  if (!number_of_rows) return success();
+  table_item_t *derived = 0;
+  defer(free, derived);
+  ensure(table_key_derive_many(
+      schema, rows, number_of_rows, &derived));
+  if (!derived)
+    return table_set_many_rows(tx, schema, rows, number_of_rows);
+  ensure(table_set_many_rows(tx, schema, derived, number_of_rows));
+  for (size_t r = 0; r < number_of_rows; r++) {
+    rows[r].schema  = schema;
+    rows[r].item_id = derived[r].item_id;
+  }
+  return success();
+}
+// end::table_set_many[]
+
+// tag::table_update[]
+static result_t table_update_ensure_unique(
+    txn_t *tx, table_item_t *item, span_t *old_entries) {
+  for (size_t i = 1; i < item->number_of_entries; i++) {
+    if (item->schema->types[i] != index_type_btree ||
+        !table_entry_changed(&item->entries[i], &old_entries[i]))
+      continue;
+    uint8_t buffer[TABLE_COVERING_KEY_MAX_SIZE];
+    btree_val_t get = {.tree_id = item->schema->index_ids[i]};
+    ensure(table_index_key(
+        item->schema, i, &item->entries[i], 0, buffer, &get.key));
+    if (table_is_buffered(item->schema, i)) {
+      ensure(table_buffer_get(tx, item->schema, i, &get));
+    } else {
+      ensure(btree_get(tx, &get));
+    }
+    ensure(get.has_val == false || get.val == item->item_id,
+        msg("Duplicate value"), with(i, "%zu"));
+  }
+  return success();
+}
+
+static result_t table_update_entries(
+    txn_t *tx, table_item_t *item, span_t *old_entries) {
+  if (table_is_clustered(item->schema))
+    return table_clustered_update(tx, item, old_entries);
+  // <1>
+  ensure(table_update_ensure_unique(tx, item, old_entries));
+  uint64_t old_item_id = item->item_id;
+  // <2>
+  if (table_entry_changed(&item->entries[0], &old_entries[0])) {
+    container_item_t c_item = {
+        .container_id = item->schema->index_ids[0],
+        .item_id      = item->item_id,
+        .data         = item->entries[0]};
+    bool in_place;
+    ensure(container_item_update(tx, &c_item, &in_place));
+    item->item_id = c_item.item_id;
+  }
+  bool moved = old_item_id != item->item_id;
+  for (size_t i = 1; i < item->number_of_entries; i++) {
+    bool changed = table_index_changed(
+        item->schema, i, item->entries, old_entries);
+    // <3>
+    if (!changed && !moved) continue;
+    if (!changed && item->schema->types[i] == index_type_btree) {
+      // same key, just point it to the new location
+      uint8_t buffer[TABLE_COVERING_KEY_MAX_SIZE];
+      btree_val_t set = {.tree_id = item->schema->index_ids[i],
+          .val                    = item->item_id};
+      ensure(table_index_key(item->schema, i, &item->entries[i],
+          &item->entries[0], buffer, &set.key));
+      if (table_is_buffered(item->schema, i)) {
+        ensure(table_buffer_put(
+            tx, item->schema, i, &set.key, item->item_id));
+        continue;
       }
-      case index_type_container:
-        failed(EINVAL,
-            msg("container must appear only as the first element"));
-      default:
-        failed(EINVAL, msg("Uknown index type"));
+      ensure(btree_set(tx, &set, 0));
+      continue;
     }
+    // <4>
+    ensure(table_index_remove(
+        tx, item->schema, i, &old_entries[i], old_item_id));
+    ensure(table_index_add(tx, item->schema, i, &item->entries[i],
+        &item->entries[0], item->item_id));
   }
   return success();
 }
 
+result_t table_update(
+    txn_t *tx, table_item_t *item, span_t *old_entries) {
+  counted_op(tx->state->db, db_op_table_update);
+  ensure(table_ensure_item(item));
+  table_item_t derived = *item;
+  void *keys = 0, *old_keys = 0;
+  defer(free, keys);
+  defer(free, old_keys);
+  ensure(table_key_derive(item->schema, &derived.entries, &keys));
+  ensure(table_key_derive(item->schema, &old_entries, &old_keys));
+  ensure(table_update_entries(tx, &derived, old_entries));
+  item->item_id = derived.item_id;
+  ensure(table_stats_record(tx, item->schema, &derived, 1, 0));
+  return success();
+}
+// end::table_update[]
+
 result_t table_get(txn_t *tx, table_item_t *item) {
+  counted_op(tx->state->db, db_op_table_get);
   ensure(table_ensure_item(item));
   switch (item->schema->types[item->index_to_use]) {
     case index_type_container:
@@ -278,15 +825,22 @@ result_t table_get(txn_t *tx, table_item_t *item) {
       container_item_t ci = {
           .container_id = item->schema->index_ids[0],
           .item_id      = item->item_id};
-      ensure(container_item_get(tx, &ci));
+      ensure(db_row_cache_get(tx, &ci));
       item->result = ci.data;
       return success();
     }
     case index_type_btree: {
+      uint8_t buffer[TABLE_COVERING_KEY_MAX_SIZE];
       btree_val_t kvp = {
-          .tree_id = item->schema->index_ids[item->index_to_use],
-          .key     = item->entries[0]};
-      ensure(btree_get(tx, &kvp));
+          .tree_id = item->schema->index_ids[item->index_to_use]};
+      ensure(table_index_key(item->schema, item->index_to_use,
+          item->entries, 0, buffer, &kvp.key));
+      if (table_is_buffered(item->schema, item->index_to_use)) {
+        ensure(table_buffer_get(
+            tx, item->schema, item->index_to_use, &kvp));
+      } else {
+        ensure(btree_get(tx, &kvp));
+      }
       if (kvp.has_val == false) goto no_entry_found;
       item->item_id = kvp.val;
       goto get_from_container;
@@ -300,7 +854,7 @@ result_t table_get(txn_t *tx, table_item_t *item) {
         if (get.has_val == false) goto no_entry_found;
         container_item_t ref = {.item_id = get.val,
             .container_id = item->schema->index_ids[0]};
-        ensure(container_item_get(tx, &ref));
+        ensure(db_row_cache_get(tx, &ref));
         item->result.address = varint_decode(
             varint_decode(ref.data.address, &item->item_id),
             &item->result.size);
@@ -318,10 +872,41 @@ result_t table_get(txn_t *tx, table_item_t *item) {
         }
       }
     }
+    case index_type_clustered:
+      return table_clustered_get(tx, item);
     default:
       failed(EINVAL, msg("Uknown index type"));
   }
 no_entry_found:
   memset(&item->result, 0, sizeof(span_t));
   return success();
-}
\ No newline at end of file
+}
+
+// tag::table_get_covered[]
+result_t table_get_covered(txn_t *tx, table_item_t *item) {
+  ensure(table_ensure_item(item));
+  ensure(table_is_covering(item->schema, item->index_to_use),
+      msg("Index does not cover any fields"),
+      with(item->index_to_use, "%d"));
+  uint8_t buffer[TABLE_COVERING_KEY_MAX_SIZE];
+  span_t prefix;
+  ensure(table_index_key(item->schema, item->index_to_use,
+      item->entries, 0, buffer, &prefix));
+  btree_cursor_t it = {.tx = tx,
+      .tree_id = item->schema->index_ids[item->index_to_use],
+      .key     = prefix};
+  defer(btree_free_cursor, it);
+  ensure(btree_cursor_search(&it));
+  ensure(btree_get_next(&it));
+  memset(&item->result, 0, sizeof(span_t));
+  if (it.has_val == false || it.key.size < prefix.size ||
+      memcmp(it.key.address, prefix.address, prefix.size)) {
+    return success();  // no such key
+  }
+  // answered from the index page, the row is never read
+  item->item_id        = it.val;
+  item->result.address = it.key.address + prefix.size;
+  item->result.size    = it.key.size - prefix.size;
+  return success();
+}
+// end::table_get_covered[]
@@ -0,0 +1,120 @@
+#include <string.h>
+
+#include <gavran/db.h>
+#include <gavran/internal.h>
+
+// tag::table_clustered[]
+// set on the primary key entry when the row lives in the container
+#define TABLE_CLUSTERED_OVERFLOW (1)
+
+implementation_detail bool table_is_clustered(
+    table_schema_t *schema) {
+  return schema->count > 1 &&
+         schema->types[1] == index_type_clustered;
+}
+
+implementation_detail result_t table_clustered_row(txn_t *tx,
+    table_schema_t *schema, btree_val_t *kvp, uint64_t *item_id,
+    span_t *row) {
+  if (!(kvp->flags & TABLE_CLUSTERED_OVERFLOW)) {
+    *item_id = 0;  // the row is in the leaf, no container item
+    *row     = kvp->data;
+    return success();
+  }
+  container_item_t item = {
+      .container_id = schema->index_ids[0], .item_id = kvp->val};
+  ensure(container_item_get(tx, &item));
+  *item_id = kvp->val;
+  *row     = item.data;
+  return success();
+}
+
+static result_t table_clustered_put(txn_t *tx, table_item_t *item) {
+  table_schema_t *schema = item->schema;
+  span_t *row            = &item->entries[0];
+  btree_val_t set = {
+      .tree_id = schema->index_ids[1], .key = item->entries[1]};
+  item->item_id = 0;
+  if (row->size <= btree_inline_max_size(tx)) {
+    set.data.size = row->size;
+    // an empty row still needs an address to be stored inline
+    set.data.address = row->size ? row->address : set.key.address;
+  } else {
+    container_item_t overflow = {
+        .container_id = schema->index_ids[0], .data = *row};
+    ensure(container_item_put(tx, &overflow));
+    item->item_id = set.val = overflow.item_id;
+    set.flags               = TABLE_CLUSTERED_OVERFLOW;
+  }
+  btree_val_t old = {0};
+  ensure(btree_set(tx, &set, &old));
+  if (old.has_val && (old.flags & TABLE_CLUSTERED_OVERFLOW)) {
+    container_item_t prev = {
+        .container_id = schema->index_ids[0], .item_id = old.val};
+    ensure(container_item_del(tx, &prev));
+  }
+  return success();
+}
+
+static result_t table_clustered_remove(
+    txn_t *tx, table_schema_t *schema, span_t *key) {
+  btree_val_t del = {.tree_id = schema->index_ids[1], .key = *key};
+  ensure(btree_del(tx, &del));
+  if (del.has_val && (del.flags & TABLE_CLUSTERED_OVERFLOW)) {
+    container_item_t prev = {
+        .container_id = schema->index_ids[0], .item_id = del.val};
+    ensure(container_item_del(tx, &prev));
+  }
+  return success();
+}
+
+static result_t table_clustered_ensure_unique(
+    txn_t *tx, table_item_t *item) {
+  btree_val_t get = {
+      .tree_id = item->schema->index_ids[1], .key = item->entries[1]};
+  ensure(btree_get(tx, &get));
+  ensure(get.has_val == false, msg("Duplicate value"),
+      with(item->entries[1].size, "%zu"));
+  return success();
+}
+
+implementation_detail result_t table_clustered_set(
+    txn_t *tx, table_item_t *item) {
+  ensure(table_clustered_ensure_unique(tx, item));
+  ensure(table_clustered_put(tx, item));
+  return success();
+}
+
+implementation_detail result_t table_clustered_del(
+    txn_t *tx, table_item_t *item) {
+  ensure(table_clustered_remove(tx, item->schema, &item->entries[1]));
+  return success();
+}
+
+implementation_detail result_t table_clustered_update(
+    txn_t *tx, table_item_t *item, span_t *old_entries) {
+  span_t *key = &item->entries[1];
+  if (key->size != old_entries[1].size ||
+      memcmp(key->address, old_entries[1].address, key->size)) {
+    // the row moves to its new place in the tree
+    ensure(table_clustered_ensure_unique(tx, item));
+    ensure(table_clustered_remove(tx, item->schema, &old_entries[1]));
+  }
+  ensure(table_clustered_put(tx, item));
+  return success();
+}
+
+implementation_detail result_t table_clustered_get(
+    txn_t *tx, table_item_t *item) {
+  btree_val_t kvp = {
+      .tree_id = item->schema->index_ids[1], .key = item->entries[0]};
+  ensure(btree_get(tx, &kvp));
+  if (kvp.has_val == false) {
+    memset(&item->result, 0, sizeof(span_t));
+    return success();
+  }
+  ensure(table_clustered_row(
+      tx, item->schema, &kvp, &item->item_id, &item->result));
+  return success();
+}
+// end::table_clustered[]
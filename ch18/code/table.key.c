@@ -0,0 +1,258 @@
+#include <byteswap.h>
+#include <string.h>
+
+#include <gavran/db.h>
+#include <gavran/internal.h>
+
+// tag::table_key_append[]
+// big endian, so the bytes compare in the order of the values
+uint8_t *table_key_append_uint(uint8_t *buffer, uint64_t value) {
+  value = bswap_64(value);
+  memcpy(buffer, &value, sizeof(uint64_t));
+  return buffer + sizeof(uint64_t);
+}
+
+// big endian with the sign bit flipped, so negative values sort
+// before positive ones
+uint8_t *table_key_append_int(uint8_t *buffer, int64_t value) {
+  return table_key_append_uint(
+      buffer, (uint64_t)value ^ (1UL << 63));
+}
+
+// positive values only need the sign bit set, negative values are
+// flipped entirely so larger magnitudes sort first
+uint8_t *table_key_append_double(uint8_t *buffer, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(uint64_t));
+  bits = (bits & (1UL << 63)) ? ~bits : bits | (1UL << 63);
+  return table_key_append_uint(buffer, bits);
+}
+
+uint8_t *table_key_append_string(uint8_t *buffer, span_t *value) {
+  for (size_t i = 0; i < value->size; i++) {
+    *buffer = ((uint8_t *)value->address)[i];
+    if (*buffer++ == 0) *buffer++ = 0xFF;
+  }
+  *buffer++ = 0;
+  *buffer++ = 0;
+  return buffer;
+}
+// end::table_key_append[]
+
+// tag::table_key_read[]
+uint8_t *table_key_read_uint(uint8_t *buffer, uint64_t *value) {
+  memcpy(value, buffer, sizeof(uint64_t));
+  *value = bswap_64(*value);
+  return buffer + sizeof(uint64_t);
+}
+
+uint8_t *table_key_read_int(uint8_t *buffer, int64_t *value) {
+  uint64_t bits;
+  buffer = table_key_read_uint(buffer, &bits);
+  *value = (int64_t)(bits ^ (1UL << 63));
+  return buffer;
+}
+
+uint8_t *table_key_read_double(uint8_t *buffer, double *value) {
+  uint64_t bits;
+  buffer = table_key_read_uint(buffer, &bits);
+  bits   = (bits & (1UL << 63)) ? bits & ~(1UL << 63) : ~bits;
+  memcpy(value, &bits, sizeof(uint64_t));
+  return buffer;
+}
+
+uint8_t *table_key_read_string(uint8_t *buffer, span_t *value) {
+  uint8_t *out = value->address;
+  value->size  = 0;
+  while (buffer[0] != 0 || buffer[1] != 0) {
+    out[value->size++] = *buffer;
+    buffer += *buffer ? 1 : 2;  // skip the escape after a zero
+  }
+  return buffer + 2;
+}
+// end::table_key_read[]
+
+// tag::table_key_encode[]
+static result_t table_key_field_int(
+    table_key_part_t *part, uint8_t *src, int64_t *value) {
+  switch (part->field.size) {
+    case 1:
+      *value = *(int8_t *)src;
+      return success();
+    case 2: {
+      int16_t v;
+      memcpy(&v, src, sizeof(v));
+      *value = v;
+      return success();
+    }
+    case 4: {
+      int32_t v;
+      memcpy(&v, src, sizeof(v));
+      *value = v;
+      return success();
+    }
+    case 8:
+      memcpy(value, src, sizeof(int64_t));
+      return success();
+    default:
+      failed(EINVAL, msg("Integer key parts are 1, 2, 4 or 8 bytes"),
+          with(part->field.size, "%d"));
+  }
+}
+
+static result_t table_key_field_uint(
+    table_key_part_t *part, uint8_t *src, uint64_t *value) {
+  *value = 0;
+  switch (part->field.size) {
+    case 1:
+    case 2:
+    case 4:
+    case 8:  // little endian, the low bytes come first
+      memcpy(value, src, part->field.size);
+      return success();
+    default:
+      failed(EINVAL, msg("Integer key parts are 1, 2, 4 or 8 bytes"),
+          with(part->field.size, "%d"));
+  }
+}
+
+static result_t table_key_field_double(
+    table_key_part_t *part, uint8_t *src, double *value) {
+  if (part->field.size == sizeof(float)) {
+    float f;
+    memcpy(&f, src, sizeof(float));
+    *value = f;
+    return success();
+  }
+  ensure(part->field.size == sizeof(double),
+      msg("Float key parts are 4 or 8 bytes"),
+      with(part->field.size, "%d"));
+  memcpy(value, src, sizeof(double));
+  return success();
+}
+
+static result_t table_key_append_part(table_key_part_t *part,
+    uint8_t *src, uint8_t *buffer, uint8_t **end) {
+  switch (part->type) {
+    case table_key_bytes:
+      memcpy(buffer, src, part->field.size);
+      *end = buffer + part->field.size;
+      return success();
+    case table_key_string: {
+      uint8_t *zero = memchr(src, 0, part->field.size);
+      span_t str    = {.address = src,
+          .size = zero ? (size_t)(zero - src) : part->field.size};
+      *end = table_key_append_string(buffer, &str);
+      return success();
+    }
+    case table_key_timestamp:
+      ensure(part->field.size == sizeof(int64_t),
+          msg("Timestamp key parts are 8 bytes"),
+          with(part->field.size, "%d"));
+      __attribute__((fallthrough));
+    case table_key_int: {
+      int64_t value;
+      ensure(table_key_field_int(part, src, &value));
+      *end = table_key_append_int(buffer, value);
+      return success();
+    }
+    case table_key_uint: {
+      uint64_t value;
+      ensure(table_key_field_uint(part, src, &value));
+      *end = table_key_append_uint(buffer, value);
+      return success();
+    }
+    case table_key_float: {
+      double value;
+      ensure(table_key_field_double(part, src, &value));
+      *end = table_key_append_double(buffer, value);
+      return success();
+    }
+    default:
+      failed(EINVAL, msg("Unknown key part type"),
+          with(part->type, "%d"));
+  }
+}
+
+result_t table_key_encode(
+    table_key_t *key, span_t *row, uint8_t *buffer, span_t *out) {
+  ensure(key->number_of_parts > 0 &&
+             key->number_of_parts <= TABLE_KEY_MAX_PARTS,
+      msg("Invalid number of key parts"),
+      with(key->number_of_parts, "%d"));
+  uint8_t *cur = buffer;
+  for (size_t i = 0; i < key->number_of_parts; i++) {
+    table_key_part_t *part = &key->parts[i];
+    size_t end = (size_t)part->field.offset + part->field.size;
+    ensure(row->size >= end, msg("Row is too small for the key"),
+        with(row->size, "%zu"), with(i, "%zu"));
+    // the worst case, a string of zeros, doubles its size
+    size_t max = (size_t)part->field.size * 2 + 2;
+    ensure((size_t)(cur - buffer) + MAX(max, 8) <= TABLE_KEY_MAX_SIZE,
+        msg("Key is too large"), with(i, "%zu"));
+    ensure(table_key_append_part(
+        part, row->address + part->field.offset, cur, &cur));
+  }
+  out->address = buffer;
+  out->size    = (size_t)(cur - buffer);
+  return success();
+}
+// end::table_key_encode[]
+
+// tag::table_key_derive[]
+static bool table_key_has_parts(table_schema_t *schema) {
+  if (!schema->keys) return false;
+  for (size_t i = 1; i < schema->count; i++) {
+    if (schema->keys[i].number_of_parts) return true;
+  }
+  return false;
+}
+
+implementation_detail result_t table_key_derive(
+    table_schema_t *schema, span_t **entries, void **buffer) {
+  if (!table_key_has_parts(schema)) return success();
+  ensure(mem_calloc(buffer, schema->count * (sizeof(span_t) +
+                                                TABLE_KEY_MAX_SIZE)));
+  span_t *derived = *buffer;
+  uint8_t *keys   = (uint8_t *)(derived + schema->count);
+  memcpy(derived, *entries, schema->count * sizeof(span_t));
+  for (size_t i = 1; i < schema->count; i++) {
+    if (!schema->keys[i].number_of_parts) continue;
+    ensure(table_key_encode(&schema->keys[i], &derived[0],
+        keys + i * TABLE_KEY_MAX_SIZE, &derived[i]));
+  }
+  *entries = derived;
+  return success();
+}
+
+// a copy of the rows, with the keys in the same allocation
+implementation_detail result_t table_key_derive_many(
+    table_schema_t *schema, table_item_t *rows,
+    size_t number_of_rows, table_item_t **derived) {
+  *derived = 0;
+  if (!table_key_has_parts(schema)) return success();
+  size_t row_size =
+      sizeof(table_item_t) +
+      schema->count * (sizeof(span_t) + TABLE_KEY_MAX_SIZE);
+  ensure(mem_calloc((void *)derived, number_of_rows * row_size));
+  uint8_t *cur = (uint8_t *)(*derived + number_of_rows);
+  for (size_t r = 0; r < number_of_rows; r++) {
+    ensure(rows[r].number_of_entries == schema->count,
+        with(r, "%zu"));
+    table_item_t *row = &(*derived)[r];
+    *row              = rows[r];
+    row->entries      = (span_t *)cur;
+    memcpy(row->entries, rows[r].entries,
+        schema->count * sizeof(span_t));
+    uint8_t *keys = cur + schema->count * sizeof(span_t);
+    cur += row_size - sizeof(table_item_t);
+    for (size_t i = 1; i < schema->count; i++) {
+      if (!schema->keys[i].number_of_parts) continue;
+      ensure(table_key_encode(&schema->keys[i], &row->entries[0],
+                 keys + i * TABLE_KEY_MAX_SIZE, &row->entries[i]),
+          with(r, "%zu"));
+    }
+  }
+  return success();
+}
+// end::table_key_derive[]
@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <gavran/db.h>
+#include <gavran/internal.h>
+
+// tag::table_query_collect[]
+typedef struct table_query_ids {
+  uint64_t *item_ids;
+  size_t count;
+} table_query_ids_t;
+
+typedef struct table_query_lists {
+  table_query_ids_t *ids;
+  size_t count;
+} table_query_lists_t;
+
+static result_t table_query_lists_free(table_query_lists_t *lists) {
+  for (size_t i = 0; i < lists->count; i++) {
+    free(lists->ids[i].item_ids);
+  }
+  free(lists->ids);
+  return success();
+}
+enable_defer(table_query_lists_free);
+
+static int table_query_cmp_ids(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static int table_query_cmp_count(const void *a, const void *b) {
+  const table_query_ids_t *x = a;
+  const table_query_ids_t *y = b;
+  return (x->count > y->count) - (x->count < y->count);
+}
+
+static result_t table_query_collect_range(table_query_t *query,
+    table_condition_t *cond, table_query_ids_t *ids) {
+  table_range_t range = {.tx = query->tx,
+      .schema                = query->schema,
+      .index_to_use          = cond->index_to_use,
+      .start                 = cond->start,
+      .end                   = cond->end};
+  defer(table_range_close, range);
+  size_t capacity = 0;
+  while (true) {
+    if (ids->count + TABLE_RANGE_BATCH_SIZE > capacity) {
+      capacity =
+          MAX(capacity * 2, ids->count + TABLE_RANGE_BATCH_SIZE);
+      ensure(mem_realloc(
+          (void *)&ids->item_ids, capacity * sizeof(uint64_t)));
+    }
+    size_t count;
+    ensure(table_range_next_ids(
+        &range, ids->item_ids + ids->count, &count));
+    if (!count) break;
+    ids->count += count;
+  }
+  return success();
+}
+
+static result_t table_query_collect(table_query_t *query,
+    table_condition_t *cond, table_query_ids_t *ids) {
+  uint16_t index = cond->index_to_use;
+  ensure(index > 0 && index < query->schema->count,
+      msg("Invalid index for query condition"), with(index, "%d"));
+  switch (query->schema->types[index]) {
+    case index_type_btree:
+      ensure(table_query_collect_range(query, cond, ids));
+      break;
+    case index_type_hash:
+      ensure(!cond->end.size,
+          msg("Hash indexes can only match a single key"),
+          with(index, "%d"));
+      ensure(table_hash_index_collect(query->tx, query->schema, index,
+          &cond->start, &ids->item_ids, &ids->count));
+      break;
+    case index_type_container:
+    case index_type_clustered:
+    default:
+      failed(EINVAL, msg("Queries require btree or hash indexes"),
+          with(index, "%d"));
+  }
+  qsort(ids->item_ids, ids->count, sizeof(uint64_t),
+      table_query_cmp_ids);
+  return success();
+}
+// end::table_query_collect[]
+
+// tag::table_query_intersect[]
+// lists this much larger than the matches so far are probed with a
+// galloping search instead of being walked one by one
+#define TABLE_QUERY_GALLOP_RATIO (8)
+
+// first position at or after lo holding a value >= target, probing
+// 1, 2, 4, ... ahead, then a binary search over the last step
+static size_t table_query_gallop(
+    uint64_t *ids, size_t count, size_t lo, uint64_t target) {
+  size_t hi = lo, step = 1;
+  while (hi < count && ids[hi] < target) {
+    lo = hi + 1;
+    hi += step;
+    step *= 2;
+  }
+  hi = MIN(hi, count);
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ids[mid] < target) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// keeps the ids in matches that also appear in other, in place
+static size_t table_query_intersect(
+    uint64_t *matches, size_t count, table_query_ids_t *other) {
+  bool gallop = other->count > count * TABLE_QUERY_GALLOP_RATIO;
+  size_t kept = 0, pos = 0;
+  for (size_t i = 0; i < count && pos < other->count; i++) {
+    if (gallop) {
+      pos = table_query_gallop(
+          other->item_ids, other->count, pos, matches[i]);
+    } else {
+      while (pos < other->count && other->item_ids[pos] < matches[i])
+        pos++;
+    }
+    if (pos < other->count && other->item_ids[pos] == matches[i])
+      matches[kept++] = matches[i];
+  }
+  return kept;
+}
+
+static result_t table_query_start(table_query_t *query) {
+  ensure(query->number_of_conditions > 0,
+      msg("A query requires at least one condition"));
+  query->started            = true;
+  table_query_lists_t lists = {.count = query->number_of_conditions};
+  defer(table_query_lists_free, lists);
+  ensure(mem_calloc(
+      (void *)&lists.ids, lists.count * sizeof(table_query_ids_t)));
+  for (size_t c = 0; c < lists.count; c++) {
+    ensure(table_query_collect(
+        query, &query->conditions[c], &lists.ids[c]));
+  }
+  // start from the most selective condition, the matches only
+  // shrink from there
+  qsort(lists.ids, lists.count, sizeof(table_query_ids_t),
+      table_query_cmp_count);
+  query->matches           = lists.ids[0].item_ids;
+  query->number_of_matches = lists.ids[0].count;
+  lists.ids[0].item_ids    = 0;  // owned by the query now
+  for (size_t c = 1; c < lists.count; c++) {
+    if (!query->number_of_matches) break;
+    query->number_of_matches = table_query_intersect(
+        query->matches, query->number_of_matches, &lists.ids[c]);
+  }
+  return success();
+}
+// end::table_query_intersect[]
+
+// tag::table_query_next[]
+result_t table_query_next(table_query_t *query) {
+  if (!query->started) ensure(table_query_start(query));
+  size_t count = MIN(TABLE_QUERY_BATCH_SIZE,
+      query->number_of_matches - query->position);
+  for (size_t i = 0; i < count; i++) {
+    container_item_t item = {
+        .container_id = query->schema->index_ids[0],
+        .item_id      = query->matches[query->position++]};
+    ensure(db_row_cache_get(query->tx, &item));
+    query->item_ids[i] = item.item_id;
+    query->rows[i]     = item.data;
+  }
+  query->count = (uint16_t)count;
+  return success();
+}
+
+result_t table_query_close(table_query_t *query) {
+  free(query->matches);
+  query->matches = 0;
+  query->started = false;
+  return success();
+}
+// end::table_query_next[]
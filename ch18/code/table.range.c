@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <gavran/db.h>
+#include <gavran/internal.h>
+
+// tag::table_range_start[]
+static int table_range_compare(
+    table_range_t *range, span_t *key, span_t *bound) {
+  int rc = memcmp(
+      key->address, bound->address, MIN(key->size, bound->size));
+  // covering keys are prefix free, the covered bytes don't count
+  if (rc || table_is_covering(range->schema, range->index_to_use))
+    return rc;
+  if (range->end_is_prefix && bound == &range->upper &&
+      key->size >= bound->size)
+    return 0;  // shares the end as a prefix
+  return (key->size > bound->size) - (key->size < bound->size);
+}
+
+static result_t table_range_seek(
+    table_range_t *range, btree_cursor_t *cursor) {
+  if (!range->lower.size) {
+    ensure(btree_cursor_at_start(cursor));
+    return success();
+  }
+  cursor->key = range->lower;
+  ensure(btree_cursor_search(cursor));
+  // the search matches on a shared prefix, so it may land in the
+  // middle of a run of matching keys, step back to before the run
+  while (true) {
+    ensure(btree_get_prev(cursor));
+    if (cursor->has_val == false) {
+      ensure(btree_free_cursor(cursor));  // at_start won't free it
+      ensure(btree_cursor_at_start(cursor));
+      break;
+    }
+    if (table_range_compare(range, &cursor->key, &range->lower) < 0)
+      break;
+  }
+  return success();
+}
+
+// moves to the next key in the range, has_val is false past its end
+static result_t table_range_step(
+    table_range_t *range, btree_cursor_t *cursor) {
+  while (true) {
+    ensure(btree_get_next(cursor));
+    if (cursor->has_val == false) return success();
+    if (range->upper.size &&
+        table_range_compare(range, &cursor->key, &range->upper) > 0) {
+      cursor->has_val = false;
+      return success();
+    }
+    if (!range->lower.size ||
+        table_range_compare(range, &cursor->key, &range->lower) >= 0)
+      return success();
+  }
+}
+
+static result_t table_range_start(table_range_t *range) {
+  index_type_t type = range->schema->types[range->index_to_use];
+  ensure(type == index_type_btree || type == index_type_clustered,
+      msg("Range queries require a btree index"),
+      with(range->index_to_use, "%d"));
+  ensure(mem_calloc(
+      (void *)&range->bounds, TABLE_COVERING_KEY_MAX_SIZE * 2));
+  if (range->start.size) {
+    ensure(table_index_key(range->schema, range->index_to_use,
+        &range->start, 0, range->bounds, &range->lower));
+  }
+  if (range->end.size) {
+    ensure(table_index_key(range->schema, range->index_to_use,
+        &range->end, 0, range->bounds + TABLE_COVERING_KEY_MAX_SIZE,
+        &range->upper));
+  }
+  range->started   = true;
+  range->cursor.tx = range->tx;
+  range->cursor.tree_id =
+      range->schema->index_ids[range->index_to_use];
+  ensure(table_range_seek(range, &range->cursor));
+  ensure(table_range_step(range, &range->cursor));
+  if (!table_is_buffered(range->schema, range->index_to_use))
+    return success();
+  range->buffer.tx = range->tx;
+  range->buffer.tree_id =
+      range->schema->buffer_ids[range->index_to_use];
+  ensure(table_range_seek(range, &range->buffer));
+  ensure(table_range_step(range, &range->buffer));
+  return success();
+}
+// end::table_range_start[]
+
+// tag::table_range_next[]
+typedef struct table_range_entry {
+  uint64_t item_id;
+  uint64_t order;
+  span_t data;  // the row, for clustered indexes
+  uint8_t flags;
+  uint8_t padding[7];
+} table_range_entry_t;
+
+static int table_range_entry_cmp(const void *a, const void *b) {
+  const table_range_entry_t *x = a;
+  const table_range_entry_t *y = b;
+  return (x->item_id > y->item_id) - (x->item_id < y->item_id);
+}
+
+// buffered writes are newer than the index, they win on equal keys
+static int table_range_next_source(table_range_t *range) {
+  btree_cursor_t *index = &range->cursor, *buffer = &range->buffer;
+  if (!buffer->tree_id || !buffer->has_val) return -1;
+  if (!index->has_val) return 1;
+  int rc = memcmp(index->key.address, buffer->key.address,
+      MIN(index->key.size, buffer->key.size));
+  if (rc) return rc;
+  return (index->key.size > buffer->key.size) -
+         (index->key.size < buffer->key.size);
+}
+
+static result_t table_range_collect(table_range_t *range,
+    table_range_entry_t *entries, size_t *count) {
+  *count = 0;
+  while (!range->done && *count < TABLE_RANGE_BATCH_SIZE) {
+    if (range->cursor.has_val == false &&
+        (!range->buffer.tree_id || range->buffer.has_val == false)) {
+      range->done = true;
+      break;
+    }
+    int source = table_range_next_source(range);
+    if (source >= 0) {
+      btree_cursor_t *buffer = &range->buffer;
+      if (source == 0) {  // the buffer replaces this entry
+        ensure(table_range_step(range, &range->cursor));
+      }
+      bool removed = buffer->flags & TABLE_BUFFER_TOMBSTONE;
+      uint64_t val = buffer->val;
+      ensure(table_range_step(range, buffer));
+      if (removed) continue;
+      entries[*count] = (table_range_entry_t){
+          .item_id = val, .order = *count};
+      (*count)++;
+      continue;
+    }
+    entries[*count].item_id = range->cursor.val;
+    entries[*count].order   = *count;
+    entries[*count].data    = range->cursor.data;
+    entries[*count].flags   = range->cursor.flags;
+    (*count)++;
+    ensure(table_range_step(range, &range->cursor));
+  }
+  return success();
+}
+
+static result_t table_range_prefetch_run(
+    txn_state_t *state, uint64_t start, uint64_t end) {
+  span_t *map =
+      state->flags & db_flags_avoid_mmap_io ? 0 : &state->map;
+  ensure(pal_prefetch(state->db->handle, map, start * PAGE_SIZE,
+      (end - start) * PAGE_SIZE));
+  return success();
+}
+
+// the entries are sorted by item id, so their pages are in order and
+// neighbouring pages are hinted together, as a single run
+static result_t table_range_prefetch(table_range_t *range,
+    table_range_entry_t *entries, size_t count) {
+  txn_state_t *state = range->tx->state;
+  uint64_t start = 0, end = 0;  // the current run, [start, end)
+  for (size_t i = 0; i < count; i++) {
+    uint64_t page_num = entries[i].item_id / PAGE_SIZE;
+    if ((page_num + 1) * PAGE_SIZE > state->map.size) continue;
+    if (end && page_num + 1 >= end && page_num <= end) {
+      end = page_num + 1;  // the same page, or the one after it
+      continue;
+    }
+    if (end) ensure(table_range_prefetch_run(state, start, end));
+    start = page_num;
+    end   = page_num + 1;
+  }
+  if (end) ensure(table_range_prefetch_run(state, start, end));
+  return success();
+}
+
+result_t table_range_next(table_range_t *range) {
+  counted_op(range->tx->state->db, db_op_table_range_next);
+  if (!range->started) ensure(table_range_start(range));
+  table_range_entry_t entries[TABLE_RANGE_BATCH_SIZE];
+  size_t count;
+  ensure(table_range_collect(range, entries, &count));
+  range->count = (uint16_t)count;
+  if (range->schema->types[range->index_to_use] ==
+      index_type_clustered) {
+    // rows are in the leaves, already in key order
+    for (size_t i = 0; i < count; i++) {
+      btree_val_t kvp = {.val = entries[i].item_id,
+          .data = entries[i].data, .flags = entries[i].flags};
+      ensure(table_clustered_row(range->tx, range->schema, &kvp,
+          &range->item_ids[i], &range->rows[i]));
+    }
+    return success();
+  }
+  // <1>
+  qsort(entries, count, sizeof(table_range_entry_t),
+      table_range_entry_cmp);
+  ensure(table_range_prefetch(range, entries, count));
+  // <2>
+  for (size_t i = 0; i < count; i++) {
+    container_item_t item = {
+        .container_id = range->schema->index_ids[0],
+        .item_id      = entries[i].item_id};
+    ensure(db_row_cache_get(range->tx, &item));
+    size_t slot            = range->key_order ? entries[i].order : i;
+    range->item_ids[slot]  = entries[i].item_id;
+    range->rows[slot]      = item.data;
+  }
+  return success();
+}
+
+// only the index is read, for callers that want the item ids alone
+implementation_detail result_t table_range_next_ids(
+    table_range_t *range, uint64_t *item_ids, size_t *count) {
+  if (!range->started) ensure(table_range_start(range));
+  table_range_entry_t entries[TABLE_RANGE_BATCH_SIZE];
+  ensure(table_range_collect(range, entries, count));
+  for (size_t i = 0; i < *count; i++) {
+    item_ids[i] = entries[i].item_id;
+  }
+  return success();
+}
+
+result_t table_range_close(table_range_t *range) {
+  if (range->started) ensure(btree_free_cursor(&range->cursor));
+  if (range->started && range->buffer.tree_id) {
+    ensure(btree_free_cursor(&range->buffer));
+  }
+  free(range->bounds);
+  range->bounds  = 0;
+  range->started = false;
+  return success();
+}
+// end::table_range_next[]
@@ -0,0 +1,323 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gavran/db.h>
+#include <gavran/internal.h>
+
+// tag::table_scan_refs[]
+// hash indexes keep their references in the table's container, and
+// telling them apart from the rows means walking every chain. So the
+// sorted ids are collected once per table and kept on the
+// transaction, a write transaction drops them when it changes a hash
+// index. Scans that are still open keep the old ids until closed.
+struct table_refs {
+  uint64_t container_id;
+  uint64_t *ids;
+  size_t count;
+  uint32_t usages;  // open scans using the ids
+  bool stale;
+  uint8_t padding[3];
+  table_refs_t *next;
+};
+
+static int table_scan_cmp_ids(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static result_t table_scan_add_ref(table_refs_t *refs, uint64_t id) {
+  if ((refs->count & (refs->count - 1)) == 0) {
+    size_t size = refs->count ? refs->count * 2 : 8;
+    ensure(mem_realloc((void *)&refs->ids, size * sizeof(uint64_t)));
+  }
+  refs->ids[refs->count++] = id;
+  return success();
+}
+
+static result_t table_scan_collect_refs(
+    txn_t *tx, table_schema_t *schema, table_refs_t *refs) {
+  for (size_t i = 1; i < schema->count; i++) {
+    if (schema->types[i] != index_type_hash) continue;
+    pages_map_t *pages;
+    ensure(pagesmap_new(8, &pages));
+    defer(free, pages);
+    hash_val_t it = {.hash_id = schema->index_ids[i]};
+    while (true) {
+      ensure(hash_get_next(tx, &pages, &it));
+      if (it.has_val == false) break;
+      uint64_t cur = it.val;
+      while (cur) {  // walk the collision chain
+        ensure(table_scan_add_ref(refs, cur));
+        container_item_t ref = {
+            .container_id = schema->index_ids[0], .item_id = cur};
+        ensure(container_item_get(tx, &ref));
+        uint64_t item_id;
+        span_t key;
+        table_hash_ref_decode(&ref.data, &item_id, &key, &cur);
+      }
+    }
+  }
+  qsort(refs->ids, refs->count, sizeof(uint64_t), table_scan_cmp_ids);
+  return success();
+}
+
+static void table_scan_refs_forget(void *state) {
+  txn_state_t *tx_state = *(txn_state_t **)state;
+  while (tx_state->table_refs) {
+    table_refs_t *cur    = tx_state->table_refs;
+    tx_state->table_refs = cur->next;
+    free(cur->ids);
+    free(cur);
+  }
+}
+
+static result_t table_scan_refs_new(txn_t *tx, table_refs_t **refs) {
+  txn_state_t *state = tx->state;
+  if (!state->table_refs) {  // the list only grows, so this is once
+    ensure(txn_register_cleanup_action(&state->on_rollback,
+        table_scan_refs_forget, &state, sizeof(txn_state_t *)));
+    ensure(txn_register_cleanup_action(&state->on_forget,
+        table_scan_refs_forget, &state, sizeof(txn_state_t *)));
+  }
+  ensure(mem_calloc((void *)refs, sizeof(table_refs_t)));
+  (*refs)->next     = state->table_refs;
+  state->table_refs = *refs;
+  return success();
+}
+
+static result_t table_scan_refs_acquire(table_scan_t *scan) {
+  uint64_t container_id = scan->schema->index_ids[0];
+  table_refs_t *unused  = 0;
+  for (table_refs_t *cur = scan->tx->state->table_refs; cur;
+       cur               = cur->next) {
+    if (cur->container_id != container_id) continue;
+    if (!cur->stale) {
+      cur->usages++;
+      scan->refs = cur;
+      return success();
+    }
+    if (!cur->usages) unused = cur;
+  }
+  if (!unused) ensure(table_scan_refs_new(scan->tx, &unused));
+  unused->container_id = container_id;
+  unused->stale        = true;  // until all the ids are in
+  unused->usages       = 1;
+  scan->refs           = unused;
+  ensure(table_scan_collect_refs(scan->tx, scan->schema, unused));
+  unused->stale = false;
+  return success();
+}
+
+static void table_scan_refs_clear(table_refs_t *refs) {
+  free(refs->ids);
+  refs->ids   = 0;
+  refs->count = 0;
+}
+
+static void table_scan_refs_release(table_refs_t *refs) {
+  if (--refs->usages == 0 && refs->stale) table_scan_refs_clear(refs);
+}
+
+implementation_detail void table_scan_refs_changed(
+    txn_t *tx, uint64_t container_id) {
+  for (table_refs_t *cur = tx->state->table_refs; cur;
+       cur               = cur->next) {
+    if (cur->container_id != container_id) continue;
+    cur->stale = true;
+    if (!cur->usages) table_scan_refs_clear(cur);
+  }
+}
+
+static bool table_scan_is_ref(table_scan_t *scan, uint64_t id) {
+  return scan->refs->count &&
+         bsearch(&id, scan->refs->ids, scan->refs->count,
+             sizeof(uint64_t), table_scan_cmp_ids);
+}
+// end::table_scan_refs[]
+
+// tag::table_scan_filter[]
+static int table_scan_compare(
+    uint8_t *field, size_t size, span_t *value) {
+  int rc = memcmp(field, value->address, MIN(size, value->size));
+  if (rc) return rc;
+  return (size > value->size) - (size < value->size);
+}
+
+static bool table_scan_match(
+    table_predicate_t *pred, uint8_t *field, size_t size) {
+  switch (pred->op) {
+    case table_predicate_eq:
+      return size == pred->value.size &&
+             memcmp(field, pred->value.address, size) == 0;
+    case table_predicate_prefix:
+      return size >= pred->value.size &&
+             memcmp(field, pred->value.address, pred->value.size) ==
+                 0;
+    case table_predicate_range:
+      if (pred->value.size &&
+          table_scan_compare(field, size, &pred->value) < 0)
+        return false;
+      return !pred->upper.size ||
+             table_scan_compare(field, size, &pred->upper) <= 0;
+    default:
+      return false;
+  }
+}
+
+// applies one predicate at a time over the whole batch, compacting
+// the batch in place so the next predicate sees only the survivors
+static void table_scan_filter(table_scan_t *scan) {
+  for (size_t p = 0; p < scan->number_of_predicates; p++) {
+    table_predicate_t *pred = &scan->predicates[p];
+    size_t end   = (size_t)pred->field.offset + pred->field.size;
+    size_t count = 0;
+    for (size_t r = 0; r < scan->count; r++) {
+      if (scan->rows[r].size < end ||
+          !table_scan_match(pred,
+              scan->rows[r].address + pred->field.offset,
+              pred->field.size))
+        continue;
+      scan->rows[count]       = scan->rows[r];
+      scan->item_ids[count++] = scan->item_ids[r];
+    }
+    scan->count = (uint16_t)count;
+  }
+}
+// end::table_scan_filter[]
+
+// tag::table_scan_project[]
+static result_t table_scan_project(table_scan_t *scan) {
+  if (!scan->number_of_fields) return success();
+  size_t row_size = 0;
+  for (size_t f = 0; f < scan->number_of_fields; f++) {
+    row_size += scan->projection[f].size;
+  }
+  if (!scan->projected) {
+    ensure(mem_calloc((void *)&scan->projected,
+        row_size * TABLE_SCAN_BATCH_SIZE));
+  }
+  for (size_t r = 0; r < scan->count; r++) {
+    uint8_t *dst = scan->projected + r * row_size;
+    uint8_t *cur = dst;
+    for (size_t f = 0; f < scan->number_of_fields; f++) {
+      table_field_t *field = &scan->projection[f];
+      size_t end           = (size_t)field->offset + field->size;
+      ensure(scan->rows[r].size >= end,
+          msg("Row is too short for the projection"),
+          with(scan->item_ids[r], "%lu"), with(f, "%zu"));
+      memcpy(cur, scan->rows[r].address + field->offset, field->size);
+      cur += field->size;
+    }
+    scan->rows[r].address = dst;
+    scan->rows[r].size    = row_size;
+  }
+  return success();
+}
+// end::table_scan_project[]
+
+// tag::table_scan_next[]
+static result_t table_scan_fill_batch(table_scan_t *scan) {
+  scan->count = 0;
+  while (scan->page_num && scan->count < TABLE_SCAN_BATCH_SIZE) {
+    page_t p = {.page_num = scan->page_num};
+    ensure(txn_get_page(scan->tx, &p));
+    assert(p.metadata->common.page_flags == page_flags_container);
+    size_t max_pos = p.metadata->container.floor / sizeof(uint16_t);
+    int16_t *positions = p.address;
+    for (; scan->position < max_pos &&
+           scan->count < TABLE_SCAN_BATCH_SIZE;
+         scan->position++) {
+      int16_t offset = positions[scan->position];
+      if (offset == 0) continue;
+      uint64_t item_id = p.page_num * PAGE_SIZE + scan->position + 1;
+      if (offset < 0) {  // large row, stored elsewhere
+        uint64_t size;
+        container_item_t large = {
+            .container_id = scan->schema->index_ids[0]};
+        varint_decode(varint_decode(p.address + -offset, &size),
+            &large.item_id);
+        large.item_id *= PAGE_SIZE;
+        if (large.item_id == scan->schema->stats_id) continue;
+        ensure(container_item_get(scan->tx, &large));
+        scan->item_ids[scan->count] = large.item_id;
+        scan->rows[scan->count++]   = large.data;
+        continue;
+      }
+      if (item_id == scan->schema->stats_id ||
+          table_scan_is_ref(scan, item_id))
+        continue;
+      scan->item_ids[scan->count] = item_id;
+      scan->rows[scan->count].address = varint_decode(
+          p.address + offset, &scan->rows[scan->count].size);
+      scan->count++;
+    }
+    if (scan->position == max_pos) {
+      scan->page_num = p.metadata->container.next;
+      scan->position = 0;
+    }
+  }
+  return success();
+}
+
+// the container only holds the overflow rows, so we walk the leaves
+static result_t table_scan_fill_clustered(table_scan_t *scan) {
+  scan->count = 0;
+  while (scan->page_num && scan->count < TABLE_SCAN_BATCH_SIZE) {
+    ensure(btree_get_next(&scan->cursor));
+    if (scan->cursor.has_val == false) {
+      scan->page_num = 0;
+      break;
+    }
+    btree_val_t kvp = {.val = scan->cursor.val,
+        .data = scan->cursor.data, .flags = scan->cursor.flags};
+    ensure(table_clustered_row(scan->tx, scan->schema, &kvp,
+        &scan->item_ids[scan->count], &scan->rows[scan->count]));
+    scan->count++;
+  }
+  return success();
+}
+
+static result_t table_scan_start(table_scan_t *scan) {
+  scan->started = true;
+  if (table_is_clustered(scan->schema)) {
+    scan->cursor.tx      = scan->tx;
+    scan->cursor.tree_id = scan->schema->index_ids[1];
+    ensure(btree_cursor_at_start(&scan->cursor));
+    scan->page_num = scan->cursor.tree_id;  // not done yet
+    return success();
+  }
+  // start from the container's first page
+  ensure(table_scan_refs_acquire(scan));
+  scan->page_num = scan->schema->index_ids[0];
+  return success();
+}
+
+result_t table_scan_next(table_scan_t *scan) {
+  counted_op(scan->tx->state->db, db_op_table_scan_next);
+  if (!scan->started) ensure(table_scan_start(scan));
+  bool clustered = table_is_clustered(scan->schema);
+  do {  // keep going until we have results or run out of rows
+    if (clustered) {
+      ensure(table_scan_fill_clustered(scan));
+    } else {
+      ensure(table_scan_fill_batch(scan));
+    }
+    table_scan_filter(scan);
+    ensure(table_scan_project(scan));
+  } while (!scan->count && scan->page_num);
+  return success();
+}
+
+result_t table_scan_close(table_scan_t *scan) {
+  if (scan->started && table_is_clustered(scan->schema)) {
+    ensure(btree_free_cursor(&scan->cursor));
+  }
+  if (scan->refs) table_scan_refs_release(scan->refs);
+  free(scan->projected);
+  scan->refs      = 0;
+  scan->projected = 0;
+  return success();
+}
+// end::table_scan_next[]
@@ -0,0 +1,398 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gavran/db.h>
+#include <gavran/internal.h>
+
+// tag::table_stats_sketch[]
+#define TABLE_STATS_REGISTER_BITS (7)  // log2(TABLE_STATS_REGISTERS)
+
+// returns whether the sketch changed
+static bool table_stats_add_key(
+    table_index_stats_t *stats, span_t *key) {
+  uint64_t hash  = table_hash_key(key);
+  size_t idx     = hash >> (64 - TABLE_STATS_REGISTER_BITS);
+  uint64_t rest  = hash << TABLE_STATS_REGISTER_BITS;
+  uint8_t rank   = rest ? (uint8_t)(__builtin_clzl(rest) + 1)
+                        : 64 - TABLE_STATS_REGISTER_BITS + 1;
+  if (stats->registers[idx] >= rank) return false;
+  stats->registers[idx] = rank;
+  return true;
+}
+
+uint64_t table_stats_distinct(table_index_stats_t *stats) {
+  double m   = TABLE_STATS_REGISTERS;
+  double sum = 0;
+  size_t zeros = 0;
+  for (size_t i = 0; i < TABLE_STATS_REGISTERS; i++) {
+    sum += ldexp(1.0, -stats->registers[i]);
+    if (!stats->registers[i]) zeros++;
+  }
+  double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+  if (estimate <= 2.5 * m && zeros) {  // small range correction
+    estimate = m * log(m / (double)zeros);
+  }
+  return (uint64_t)llround(estimate);
+}
+// end::table_stats_sketch[]
+
+// tag::table_stats_delta[]
+// the row count changes with every set and del, so the changes are
+// kept on the transaction and written once, as it commits. The
+// sketches settle quickly, they are written only when they change.
+struct table_stats_delta {
+  uint64_t container_id;
+  uint64_t stats_id;
+  int64_t rows;
+  table_stats_delta_t *next;
+};
+
+static void table_stats_delta_forget(void *state) {
+  txn_state_t *tx_state = *(txn_state_t **)state;
+  while (tx_state->table_stats) {
+    table_stats_delta_t *cur = tx_state->table_stats;
+    tx_state->table_stats    = cur->next;
+    free(cur);
+  }
+}
+
+static table_stats_delta_t *table_stats_delta_find(
+    txn_t *tx, uint64_t container_id) {
+  for (table_stats_delta_t *cur = tx->state->table_stats; cur;
+       cur                      = cur->next) {
+    if (cur->container_id == container_id) return cur;
+  }
+  return 0;
+}
+
+static result_t table_stats_delta_add(
+    txn_t *tx, table_schema_t *schema, int64_t rows) {
+  uint64_t container_id      = schema->index_ids[0];
+  table_stats_delta_t *delta =
+      table_stats_delta_find(tx, container_id);
+  if (!delta) {
+    txn_state_t *state = tx->state;
+    if (!state->table_stats) {  // only grows, so this is once
+      ensure(txn_register_cleanup_action(&state->on_rollback,
+          table_stats_delta_forget, &state, sizeof(txn_state_t *)));
+      ensure(txn_register_cleanup_action(&state->on_forget,
+          table_stats_delta_forget, &state, sizeof(txn_state_t *)));
+    }
+    ensure(mem_calloc((void *)&delta, sizeof(table_stats_delta_t)));
+    delta->container_id = container_id;
+    delta->next         = state->table_stats;
+    state->table_stats  = delta;
+  }
+  delta->stats_id = schema->stats_id;
+  delta->rows += rows;
+  return success();
+}
+
+static uint64_t table_stats_apply(uint64_t rows, int64_t delta) {
+  return (uint64_t)MAX(0, (int64_t)rows + delta);
+}
+
+// the stats item keeps its size, so it is updated in place
+static result_t table_stats_delta_write(
+    txn_t *tx, table_stats_delta_t *delta) {
+  container_item_t item = {.container_id = delta->container_id,
+      .item_id                           = delta->stats_id};
+  ensure(container_item_get(tx, &item));
+  table_stats_t *stats;
+  ensure(mem_alloc((void *)&stats, item.data.size));
+  defer(free, stats);
+  memcpy(stats, item.data.address, item.data.size);
+  stats->rows = table_stats_apply(stats->rows, delta->rows);
+  item.data   = (span_t){.address = stats, .size = item.data.size};
+  bool in_place;
+  ensure(container_item_update(tx, &item, &in_place));
+  ensure(item.item_id == delta->stats_id,
+      msg("Table statistics moved on commit"),
+      with(delta->container_id, "%lu"));
+  delta->rows = 0;
+  return success();
+}
+
+implementation_detail result_t table_stats_before_commit(txn_t *tx) {
+  for (table_stats_delta_t *cur = tx->state->table_stats; cur;
+       cur                      = cur->next) {
+    if (cur->rows) ensure(table_stats_delta_write(tx, cur));
+  }
+  return success();
+}
+
+implementation_detail void table_stats_dropped(
+    txn_t *tx, uint64_t container_id) {
+  table_stats_delta_t *delta =
+      table_stats_delta_find(tx, container_id);
+  if (delta) delta->rows = 0;  // nothing left to write it to
+}
+// end::table_stats_delta[]
+
+// tag::table_stats_load[]
+static size_t table_stats_size(uint16_t count) {
+  return sizeof(table_stats_t) + count * sizeof(table_index_stats_t);
+}
+
+// a copy sized for the schema, indexes added since the stats were
+// written start out empty. The rows include the transaction's delta.
+static result_t table_stats_load(
+    txn_t *tx, table_schema_t *schema, table_stats_t **stats) {
+  ensure(schema->stats_id, msg("Table has no statistics"),
+      with(schema->name, "%s"));
+  container_item_t item = {.container_id = schema->index_ids[0],
+      .item_id                           = schema->stats_id};
+  ensure(container_item_get(tx, &item));
+  ensure(item.data.size >= sizeof(table_stats_t),
+      msg("Invalid table statistics"), with(schema->name, "%s"));
+  size_t size = table_stats_size(schema->count);
+  ensure(mem_calloc((void *)stats, size));
+  memcpy(*stats, item.data.address, MIN(size, item.data.size));
+  (*stats)->count = schema->count;
+  table_stats_delta_t *delta =
+      table_stats_delta_find(tx, schema->index_ids[0]);
+  if (delta) {
+    (*stats)->rows = table_stats_apply((*stats)->rows, delta->rows);
+  }
+  return success();
+}
+
+static result_t table_stats_store(
+    txn_t *tx, table_schema_t *schema, table_stats_t *stats) {
+  span_t data = {
+      .address = stats, .size = table_stats_size(stats->count)};
+  container_item_t item = {.container_id = schema->index_ids[0],
+      .item_id = schema->stats_id, .data = data};
+  bool in_place;
+  ensure(container_item_update(tx, &item, &in_place));
+  table_stats_delta_t *delta =
+      table_stats_delta_find(tx, schema->index_ids[0]);
+  if (delta) {  // written along with the rest
+    delta->rows     = 0;
+    delta->stats_id = item.item_id;
+  }
+  if (item.item_id == schema->stats_id) return success();
+  schema->stats_id = item.item_id;  // grew, the schema must follow
+  ensure(table_schema_update(tx, schema));
+  return success();
+}
+
+implementation_detail result_t table_stats_create(
+    txn_t *tx, table_schema_t *schema) {
+  size_t size = table_stats_size(schema->count);
+  table_stats_t *stats;
+  ensure(mem_calloc((void *)&stats, size));
+  defer(free, stats);
+  stats->count          = schema->count;
+  container_item_t item = {.container_id = schema->index_ids[0],
+      .data = {.address = stats, .size = size}};
+  ensure(container_item_put(tx, &item));
+  schema->stats_id = item.item_id;
+  return success();
+}
+
+result_t table_get_stats(
+    txn_t *tx, table_schema_t *schema, table_stats_t **stats) {
+  ensure(table_stats_load(tx, schema, stats));
+  return success();
+}
+// end::table_stats_load[]
+
+// tag::table_stats_record[]
+implementation_detail result_t table_stats_record(txn_t *tx,
+    table_schema_t *schema, table_item_t *rows,
+    size_t number_of_rows, int64_t delta) {
+  if (!schema->stats_id) return success();
+  if (delta) ensure(table_stats_delta_add(tx, schema, delta));
+  if (!number_of_rows) return success();
+  table_stats_t *stats = 0;
+  defer(free, stats);
+  ensure(table_stats_load(tx, schema, &stats));
+  bool changed = false;
+  for (size_t r = 0; r < number_of_rows; r++) {
+    for (size_t i = 1; i < schema->count; i++) {
+      changed |= table_stats_add_key(
+          &stats->indexes[i], &rows[r].entries[i]);
+    }
+  }
+  if (!changed) return success();
+  ensure(table_stats_store(tx, schema, stats));
+  return success();
+}
+// end::table_stats_record[]
+
+// tag::table_analyze[]
+static result_t table_stats_analyze_tree(txn_t *tx,
+    table_schema_t *schema, size_t i, uint64_t rows,
+    table_index_stats_t *stats) {
+  uint64_t step = MAX(1, rows / (TABLE_STATS_BOUNDS + 1));
+  btree_cursor_t it = {.tx = tx, .tree_id = schema->index_ids[i]};
+  defer(btree_free_cursor, it);
+  ensure(btree_cursor_at_start(&it));
+  for (uint64_t n = 1;; n++) {
+    ensure(btree_get_next(&it));
+    if (it.has_val == false) break;
+    table_stats_add_key(stats, &it.key);
+    if (n % step || stats->number_of_bounds == TABLE_STATS_BOUNDS ||
+        n == rows)
+      continue;
+    size_t size = MIN(it.key.size, TABLE_STATS_BOUND_SIZE);
+    memcpy(stats->bounds[stats->number_of_bounds], it.key.address,
+        size);
+    stats->bound_sizes[stats->number_of_bounds++] = (uint8_t)size;
+  }
+  return success();
+}
+
+static result_t table_stats_analyze_hash(txn_t *tx,
+    table_schema_t *schema, size_t i, table_index_stats_t *stats) {
+  pages_map_t *pages;
+  ensure(pagesmap_new(8, &pages));
+  defer(free, pages);
+  hash_val_t it = {.hash_id = schema->index_ids[i]};
+  while (true) {
+    ensure(hash_get_next(tx, &pages, &it));
+    if (it.has_val == false) break;
+    uint64_t cur = it.val;
+    while (cur) {  // walk the collision chain
+      container_item_t ref = {
+          .container_id = schema->index_ids[0], .item_id = cur};
+      ensure(container_item_get(tx, &ref));
+      uint64_t item_id;
+      span_t key;
+      table_hash_ref_decode(&ref.data, &item_id, &key, &cur);
+      table_stats_add_key(stats, &key);
+    }
+  }
+  return success();
+}
+
+static result_t table_stats_analyze_index(txn_t *tx,
+    table_schema_t *schema, size_t i, table_stats_t *stats) {
+  table_index_stats_t *index = &stats->indexes[i];
+  memset(index, 0, sizeof(table_index_stats_t));
+  switch (schema->types[i]) {
+    case index_type_btree:
+    case index_type_clustered:
+      return table_stats_analyze_tree(
+          tx, schema, i, stats->rows, index);
+    case index_type_hash:
+      return table_stats_analyze_hash(tx, schema, i, index);
+    case index_type_container:
+    default:
+      failed(EINVAL, msg("Uknown index type"), with(i, "%zu"));
+  }
+}
+
+result_t table_analyze(txn_t *tx, table_schema_t *schema) {
+  table_stats_t *stats = 0;
+  defer(free, stats);
+  ensure(table_stats_load(tx, schema, &stats));
+  ensure(table_merge_buffers(tx, schema));  // the bounds need them
+  table_scan_t scan = {.tx = tx, .schema = schema};
+  defer(table_scan_close, scan);
+  stats->rows = 0;
+  do {
+    ensure(table_scan_next(&scan));
+    stats->rows += scan.count;
+  } while (scan.count);
+  for (size_t i = 1; i < schema->count; i++) {
+    ensure(table_stats_analyze_index(tx, schema, i, stats));
+  }
+  ensure(table_stats_store(tx, schema, stats));
+  return success();
+}
+
+// a newly added index only needs its own statistics
+implementation_detail result_t table_stats_analyze_added(
+    txn_t *tx, table_schema_t *schema, size_t i) {
+  if (!schema->stats_id) return success();
+  table_stats_t *stats = 0;
+  defer(free, stats);
+  ensure(table_stats_load(tx, schema, &stats));
+  ensure(table_stats_analyze_index(tx, schema, i, stats));
+  ensure(table_stats_store(tx, schema, stats));
+  return success();
+}
+// end::table_analyze[]
+
+// tag::table_estimate[]
+// bounds are truncated, one that matches the key's prefix may be on
+// either side of it, so we count it as inside the range
+static int table_stats_bound_cmp(
+    table_index_stats_t *stats, size_t b, span_t *key) {
+  int rc = memcmp(stats->bounds[b], key->address,
+      MIN(stats->bound_sizes[b], key->size));
+  if (rc || stats->bound_sizes[b] == TABLE_STATS_BOUND_SIZE)
+    return rc;
+  return (stats->bound_sizes[b] > key->size) -
+         (stats->bound_sizes[b] < key->size);
+}
+
+static uint64_t table_stats_range(table_stats_t *stats, size_t i,
+    span_t *lower, span_t *upper) {
+  table_index_stats_t *index = &stats->indexes[i];
+  if (!index->number_of_bounds) return stats->rows;  // not analyzed
+  uint64_t inside = 0;
+  for (size_t b = 0; b < index->number_of_bounds; b++) {
+    if (lower->size && table_stats_bound_cmp(index, b, lower) < 0)
+      continue;
+    if (upper->size && table_stats_bound_cmp(index, b, upper) > 0)
+      continue;
+    inside++;
+  }
+  // each bound starts a bucket holding an equal share of the rows,
+  // the range also touches the bucket before its first bound
+  uint64_t buckets = index->number_of_bounds + 1U;
+  return MIN(stats->rows,
+      (inside + 1) * ((stats->rows + buckets - 1) / buckets));
+}
+
+result_t table_estimate(txn_t *tx, table_schema_t *schema,
+    table_condition_t *condition, uint64_t *rows) {
+  uint16_t i = condition->index_to_use;
+  ensure(i > 0 && i < schema->count,
+      msg("Invalid index for query condition"), with(i, "%d"));
+  table_stats_t *stats = 0;
+  defer(free, stats);
+  ensure(table_stats_load(tx, schema, &stats));
+  uint64_t distinct =
+      MAX(1, table_stats_distinct(&stats->indexes[i]));
+  uint64_t per_key = MAX(1, (stats->rows + distinct - 1) / distinct);
+  span_t *start = &condition->start, *end = &condition->end;
+  if (schema->types[i] == index_type_hash ||
+      (start->size && start->size == end->size &&
+          !memcmp(start->address, end->address, start->size))) {
+    *rows = MIN(stats->rows, per_key);  // a single key
+    return success();
+  }
+  uint8_t buffer[TABLE_COVERING_KEY_MAX_SIZE * 2];
+  span_t lower = {0}, upper = {0};
+  if (start->size) {
+    ensure(table_index_key(schema, i, start, 0, buffer, &lower));
+  }
+  if (end->size) {
+    ensure(table_index_key(schema, i, end, 0,
+        buffer + TABLE_COVERING_KEY_MAX_SIZE, &upper));
+  }
+  *rows = table_stats_range(stats, i, &lower, &upper);
+  return success();
+}
+
+result_t table_choose_index(txn_t *tx, table_schema_t *schema,
+    table_condition_t *conditions, size_t number_of_conditions,
+    size_t *best) {
+  ensure(number_of_conditions > 0,
+      msg("At least one condition is required"));
+  uint64_t least = UINT64_MAX;
+  for (size_t c = 0; c < number_of_conditions; c++) {
+    uint64_t rows;
+    ensure(table_estimate(tx, schema, &conditions[c], &rows));
+    if (rows >= least) continue;
+    least = rows;
+    *best = c;
+  }
+  return success();
+}
+// end::table_estimate[]
@@ -13,6 +13,88 @@
 #include <gavran/test.h>
 
 // tag::tests18[]
+static index_type_t users_types[3] = {
+    index_type_container, index_type_btree, index_type_hash};
+
+static result_t create_users_table(
+    txn_t *tx, uint64_t ids[3], table_schema_t *schema) {
+  memset(schema, 0, sizeof(table_schema_t));
+  schema->name      = "users";
+  schema->count     = 3;
+  schema->types     = users_types;
+  schema->index_ids = ids;
+  ensure(table_create(tx, schema));
+  return success();
+}
+
+static span_t str_span(char *s) {
+  span_t span = {.address = s, .size = strlen(s)};
+  return span;
+}
+
+static result_t get_user_by(txn_t *tx, table_schema_t *schema,
+    uint16_t index, char *key, span_t *result) {
+  span_t entries[3] = {str_span(key)};
+  table_item_t get  = {.schema = schema,
+      .entries              = entries,
+      .number_of_entries    = 3,
+      .index_to_use         = index};
+  ensure(table_get(tx, &get));
+  *result = get.result;
+  return success();
+}
+
+static bool has_error_message(const char *text) {
+  size_t count;
+  const char **messages = errors_get_messages(&count);
+  for (size_t i = 0; i < count; i++) {
+    if (strstr(messages[i], text)) return true;
+  }
+  return false;
+}
+
+static result_t extract_field(void *state, span_t *row, span_t *key) {
+  table_field_t *field = state;
+  ensure(row->size >= (size_t)field->offset + field->size);
+  key->address = row->address + field->offset;
+  key->size    = field->size;
+  return success();
+}
+
+static void count_shipped(
+    void *state, uint64_t tx_id, span_t *record) {
+  (void)tx_id;
+  (void)record;
+  (*(size_t *)state)++;
+}
+
+#ifdef GAVRAN_FAULTS
+static void fill_crash_page(void *address, uint64_t version) {
+  uint64_t *words = address;
+  uint64_t x      = version * 0x9E3779B97F4A7C15UL + 1;
+  for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    words[i] = x;
+  }
+  words[0] = version;
+}
+
+static result_t write_crash_version(
+    db_t *db, uint64_t page_num, uint64_t version) {
+  txn_t tx;
+  ensure(txn_create(db, TX_WRITE, &tx));
+  defer(txn_close, tx);
+  page_t p = {.page_num = page_num};
+  ensure(txn_modify_page(&tx, &p));
+  for (size_t i = 0; i < p.number_of_pages; i++)
+    fill_crash_page((char *)p.address + i * PAGE_SIZE, version);
+  ensure(txn_commit(&tx));
+  return success();
+}
+#endif
+
 describe(tables) {
   before_each() {
     errors_clear();
@@ -41,5 +123,1676 @@ describe(tables) {
       assert(root.index_ids[1] == 4);
     }
   }
+
+  it("can update a row, touching only changed indexes") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    uint64_t ids[3];
+    table_schema_t users;
+    assert(create_users_table(&tx, ids, &users));
+
+    span_t entries[3] = {str_span("oren:oren@ravendb.net"),
+        str_span("oren@ravendb.net"), str_span("oren")};
+    table_item_t item = {.schema = &users,
+        .entries                 = entries,
+        .number_of_entries       = 3};
+    assert(table_set(&tx, &item));
+    uint64_t item_id = item.item_id;
+
+    span_t updated[3] = {str_span("oren:oren@example.com"),
+        str_span("oren@example.com"), str_span("oren")};
+    item.entries = updated;
+    assert(table_update(&tx, &item, entries));
+    assert(item.item_id == item_id);  // same size, in place
+
+    span_t result;
+    assert(get_user_by(&tx, &users, 1, "oren@ravendb.net", &result));
+    assert(result.size == 0);
+    assert(get_user_by(&tx, &users, 1, "oren@example.com", &result));
+    assert(result.size == updated[0].size);
+    assert(!memcmp(result.address, "oren:oren@example.com", 21));
+    assert(get_user_by(&tx, &users, 2, "oren", &result));
+    assert(result.size == updated[0].size);
+
+    // grow to a large item, forcing the row to move
+    char *large;
+    assert(mem_calloc((void *)&large, 16 * 1024));
+    defer(free, large);
+    memcpy(large, "oren:large", 10);
+    span_t moved[3] = {{.address = large, .size = 16 * 1024},
+        str_span("oren@example.com"), str_span("oren")};
+    item.entries = moved;
+    assert(table_update(&tx, &item, updated));
+    assert(item.item_id != item_id);
+
+    assert(get_user_by(&tx, &users, 1, "oren@example.com", &result));
+    assert(result.size == 16 * 1024);
+    assert(get_user_by(&tx, &users, 2, "oren", &result));
+    assert(result.size == 16 * 1024);
+    assert(!memcmp(result.address, "oren:large", 10));
+
+    assert(table_del(&tx, &item));
+    assert(get_user_by(&tx, &users, 1, "oren@example.com", &result));
+    assert(result.size == 0);
+    assert(get_user_by(&tx, &users, 2, "oren", &result));
+    assert(result.size == 0);
+  }
+
+  it("rejects an update to an existing unique key") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    uint64_t ids[3];
+    table_schema_t users;
+    assert(create_users_table(&tx, ids, &users));
+
+    span_t first[3] = {
+        str_span("a:a@a.com"), str_span("a@a.com"), str_span("a")};
+    span_t second[3] = {
+        str_span("b:b@b.com"), str_span("b@b.com"), str_span("b")};
+    table_item_t item = {
+        .schema = &users, .entries = first, .number_of_entries = 3};
+    assert(table_set(&tx, &item));
+    item.entries = second;
+    assert(table_set(&tx, &item));
+
+    span_t clash[3] = {
+        str_span("b:a@a.com"), str_span("a@a.com"), str_span("b")};
+    item.entries = clash;
+    assert(!table_update(&tx, &item, second));
+    size_t count;
+    errors_get_codes(&count);
+    assert(count > 0);
+    errors_clear();
+  }
+
+  it("can insert many rows in a single batch") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    uint64_t ids[3];
+    table_schema_t users;
+    assert(create_users_table(&tx, ids, &users));
+
+    size_t count = 1000;
+    char *buffer;
+    assert(mem_calloc((void *)&buffer, count * 64));
+    defer(free, buffer);
+    span_t *entries;
+    assert(mem_calloc((void *)&entries, count * 3 * sizeof(span_t)));
+    defer(free, entries);
+    table_item_t *rows;
+    assert(mem_calloc((void *)&rows, count * sizeof(table_item_t)));
+    defer(free, rows);
+    for (size_t i = 0; i < count; i++) {
+      size_t n  = (i * 7919) % count;  // insert out of order
+      char *row = buffer + i * 64;
+      sprintf(row, "user-%04zu:user%04zu@ravendb.net", n, n);
+      span_t *e = entries + i * 3;
+      e[0]      = (span_t){.address = row, .size = 30};
+      e[1]      = (span_t){.address = row + 10, .size = 20};
+      e[2]      = (span_t){.address = row, .size = 9};
+      rows[i].entries           = e;
+      rows[i].number_of_entries = 3;
+    }
+    assert(table_set_many(&tx, &users, rows, count));
+
+    for (size_t i = 0; i < count; i++) {
+      char key[32];
+      span_t result;
+      sprintf(key, "user%04zu@ravendb.net", i);
+      assert(get_user_by(&tx, &users, 1, key, &result));
+      assert(result.size == 30);
+      assert(!memcmp(result.address + 10, key, 20));
+      sprintf(key, "user-%04zu", i);
+      assert(get_user_by(&tx, &users, 2, key, &result));
+      assert(result.size == 30);
+      assert(!memcmp(result.address, key, 9));
+    }
+    for (size_t i = 0; i < count; i++) {
+      container_item_t item = {
+          .container_id = ids[0], .item_id = rows[i].item_id};
+      assert(container_item_get(&tx, &item));
+      assert(item.data.size == rows[i].entries[0].size);
+    }
+  }
+
+  it("keeps hash indexes valid for inserts in bucket order") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    uint64_t ids[3];
+    table_schema_t users;
+    assert(create_users_table(&tx, ids, &users));
+
+    // enough rows to split the hash pages many times over
+    size_t count = 50000;
+    char *buffer;
+    assert(mem_calloc((void *)&buffer, count * 64));
+    defer(free, buffer);
+    span_t *entries;
+    assert(mem_calloc((void *)&entries, count * 3 * sizeof(span_t)));
+    defer(free, entries);
+    table_item_t *rows;
+    assert(mem_calloc((void *)&rows, count * sizeof(table_item_t)));
+    defer(free, rows);
+    for (size_t i = 0; i < count; i++) {
+      char *row = buffer + i * 64;
+      sprintf(row, "user-%06zu:user%06zu@ravendb.net", i, i);
+      span_t *e = entries + i * 3;
+      e[0]      = (span_t){.address = row, .size = 34};
+      e[1]      = (span_t){.address = row + 12, .size = 22};
+      e[2]      = (span_t){.address = row, .size = 11};
+      rows[i].entries           = e;
+      rows[i].number_of_entries = 3;
+    }
+    assert(table_set_many(&tx, &users, rows, count));
+    for (size_t i = 0; i < count; i += 2) {
+      rows[i].schema = &users;
+      assert(table_del(&tx, &rows[i]));
+    }
+    for (size_t i = 0; i < count; i++) {
+      char key[16];
+      span_t result;
+      sprintf(key, "user-%06zu", i);
+      assert(get_user_by(&tx, &users, 2, key, &result));
+      assert(result.size == (i % 2 ? 34 : 0));
+    }
+  }
+
+  it("can answer queries from a covering index") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    index_type_t types[2]  = {index_type_container, index_type_btree};
+    table_field_t covers[2] = {{0}, {.offset = 0, .size = 4}};
+    uint64_t ids[2];
+    table_schema_t emails = {.name = "emails",
+        .count                     = 2,
+        .types                     = types,
+        .index_ids                 = ids,
+        .covers                    = covers};
+    assert(table_create(&tx, &emails));
+
+    table_schema_t loaded;
+    assert(table_get_schema(&tx, "emails", &loaded));
+    assert(loaded.covers);
+    assert(loaded.covers[1].offset == 0);
+    assert(loaded.covers[1].size == 4);
+
+    span_t first[2]  = {str_span("oren:oren@ravendb.net"),
+        str_span("oren@ravendb.net")};
+    span_t second[2] = {str_span("ayen:oren@ravendb.net.il"),
+        str_span("oren@ravendb.net.il")};  // key is a prefix
+    table_item_t item = {
+        .schema = &loaded, .entries = first, .number_of_entries = 2};
+    assert(table_set(&tx, &item));
+    uint64_t first_id = item.item_id;
+    item.entries      = second;
+    assert(table_set(&tx, &item));
+
+    span_t key[2]    = {str_span("oren@ravendb.net")};
+    table_item_t get = {.schema = &loaded,
+        .entries                = key,
+        .number_of_entries      = 2,
+        .index_to_use           = 1};
+    assert(table_get_covered(&tx, &get));
+    assert(get.result.size == 4);
+    assert(!memcmp(get.result.address, "oren", 4));
+    assert(get.item_id == first_id);
+    assert(table_get(&tx, &get));  // full row, via the same index
+    assert(get.result.size == first[0].size);
+
+    key[0] = str_span("oren@ravendb.net.il");
+    assert(table_get_covered(&tx, &get));
+    assert(!memcmp(get.result.address, "ayen", 4));
+
+    span_t renamed[2] = {str_span("eini:oren@ravendb.net"),
+        str_span("oren@ravendb.net")};
+    item.entries      = renamed;
+    item.item_id      = first_id;
+    assert(table_update(&tx, &item, first));
+    key[0] = str_span("oren@ravendb.net");
+    assert(table_get_covered(&tx, &get));
+    assert(!memcmp(get.result.address, "eini", 4));
+
+    assert(table_del(&tx, &item));
+    assert(table_get_covered(&tx, &get));
+    assert(get.result.size == 0);
+    key[0] = str_span("oren@ravendb.net.il");
+    assert(table_get_covered(&tx, &get));
+    assert(get.result.size == 4);
+  }
+
+  it("can scan a table with predicates and projection") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    uint64_t ids[3];
+    table_schema_t users;
+    assert(create_users_table(&tx, ids, &users));
+
+    // rows are: id (4), name (6), country (2)
+    char *names[3]     = {"alice", "bob", "carol"};
+    char *countries[3] = {"IL", "US", "UK"};
+    char rows[200][16];
+    for (size_t i = 0; i < 200; i++) {
+      sprintf(rows[i], "%04zu%-6s%s", i, names[i % 3],
+          countries[i % 3 == 0 ? 0 : (i % 2) + 1]);
+      span_t entries[3] = {{.address = rows[i], .size = 12},
+          {.address = rows[i], .size = 4},
+          {.address = rows[i], .size = 10}};
+      table_item_t item = {.schema = &users,
+          .entries                 = entries,
+          .number_of_entries       = 3};
+      assert(table_set(&tx, &item));
+    }
+    char *large;  // stored outside of the container pages
+    assert(mem_calloc((void *)&large, 16 * 1024));
+    defer(free, large);
+    memcpy(large, "9999carol IL", 12);
+    span_t entries[3] = {{.address = large, .size = 16 * 1024},
+        {.address = large, .size = 4},
+        {.address = large, .size = 10}};
+    table_item_t item = {
+        .schema = &users, .entries = entries, .number_of_entries = 3};
+    assert(table_set(&tx, &item));
+
+    table_scan_t all = {.tx = &tx, .schema = &users};
+    defer(table_scan_close, all);
+    size_t total = 0;
+    do {
+      assert(table_scan_next(&all));
+      total += all.count;
+    } while (all.count);
+    assert(total == 201);  // hash references are not rows
+
+    table_predicate_t preds[2] = {
+        {.field = {.offset = 10, .size = 2},
+            .op    = table_predicate_eq,
+            .value = str_span("IL")},
+        {.field = {.offset = 0, .size = 4},
+            .op    = table_predicate_range,
+            .value = str_span("0050"),
+            .upper = str_span("0150")}};
+    table_field_t name  = {.offset = 4, .size = 6};
+    table_scan_t scan   = {.tx = &tx,
+        .schema               = &users,
+        .predicates           = preds,
+        .number_of_predicates = 2,
+        .projection           = &name,
+        .number_of_fields     = 1};
+    defer(table_scan_close, scan);
+    size_t matches = 0;
+    do {
+      assert(table_scan_next(&scan));
+      for (size_t i = 0; i < scan.count; i++) {
+        assert(scan.rows[i].size == 6);
+        assert(!memcmp(scan.rows[i].address, "alice ", 6));
+      }
+      matches += scan.count;
+    } while (scan.count);
+    assert(matches == 34);  // multiples of 3 in [50, 150]
+
+    table_predicate_t prefix = {.field = {.offset = 4, .size = 6},
+        .op    = table_predicate_prefix,
+        .value = str_span("car")};
+    table_scan_t carols = {.tx = &tx,
+        .schema               = &users,
+        .predicates           = &prefix,
+        .number_of_predicates = 1};
+    defer(table_scan_close, carols);
+    matches = 0;
+    do {
+      assert(table_scan_next(&carols));
+      matches += carols.count;
+    } while (carols.count);
+    assert(matches == 67);  // 66 rows plus the large one
+
+    // the scans above shared the references, a new row adds one
+    char row[16] = "0200bob   US";
+    span_t more[3] = {{.address = row, .size = 12},
+        {.address = row, .size = 4}, {.address = row, .size = 10}};
+    table_item_t added = {
+        .schema = &users, .entries = more, .number_of_entries = 3};
+    assert(table_set(&tx, &added));
+    table_scan_t again = {.tx = &tx, .schema = &users};
+    defer(table_scan_close, again);
+    total = 0;
+    do {
+      assert(table_scan_next(&again));
+      total += again.count;
+    } while (again.count);
+    assert(total == 202);
+
+    // rows are never dropped from the results for being too short
+    table_field_t past_end = {.offset = 10, .size = 8};
+    table_scan_t short_rows = {.tx = &tx,
+        .schema                   = &users,
+        .projection               = &past_end,
+        .number_of_fields         = 1};
+    defer(table_scan_close, short_rows);
+    assert(!table_scan_next(&short_rows));
+    assert(has_error_message("Row is too short for the projection"));
+    errors_clear();
+  }
+
+  it("can fetch an index range in page order") {
+    // the pages are hinted through the map, or the file without it
+    for (size_t avoid_mmap = 0; avoid_mmap < 2; avoid_mmap++) {
+      db_t db;
+      db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+          .flags = avoid_mmap ? db_flags_avoid_mmap_io : 0};
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+
+      txn_t tx;
+      assert(txn_create(&db, TX_WRITE, &tx));
+      defer(txn_close, tx);
+      uint64_t ids[3];
+      table_schema_t users;
+      assert(create_users_table(&tx, ids, &users));
+
+      char rows[1000][32];
+      for (size_t i = 0; i < 1000; i++) {
+        size_t n = (i * 7919) % 1000;  // scatter keys over pages
+        sprintf(rows[i], "user-%04zu:user%04zu@ravendb.net", n, n);
+        span_t entries[3] = {{.address = rows[i], .size = 30},
+            {.address = rows[i] + 10, .size = 20},
+            {.address = rows[i], .size = 9}};
+        table_item_t item = {.schema = &users,
+            .entries                 = entries,
+            .number_of_entries       = 3};
+        assert(table_set(&tx, &item));
+      }
+
+      for (size_t key_order = 0; key_order < 2; key_order++) {
+        table_range_t range = {.tx = &tx,
+            .schema                = &users,
+            .index_to_use          = 1,
+            .key_order             = key_order,
+            .start = str_span("user01"),  // prefix of many keys
+            .end   = str_span("user0199@ravendb.net")};
+        defer(table_range_close, range);
+        size_t total = 0;
+        do {
+          assert(table_range_next(&range));
+          for (size_t i = 0; i < range.count; i++) {
+            assert(range.rows[i].size == 30);
+            assert(!memcmp(range.rows[i].address + 10, "user01", 6));
+            if (i == 0) continue;
+            if (key_order) {
+              assert(memcmp(range.rows[i - 1].address,
+                         range.rows[i].address, 30) < 0);
+            } else {
+              assert(range.item_ids[i - 1] < range.item_ids[i]);
+            }
+          }
+          total += range.count;
+        } while (range.count);
+        assert(total == 100);
+      }
+    }
+  }
+
+  it("can add indexes to a populated table") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    index_type_t types[3] = {index_type_container};
+    uint64_t ids[3];
+    table_schema_t users = {.name = "users",
+        .count                    = 1,
+        .types                    = types,
+        .index_ids                = ids};
+    assert(table_create(&tx, &users));
+
+    size_t count = 3000;
+    char *buffer;
+    assert(mem_calloc((void *)&buffer, count * 64));
+    defer(free, buffer);
+    for (size_t i = 0; i < count; i++) {
+      size_t n  = (i * 7919) % count;  // insert out of order
+      char *row = buffer + i * 64;
+      sprintf(row, "user-%04zu:user%04zu@ravendb.net", n, n);
+      span_t entries[1] = {{.address = row, .size = 30}};
+      table_item_t item = {.schema = &users,
+          .entries                 = entries,
+          .number_of_entries       = 1};
+      assert(table_set(&tx, &item));
+    }
+
+    // multiple runs, sorted over two waves of threads
+    table_field_t emails = {.offset = 10, .size = 20};
+    table_field_t names  = {.offset = 0, .size = 9};
+    table_index_options_t by_email = {.extract = extract_field,
+        .state                             = &emails,
+        .threads                           = 2,
+        .type                              = index_type_btree};
+    assert(table_add_index(&tx, &users, &by_email));
+    table_index_options_t by_name = {.extract = extract_field,
+        .state                            = &names,
+        .threads                          = 2,
+        .type                             = index_type_hash};
+    assert(table_add_index(&tx, &users, &by_name));
+    assert(users.count == 3);
+
+    table_schema_t loaded;
+    assert(table_get_schema(&tx, "users", &loaded));
+    assert(loaded.count == 3);
+    assert(loaded.types[1] == index_type_btree);
+    assert(loaded.types[2] == index_type_hash);
+    for (size_t i = 0; i < count; i++) {
+      char key[32];
+      span_t result;
+      sprintf(key, "user%04zu@ravendb.net", i);
+      assert(get_user_by(&tx, &loaded, 1, key, &result));
+      assert(result.size == 30);
+      assert(!memcmp(result.address + 10, key, 20));
+      sprintf(key, "user-%04zu", i);
+      assert(get_user_by(&tx, &loaded, 2, key, &result));
+      assert(result.size == 30);
+      assert(!memcmp(result.address, key, 9));
+    }
+
+    // the bulk built tree accepts regular writes afterward
+    char row[] = "user-9999:user9999@ravendb.net";
+    span_t entries[3] = {{.address = row, .size = 30},
+        {.address = row + 10, .size = 20},
+        {.address = row, .size = 9}};
+    table_item_t item = {.schema = &loaded,
+        .entries                 = entries,
+        .number_of_entries       = 3};
+    assert(table_set(&tx, &item));
+    span_t result;
+    assert(get_user_by(
+        &tx, &loaded, 1, "user9999@ravendb.net", &result));
+    assert(result.size == 30);
+  }
+  it("can add an index to a schema loaded from the database") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    {
+      txn_t tx;
+      assert(txn_create(&db, TX_WRITE, &tx));
+      defer(txn_close, tx);
+      index_type_t types[1] = {index_type_container};
+      uint64_t ids[1];
+      table_schema_t users = {.name = "users",
+          .count                    = 1,
+          .types                    = types,
+          .index_ids                = ids};
+      assert(table_create(&tx, &users));
+      char row[] = "user-0001:user0001@ravendb.net";
+      span_t entries[1] = {{.address = row, .size = 30}};
+      table_item_t item = {.schema = &users,
+          .entries                 = entries,
+          .number_of_entries       = 1};
+      assert(table_set(&tx, &item));
+      assert(txn_commit(&tx));
+    }
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    // points into the (read only) data file, no room to grow
+    table_schema_t users;
+    assert(table_get_schema(&tx, "users", &users));
+    table_field_t names = {.offset = 0, .size = 9};
+    table_index_options_t by_name = {.extract = extract_field,
+        .state                            = &names,
+        .type                             = index_type_btree};
+    assert(table_add_index(&tx, &users, &by_name));
+    assert(users.count == 2);
+    assert(users.types[1] == index_type_btree);
+    span_t entries[2] = {str_span("user-0001")};
+    table_item_t get  = {.schema = &users,
+        .entries              = entries,
+        .number_of_entries    = 2,
+        .index_to_use         = 1};
+    assert(table_get(&tx, &get));
+    assert(get.result.size == 30);
+  }
+
+  it("reports a duplicate only when adding an index finds one") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    index_type_t types[2] = {index_type_container};
+    uint64_t ids[2];
+    table_schema_t users = {.name = "users",
+        .count                    = 1,
+        .types                    = types,
+        .index_ids                = ids};
+    assert(table_create(&tx, &users));
+    char *rows[] = {"user-0001:same", "user-0002:same"};
+    for (size_t i = 0; i < 2; i++) {
+      span_t entries[1] = {str_span(rows[i])};
+      table_item_t item = {.schema = &users,
+          .entries                 = entries,
+          .number_of_entries       = 1};
+      assert(table_set(&tx, &item));
+    }
+
+    table_field_t same = {.offset = 10, .size = 4};
+    table_index_options_t by_same = {.extract = extract_field,
+        .state                            = &same,
+        .type                             = index_type_btree};
+    assert(!table_add_index(&tx, &users, &by_same));
+    assert(has_error_message("Duplicate value"));
+    errors_clear();
+
+    table_field_t empty = {.offset = 0, .size = 0};
+    table_index_options_t by_empty = {.extract = extract_field,
+        .state                             = &empty,
+        .type                              = index_type_btree};
+    assert(!table_add_index(&tx, &users, &by_empty));
+    assert(!has_error_message("Duplicate value"));
+    errors_clear();
+  }
+
+  it("can intersect conditions on several indexes") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    uint64_t ids[3];
+    table_schema_t users;
+    assert(create_users_table(&tx, ids, &users));
+
+    char rows[1000][32];
+    for (size_t i = 0; i < 1000; i++) {
+      size_t n = (i * 7919) % 1000;  // ten groups of 100 users
+      sprintf(rows[i], "grp-%02zu:user%04zu@ravendb.net", n % 10, n);
+      span_t entries[3] = {{.address = rows[i], .size = 27},
+          {.address = rows[i] + 7, .size = 20},
+          {.address = rows[i], .size = 6}};
+      table_item_t item = {.schema = &users,
+          .entries                 = entries,
+          .number_of_entries       = 3};
+      assert(table_set(&tx, &item));
+    }
+
+    table_condition_t conditions[2] = {
+        {.index_to_use = 1,
+            .start     = str_span("user0100@ravendb.net"),
+            .end       = str_span("user0299@ravendb.net")},
+        {.index_to_use = 2, .start = str_span("grp-03")}};
+    table_query_t query = {.tx = &tx,
+        .schema                = &users,
+        .conditions            = conditions,
+        .number_of_conditions  = 2};
+    defer(table_query_close, query);
+    size_t total = 0;
+    do {
+      assert(table_query_next(&query));
+      for (size_t i = 0; i < query.count; i++) {
+        assert(!memcmp(query.rows[i].address, "grp-03", 6));
+        char *hundreds = (char *)query.rows[i].address + 12;
+        assert(*hundreds == '1' || *hundreds == '2');
+        if (i) assert(query.item_ids[i - 1] < query.item_ids[i]);
+      }
+      total += query.count;
+    } while (query.count);
+    assert(total == 20);
+
+    conditions[1].start = str_span("grp-99");  // no such group
+    table_query_t none  = {.tx = &tx,
+        .schema               = &users,
+        .conditions           = conditions,
+        .number_of_conditions = 2};
+    defer(table_query_close, none);
+    assert(table_query_next(&none));
+    assert(none.count == 0);
+  }
+
+  it("can buffer the writes to a btree index") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    uint64_t ids[3], buffer_ids[3] = {0, 1, 0};
+    table_schema_t users = {.name = "users",
+        .count                    = 3,
+        .types                    = users_types,
+        .index_ids                = ids,
+        .buffer_ids               = buffer_ids};
+    assert(table_create(&tx, &users));
+    assert(buffer_ids[1] != 0 && buffer_ids[1] != 1);
+
+    size_t count = 4000;
+    char rows[4000][24];
+    for (size_t i = 0; i < count; i++) {
+      size_t n = (i * 7919) % count;  // insert out of order
+      sprintf(rows[n], "user%05zu@ravendb.net", n);
+      span_t entries[3] = {{.address = rows[n], .size = 21},
+          {.address = rows[n], .size = 21},
+          {.address = rows[n], .size = 9}};
+      table_item_t item = {.schema = &users,
+          .entries                 = entries,
+          .number_of_entries       = 3};
+      assert(table_set(&tx, &item));
+    }
+    span_t dup[3] = {{.address = rows[7], .size = 21},
+        {.address = rows[7], .size = 21}, str_span("other")};
+    table_item_t item = {
+        .schema = &users, .entries = dup, .number_of_entries = 3};
+    assert(!table_set(&tx, &item));
+    errors_clear();
+
+    for (size_t i = 0; i < count; i += 4) {
+      span_t entries[3] = {{.address = rows[i], .size = 21}};
+      table_item_t get  = {.schema = &users,
+          .entries              = entries,
+          .number_of_entries    = 3,
+          .index_to_use         = 1};
+      assert(table_get(&tx, &get));
+      entries[1] = entries[0];  // the row is freed before the keys
+      entries[2] = (span_t){.address = rows[i], .size = 9};
+      assert(table_del(&tx, &get));
+    }
+    for (size_t i = 0; i < count; i++) {
+      span_t result;
+      assert(get_user_by(&tx, &users, 1, rows[i], &result));
+      assert(result.size == (i % 4 ? 21 : 0));
+    }
+
+    for (size_t pass = 0; pass < 2; pass++) {
+      table_range_t range = {.tx = &tx,
+          .schema                = &users,
+          .index_to_use          = 1,
+          .start                 = str_span("user01000@ravendb.net"),
+          .end                   = str_span("user01999@ravendb.net"),
+          .key_order             = true};
+      defer(table_range_close, range);
+      size_t total = 0;
+      do {
+        assert(table_range_next(&range));
+        for (size_t i = 0; i < range.count; i++) {
+          assert(!memcmp(range.rows[i].address, "user01", 6));
+        }
+        total += range.count;
+      } while (range.count);
+      assert(total == 750);
+      assert(table_merge_buffers(&tx, &users));
+    }
+    {
+      btree_cursor_t it = {.tx = &tx, .tree_id = buffer_ids[1]};
+      assert(btree_cursor_at_start(&it));
+      defer(btree_free_cursor, it);
+      assert(btree_get_next(&it));
+      assert(it.has_val == false);  // all merged
+    }
+    assert(txn_commit(&tx));
+    assert(txn_close(&tx));
+
+    txn_t rtx;
+    assert(txn_create(&db, TX_READ, &rtx));
+    defer(txn_close, rtx);
+    table_schema_t loaded;
+    assert(table_get_schema(&rtx, "users", &loaded));
+    assert(loaded.buffer_ids);
+    assert(loaded.buffer_ids[1] == buffer_ids[1]);
+    span_t result;
+    assert(get_user_by(&rtx, &loaded, 1, rows[3999], &result));
+    assert(result.size == 21);
+  }
+
+  it("can keep statistics for choosing an index") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    uint64_t ids[3];
+    table_schema_t users;
+    assert(create_users_table(&tx, ids, &users));
+
+    char rows[1000][32];
+    for (size_t i = 0; i < 1000; i++) {
+      sprintf(rows[i], "grp-%02zu:user%04zu@ravendb.net", i % 10, i);
+      span_t entries[3] = {{.address = rows[i], .size = 27},
+          {.address = rows[i] + 7, .size = 20},
+          {.address = rows[i], .size = 6}};
+      table_item_t item = {.schema = &users,
+          .entries                 = entries,
+          .number_of_entries       = 3};
+      assert(table_set(&tx, &item));
+    }
+
+    table_stats_t *stats = 0;
+    defer(free, stats);
+    assert(table_get_stats(&tx, &users, &stats));
+    assert(stats->rows == 1000);
+    assert(stats->indexes[1].number_of_bounds == 0);  // not analyzed
+    uint64_t distinct = table_stats_distinct(&stats->indexes[1]);
+    assert(distinct > 700 && distinct < 1300);
+    assert(table_stats_distinct(&stats->indexes[2]) == 10);
+
+    assert(table_analyze(&tx, &users));
+    free(stats);
+    stats = 0;
+    assert(table_get_stats(&tx, &users, &stats));
+    assert(stats->rows == 1000);
+    assert(stats->indexes[1].number_of_bounds == TABLE_STATS_BOUNDS);
+
+    table_condition_t conditions[3] = {
+        {.index_to_use = 1,
+            .start     = str_span("user0100@ravendb.net"),
+            .end       = str_span("user0299@ravendb.net")},
+        {.index_to_use = 2, .start = str_span("grp-03")},
+        {.index_to_use = 1,
+            .start     = str_span("user0500@ravendb.net"),
+            .end       = str_span("user0509@ravendb.net")}};
+    uint64_t estimate;
+    assert(table_estimate(&tx, &users, &conditions[0], &estimate));
+    assert(estimate >= 200 && estimate <= 400);
+    assert(table_estimate(&tx, &users, &conditions[1], &estimate));
+    assert(estimate == 100);
+    assert(table_estimate(&tx, &users, &conditions[2], &estimate));
+    assert(estimate < 100);
+
+    size_t best;
+    assert(table_choose_index(&tx, &users, conditions, 2, &best));
+    assert(best == 1);
+    assert(table_choose_index(&tx, &users, conditions, 3, &best));
+    assert(best == 2);
+
+    span_t entries[3] = {{.address = rows[0] + 7, .size = 20}};
+    table_item_t item = {.schema = &users,
+        .entries                 = entries,
+        .number_of_entries       = 3,
+        .index_to_use            = 1};
+    assert(table_get(&tx, &item));
+    entries[0] = item.result;
+    entries[1] = (span_t){.address = rows[0] + 7, .size = 20};
+    entries[2] = (span_t){.address = rows[0], .size = 6};
+    assert(table_del(&tx, &item));
+    free(stats);
+    stats = 0;
+    assert(table_get_stats(&tx, &users, &stats));
+    assert(stats->rows == 999);
+
+    // the row count is written as the transaction commits
+    assert(txn_commit(&tx));
+    assert(txn_close(&tx));
+    assert(txn_create(&db, TX_WRITE, &tx));
+    free(stats);
+    stats = 0;
+    assert(table_get_stats(&tx, &users, &stats));
+    assert(stats->rows == 999);
+    entries[0] = (span_t){.address = rows[0], .size = 27};
+    assert(table_set(&tx, &item));
+    assert(txn_close(&tx));  // rolled back
+    assert(txn_create(&db, TX_READ, &tx));
+    free(stats);
+    stats = 0;
+    assert(table_get_stats(&tx, &users, &stats));
+    assert(stats->rows == 999);
+  }
+
+  it("can range over typed composite keys") {
+    uint8_t a[TABLE_KEY_MAX_SIZE], b[TABLE_KEY_MAX_SIZE];
+    double doubles[] = {-1e10, -2.5, -0.0, 0.0, 1.5, 1e10};
+    for (size_t i = 1; i < 6; i++) {
+      table_key_append_double(a, doubles[i - 1]);
+      table_key_append_double(b, doubles[i]);
+      assert(memcmp(a, b, 8) <= 0);
+    }
+    span_t strs[2] = {{.address = "ab", .size = 2},
+        {.address = "ab\0c", .size = 4}};
+    uint8_t *end = table_key_append_string(a, &strs[0]);
+    table_key_append_string(b, &strs[1]);
+    assert(memcmp(a, b, (size_t)(end - a)) < 0);
+    char copy[8];
+    span_t read = {.address = copy};
+    table_key_read_string(b, &read);
+    assert(read.size == 4 && !memcmp(copy, "ab\0c", 4));
+
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    // (device, timestamp), read from the row
+    index_type_t types[2] = {index_type_container, index_type_btree};
+    table_key_t keys[2]   = {{.number_of_parts = 0},
+        {.number_of_parts = 2,
+            .parts        = {
+                {.field = {.offset = 0, .size = 4},
+                    .type = table_key_int},
+                {.field = {.offset = 8, .size = 8},
+                    .type = table_key_timestamp}}}};
+    uint64_t ids[2];
+    table_schema_t readings = {.name = "readings",
+        .count                       = 2,
+        .types                       = types,
+        .index_ids                   = ids,
+        .keys                        = keys};
+    assert(table_create(&tx, &readings));
+
+    typedef struct reading {
+      int32_t device;
+      uint8_t padding[4];
+      int64_t ts;
+    } reading_t;
+    reading_t rows[700];
+    table_item_t items[700];
+    span_t entries[700][2];
+    for (size_t i = 0; i < 700; i++) {
+      size_t n    = (i * 7919) % 700;  // out of order
+      rows[i]     = (reading_t){.device = (int32_t)(n % 7) - 3,
+          .ts = (int64_t)(n / 7) * 10 - 500};
+      entries[i][0] = (span_t){.address = &rows[i], .size = 16};
+      entries[i][1] = (span_t){0};  // built from the row
+      items[i] = (table_item_t){.schema = &readings,
+          .entries                      = entries[i],
+          .number_of_entries            = 2};
+    }
+    assert(table_set_many(&tx, &readings, items, 700));
+
+    table_schema_t loaded;
+    assert(table_get_schema(&tx, "readings", &loaded));
+    assert(loaded.keys && loaded.keys[1].number_of_parts == 2);
+    assert(loaded.keys[1].parts[1].type == table_key_timestamp);
+
+    // device -1, timestamps -100 to 200
+    uint8_t lower[16], upper[16];
+    table_key_append_int(table_key_append_int(lower, -1), -100);
+    table_key_append_int(table_key_append_int(upper, -1), 200);
+    table_range_t range = {.tx = &tx,
+        .schema                = &loaded,
+        .index_to_use          = 1,
+        .key_order             = true,
+        .start                 = {.address = lower, .size = 16},
+        .end                   = {.address = upper, .size = 16}};
+    defer(table_range_close, range);
+    int64_t expected = -100;
+    do {
+      assert(table_range_next(&range));
+      for (size_t i = 0; i < range.count; i++) {
+        reading_t *r = range.rows[i].address;
+        assert(r->device == -1 && r->ts == expected);
+        expected += 10;
+      }
+    } while (range.count);
+    assert(expected == 210);
+
+    // every reading of device 2, as a prefix scan
+    table_key_append_int(lower, 2);
+    table_range_t prefix = {.tx = &tx,
+        .schema                 = &loaded,
+        .index_to_use           = 1,
+        .end_is_prefix          = true,
+        .start                  = {.address = lower, .size = 8},
+        .end                    = {.address = lower, .size = 8}};
+    defer(table_range_close, prefix);
+    size_t total = 0;
+    do {
+      assert(table_range_next(&prefix));
+      for (size_t i = 0; i < prefix.count; i++) {
+        assert(((reading_t *)prefix.rows[i].address)->device == 2);
+      }
+      total += prefix.count;
+    } while (prefix.count);
+    assert(total == 100);
+
+    // updates and deletes find the old key from the old row
+    reading_t moved   = rows[0];
+    moved.device      = 100;
+    span_t updated[2] = {{.address = &moved, .size = 16}, {0}};
+    items[0].entries  = updated;
+    assert(table_update(&tx, &items[0], entries[0]));
+    table_key_append_int(table_key_append_int(lower, 100), moved.ts);
+    span_t key       = {.address = lower, .size = 16};
+    table_item_t get = {.schema = &loaded,
+        .entries                = &key,
+        .number_of_entries      = 2,
+        .index_to_use           = 1};
+    assert(table_get(&tx, &get));
+    assert(get.result.size == 16);
+    assert(table_del(&tx, &items[0]));
+    assert(table_get(&tx, &get));
+    assert(get.result.size == 0);
+  }
+
+  it("can look up many btree keys at once") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    uint64_t tree_id;
+    assert(btree_create(&tx, &tree_id));
+
+    size_t count = 20000;
+    char keys[20000][12];
+    for (size_t i = 0; i < count; i++) {
+      size_t n = (i * 7919) % count;
+      sprintf(keys[n], "key-%06zu", n);
+      btree_val_t set = {.tree_id = tree_id,
+          .key = {.address = keys[n], .size = strlen(keys[n])},
+          .val = n};
+      if (n % 3) assert(btree_set(&tx, &set, 0));  // some missing
+    }
+
+    // out of order, with repeats, landing on many leaves
+    size_t lookups = 3000;
+    btree_val_t *kvps;
+    assert(mem_calloc((void *)&kvps, lookups * sizeof(btree_val_t)));
+    defer(free, kvps);
+    for (size_t i = 0; i < lookups; i++) {
+      size_t n    = (i * 104729) % count;
+      kvps[i].key = (span_t){.address = keys[n], .size = 10};
+    }
+    assert(btree_get_many(&tx, tree_id, kvps, lookups));
+    for (size_t i = 0; i < lookups; i++) {
+      size_t n        = (i * 104729) % count;
+      btree_val_t get = {.tree_id = tree_id, .key = kvps[i].key};
+      assert(btree_get(&tx, &get));
+      assert(kvps[i].has_val == get.has_val);
+      assert(kvps[i].has_val == ((n % 3) != 0));
+      if (kvps[i].has_val) assert(kvps[i].val == n);
+    }
+  }
+
+  it("can keep values inline up to the configured size") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .inline_max_size                  = BTREE_INLINE_LIMIT};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    assert(btree_inline_max_size(&tx) == BTREE_INLINE_LIMIT);
+    uint64_t tree_id;
+    assert(btree_create(&tx, &tree_id));
+
+    // the largest keys and values, splitting the leaves often
+    uint8_t key[512], value[BTREE_INLINE_LIMIT];
+    size_t count = 300;
+    for (size_t i = 0; i < count; i++) {
+      size_t n = (i * 7919) % count;
+      memset(key, 'k', sizeof(key));
+      memset(value, (int)n, sizeof(value));
+      sprintf((char *)key, "%04zu", n);
+      span_t data     = {
+          .address = value, .size = n % 2 ? sizeof(value) : n};
+      btree_val_t set = {.tree_id = tree_id,
+          .key  = {.address = key, .size = sizeof(key)},
+          .data = data};
+      assert(btree_set(&tx, &set, 0));
+    }
+    for (size_t i = 0; i < count; i++) {
+      memset(key, 'k', sizeof(key));
+      sprintf((char *)key, "%04zu", i);
+      btree_val_t get = {.tree_id = tree_id,
+          .key = {.address = key, .size = sizeof(key)}};
+      assert(btree_get(&tx, &get));  // a single lookup
+      assert(get.has_val);
+      assert(get.data.size == (i % 2 ? sizeof(value) : i));
+      for (size_t b = 0; b < get.data.size; b++) {
+        assert(((uint8_t *)get.data.address)[b] == (uint8_t)i);
+      }
+    }
+    btree_val_t big = {.tree_id = tree_id,
+        .key  = {.address = key, .size = 4},
+        .data = {.address = value, .size = sizeof(value) + 1}};
+    assert(!btree_set(&tx, &big, 0));
+    errors_clear();
+
+    assert(txn_commit(&tx));
+    assert(txn_close(&tx));
+
+    // reopened with the default size, the values stored inline under
+    // the larger one are still read from the leaves
+    assert(db_close(&db));
+    options.inline_max_size = 0;
+    assert(db_create("/tmp/db/try", &options, &db));
+    assert(txn_create(&db, TX_WRITE, &tx));
+    assert(btree_inline_max_size(&tx) == BTREE_INLINE_MAX_SIZE);
+    for (size_t i = 1; i < count; i += 2) {
+      memset(key, 'k', sizeof(key));
+      sprintf((char *)key, "%04zu", i);
+      btree_val_t get = {.tree_id = tree_id,
+          .key = {.address = key, .size = sizeof(key)}};
+      assert(btree_get(&tx, &get));
+      assert(get.has_val && get.data.size == sizeof(value));
+    }
+    btree_val_t over = {.tree_id = tree_id,
+        .key  = {.address = key, .size = sizeof(key)},
+        .data = {.address = value, .size = sizeof(value)}};
+    assert(!btree_set(&tx, &over, 0));
+    errors_clear();
+
+    options.inline_max_size = BTREE_INLINE_LIMIT + 1;
+    db_t invalid;
+    assert(!db_create("/tmp/db/other", &options, &invalid));
+    errors_clear();
+  }
+
+  it("can serve hot rows from the row cache") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .row_cache_size                   = 64 * 1024};
+    randombytes_buf(options.encryption_key, 32);
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    db_row_cache_t *cache = db.state->row_cache;
+    assert(cache);
+
+    uint64_t ids[3];
+    table_schema_t users;
+    span_t entries[3] = {str_span("oren:oren@ravendb.net"),
+        str_span("oren@ravendb.net"), str_span("oren")};
+    table_item_t item = {.schema = &users,
+        .entries                 = entries,
+        .number_of_entries       = 3};
+    {
+      txn_t tx;
+      assert(txn_create(&db, TX_WRITE, &tx));
+      defer(txn_close, tx);
+      assert(create_users_table(&tx, ids, &users));
+      assert(table_set(&tx, &item));
+      assert(txn_commit(&tx));
+    }
+
+    span_t result;
+    for (size_t i = 0; i < 3; i++) {
+      txn_t rtx;
+      assert(txn_create(&db, TX_READ, &rtx));
+      defer(txn_close, rtx);
+      assert(
+          get_user_by(&rtx, &users, 1, "oren@ravendb.net", &result));
+      assert(result.size == entries[0].size);
+      assert(!memcmp(result.address, "oren:oren@ravendb.net", 21));
+    }
+    assert(cache->misses == 1);
+    assert(cache->hits == 2);
+
+    txn_t old;  // opened before the update, keeps the old row
+    assert(txn_create(&db, TX_READ, &old));
+    defer(txn_close, old);
+    {
+      span_t updated[3] = {str_span("oren:oren@example.com"),
+          str_span("oren@example.com"), str_span("oren")};
+      txn_t tx;
+      assert(txn_create(&db, TX_WRITE, &tx));
+      defer(txn_close, tx);
+      item.entries = updated;
+      assert(table_update(&tx, &item, entries));
+      assert(txn_commit(&tx));
+    }
+    assert(!cache->used);  // the commit dropped the stale row
+
+    assert(get_user_by(&old, &users, 1, "oren@ravendb.net", &result));
+    assert(!memcmp(result.address, "oren:oren@ravendb.net", 21));
+    for (size_t i = 0; i < 2; i++) {
+      txn_t rtx;
+      assert(txn_create(&db, TX_READ, &rtx));
+      defer(txn_close, rtx);
+      assert(
+          get_user_by(&rtx, &users, 1, "oren@example.com", &result));
+      assert(!memcmp(result.address, "oren:oren@example.com", 21));
+    }
+    assert(cache->misses == 2);
+    assert(cache->hits == 3);
+
+    // the range and query fetches are served from the cache as well
+    {
+      txn_t rtx;
+      assert(txn_create(&db, TX_READ, &rtx));
+      defer(txn_close, rtx);
+      table_range_t range = {
+          .tx = &rtx, .schema = &users, .index_to_use = 1};
+      defer(table_range_close, range);
+      assert(table_range_next(&range));
+      assert(range.count == 1);
+      assert(!memcmp(
+          range.rows[0].address, "oren:oren@example.com", 21));
+    }
+    {
+      txn_t rtx;
+      assert(txn_create(&db, TX_READ, &rtx));
+      defer(txn_close, rtx);
+      table_condition_t by_email = {
+          .index_to_use = 1, .start = str_span("oren@example.com")};
+      table_query_t query = {.tx = &rtx,
+          .schema                = &users,
+          .conditions            = &by_email,
+          .number_of_conditions  = 1};
+      defer(table_query_close, query);
+      assert(table_query_next(&query));
+      assert(query.count == 1);
+    }
+    assert(cache->misses == 2);
+    assert(cache->hits == 5);
+  }
+
+  it("can store rows in the leaves of a clustered table") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    index_type_t types[2] = {
+        index_type_container, index_type_clustered};
+    uint64_t ids[2];
+    table_schema_t events = {.name = "events",
+        .count                     = 2,
+        .types                     = types,
+        .index_ids                 = ids};
+    assert(table_create(&tx, &events));
+
+    size_t count = 2000;
+    uint8_t *buffer;  // every 10th row is too big for the leaf
+    assert(mem_calloc((void *)&buffer, count * 2048));
+    defer(free, buffer);
+    table_item_t *rows;
+    assert(mem_calloc((void *)&rows, count * sizeof(table_item_t)));
+    defer(free, rows);
+    span_t *entries;
+    assert(mem_calloc((void *)&entries, count * 2 * sizeof(span_t)));
+    defer(free, entries);
+    for (size_t i = 0; i < count; i++) {
+      uint64_t ts = bswap_64((i * 7919) % count);  // out of order
+      uint8_t *row = buffer + i * 2048;
+      memcpy(row, &ts, sizeof(uint64_t));
+      memset(row + 8, (int)i, 2040);
+      entries[i * 2]     = (span_t){.address = row,
+          .size = bswap_64(ts) % 10 ? 100 : 2048};
+      entries[i * 2 + 1] = (span_t){.address = row, .size = 8};
+      rows[i] = (table_item_t){.schema = &events,
+          .entries                     = entries + i * 2,
+          .number_of_entries           = 2};
+    }
+    for (size_t i = 0; i < count / 2; i++) {
+      assert(table_set(&tx, &rows[i]));
+    }
+    assert(
+        table_set_many(&tx, &events, rows + count / 2, count / 2));
+    assert(!table_set(&tx, &rows[0]));  // duplicate key
+    errors_clear();
+
+    uint64_t start = bswap_64(500), end = bswap_64(1499);
+    table_range_t range = {.tx = &tx,
+        .schema                = &events,
+        .index_to_use          = 1,
+        .start                 = {.address = &start, .size = 8},
+        .end                   = {.address = &end, .size = 8}};
+    defer(table_range_close, range);
+    uint64_t expected = 500;
+    do {
+      assert(table_range_next(&range));
+      for (size_t i = 0; i < range.count; i++) {
+        uint64_t ts;
+        memcpy(&ts, range.rows[i].address, sizeof(uint64_t));
+        assert(bswap_64(ts) == expected);
+        assert(range.rows[i].size == (expected % 10 ? 100 : 2048));
+        assert((range.item_ids[i] != 0) == (expected % 10 == 0));
+        expected++;
+      }
+    } while (range.count);
+    assert(expected == 1500);
+
+    // grow a row out of the leaf and move it to a new key
+    table_item_t *item = &rows[42];
+    span_t old[2]      = {item->entries[0], item->entries[1]};
+    uint64_t moved     = bswap_64(count + 1);
+    uint8_t *row       = item->entries[0].address;
+    span_t updated[2]  = {{.address = row, .size = 2048},
+        {.address = &moved, .size = 8}};
+    item->entries      = updated;
+    assert(table_update(&tx, item, old));
+    span_t key       = old[1];
+    table_item_t get = {.schema = &events,
+        .entries                = &key,
+        .number_of_entries      = 2,
+        .index_to_use           = 1};
+    assert(table_get(&tx, &get));
+    assert(get.result.size == 0);
+    key = updated[1];
+    assert(table_get(&tx, &get));
+    assert(get.result.size == 2048 && get.item_id != 0);
+    assert(table_del(&tx, item));
+    assert(table_get(&tx, &get));
+    assert(get.result.size == 0);
+
+    table_scan_t scan = {.tx = &tx, .schema = &events};
+    defer(table_scan_close, scan);
+    size_t total = 0;
+    do {
+      assert(table_scan_next(&scan));
+      total += scan.count;
+    } while (scan.count);
+    assert(total == count - 1);
+  }
+
+  it("can report the latency of commit phases") {
+    size_t shipped       = 0;
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags                            = db_flags_latency_stats,
+        .wal_write_callback               = count_shipped,
+        .wal_write_callback_state         = &shipped};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    db_latency_stats_t before;
+    assert(db_get_latency_stats(&db, &before));
+    size_t shipped_before = shipped;
+    for (size_t i = 0; i < 10; i++) {
+      txn_t tx;
+      assert(txn_create(&db, TX_WRITE, &tx));
+      defer(txn_close, tx);
+      page_t p = {.number_of_pages = 1};
+      assert(txn_allocate_page(&tx, &p, 0));
+      p.metadata->overflow.page_flags      = page_flags_overflow;
+      p.metadata->overflow.number_of_pages = 1;
+      assert(txn_commit(&tx));
+    }
+    db_latency_stats_t stats;
+    assert(db_get_latency_stats(&db, &stats));
+    db_latency_phase_t committed[] = {db_latency_commit,
+        db_latency_finalize_pages, db_latency_wal_prepare,
+        db_latency_wal_hash, db_latency_wal_write,
+        db_latency_log_shipping};
+    for (size_t i = 0; i < sizeof(committed) / sizeof(committed[0]);
+         i++) {
+      db_latency_histogram_t *h = &stats.phases[committed[i]];
+      assert(h->count == before.phases[committed[i]].count + 10);
+      uint64_t p50 = db_latency_percentile(h, 0.5);
+      uint64_t p99 = db_latency_percentile(h, 0.99);
+      assert(p50 <= p99 && p99 <= h->max_ns && h->max_ns);
+    }
+    assert(shipped == shipped_before + 10);
+    // each transaction was written back when it was closed
+    assert(stats.phases[db_latency_gc_writeback].count >= 10);
+    assert(strcmp(db_latency_phase_name(db_latency_wal_hash),
+               "wal_hash") == 0);
+  }
+
+  it("keeps no latency histograms unless asked to") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t tx;
+    assert(txn_create(&db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    page_t p = {.number_of_pages = 1};
+    assert(txn_allocate_page(&tx, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = 1;
+    assert(txn_commit(&tx));
+    db_latency_stats_t stats;
+    assert(db_get_latency_stats(&db, &stats));
+    for (size_t i = 0; i < db_latency_number_of_phases; i++) {
+      assert(stats.phases[i].count == 0);
+    }
+  }
+
+  it("can report the runtime stats of the database") {
+    db_t db;
+    db_options_t options = {.minimum_size = 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    db_stats_t start;
+    assert(db_get_stats(&db, &start));
+    assert(start.file_size == 1024 * 1024 && start.free_pages);
+    assert(!start.open_read_transactions);
+
+    txn_t rtx;
+    assert(txn_create(&db, TX_READ, &rtx));
+    for (size_t i = 0; i < 3; i++) {
+      txn_t tx;
+      assert(txn_create(&db, TX_WRITE, &tx));
+      defer(txn_close, tx);
+      page_t p = {.number_of_pages = 64};
+      assert(txn_allocate_page(&tx, &p, 0));
+      p.metadata->overflow.page_flags      = page_flags_overflow;
+      p.metadata->overflow.number_of_pages = 64;
+      assert(txn_commit(&tx));
+    }
+    db_stats_t stats;
+    assert(db_get_stats(&db, &stats));
+    assert(stats.open_read_transactions == 1);
+    // the reader keeps all three versions alive
+    assert(stats.pending_transactions == 3);
+    assert(stats.pending_version_bytes >= 3 * 64 * PAGE_SIZE);
+    assert(stats.file_growths > start.file_growths);
+    assert(stats.number_of_pages > start.number_of_pages);
+    assert(stats.last_tx_id == start.last_tx_id + 3);
+    assert(stats.wal_write_position[stats.wal_current_file] >
+           start.wal_write_position[start.wal_current_file]);
+
+    assert(txn_close(&rtx));
+    assert(db_get_stats(&db, &stats));
+    assert(!stats.open_read_transactions);
+    assert(!stats.pending_transactions);
+    assert(stats.oldest_active_tx > start.oldest_active_tx);
+
+    db_stats_counter_t counters[DB_STATS_NUMBER_OF_COUNTERS];
+    db_stats_counters(&stats, counters);
+    assert(strcmp(counters[2].name, "free_pages") == 0);
+    assert(counters[2].value == stats.free_pages);
+  }
+#ifdef GAVRAN_FAULTS
+  it("recovers the last durable commit after a torn WAL write") {
+    db_options_t options = {.minimum_size = 1024 * 1024};
+    uint64_t page_num;
+    pal_faults_t faults = {.file_suffix = ".wal",
+        .crash_at_write                 = 6,
+        .torn_write_size                = PAGE_SIZE / 2};
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      {
+        txn_t tx;
+        assert(txn_create(&db, TX_WRITE, &tx));
+        defer(txn_close, tx);
+        page_t p = {.number_of_pages = 4};
+        assert(txn_allocate_page(&tx, &p, 0));
+        p.metadata->overflow.page_flags      = page_flags_overflow;
+        p.metadata->overflow.number_of_pages = 4;
+        page_num                             = p.page_num;
+        assert(txn_commit(&tx));
+      }
+      pal_set_faults(&faults);
+      for (uint64_t v = 1; v <= 10; v++)
+        assert(write_crash_version(&db, page_num, v));
+      pal_set_faults(0);
+    }
+    assert(faults.crashed && faults.writes == 6);
+
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t tx;
+    assert(txn_create(&db, TX_READ, &tx));
+    defer(txn_close, tx);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&tx, &p));
+    void *expected;
+    assert(mem_alloc_page_aligned(&expected, PAGE_SIZE));
+    defer(free, expected);
+    fill_crash_page(expected, 5);
+    for (size_t i = 0; i < 4; i++) {
+      assert(memcmp((char *)p.address + i * PAGE_SIZE, expected,
+                 PAGE_SIZE) == 0);
+    }
+  }
+  it("recovers a diff that runs to the end of the page") {
+    db_options_t options = {.minimum_size = 1024 * 1024};
+    uint64_t page_num;
+    // crash on the next write, so the page is only in the WAL
+    pal_faults_t faults = {.crash_at_write = 1};
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      txn_t rtx;
+      assert(txn_create(&db, TX_READ, &rtx));
+      defer(txn_close, rtx);
+      {
+        txn_t tx;
+        assert(txn_create(&db, TX_WRITE, &tx));
+        defer(txn_close, tx);
+        page_t p = {.number_of_pages = 1};
+        assert(txn_allocate_page(&tx, &p, 0));
+        p.metadata->overflow.page_flags      = page_flags_overflow;
+        p.metadata->overflow.number_of_pages = 1;
+        page_num                             = p.page_num;
+        assert(txn_commit(&tx));
+      }
+      // the open read transaction holds off the write to the file
+      txn_t tx;
+      assert(txn_create(&db, TX_WRITE, &tx));
+      defer(txn_close, tx);
+      page_t p = {.page_num = page_num};
+      assert(txn_modify_page(&tx, &p));
+      uint64_t *words = p.address;
+      for (size_t i = 1000; i < PAGE_SIZE / sizeof(uint64_t); i++)
+        words[i] = i;
+      assert(txn_commit(&tx));
+      pal_set_faults(&faults);
+    }
+    pal_set_faults(0);
+    assert(faults.crashed);
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t tx;
+    assert(txn_create(&db, TX_READ, &tx));
+    defer(txn_close, tx);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&tx, &p));
+    uint64_t *words = p.address;
+    assert(words[PAGE_SIZE / sizeof(uint64_t) - 1] ==
+           PAGE_SIZE / sizeof(uint64_t) - 1);
+  }
+#endif
+  it("can count allocations and syscalls per operation") {
+    db_sys_stats_t stats;
+    {
+      db_t db;
+      db_options_t options = {.minimum_size = 1024 * 1024};
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      txn_t tx;
+      assert(txn_create(&db, TX_WRITE, &tx));
+      assert(txn_close(&tx));
+      assert(db_get_sys_stats(&db, &stats));
+      assert(!stats.ops[db_op_txn_create].calls);  // opt in
+    }
+    db_t db;
+    db_options_t options = {
+        .minimum_size = 1024 * 1024, .flags = db_flags_sys_counters};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    db_sys_stats_t start;  // db_create runs transactions of its own
+    assert(db_get_sys_stats(&db, &start));
+    uint64_t ids[3];
+    table_schema_t users;
+    {
+      txn_t tx;
+      assert(txn_create(&db, TX_WRITE, &tx));
+      defer(txn_close, tx);
+      assert(create_users_table(&tx, ids, &users));
+      char *names[3] = {"a", "b", "c"};
+      for (size_t i = 0; i < 3; i++) {
+        char row[32], email[16];
+        sprintf(row, "%s:%s@a.com", names[i], names[i]);
+        sprintf(email, "%s@a.com", names[i]);
+        span_t entries[3] = {
+            str_span(row), str_span(email), str_span(names[i])};
+        table_item_t item = {.schema = &users,
+            .entries                 = entries,
+            .number_of_entries       = 3};
+        assert(table_set(&tx, &item));
+      }
+      assert(txn_commit(&tx));
+    }
+    txn_t rtx;
+    assert(txn_create(&db, TX_READ, &rtx));
+    defer(txn_close, rtx);
+    span_t row;
+    assert(get_user_by(&rtx, &users, 1, "b@a.com", &row));
+
+    assert(db_get_sys_stats(&db, &stats));
+    // table_create stores the schema with a table_set of its own
+    assert(stats.ops[db_op_table_set].calls -
+               start.ops[db_op_table_set].calls ==
+           4);
+    assert(stats.ops[db_op_table_get].calls == 1);
+    // the indexes are updated as part of the table_set
+    assert(stats.ops[db_op_btree_set].calls ==
+           start.ops[db_op_btree_set].calls);
+    assert(stats.ops[db_op_txn_create].calls -
+               start.ops[db_op_txn_create].calls ==
+           2);
+    assert(stats.ops[db_op_txn_create].sys[sys_counter_alloc]);
+    assert(stats.ops[db_op_txn_commit].sys[sys_counter_pwrite]);
+    assert(stats.ops[db_op_txn_close].sys[sys_counter_free]);
+    assert(strcmp(db_op_name(db_op_btree_set), "btree_set") == 0);
+    assert(strcmp(db_sys_counter_name(sys_counter_fsync), "fsync") ==
+           0);
+  }
+  it("can trace the pages that transactions touch") {
+    db_t db;
+    db_options_t options = {
+        .minimum_size = 1024 * 1024, .page_trace_size = 64};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t tree_id, write_tx_id;
+    {
+      txn_t tx;
+      assert(txn_create(&db, TX_WRITE, &tx));
+      defer(txn_close, tx);
+      write_tx_id = tx.state->tx_id;
+      assert(btree_create(&tx, &tree_id));
+      for (size_t i = 0; i < 64; i++) {
+        char key[16];
+        sprintf(key, "%04zu", i);
+        btree_val_t set = {
+            .tree_id = tree_id, .key = str_span(key), .val = i};
+        assert(btree_set(&tx, &set, 0));
+      }
+      assert(txn_commit(&tx));
+    }
+    txn_t rtx;
+    assert(txn_create(&db, TX_READ, &rtx));
+    defer(txn_close, rtx);
+    btree_val_t get = {.tree_id = tree_id, .key = str_span("0042")};
+    assert(btree_get(&rtx, &get) && get.has_val && get.val == 42);
+
+    // the ring is far smaller than what was done so far
+    db_page_access_t entries[128];
+    uint64_t position = 0, lost;
+    size_t read;
+    assert(db_page_trace_read(
+        &db, &position, entries, 128, &read, &lost));
+    assert(lost > 0 && read > 0 && read <= 64);
+    bool leaf_write = false, leaf_read = false;
+    for (size_t i = 0; i < read; i++) {
+      if (entries[i].page_flags != page_flags_tree_leaf) continue;
+      if (entries[i].write) {
+        leaf_write |= entries[i].tx_id == write_tx_id;
+      } else {
+        leaf_read |= entries[i].tx_id == rtx.state->tx_id;
+      }
+    }
+    assert(leaf_write && leaf_read);
+    assert(db_page_trace_read(
+        &db, &position, entries, 128, &read, &lost));
+    assert(read == 0 && lost == 0);  // nothing new since
+
+    // only the pages that were found are traced
+    page_t outside = {.page_num = db.state->number_of_pages + 1};
+    assert(!txn_raw_get_page(&rtx, &outside));
+    errors_clear();
+    assert(db_page_trace_read(
+        &db, &position, entries, 128, &read, &lost));
+    assert(read == 0 && lost == 0);
+  }
+
+  it("traces without reading pages in no mmap mode") {
+    db_t db;
+    db_options_t options = {.minimum_size = 1024 * 1024,
+        .flags                            = db_flags_avoid_mmap_io,
+        .page_trace_size                  = 64};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t page_num;
+    {
+      txn_t tx;
+      assert(txn_create(&db, TX_WRITE, &tx));
+      defer(txn_close, tx);
+      page_t p = {.number_of_pages = 1};
+      assert(txn_allocate_page(&tx, &p, 0));
+      p.metadata->overflow.page_flags      = page_flags_overflow;
+      p.metadata->overflow.number_of_pages = 1;
+      page_num                             = p.page_num;
+      assert(txn_commit(&tx));
+    }
+    txn_t rtx;
+    assert(txn_create(&db, TX_READ, &rtx));
+    defer(txn_close, rtx);
+    uint64_t position = db.state->page_trace->head;
+    page_t p          = {.page_num = page_num};
+    assert(txn_raw_get_page(&rtx, &p));
+    db_page_access_t entry;
+    size_t read;
+    uint64_t lost;
+    assert(
+        db_page_trace_read(&db, &position, &entry, 1, &read, &lost));
+    assert(read == 1 && entry.page_num == page_num);
+    assert(entry.page_flags == DB_PAGE_TRACE_UNKNOWN_FLAGS);
+    page_t metadata = {.page_num = page_num & PAGES_IN_METADATA_MASK};
+    assert(!pagesmap_lookup(rtx.working_set, &metadata));
+  }
 }
 // end::tests18[]
@@ -0,0 +1,583 @@
+// gavran-bench: reproducible microbenchmarks, reported as JSON
+//
+//   gavran-bench [options] <dir>
+//
+// Every benchmark runs once per mode (mmap, no mmap and encrypted),
+// each on a fresh database in dir. Latencies are measured for every
+// operation, or every commit, and reported as percentiles. Keys come
+// from a fixed seed, so runs can be compared with each other. With
+// -S the allocations and system calls are counted as well, per call.
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gavran/db.h>
+
+// tag::bench_samples[]
+typedef struct bench_samples {
+  uint64_t *ns;
+  size_t count;
+  size_t capacity;
+} bench_samples_t;
+
+typedef struct bench_options {
+  char *dir;
+  char *filter;
+  char *output;
+  size_t ops;
+  size_t commits;
+  uint64_t seed;
+  bool sys_counters;
+  uint8_t padding[7];
+} bench_options_t;
+
+typedef struct bench_mode {
+  const char *name;
+  db_flags_t flags;
+  bool encrypted;
+  uint8_t padding[3];
+} bench_mode_t;
+
+typedef struct bench_ctx {
+  bench_options_t *options;
+  bench_mode_t *mode;
+  db_t db;
+  bench_samples_t samples;
+  char path[PATH_MAX];
+  uint64_t rand;
+} bench_ctx_t;
+
+static uint64_t bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64*, the same sequence for the same seed
+static uint64_t bench_rand(bench_ctx_t *ctx) {
+  ctx->rand ^= ctx->rand >> 12;
+  ctx->rand ^= ctx->rand << 25;
+  ctx->rand ^= ctx->rand >> 27;
+  return ctx->rand * 0x2545F4914F6CDD1DUL;
+}
+
+static result_t bench_record(bench_ctx_t *ctx, uint64_t start) {
+  uint64_t elapsed  = bench_now() - start;
+  bench_samples_t *s = &ctx->samples;
+  if (s->count == s->capacity) {
+    s->capacity = MAX(1024, s->capacity * 2);
+    ensure(mem_realloc(
+        (void *)&s->ns, s->capacity * sizeof(uint64_t)));
+  }
+  s->ns[s->count++] = elapsed;
+  return success();
+}
+
+static int bench_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t bench_percentile(bench_samples_t *s, double p) {
+  size_t i = (size_t)(p * (double)(s->count - 1) + 0.5);
+  return s->ns[MIN(i, s->count - 1)];
+}
+
+// only the calls that were made, and the counters that aren't zero
+static void bench_report_sys(FILE *out, bench_ctx_t *ctx) {
+  db_sys_stats_t stats;
+  if (!db_get_sys_stats(&ctx->db, &stats)) {
+    errors_clear();
+    return;
+  }
+  fprintf(out, ", \"sys\": {");
+  bool first_op = true;
+  for (size_t op = 0; op < db_op_number_of_ops; op++) {
+    db_op_counters_t *c = &stats.ops[op];
+    if (!c->calls) continue;
+    fprintf(out, "%s\"%s\": {\"calls\": %lu", first_op ? "" : ", ",
+        db_op_name((db_op_t)op), c->calls);
+    for (size_t i = 0; i < sys_counter_number_of_counters; i++) {
+      if (!c->sys[i]) continue;
+      fprintf(out, ", \"%s\": %lu",
+          db_sys_counter_name((sys_counter_t)i), c->sys[i]);
+    }
+    fprintf(out, "}");
+    first_op = false;
+  }
+  fprintf(out, "}");
+}
+
+static void bench_report(FILE *out, bool *first, const char *name,
+    bench_ctx_t *ctx) {
+  bench_samples_t *s = &ctx->samples;
+  if (!s->count) return;
+  qsort(s->ns, s->count, sizeof(uint64_t), bench_cmp);
+  uint64_t total = 0;
+  for (size_t i = 0; i < s->count; i++) total += s->ns[i];
+  double mean = (double)total / (double)s->count;
+  fprintf(out,
+      "%s\n    {\"name\": \"%s\", \"mode\": \"%s\", \"count\": %zu, "
+      "\"total_ns\": %lu, \"ops_per_sec\": %.1f, \"mean_ns\": %.1f, "
+      "\"min_ns\": %lu, \"p50_ns\": %lu, \"p90_ns\": %lu, "
+      "\"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu",
+      *first ? "" : ",", name, ctx->mode->name, s->count, total,
+      mean > 0 ? 1e9 / mean : 0, mean, s->ns[0],
+      bench_percentile(s, 0.5), bench_percentile(s, 0.9),
+      bench_percentile(s, 0.99), bench_percentile(s, 0.999),
+      s->ns[s->count - 1]);
+  if (ctx->options->sys_counters) bench_report_sys(out, ctx);
+  fprintf(out, "}");
+  *first = false;
+}
+// end::bench_samples[]
+
+// tag::bench_db[]
+static result_t bench_open(bench_ctx_t *ctx) {
+  db_options_t options = {.minimum_size = 64 * 1024 * 1024,
+      .wal_size                         = 64 * 1024 * 1024,
+      .flags                            = ctx->mode->flags};
+  if (ctx->options->sys_counters)
+    options.flags |= db_flags_sys_counters;
+  if (ctx->mode->encrypted) {
+    for (uint8_t i = 0; i < sizeof(options.encryption_key); i++) {
+      // fixed, so runs can be compared
+      options.encryption_key[i] = (uint8_t)(i + 1);
+    }
+  }
+  ensure(db_create(ctx->path, &options, &ctx->db));
+  return success();
+}
+
+static result_t bench_fresh_db(bench_ctx_t *ctx) {
+  snprintf(ctx->path, sizeof(ctx->path), "%s/bench-%s",
+      ctx->options->dir, ctx->mode->name);
+  char wal[PATH_MAX + 8];
+  unlink(ctx->path);
+  snprintf(wal, sizeof(wal), "%s-a.wal", ctx->path);
+  unlink(wal);
+  snprintf(wal, sizeof(wal), "%s-b.wal", ctx->path);
+  unlink(wal);
+  ctx->rand = ctx->options->seed;
+  ensure(bench_open(ctx));
+  return success();
+}
+
+static result_t bench_close_db(bench_ctx_t *ctx) {
+  ensure(db_close(&ctx->db));
+  return success();
+}
+enable_defer(bench_close_db);
+// end::bench_db[]
+
+// tag::bench_commit[]
+#define BENCH_COMMIT_PAGES (1000)
+
+static result_t bench_allocate(txn_t *tx, page_t *p) {
+  ensure(txn_allocate_page(tx, p, 0));
+  p->metadata->overflow.page_flags      = page_flags_overflow;
+  p->metadata->overflow.number_of_pages = 1;
+  p->metadata->overflow.size_of_value   = PAGE_SIZE;
+  return success();
+}
+
+// the pages are allocated up front, each commit only modifies them
+static result_t bench_commit(bench_ctx_t *ctx, size_t pages) {
+  uint64_t page_nums[BENCH_COMMIT_PAGES];
+  {
+    txn_t tx;
+    ensure(txn_create(&ctx->db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    for (size_t i = 0; i < BENCH_COMMIT_PAGES; i++) {
+      page_t p = {.number_of_pages = 1};
+      ensure(bench_allocate(&tx, &p));
+      page_nums[i] = p.page_num;
+    }
+    ensure(txn_commit(&tx));
+  }
+  for (size_t c = 0; c < ctx->options->commits; c++) {
+    txn_t tx;
+    ensure(txn_create(&ctx->db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    for (size_t i = 0; i < pages; i++) {
+      page_t p = {.page_num = page_nums[(c * pages + i) %
+                                        BENCH_COMMIT_PAGES]};
+      ensure(txn_modify_page(&tx, &p));
+      uint64_t *words = p.address;
+      for (size_t w = 0; w < 16; w++) words[w] = bench_rand(ctx);
+    }
+    uint64_t start = bench_now();
+    ensure(txn_commit(&tx));
+    ensure(bench_record(ctx, start));
+  }
+  return success();
+}
+
+static result_t bench_commit_1(bench_ctx_t *ctx) {
+  return bench_commit(ctx, 1);
+}
+static result_t bench_commit_10(bench_ctx_t *ctx) {
+  return bench_commit(ctx, 10);
+}
+static result_t bench_commit_1000(bench_ctx_t *ctx) {
+  return bench_commit(ctx, 1000);
+}
+// end::bench_commit[]
+
+// tag::bench_structures[]
+static void bench_key(bench_ctx_t *ctx, size_t i, uint8_t key[16]) {
+  uint64_t words[2] = {bench_rand(ctx), i};
+  memcpy(key, words, 16);
+}
+
+static result_t bench_btree(bench_ctx_t *ctx, bool get) {
+  uint64_t tree_id, seed = ctx->rand;
+  uint8_t key[16];
+  txn_t tx;
+  ensure(txn_create(&ctx->db, TX_WRITE, &tx));
+  defer(txn_close, tx);
+  ensure(btree_create(&tx, &tree_id));
+  for (size_t i = 0; i < ctx->options->ops; i++) {
+    bench_key(ctx, i, key);
+    btree_val_t set = {.tree_id = tree_id,
+        .key                    = {.address = key, .size = 16},
+        .val                    = i};
+    uint64_t start = bench_now();
+    ensure(btree_set(&tx, &set, 0));
+    if (!get) ensure(bench_record(ctx, start));
+  }
+  if (!get) return success();
+  ctx->rand = seed;  // the same keys, in the same order
+  for (size_t i = 0; i < ctx->options->ops; i++) {
+    bench_key(ctx, i, key);
+    btree_val_t kvp = {.tree_id = tree_id,
+        .key                    = {.address = key, .size = 16}};
+    uint64_t start = bench_now();
+    ensure(btree_get(&tx, &kvp));
+    ensure(bench_record(ctx, start));
+    ensure(kvp.has_val && kvp.val == i, msg("Missing btree key"));
+  }
+  return success();
+}
+
+static result_t bench_btree_set(bench_ctx_t *ctx) {
+  return bench_btree(ctx, false);
+}
+static result_t bench_btree_get(bench_ctx_t *ctx) {
+  return bench_btree(ctx, true);
+}
+
+static result_t bench_hash(bench_ctx_t *ctx, bool get) {
+  uint64_t hash_id, seed = ctx->rand;
+  txn_t tx;
+  ensure(txn_create(&ctx->db, TX_WRITE, &tx));
+  defer(txn_close, tx);
+  ensure(hash_create(&tx, &hash_id));
+  for (size_t i = 0; i < ctx->options->ops; i++) {
+    hash_val_t set = {
+        .hash_id = hash_id, .key = bench_rand(ctx), .val = i};
+    uint64_t start = bench_now();
+    ensure(hash_set(&tx, &set, 0));
+    if (!get) ensure(bench_record(ctx, start));
+  }
+  if (!get) return success();
+  ctx->rand = seed;
+  for (size_t i = 0; i < ctx->options->ops; i++) {
+    hash_val_t kvp = {.hash_id = hash_id, .key = bench_rand(ctx)};
+    uint64_t start = bench_now();
+    ensure(hash_get(&tx, &kvp));
+    ensure(bench_record(ctx, start));
+    ensure(kvp.has_val && kvp.val == i, msg("Missing hash key"));
+  }
+  return success();
+}
+
+static result_t bench_hash_set(bench_ctx_t *ctx) {
+  return bench_hash(ctx, false);
+}
+static result_t bench_hash_get(bench_ctx_t *ctx) {
+  return bench_hash(ctx, true);
+}
+
+// the reads run in their own transaction, after the commit
+static result_t bench_container(bench_ctx_t *ctx, bool get) {
+  uint64_t container_id, *ids;
+  ensure(mem_calloc(
+      (void *)&ids, ctx->options->ops * sizeof(uint64_t)));
+  defer(free, ids);
+  uint8_t row[100];
+  {
+    txn_t tx;
+    ensure(txn_create(&ctx->db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    ensure(container_create(&tx, &container_id));
+    for (size_t i = 0; i < ctx->options->ops; i++) {
+      memset(row, (int)i, sizeof(row));
+      container_item_t item = {.container_id = container_id,
+          .data = {.address = row, .size = sizeof(row)}};
+      uint64_t start = bench_now();
+      ensure(container_item_put(&tx, &item));
+      if (!get) ensure(bench_record(ctx, start));
+      ids[i] = item.item_id;
+    }
+    ensure(txn_commit(&tx));
+  }
+  if (!get) return success();
+  txn_t tx;
+  ensure(txn_create(&ctx->db, TX_READ, &tx));
+  defer(txn_close, tx);
+  for (size_t i = 0; i < ctx->options->ops; i++) {
+    size_t n = bench_rand(ctx) % ctx->options->ops;
+    container_item_t item = {
+        .container_id = container_id, .item_id = ids[n]};
+    uint64_t start = bench_now();
+    ensure(container_item_get(&tx, &item));
+    ensure(bench_record(ctx, start));
+    ensure(item.data.size == sizeof(row), msg("Missing item"));
+  }
+  return success();
+}
+
+static result_t bench_container_put(bench_ctx_t *ctx) {
+  return bench_container(ctx, false);
+}
+static result_t bench_container_get(bench_ctx_t *ctx) {
+  return bench_container(ctx, true);
+}
+// end::bench_structures[]
+
+// tag::bench_table[]
+// a row is "<id>:<name>", indexed by id in a btree and by name in a
+// hash index
+static result_t bench_table(bench_ctx_t *ctx, bool lookup) {
+  index_type_t types[3] = {
+      index_type_container, index_type_btree, index_type_hash};
+  uint64_t ids[3];
+  table_schema_t schema = {.name = "bench",
+      .count                     = 3,
+      .types                     = types,
+      .index_ids                 = ids};
+  char row[64], id[24], name[24];
+  {
+    txn_t tx;
+    ensure(txn_create(&ctx->db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    ensure(table_create(&tx, &schema));
+    for (size_t i = 0; i < ctx->options->ops; i++) {
+      snprintf(id, sizeof(id), "%016zx", i);
+      snprintf(name, sizeof(name), "%016lx", bench_rand(ctx));
+      snprintf(row, sizeof(row), "%s:%s", id, name);
+      span_t entries[3] = {{.address = row, .size = strlen(row)},
+          {.address = id, .size = strlen(id)},
+          {.address = name, .size = strlen(name)}};
+      table_item_t item = {.schema = &schema,
+          .entries                 = entries,
+          .number_of_entries       = 3};
+      uint64_t start = bench_now();
+      ensure(table_set(&tx, &item));
+      if (!lookup) ensure(bench_record(ctx, start));
+    }
+    ensure(txn_commit(&tx));
+  }
+  if (!lookup) return success();
+  txn_t tx;
+  ensure(txn_create(&ctx->db, TX_READ, &tx));
+  defer(txn_close, tx);
+  for (size_t i = 0; i < ctx->options->ops; i++) {
+    uint64_t n = bench_rand(ctx) % ctx->options->ops;
+    snprintf(id, sizeof(id), "%016lx", n);
+    span_t entries[3] = {{.address = id, .size = strlen(id)}};
+    table_item_t item = {.schema = &schema,
+        .entries                 = entries,
+        .number_of_entries       = 3,
+        .index_to_use            = 1};
+    uint64_t start = bench_now();
+    ensure(table_get(&tx, &item));
+    ensure(bench_record(ctx, start));
+    ensure(item.result.size, msg("Missing row"));
+  }
+  return success();
+}
+
+static result_t bench_table_insert(bench_ctx_t *ctx) {
+  return bench_table(ctx, false);
+}
+static result_t bench_table_lookup(bench_ctx_t *ctx) {
+  return bench_table(ctx, true);
+}
+// end::bench_table[]
+
+// tag::bench_recovery[]
+// each sample reopens the database, replaying the transactions
+// committed since it was created
+static result_t bench_recovery(bench_ctx_t *ctx) {
+  size_t reopens = MAX(1, ctx->options->commits / 10);
+  for (size_t r = 0; r < reopens; r++) {
+    for (size_t c = 0; c < 10; c++) {
+      txn_t tx;
+      ensure(txn_create(&ctx->db, TX_WRITE, &tx));
+      defer(txn_close, tx);
+      for (size_t i = 0; i < 10; i++) {
+        page_t p = {.number_of_pages = 1};
+        ensure(bench_allocate(&tx, &p));
+        memset(p.address, (int)bench_rand(ctx), PAGE_SIZE / 4);
+      }
+      ensure(txn_commit(&tx));
+    }
+    ensure(db_close(&ctx->db));
+    uint64_t start = bench_now();
+    ensure(bench_open(ctx));
+    ensure(bench_record(ctx, start));
+  }
+  return success();
+}
+// end::bench_recovery[]
+
+// tag::bench_run[]
+typedef struct bench {
+  const char *name;
+  result_t (*run)(bench_ctx_t *ctx);
+} bench_t;
+
+static bench_t benchmarks[] = {
+    {"commit_1_page", bench_commit_1},
+    {"commit_10_pages", bench_commit_10},
+    {"commit_1000_pages", bench_commit_1000},
+    {"btree_set", bench_btree_set},
+    {"btree_get", bench_btree_get},
+    {"hash_set", bench_hash_set},
+    {"hash_get", bench_hash_get},
+    {"container_item_put", bench_container_put},
+    {"container_item_get", bench_container_get},
+    {"table_insert", bench_table_insert},
+    {"table_lookup", bench_table_lookup},
+    {"recovery", bench_recovery},
+};
+
+static bench_mode_t modes[] = {
+    {.name = "mmap"},
+    {.name = "no_mmap", .flags = db_flags_avoid_mmap_io},
+    {.name = "encrypted", .encrypted = true},
+};
+
+static result_t bench_run_one(
+    bench_ctx_t *ctx, bench_t *bench, FILE *out, bool *first) {
+  ensure(bench_fresh_db(ctx));
+  defer(bench_close_db, *ctx);
+  ctx->samples.count = 0;
+  ensure(bench->run(ctx), msg("Benchmark failed"),
+      with(bench->name, "%s"), with(ctx->mode->name, "%s"));
+  bench_report(out, first, bench->name, ctx);
+  fprintf(stderr, "%-20s %-10s done\n", bench->name, ctx->mode->name);
+  return success();
+}
+
+static result_t bench_run_all(bench_options_t *options, FILE *out) {
+  bench_ctx_t ctx = {.options = options};
+  defer(free, ctx.samples.ns);
+  bool first = true;
+  fprintf(out, "{\"seed\": %lu, \"ops\": %zu, \"commits\": %zu, "
+               "\"page_size\": %d, \"results\": [",
+      options->seed, options->ops, options->commits, PAGE_SIZE);
+  for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]);
+       b++) {
+    if (options->filter &&
+        !strstr(benchmarks[b].name, options->filter))
+      continue;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+      ctx.mode = &modes[m];
+      ensure(bench_run_one(&ctx, &benchmarks[b], out, &first));
+    }
+  }
+  fprintf(out, "\n]}\n");
+  return success();
+}
+
+static result_t bench_run(bench_options_t *options) {
+  if (!options->output) {
+    ensure(bench_run_all(options, stdout));
+    return success();
+  }
+  FILE *out = fopen(options->output, "w");
+  ensure(out, msg("Unable to open output file"),
+      with(options->output, "%s"));
+  bool ok = bench_run_all(options, out);
+  fclose(out);
+  ensure(ok);
+  return success();
+}
+// end::bench_run[]
+
+static void bench_usage(void) {
+  fprintf(stderr,
+      "usage: gavran-bench [options] <dir>\n"
+      "  -n, --ops N        operations per benchmark (20000)\n"
+      "  -c, --commits N    commits per commit benchmark (200)\n"
+      "  -s, --seed N       seed for the keys (42)\n"
+      "  -f, --filter NAME  only benchmarks with NAME in their name\n"
+      "  -o, --output FILE  write the JSON there, not to stdout\n"
+      "  -S, --sys-counters count allocations and system calls\n");
+}
+
+static result_t bench_parse_args(
+    int argc, char **argv, bench_options_t *options) {
+  options->ops     = 20000;
+  options->commits = 200;
+  options->seed    = 42;
+  static struct option long_options[] = {
+      {"ops", required_argument, 0, 'n'},
+      {"commits", required_argument, 0, 'c'},
+      {"seed", required_argument, 0, 's'},
+      {"filter", required_argument, 0, 'f'},
+      {"output", required_argument, 0, 'o'},
+      {"sys-counters", no_argument, 0, 'S'}, {0, 0, 0, 0}};
+  int c;
+  while ((c = getopt_long(
+              argc, argv, "n:c:s:f:o:S", long_options, 0)) != -1) {
+    switch (c) {
+      case 'n':
+        options->ops = strtoul(optarg, 0, 10);
+        break;
+      case 'c':
+        options->commits = strtoul(optarg, 0, 10);
+        break;
+      case 's':
+        options->seed = strtoul(optarg, 0, 10);
+        break;
+      case 'f':
+        options->filter = optarg;
+        break;
+      case 'o':
+        options->output = optarg;
+        break;
+      case 'S':
+        options->sys_counters = true;
+        break;
+      default:
+        failed(EINVAL, msg("Unknown option"));
+    }
+  }
+  ensure(argc - optind == 1, msg("Expected <dir>"));
+  ensure(options->ops && options->commits && options->seed,
+      msg("Operations, commits and seed must be positive"));
+  options->dir = argv[optind];
+  return success();
+}
+
+int main(int argc, char **argv) {
+  bench_options_t options = {0};
+  if (!bench_parse_args(argc, argv, &options)) {
+    errors_print_all();
+    bench_usage();
+    return 2;
+  }
+  if (!bench_run(&options)) {
+    errors_print_all();
+    return 1;
+  }
+  return 0;
+}
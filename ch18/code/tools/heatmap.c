@@ -0,0 +1,296 @@
+// gavran-heatmap: where in the file the page accesses go
+//
+//   gavran-heatmap [options] <trace>
+//
+// The trace is a file of db_page_access_t records, as returned by
+// db_page_trace_read (gavran-ycsb -T writes one). The file is split
+// into --regions equal ranges of pages, up to the highest page in the
+// trace, and the accesses are counted per page type and region. For
+// each type, the distinct pages it touched are its working set. Reads
+// and writes are shown as a text heatmap, or as JSON with -o.
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gavran/db.h>
+
+#define HEATMAP_TYPES (page_flags_tree_branch + 2)  // and unknown
+#define HEATMAP_CHUNK (4096)
+
+static const char *heatmap_type_names[HEATMAP_TYPES] = {"free",
+    "file_header", "metadata", "free_space_bitmap", "overflow",
+    "hash_directory", "hash", "container", "tree_leaf",
+    "tree_branch", "unknown"};
+
+typedef struct heatmap_options {
+  char *path;
+  char *output;
+  size_t regions;
+} heatmap_options_t;
+
+// tag::heatmap_state[]
+typedef struct heatmap_type {
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t distinct_pages;
+  uint64_t *reads_by_region;
+  uint64_t *writes_by_region;
+  uint64_t *seen;  // bitmap of the pages
+} heatmap_type_t;
+
+typedef struct heatmap_state {
+  heatmap_options_t *options;
+  uint64_t accesses;
+  uint64_t transactions;
+  uint64_t number_of_pages;  // highest page in the trace + 1
+  uint64_t pages_per_region;
+  db_page_access_t *entries;
+  heatmap_type_t types[HEATMAP_TYPES];
+} heatmap_state_t;
+
+static result_t heatmap_free(heatmap_state_t *s) {
+  free(s->entries);
+  for (size_t i = 0; i < HEATMAP_TYPES; i++) {
+    free(s->types[i].reads_by_region);
+    free(s->types[i].writes_by_region);
+    free(s->types[i].seen);
+  }
+  return success();
+}
+enable_defer(heatmap_free);
+// end::heatmap_state[]
+
+// tag::heatmap_count[]
+// the size of the file isn't in the trace, so the first pass finds
+// the highest page and the second one counts
+static result_t heatmap_find_pages(heatmap_state_t *s, FILE *in) {
+  size_t read;
+  uint64_t last_tx = 0;
+  while ((read = fread(s->entries, sizeof(db_page_access_t),
+              HEATMAP_CHUNK, in))) {
+    for (size_t i = 0; i < read; i++) {
+      s->number_of_pages =
+          MAX(s->number_of_pages, s->entries[i].page_num + 1);
+      if (s->entries[i].tx_id != last_tx) s->transactions++;
+      last_tx = s->entries[i].tx_id;
+    }
+    s->accesses += read;
+  }
+  ensure(!ferror(in), msg("Unable to read the trace"));
+  ensure(s->accesses, msg("The trace is empty"));
+  s->pages_per_region =
+      (s->number_of_pages + s->options->regions - 1) /
+      s->options->regions;
+  return success();
+}
+
+static result_t heatmap_count(heatmap_state_t *s, FILE *in) {
+  size_t regions = s->options->regions;
+  size_t words   = (s->number_of_pages + 63) / 64;
+  for (size_t i = 0; i < HEATMAP_TYPES; i++) {
+    ensure(mem_calloc((void *)&s->types[i].reads_by_region,
+        regions * sizeof(uint64_t)));
+    ensure(mem_calloc((void *)&s->types[i].writes_by_region,
+        regions * sizeof(uint64_t)));
+    ensure(mem_calloc((void *)&s->types[i].seen,
+        words * sizeof(uint64_t)));
+  }
+  rewind(in);
+  size_t read;
+  while ((read = fread(s->entries, sizeof(db_page_access_t),
+              HEATMAP_CHUNK, in))) {
+    for (size_t i = 0; i < read; i++) {
+      db_page_access_t *e = &s->entries[i];
+      heatmap_type_t *t   = &s->types[MIN(
+          e->page_flags, (uint8_t)(HEATMAP_TYPES - 1))];
+      size_t region       = e->page_num / s->pages_per_region;
+      if (e->write) {
+        t->writes++;
+        t->writes_by_region[region]++;
+      } else {
+        t->reads++;
+        t->reads_by_region[region]++;
+      }
+      uint64_t bit = 1UL << (e->page_num % 64);
+      if (!(t->seen[e->page_num / 64] & bit)) {
+        t->seen[e->page_num / 64] |= bit;
+        t->distinct_pages++;
+      }
+    }
+  }
+  ensure(!ferror(in), msg("Unable to read the trace"));
+  return success();
+}
+// end::heatmap_count[]
+
+// tag::heatmap_report[]
+// log scale, so the cold regions still show up next to the hot ones
+static char heatmap_shade(uint64_t count, uint64_t max) {
+  static const char shades[] = " .:-=+*#%@";
+  if (!count) return shades[0];
+  double level = log((double)count + 1) / log((double)max + 1);
+  size_t i     = 1 + (size_t)(level * (double)(sizeof(shades) - 3));
+  return shades[MIN(i, sizeof(shades) - 2)];
+}
+
+static void heatmap_print_grid(
+    FILE *out, heatmap_state_t *s, bool writes) {
+  uint64_t max = 0;
+  for (size_t i = 0; i < HEATMAP_TYPES; i++) {
+    uint64_t *counts = writes ? s->types[i].writes_by_region
+                              : s->types[i].reads_by_region;
+    for (size_t r = 0; r < s->options->regions; r++)
+      max = MAX(max, counts[r]);
+  }
+  fprintf(out, "\n%-18s|", writes ? "writes" : "reads");
+  for (size_t r = 0; r < s->options->regions; r++)
+    fputc(r % 10 ? ' ' : '0' + (char)(r / 10 % 10), out);
+  fprintf(out, "|\n");
+  for (size_t i = 0; i < HEATMAP_TYPES; i++) {
+    heatmap_type_t *t = &s->types[i];
+    if (!(writes ? t->writes : t->reads)) continue;
+    uint64_t *counts =
+        writes ? t->writes_by_region : t->reads_by_region;
+    fprintf(out, "%-18s|", heatmap_type_names[i]);
+    for (size_t r = 0; r < s->options->regions; r++)
+      fputc(heatmap_shade(counts[r], max), out);
+    fprintf(out, "|\n");
+  }
+}
+
+static void heatmap_print_text(FILE *out, heatmap_state_t *s) {
+  fprintf(out,
+      "%lu accesses in %lu transactions, %lu pages (%.1f MB), "
+      "%lu pages per region\n\n"
+      "%-18s %12s %12s %12s %12s\n",
+      s->accesses, s->transactions, s->number_of_pages,
+      (double)(s->number_of_pages * PAGE_SIZE) / (1024 * 1024),
+      s->pages_per_region, "type", "reads", "writes", "pages",
+      "MB");
+  for (size_t i = 0; i < HEATMAP_TYPES; i++) {
+    heatmap_type_t *t = &s->types[i];
+    if (!t->reads && !t->writes) continue;
+    fprintf(out, "%-18s %12lu %12lu %12lu %12.1f\n",
+        heatmap_type_names[i], t->reads, t->writes, t->distinct_pages,
+        (double)(t->distinct_pages * PAGE_SIZE) / (1024 * 1024));
+  }
+  heatmap_print_grid(out, s, false);
+  heatmap_print_grid(out, s, true);
+}
+
+static void heatmap_print_counts(
+    FILE *out, uint64_t *counts, size_t regions) {
+  for (size_t r = 0; r < regions; r++)
+    fprintf(out, "%s%lu", r ? ", " : "", counts[r]);
+}
+
+static void heatmap_print_json(FILE *out, heatmap_state_t *s) {
+  fprintf(out,
+      "{\"accesses\": %lu, \"transactions\": %lu, "
+      "\"number_of_pages\": %lu, \"regions\": %zu, "
+      "\"pages_per_region\": %lu, \"types\": [",
+      s->accesses, s->transactions, s->number_of_pages,
+      s->options->regions, s->pages_per_region);
+  bool first = true;
+  for (size_t i = 0; i < HEATMAP_TYPES; i++) {
+    heatmap_type_t *t = &s->types[i];
+    if (!t->reads && !t->writes) continue;
+    fprintf(out,
+        "%s\n  {\"type\": \"%s\", \"reads\": %lu, \"writes\": %lu, "
+        "\"distinct_pages\": %lu, \"working_set_bytes\": %lu,\n"
+        "   \"reads_by_region\": [",
+        first ? "" : ",", heatmap_type_names[i], t->reads, t->writes,
+        t->distinct_pages, t->distinct_pages * PAGE_SIZE);
+    heatmap_print_counts(
+        out, t->reads_by_region, s->options->regions);
+    fprintf(out, "],\n   \"writes_by_region\": [");
+    heatmap_print_counts(
+        out, t->writes_by_region, s->options->regions);
+    fprintf(out, "]}");
+    first = false;
+  }
+  fprintf(out, "\n]}\n");
+}
+// end::heatmap_report[]
+
+static result_t heatmap_close_file(FILE **f) {
+  fclose(*f);
+  return success();
+}
+enable_defer(heatmap_close_file);
+
+static result_t heatmap_run(heatmap_options_t *options) {
+  heatmap_state_t s = {.options = options};
+  defer(heatmap_free, s);
+  ensure(mem_calloc((void *)&s.entries,
+      HEATMAP_CHUNK * sizeof(db_page_access_t)));
+  FILE *in = fopen(options->path, "rb");
+  ensure(in, msg("Unable to open the trace"),
+      with(options->path, "%s"));
+  defer(heatmap_close_file, in);
+  ensure(heatmap_find_pages(&s, in));
+  ensure(heatmap_count(&s, in));
+
+  if (!options->output) {
+    heatmap_print_text(stdout, &s);
+    return success();
+  }
+  FILE *out = fopen(options->output, "w");
+  ensure(out, msg("Unable to open output file"),
+      with(options->output, "%s"));
+  heatmap_print_json(out, &s);
+  fclose(out);
+  return success();
+}
+
+static void heatmap_usage(void) {
+  fprintf(stderr,
+      "usage: gavran-heatmap [options] <trace>\n"
+      "  -r, --regions N       ranges the file is split to "
+      "(default 64)\n"
+      "  -o, --output FILE     write JSON there, instead of text\n");
+}
+
+static result_t heatmap_parse_args(
+    int argc, char **argv, heatmap_options_t *options) {
+  options->regions                    = 64;
+  static struct option long_options[] = {
+      {"regions", required_argument, 0, 'r'},
+      {"output", required_argument, 0, 'o'}, {0, 0, 0, 0}};
+  int c;
+  while ((c = getopt_long(argc, argv, "r:o:", long_options, 0)) !=
+         -1) {
+    switch (c) {
+      case 'r':
+        options->regions = strtoul(optarg, 0, 10);
+        break;
+      case 'o':
+        options->output = optarg;
+        break;
+      default:
+        failed(EINVAL, msg("Unknown option"));
+    }
+  }
+  ensure(argc - optind == 1, msg("Expected <trace>"));
+  ensure(options->regions && options->regions <= 1024,
+      msg("Regions must be between 1 and 1024"),
+      with(options->regions, "%zu"));
+  options->path = argv[optind];
+  return success();
+}
+
+int main(int argc, char **argv) {
+  heatmap_options_t options = {0};
+  if (!heatmap_parse_args(argc, argv, &options)) {
+    errors_print_all();
+    heatmap_usage();
+    return 2;
+  }
+  if (!heatmap_run(&options)) {
+    errors_print_all();
+    return 1;
+  }
+  return 0;
+}
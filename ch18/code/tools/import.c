@@ -0,0 +1,416 @@
+// gavran-import: bulk loads rows from a file into a new table
+//
+//   gavran-import [options] <db> <table> <input>
+//
+// The input is either newline separated text rows (csv) or binary
+// records of a fixed size. Rows are located on multiple threads,
+// written with large batches per transaction and the indexes are
+// built in bulk once all the rows are in.
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gavran/db.h>
+
+#define IMPORT_MAX_INDEXES (16)
+
+// tag::import_options[]
+typedef struct import_index {
+  // a column of a delimited row, or a byte range of the row
+  table_field_t field;
+  uint16_t column;
+  index_type_t type;
+  char delimiter;
+  bool by_column;
+  uint8_t padding[3];
+} import_index_t;
+
+typedef struct import_options {
+  char *db_path;
+  char *table_name;
+  char *input_path;
+  size_t record_size;  // 0 for newline separated rows
+  size_t batch_size;
+  size_t bytes_per_run;
+  uint16_t threads;
+  uint16_t number_of_indexes;
+  char delimiter;
+  uint8_t padding[3];
+  import_index_t indexes[IMPORT_MAX_INDEXES];
+} import_options_t;
+// end::import_options[]
+
+static double import_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void import_report(const char *phase, size_t rows,
+    size_t bytes, double elapsed) {
+  double mb = (double)bytes / (1024 * 1024);
+  elapsed   = elapsed > 0 ? elapsed : 1e-9;
+  printf("%-8s %10zu rows %10.2f MB %8.3f s", phase, rows, mb,
+      elapsed);
+  printf(" %12.0f rows/s %8.2f MB/s\n", (double)rows / elapsed,
+      mb / elapsed);
+}
+
+// tag::import_parse[]
+typedef struct import_chunk {
+  import_options_t *options;
+  span_t input;
+  span_t *rows;
+  size_t count;
+  size_t capacity;
+  bool failed;
+  uint8_t padding[7];
+} import_chunk_t;
+
+// runs on the parsing threads, errors are reported by the caller
+static bool import_chunk_push(import_chunk_t *chunk, void *start,
+    size_t size) {
+  if (chunk->count == chunk->capacity) {
+    chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 1024;
+    void *rows =
+        realloc(chunk->rows, chunk->capacity * sizeof(span_t));
+    if (!rows) return false;
+    chunk->rows = rows;
+  }
+  chunk->rows[chunk->count++] = (span_t){start, size};
+  return true;
+}
+
+static void *import_parse_chunk(void *arg) {
+  import_chunk_t *chunk = arg;
+  uint8_t *cur          = chunk->input.address;
+  uint8_t *end          = cur + chunk->input.size;
+  size_t record_size    = chunk->options->record_size;
+  while (cur < end) {
+    size_t size = record_size, next = record_size;
+    if (!record_size) {
+      uint8_t *eol = memchr(cur, '\n', (size_t)(end - cur));
+      size         = (size_t)((eol ? eol : end) - cur);
+      next         = size + (eol ? 1 : 0);
+      if (size && cur[size - 1] == '\r') size--;
+    }
+    if (size && !import_chunk_push(chunk, cur, size)) break;
+    cur += next;  // empty lines are skipped
+  }
+  chunk->failed = cur < end;
+  return 0;
+}
+
+// splits the input on row boundaries and locates the rows of each
+// part on its own thread
+static result_t import_parse(import_options_t *options, span_t *input,
+    span_t **rows, size_t *count) {
+  import_chunk_t *chunks;
+  ensure(mem_calloc(
+      (void *)&chunks, options->threads * sizeof(import_chunk_t)));
+  defer(free, chunks);
+  pthread_t *handles;
+  ensure(mem_calloc(
+      (void *)&handles, options->threads * sizeof(pthread_t)));
+  defer(free, handles);
+
+  uint8_t *start = input->address;
+  uint8_t *end   = start + input->size;
+  size_t part    = input->size / options->threads;
+  if (options->record_size) {
+    part -= part % options->record_size;
+  }
+  for (size_t i = 0; i < options->threads; i++) {
+    uint8_t *stop = i + 1 == options->threads ? end : start + part;
+    if (stop > end) stop = end;
+    if (!options->record_size) {
+      uint8_t *eol = memchr(stop, '\n', (size_t)(end - stop));
+      stop         = eol ? eol + 1 : end;
+    }
+    chunks[i].options = options;
+    chunks[i].input   = (span_t){start, (size_t)(stop - start)};
+    start             = stop;
+  }
+
+  size_t started = 0;
+  int rc         = 0;
+  for (; started < options->threads; started++) {
+    rc = pthread_create(
+        &handles[started], 0, import_parse_chunk, &chunks[started]);
+    if (rc) break;
+  }
+  *count = 0;
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(handles[i], 0);
+    *count += chunks[i].count;
+  }
+  bool ok = rc == 0;
+  for (size_t i = 0; i < started; i++) {
+    ok = ok && !chunks[i].failed;
+  }
+  if (ok) {
+    ok = mem_calloc((void *)rows, MAX(1, *count) * sizeof(span_t));
+  }
+  size_t pos = 0;
+  for (size_t i = 0; i < started; i++) {
+    if (ok) {
+      memcpy(*rows + pos, chunks[i].rows,
+          chunks[i].count * sizeof(span_t));
+    }
+    pos += chunks[i].count;
+    free(chunks[i].rows);
+  }
+  ensure(ok, msg("Unable to parse the input"), with(rc, "%d"));
+  return success();
+}
+// end::import_parse[]
+
+// tag::import_load[]
+static result_t import_extract(
+    void *state, span_t *row, span_t *key) {
+  import_index_t *index = state;
+  if (!index->by_column) {
+    ensure(row->size >=
+               (size_t)index->field.offset + index->field.size,
+        msg("Row is too small for the indexed range"),
+        with(row->size, "%zu"));
+    key->address = row->address + index->field.offset;
+    key->size    = index->field.size;
+    return success();
+  }
+  char *cur = row->address;
+  char *end = cur + row->size;
+  for (uint16_t c = 0; c < index->column; c++) {
+    cur = memchr(cur, index->delimiter, (size_t)(end - cur));
+    ensure(cur, msg("Row is missing the indexed column"),
+        with(index->column, "%d"));
+    cur++;
+  }
+  char *stop   = memchr(cur, index->delimiter, (size_t)(end - cur));
+  key->address = cur;
+  key->size    = (size_t)((stop ? stop : end) - cur);
+  ensure(key->size, msg("Indexed column is empty"),
+      with(index->column, "%d"));
+  return success();
+}
+
+static result_t import_load(import_options_t *options, db_t *db,
+    span_t *rows, size_t count, size_t bytes) {
+  index_type_t types[IMPORT_MAX_INDEXES + 1] = {index_type_container};
+  uint64_t ids[IMPORT_MAX_INDEXES + 1];
+  table_schema_t schema = {.name = options->table_name,
+      .count                     = 1,
+      .types                     = types,
+      .index_ids                 = ids};
+  {
+    txn_t tx;
+    ensure(txn_create(db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    table_schema_t existing;
+    ensure(table_get_schema(&tx, options->table_name, &existing));
+    ensure(existing.count == 0, msg("Table already exists"),
+        with(options->table_name, "%s"));
+    ensure(table_create(&tx, &schema));
+    ensure(txn_commit(&tx));
+  }
+
+  table_item_t *items;
+  ensure(mem_calloc(
+      (void *)&items, options->batch_size * sizeof(table_item_t)));
+  defer(free, items);
+  double start        = import_now();
+  size_t transactions = 0;
+  for (size_t pos = 0; pos < count; pos += options->batch_size) {
+    size_t batch = MIN(options->batch_size, count - pos);
+    for (size_t i = 0; i < batch; i++) {
+      items[i] = (table_item_t){.schema = &schema,
+          .entries                      = &rows[pos + i],
+          .number_of_entries            = 1};
+    }
+    txn_t tx;
+    ensure(txn_create(db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    ensure(table_set_many(&tx, &schema, items, batch));
+    ensure(txn_commit(&tx));
+    transactions++;
+  }
+  import_report("load", count, bytes, import_now() - start);
+  printf("%-8s %zu transactions of up to %zu rows\n", "",
+      transactions, options->batch_size);
+
+  start = import_now();
+  txn_t tx;
+  ensure(txn_create(db, TX_WRITE, &tx));
+  defer(txn_close, tx);
+  for (size_t i = 0; i < options->number_of_indexes; i++) {
+    table_index_options_t index = {.extract = import_extract,
+        .state                              = &options->indexes[i],
+        .bytes_per_run                      = options->bytes_per_run,
+        .threads                            = options->threads,
+        .type = options->indexes[i].type};
+    ensure(table_add_index(&tx, &schema, &index), with(i, "%zu"));
+  }
+  ensure(txn_commit(&tx));
+  if (options->number_of_indexes) {
+    import_report("index", count, 0, import_now() - start);
+  }
+  return success();
+}
+// end::import_load[]
+
+static result_t import_read_input(char *path, span_t *input) {
+  FILE *file = fopen(path, "rb");
+  ensure(file, msg("Unable to open input file"), with(path, "%s"));
+  long size = -1;
+  if (!fseek(file, 0, SEEK_END)) size = ftell(file);
+  bool ok = size > 0 && !fseek(file, 0, SEEK_SET) &&
+            mem_alloc(&input->address, (size_t)size);
+  input->size = ok ? (size_t)size : 0;
+  if (ok) {
+    ok = fread(input->address, 1, input->size, file) == input->size;
+  }
+  fclose(file);
+  ensure(ok, msg("Unable to read input file"), with(path, "%s"),
+      with(size, "%ld"));
+  return success();
+}
+
+static result_t import_parse_index(char *spec, char delimiter,
+    import_index_t *index) {
+  char *sep = strchr(spec, ':');
+  ensure(sep, msg("Index must be TYPE:COLUMN or TYPE:OFFSET+SIZE"),
+      with(spec, "%s"));
+  *sep++ = 0;
+  if (!strcmp(spec, "btree")) {
+    index->type = index_type_btree;
+  } else if (!strcmp(spec, "hash")) {
+    index->type = index_type_hash;
+  } else {
+    failed(EINVAL, msg("Index type must be btree or hash"),
+        with(spec, "%s"));
+  }
+  unsigned offset, size;
+  if (sscanf(sep, "%u+%u", &offset, &size) == 2) {
+    ensure(offset <= UINT16_MAX && size && size <= UINT16_MAX,
+        msg("Invalid index range"), with(sep, "%s"));
+    index->field = (table_field_t){(uint16_t)offset, (uint16_t)size};
+    return success();
+  }
+  bool valid = sscanf(sep, "%u", &offset) == 1;
+  ensure(valid && offset <= UINT16_MAX, msg("Invalid index column"),
+      with(sep, "%s"));
+  index->by_column = true;
+  index->column    = (uint16_t)offset;
+  index->delimiter = delimiter;
+  return success();
+}
+
+static void import_usage(void) {
+  fprintf(stderr,
+      "usage: gavran-import [options] <db> <table> <input>\n"
+      "  -r, --record-size N  fixed size binary records\n"
+      "  -d, --delimiter C    column delimiter (default ',')\n"
+      "  -i, --index T:SPEC   btree|hash on COLUMN or OFFSET+SIZE\n"
+      "  -b, --batch N        rows per transaction (default 65536)\n"
+      "  -t, --threads N      parsing and sorting threads\n"
+      "  -m, --memory N       bytes per index sort run\n");
+}
+
+static result_t import_parse_args(
+    int argc, char **argv, import_options_t *options) {
+  long cpus                  = sysconf(_SC_NPROCESSORS_ONLN);
+  options->threads           = (uint16_t)MAX(1, MIN(cpus, 64));
+  options->batch_size        = 65536;
+  options->bytes_per_run     = 64 * 1024 * 1024;
+  options->delimiter         = ',';
+  char *specs[IMPORT_MAX_INDEXES];
+  static struct option long_options[] = {
+      {"record-size", required_argument, 0, 'r'},
+      {"delimiter", required_argument, 0, 'd'},
+      {"index", required_argument, 0, 'i'},
+      {"batch", required_argument, 0, 'b'},
+      {"threads", required_argument, 0, 't'},
+      {"memory", required_argument, 0, 'm'}, {0, 0, 0, 0}};
+  int c;
+  while ((c = getopt_long(argc, argv, "r:d:i:b:t:m:", long_options,
+              0)) != -1) {
+    switch (c) {
+      case 'r':
+        options->record_size = strtoul(optarg, 0, 10);
+        break;
+      case 'd':
+        options->delimiter = optarg[0];
+        break;
+      case 'i':
+        ensure(options->number_of_indexes < IMPORT_MAX_INDEXES,
+            msg("Too many indexes"));
+        specs[options->number_of_indexes++] = optarg;
+        break;
+      case 'b':
+        options->batch_size = strtoul(optarg, 0, 10);
+        break;
+      case 't':
+        options->threads = (uint16_t)strtoul(optarg, 0, 10);
+        break;
+      case 'm':
+        options->bytes_per_run = strtoul(optarg, 0, 10);
+        break;
+      default:
+        failed(EINVAL, msg("Unknown option"));
+    }
+  }
+  ensure(argc - optind == 3, msg("Expected <db> <table> <input>"));
+  ensure(options->batch_size && options->threads,
+      msg("Batch size and threads must be positive"));
+  options->db_path    = argv[optind];
+  options->table_name = argv[optind + 1];
+  options->input_path = argv[optind + 2];
+  for (size_t i = 0; i < options->number_of_indexes; i++) {
+    ensure(import_parse_index(
+        specs[i], options->delimiter, &options->indexes[i]));
+  }
+  return success();
+}
+
+static result_t import_run(import_options_t *options) {
+  span_t input;
+  ensure(import_read_input(options->input_path, &input));
+  defer(free, input.address);
+  size_t partial =
+      options->record_size ? input.size % options->record_size : 0;
+  ensure(partial == 0, msg("Input is not a whole number of records"),
+      with(input.size, "%zu"));
+
+  double start = import_now();
+  span_t *rows;
+  size_t count;
+  ensure(import_parse(options, &input, &rows, &count));
+  defer(free, rows);
+  import_report("parse", count, input.size, import_now() - start);
+
+  db_t db;
+  db_options_t db_options = {.minimum_size = 4 * 1024 * 1024};
+  ensure(db_create(options->db_path, &db_options, &db));
+  defer(db_close, db);
+  ensure(import_load(options, &db, rows, count, input.size));
+  import_report("total", count, input.size, import_now() - start);
+  return success();
+}
+
+int main(int argc, char **argv) {
+  import_options_t options = {0};
+  if (!import_parse_args(argc, argv, &options)) {
+    errors_print_all();
+    import_usage();
+    return 2;
+  }
+  if (!import_run(&options)) {
+    errors_print_all();
+    return 1;
+  }
+  return 0;
+}
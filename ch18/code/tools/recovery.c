@@ -0,0 +1,431 @@
+// gavran-recovery: how long recovery takes, and whether it is right
+//
+//   gavran-recovery [options] <dir>
+//
+// Commits transactions over a pool of pages until the WAL holds the
+// requested amount of data, then crashes in the middle of the next
+// WAL write. A read transaction stays open the whole time, so
+// nothing is checkpointed and recovery has to replay the entire log.
+// The database is then reopened, the time that takes is measured,
+// and every page in the pool is checked. Recovery must restore all
+// the transactions before the crash, and the torn transaction either
+// entirely or not at all. The results are reported as JSON.
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gavran/db.h>
+
+#ifndef GAVRAN_FAULTS
+#error "gavran-recovery needs the PAL fault injection, make FAULTS=1"
+#endif
+
+// tag::recovery_options[]
+#define RECOVERY_MAX_MIX (16)
+
+typedef struct recovery_options {
+  char *dir;
+  char *output;
+  uint64_t wal_bytes;
+  uint64_t seed;
+  size_t pool;
+  size_t runs;
+  size_t torn_write_size;
+  size_t mix[RECOVERY_MAX_MIX];
+  size_t mix_count;
+} recovery_options_t;
+
+typedef struct recovery_run {
+  uint64_t transactions;
+  uint64_t wal_bytes;
+  uint64_t durable_tx_id;
+  uint64_t recovered_tx_id;
+  uint64_t recovery_ns;
+  size_t bad_pages;
+  bool torn_tx_recovered;
+  bool correct;
+  uint8_t padding[6];
+} recovery_run_t;
+
+typedef struct recovery_ctx {
+  recovery_options_t *options;
+  db_t db;
+  char path[PATH_MAX];
+  uint64_t rand;
+  // the first page of the pool is at page_nums[0]
+  uint64_t *page_nums;
+  // the version of every page, as of the last durable commit
+  uint64_t *versions;
+  // and as of the last commit, which may have been torn
+  uint64_t *pending;
+} recovery_ctx_t;
+
+static uint64_t recovery_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64*, the same sequence for the same seed
+static uint64_t recovery_rand(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DUL;
+}
+
+// the content depends on the page and version only, so it can be
+// regenerated to verify the page, and it doesn't compress
+static void recovery_fill(
+    uint64_t *words, uint64_t page_num, uint64_t version) {
+  uint64_t state = (page_num << 32) ^ version ^ 0x9E3779B97F4A7C15UL;
+  words[0]       = page_num;
+  words[1]       = version;
+  for (size_t i = 2; i < PAGE_SIZE / sizeof(uint64_t); i++)
+    words[i] = recovery_rand(&state);
+}
+// end::recovery_options[]
+
+// tag::recovery_db[]
+static result_t recovery_open(recovery_ctx_t *ctx) {
+  db_options_t options = {.minimum_size = 64 * 1024 * 1024,
+      .wal_size                         = 64 * 1024 * 1024};
+  ensure(db_create(ctx->path, &options, &ctx->db));
+  return success();
+}
+
+static result_t recovery_fresh_db(recovery_ctx_t *ctx) {
+  snprintf(ctx->path, sizeof(ctx->path), "%s/recovery",
+      ctx->options->dir);
+  char wal[PATH_MAX + 8];
+  unlink(ctx->path);
+  snprintf(wal, sizeof(wal), "%s-a.wal", ctx->path);
+  unlink(wal);
+  snprintf(wal, sizeof(wal), "%s-b.wal", ctx->path);
+  unlink(wal);
+  ensure(recovery_open(ctx));
+  return success();
+}
+
+static result_t recovery_close_db(recovery_ctx_t *ctx) {
+  ensure(db_close(&ctx->db));
+  return success();
+}
+enable_defer(recovery_close_db);
+
+static result_t recovery_create_pool(recovery_ctx_t *ctx) {
+  txn_t tx;
+  ensure(txn_create(&ctx->db, TX_WRITE, &tx));
+  defer(txn_close, tx);
+  for (size_t i = 0; i < ctx->options->pool; i++) {
+    page_t p = {.number_of_pages = 1};
+    ensure(txn_allocate_page(&tx, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = 1;
+    p.metadata->overflow.size_of_value   = PAGE_SIZE;
+    recovery_fill(p.address, p.page_num, 0);
+    ctx->page_nums[i] = p.page_num;
+    ctx->versions[i]  = 0;
+  }
+  ensure(txn_commit(&tx));
+  return success();
+}
+
+static uint64_t recovery_wal_bytes(db_stats_t *stats) {
+  return stats->wal_write_position[0] + stats->wal_write_position[1];
+}
+// end::recovery_db[]
+
+// tag::recovery_workload[]
+// the pages a transaction modified only become the expected state
+// if its WAL write wasn't torn
+static result_t recovery_commit(recovery_ctx_t *ctx,
+    pal_faults_t *faults, uint64_t *tx_id) {
+  recovery_options_t *o = ctx->options;
+  size_t pages =
+      o->mix[recovery_rand(&ctx->rand) % o->mix_count];
+  pages = MIN(pages, o->pool);
+  memcpy(ctx->pending, ctx->versions, o->pool * sizeof(uint64_t));
+  txn_t tx;
+  ensure(txn_create(&ctx->db, TX_WRITE, &tx));
+  defer(txn_close, tx);
+  *tx_id = tx.state->tx_id;
+  for (size_t i = 0; i < pages; i++) {
+    size_t idx = recovery_rand(&ctx->rand) % o->pool;
+    page_t p   = {.page_num = ctx->page_nums[idx]};
+    ensure(txn_modify_page(&tx, &p));
+    recovery_fill(p.address, p.page_num, *tx_id);
+    ctx->pending[idx] = *tx_id;
+  }
+  ensure(txn_commit(&tx));
+  if (!faults->crashed)
+    memcpy(ctx->versions, ctx->pending, o->pool * sizeof(uint64_t));
+  return success();
+}
+
+static result_t recovery_crash(recovery_ctx_t *ctx,
+    pal_faults_t *faults, recovery_run_t *run) {
+  txn_t rtx;
+  ensure(txn_create(&ctx->db, TX_READ, &rtx));
+  defer(txn_close, rtx);
+  db_stats_t stats;
+  ensure(db_get_stats(&ctx->db, &stats));
+  // creating the pool doesn't count towards the target
+  uint64_t target =
+      recovery_wal_bytes(&stats) + ctx->options->wal_bytes;
+  while (!faults->crashed) {
+    ensure(db_get_stats(&ctx->db, &stats));
+    if (recovery_wal_bytes(&stats) >= target &&
+        !faults->crash_at_write) {
+      run->wal_bytes          = recovery_wal_bytes(&stats);
+      run->durable_tx_id      = stats.last_tx_id;
+      faults->crash_at_write = faults->writes + 1;
+    }
+    uint64_t tx_id;
+    ensure(recovery_commit(ctx, faults, &tx_id));
+    run->transactions++;
+  }
+  return success();
+}
+// end::recovery_workload[]
+
+// tag::recovery_verify[]
+static result_t recovery_verify(
+    recovery_ctx_t *ctx, recovery_run_t *run) {
+  db_stats_t stats;
+  ensure(db_get_stats(&ctx->db, &stats));
+  run->recovered_tx_id = stats.last_tx_id;
+  // the lost part of the torn write may be just padding, in which
+  // case the transaction is whole and recovery should apply it
+  run->torn_tx_recovered =
+      run->recovered_tx_id == run->durable_tx_id + 1;
+  if (!run->torn_tx_recovered &&
+      run->recovered_tx_id != run->durable_tx_id)
+    return success();
+  uint64_t *versions =
+      run->torn_tx_recovered ? ctx->pending : ctx->versions;
+  void *expected;
+  ensure(mem_alloc_page_aligned(&expected, PAGE_SIZE));
+  defer(free, expected);
+  txn_t tx;
+  ensure(txn_create(&ctx->db, TX_READ, &tx));
+  defer(txn_close, tx);
+  for (size_t i = 0; i < ctx->options->pool; i++) {
+    page_t p = {.page_num = ctx->page_nums[i]};
+    ensure(txn_get_page(&tx, &p));
+    recovery_fill(expected, p.page_num, versions[i]);
+    if (memcmp(p.address, expected, PAGE_SIZE)) run->bad_pages++;
+  }
+  run->correct = !run->bad_pages;
+  return success();
+}
+
+static result_t recovery_clear_faults(pal_faults_t *faults) {
+  (void)faults;
+  pal_set_faults(0);
+  return success();
+}
+enable_defer(recovery_clear_faults);
+
+// the process is dead once the write is torn, nothing it does after
+// that reaches the disk, closing the database included
+static result_t recovery_crash_db(
+    recovery_ctx_t *ctx, recovery_run_t *run) {
+  pal_faults_t faults = {.file_suffix = ".wal",
+      .torn_write_size = ctx->options->torn_write_size};
+  defer(recovery_clear_faults, faults);
+  ensure(recovery_fresh_db(ctx));
+  defer(recovery_close_db, *ctx);
+  ensure(recovery_create_pool(ctx));
+  pal_set_faults(&faults);
+  ensure(recovery_crash(ctx, &faults, run));
+  return success();
+}
+
+static result_t recovery_run_one(
+    recovery_ctx_t *ctx, size_t r, recovery_run_t *run) {
+  memset(run, 0, sizeof(recovery_run_t));
+  ctx->rand = ctx->options->seed + r;
+  ensure(recovery_crash_db(ctx, run));
+  uint64_t start = recovery_now();
+  ensure(recovery_open(ctx));
+  run->recovery_ns = recovery_now() - start;
+  defer(recovery_close_db, *ctx);
+  ensure(recovery_verify(ctx, run));
+  return success();
+}
+// end::recovery_verify[]
+
+// tag::recovery_run[]
+static void recovery_report(
+    FILE *out, size_t r, recovery_run_t *run) {
+  fprintf(out,
+      "%s\n    {\"run\": %zu, \"transactions\": %lu, "
+      "\"wal_bytes\": %lu, \"recovery_ns\": %lu, "
+      "\"wal_mb_per_sec\": %.1f, \"durable_tx_id\": %lu, "
+      "\"recovered_tx_id\": %lu, \"torn_tx_recovered\": %s, "
+      "\"bad_pages\": %zu, \"correct\": %s}",
+      r ? "," : "", r, run->transactions, run->wal_bytes,
+      run->recovery_ns,
+      run->recovery_ns ? (double)run->wal_bytes * 1e9 /
+                             (double)run->recovery_ns / 1024 / 1024
+                       : 0,
+      run->durable_tx_id, run->recovered_tx_id,
+      run->torn_tx_recovered ? "true" : "false", run->bad_pages,
+      run->correct ? "true" : "false");
+}
+
+static result_t recovery_run_all(
+    recovery_options_t *options, FILE *out) {
+  recovery_ctx_t ctx = {.options = options};
+  ensure(mem_calloc((void *)&ctx.page_nums,
+      options->pool * sizeof(uint64_t)));
+  defer(free, ctx.page_nums);
+  ensure(mem_calloc(
+      (void *)&ctx.versions, options->pool * sizeof(uint64_t)));
+  defer(free, ctx.versions);
+  ensure(mem_calloc(
+      (void *)&ctx.pending, options->pool * sizeof(uint64_t)));
+  defer(free, ctx.pending);
+
+  fprintf(out, "{\"seed\": %lu, \"target_wal_bytes\": %lu, "
+               "\"pool_pages\": %zu, \"torn_write_size\": %zu, "
+               "\"page_size\": %d, \"mix\": [",
+      options->seed, options->wal_bytes, options->pool,
+      options->torn_write_size, PAGE_SIZE);
+  for (size_t i = 0; i < options->mix_count; i++)
+    fprintf(out, "%s%zu", i ? ", " : "", options->mix[i]);
+  fprintf(out, "], \"runs\": [");
+  size_t failures = 0;
+  for (size_t r = 0; r < options->runs; r++) {
+    recovery_run_t run;
+    ensure(recovery_run_one(&ctx, r, &run), msg("Run failed"),
+        with(r, "%zu"));
+    recovery_report(out, r, &run);
+    if (!run.correct) failures++;
+    fprintf(stderr, "run %-4zu %8lu txs %6.1f ms %s\n", r,
+        run.transactions, (double)run.recovery_ns / 1e6,
+        run.correct ? "ok" : "BAD");
+  }
+  fprintf(out, "\n]}\n");
+  ensure(!failures, msg("Recovery did not restore the durable state"),
+      with(failures, "%zu"));
+  return success();
+}
+
+static result_t recovery_run(recovery_options_t *options) {
+  if (!options->output) {
+    ensure(recovery_run_all(options, stdout));
+    return success();
+  }
+  FILE *out = fopen(options->output, "w");
+  ensure(out, msg("Unable to open output file"),
+      with(options->output, "%s"));
+  bool ok = recovery_run_all(options, out);
+  fclose(out);
+  ensure(ok);
+  return success();
+}
+// end::recovery_run[]
+
+static void recovery_usage(void) {
+  fprintf(stderr,
+      "usage: gavran-recovery [options] <dir>\n"
+      "  -w, --wal-size MB  WAL to write before the crash (16)\n"
+      "  -m, --mix LIST     pages per transaction, picked at random\n"
+      "                     from a comma separated list\n"
+      "                     (1,1,1,10,100)\n"
+      "  -p, --pool N       pages the transactions modify (1024)\n"
+      "  -t, --torn BYTES   of the crashing write to keep (4096)\n"
+      "  -r, --runs N       crashes to recover from (5)\n"
+      "  -s, --seed N       seed for the workload (42)\n"
+      "  -o, --output FILE  write the JSON there, not to stdout\n");
+}
+
+static result_t recovery_parse_mix(
+    char *list, recovery_options_t *options) {
+  options->mix_count = 0;
+  for (char *tok = strtok(list, ","); tok; tok = strtok(0, ",")) {
+    ensure(options->mix_count < RECOVERY_MAX_MIX,
+        msg("Too many entries in the transaction mix"),
+        with(RECOVERY_MAX_MIX, "%d"));
+    size_t pages = strtoul(tok, 0, 10);
+    ensure(pages, msg("Transactions must modify a page at least"),
+        with(tok, "%s"));
+    options->mix[options->mix_count++] = pages;
+  }
+  return success();
+}
+
+static result_t recovery_parse_args(
+    int argc, char **argv, recovery_options_t *options) {
+  static size_t default_mix[] = {1, 1, 1, 10, 100};
+  memcpy(options->mix, default_mix, sizeof(default_mix));
+  options->mix_count       = sizeof(default_mix) / sizeof(size_t);
+  options->wal_bytes       = 16 * 1024 * 1024;
+  options->pool            = 1024;
+  options->torn_write_size = 4096;
+  options->runs            = 5;
+  options->seed            = 42;
+  static struct option long_options[] = {
+      {"wal-size", required_argument, 0, 'w'},
+      {"mix", required_argument, 0, 'm'},
+      {"pool", required_argument, 0, 'p'},
+      {"torn", required_argument, 0, 't'},
+      {"runs", required_argument, 0, 'r'},
+      {"seed", required_argument, 0, 's'},
+      {"output", required_argument, 0, 'o'}, {0, 0, 0, 0}};
+  int c;
+  while ((c = getopt_long(argc, argv, "w:m:p:t:r:s:o:", long_options,
+              0)) != -1) {
+    switch (c) {
+      case 'w':
+        options->wal_bytes = strtoul(optarg, 0, 10) * 1024 * 1024;
+        break;
+      case 'm':
+        ensure(recovery_parse_mix(optarg, options));
+        break;
+      case 'p':
+        options->pool = strtoul(optarg, 0, 10);
+        break;
+      case 't':
+        options->torn_write_size = strtoul(optarg, 0, 10);
+        break;
+      case 'r':
+        options->runs = strtoul(optarg, 0, 10);
+        break;
+      case 's':
+        options->seed = strtoul(optarg, 0, 10);
+        break;
+      case 'o':
+        options->output = optarg;
+        break;
+      default:
+        failed(EINVAL, msg("Unknown option"));
+    }
+  }
+  ensure(argc - optind == 1, msg("Expected <dir>"));
+  ensure(options->wal_bytes && options->mix_count && options->pool &&
+             options->runs && options->seed,
+      msg("WAL size, mix, pool, runs and seed must be positive"));
+  options->dir = argv[optind];
+  return success();
+}
+
+int main(int argc, char **argv) {
+  recovery_options_t options = {0};
+  if (!recovery_parse_args(argc, argv, &options)) {
+    errors_print_all();
+    recovery_usage();
+    return 2;
+  }
+  if (!recovery_run(&options)) {
+    errors_print_all();
+    return 1;
+  }
+  return 0;
+}
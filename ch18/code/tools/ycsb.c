@@ -0,0 +1,645 @@
+// gavran-ycsb: runs the YCSB core workloads against a table
+//
+//   gavran-ycsb [options] <db>
+//
+// The table has a container and a btree primary index on the key,
+// "user" followed by a hash of the record number, as YCSB does. The
+// records are loaded first, then the operations of the workload run
+// in transactions of --batch operations each. The wal is always
+// written synchronously, so a commit is durable once it returns and
+// the batch size sets the durability window. Throughput and latency
+// percentiles are reported per operation type, as JSON. An existing
+// database at <db> is replaced. With -T every page access is written
+// to a trace file, for gavran-heatmap.
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gavran/db.h>
+
+#define YCSB_KEY_SIZE (20)
+#define YCSB_MAX_SCAN (100)
+#define YCSB_TRACE_SIZE (1024 * 1024)
+
+// tag::ycsb_workloads[]
+typedef enum ycsb_op {
+  ycsb_read,
+  ycsb_update,
+  ycsb_insert,
+  ycsb_scan,
+  ycsb_read_modify_write,
+  ycsb_number_of_ops
+} ycsb_op_t;
+
+static const char *ycsb_op_names[] = {
+    "read", "update", "insert", "scan", "read_modify_write"};
+
+typedef enum ycsb_distribution {
+  ycsb_uniform,
+  ycsb_zipfian,
+  ycsb_latest
+} ycsb_distribution_t;
+
+static const char *ycsb_distribution_names[] = {
+    "uniform", "zipfian", "latest"};
+
+// percentages of each operation, as in the YCSB core workloads
+typedef struct ycsb_workload {
+  char name;
+  uint8_t mix[ycsb_number_of_ops];
+  uint8_t padding[2];
+  ycsb_distribution_t distribution;
+} ycsb_workload_t;
+
+static ycsb_workload_t ycsb_workloads[] = {
+    {'a', {50, 50, 0, 0, 0}, {0}, ycsb_zipfian},
+    {'b', {95, 5, 0, 0, 0}, {0}, ycsb_zipfian},
+    {'c', {100, 0, 0, 0, 0}, {0}, ycsb_zipfian},
+    {'d', {95, 0, 5, 0, 0}, {0}, ycsb_latest},
+    {'e', {0, 0, 5, 95, 0}, {0}, ycsb_zipfian},
+    {'f', {50, 0, 0, 0, 50}, {0}, ycsb_zipfian},
+};
+// end::ycsb_workloads[]
+
+typedef struct ycsb_options {
+  char *path;
+  char *output;
+  char *mode;
+  char *trace;
+  size_t records;
+  size_t operations;
+  size_t record_size;
+  size_t batch_size;
+  uint64_t seed;
+  char workload;
+  bool has_distribution;
+  uint8_t padding[2];
+  ycsb_distribution_t distribution;
+} ycsb_options_t;
+
+typedef struct ycsb_samples {
+  uint64_t *ns;
+  size_t count;
+  size_t capacity;
+} ycsb_samples_t;
+
+// tag::ycsb_zipfian[]
+// Gray et al, "Quickly Generating Billion-Record Synthetic
+// Databases", as used by YCSB. The zeta sum is extended as records
+// are inserted.
+typedef struct ycsb_zipfian {
+  uint64_t items;
+  double theta;
+  double alpha;
+  double zeta2;
+  double zetan;
+  double eta;
+} ycsb_zipfian_t;
+
+static double ycsb_zeta(uint64_t from, uint64_t to, double theta) {
+  double sum = 0;
+  for (uint64_t i = from; i < to; i++)
+    sum += 1 / pow((double)(i + 1), theta);
+  return sum;
+}
+
+static void ycsb_zipfian_init(ycsb_zipfian_t *z, uint64_t items) {
+  z->theta = 0.99;
+  z->alpha = 1 / (1 - z->theta);
+  z->zeta2 = ycsb_zeta(0, 2, z->theta);
+  z->zetan = ycsb_zeta(0, items, z->theta);
+  z->items = items;
+  z->eta   = (1 - pow(2.0 / (double)items, 1 - z->theta)) /
+           (1 - z->zeta2 / z->zetan);
+}
+
+static void ycsb_zipfian_grow(ycsb_zipfian_t *z, uint64_t items) {
+  if (items <= z->items) return;
+  z->zetan += ycsb_zeta(z->items, items, z->theta);
+  z->items = items;
+  z->eta   = (1 - pow(2.0 / (double)items, 1 - z->theta)) /
+           (1 - z->zeta2 / z->zetan);
+}
+
+// 0 is the most popular item
+static uint64_t ycsb_zipfian_next(ycsb_zipfian_t *z, double u) {
+  double uz = u * z->zetan;
+  if (uz < 1) return 0;
+  if (uz < 1 + pow(0.5, z->theta)) return 1;
+  double v =
+      (double)z->items * pow(z->eta * u - z->eta + 1, z->alpha);
+  return MIN((uint64_t)v, z->items - 1);
+}
+// end::ycsb_zipfian[]
+
+// tag::ycsb_state[]
+typedef struct ycsb_state {
+  ycsb_options_t *options;
+  ycsb_workload_t *workload;
+  db_t db;
+  table_schema_t schema;
+  index_type_t types[2];
+  uint8_t padding[6];
+  uint64_t index_ids[2];
+  ycsb_zipfian_t zipfian;
+  uint64_t rand;
+  uint64_t next_insert;  // records 0 to next_insert exist
+  uint8_t *row;
+  uint8_t *old_row;
+  ycsb_samples_t samples[ycsb_number_of_ops];
+  FILE *trace;
+  db_page_access_t *trace_entries;
+  uint64_t trace_position;
+  uint64_t trace_lost;
+} ycsb_state_t;
+
+static uint64_t ycsb_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t ycsb_rand(ycsb_state_t *s) {
+  s->rand ^= s->rand >> 12;
+  s->rand ^= s->rand << 25;
+  s->rand ^= s->rand >> 27;
+  return s->rand * 0x2545F4914F6CDD1DUL;
+}
+
+static double ycsb_rand_unit(ycsb_state_t *s) {
+  return (double)(ycsb_rand(s) >> 11) / (double)(1UL << 53);
+}
+
+static uint64_t ycsb_fnv(uint64_t n) {
+  uint64_t hash = 0xCBF29CE484222325UL;
+  for (size_t i = 0; i < 8; i++) {
+    hash ^= n & 0xff;
+    hash *= 1099511628211UL;
+    n >>= 8;
+  }
+  return hash;
+}
+
+static span_t ycsb_key(uint64_t record, char key[YCSB_KEY_SIZE + 1]) {
+  snprintf(key, YCSB_KEY_SIZE + 1, "user%016lx", ycsb_fnv(record));
+  span_t span = {.address = key, .size = YCSB_KEY_SIZE};
+  return span;
+}
+
+static uint64_t ycsb_next_record(ycsb_state_t *s) {
+  uint64_t n = s->next_insert;
+  switch (s->options->distribution) {
+    case ycsb_uniform:
+      return ycsb_rand(s) % n;
+    case ycsb_latest:
+      ycsb_zipfian_grow(&s->zipfian, n);
+      return n - 1 -
+             ycsb_zipfian_next(&s->zipfian, ycsb_rand_unit(s));
+    case ycsb_zipfian:
+    default:
+      // scrambled, so the popular records are spread over the keys
+      ycsb_zipfian_grow(&s->zipfian, n);
+      return ycsb_fnv(ycsb_zipfian_next(
+                 &s->zipfian, ycsb_rand_unit(s))) %
+             n;
+  }
+}
+
+// the row starts with its key, the rest are random bytes
+static void ycsb_fill_row(ycsb_state_t *s, span_t *key) {
+  memcpy(s->row, key->address, key->size);
+  for (size_t i = key->size; i + 8 <= s->options->record_size;
+       i += 8) {
+    uint64_t word = ycsb_rand(s);
+    memcpy(s->row + i, &word, 8);
+  }
+}
+// end::ycsb_state[]
+
+// tag::ycsb_ops[]
+static result_t ycsb_insert_record(ycsb_state_t *s, txn_t *tx) {
+  char key_buf[YCSB_KEY_SIZE + 1];
+  span_t key = ycsb_key(s->next_insert++, key_buf);
+  ycsb_fill_row(s, &key);
+  span_t entries[2] = {
+      {.address = s->row, .size = s->options->record_size}, key};
+  table_item_t item = {.schema = &s->schema,
+      .entries                 = entries,
+      .number_of_entries       = 2};
+  ensure(table_set(tx, &item));
+  return success();
+}
+
+static result_t ycsb_read_record(
+    ycsb_state_t *s, txn_t *tx, span_t *key, table_item_t *item) {
+  span_t entries[2] = {*key};  // the key for the index to use
+  *item             = (table_item_t){.schema = &s->schema,
+      .entries                           = entries,
+      .number_of_entries                 = 2,
+      .index_to_use                      = 1};
+  ensure(table_get(tx, item));
+  ensure(item->result.size == s->options->record_size,
+      msg("Missing record"), with((char *)key->address, "%.20s"));
+  item->entries = 0;
+  return success();
+}
+
+static result_t ycsb_update_record(ycsb_state_t *s, txn_t *tx) {
+  char key_buf[YCSB_KEY_SIZE + 1];
+  span_t key = ycsb_key(ycsb_next_record(s), key_buf);
+  table_item_t item;
+  ensure(ycsb_read_record(s, tx, &key, &item));
+  // the old row is read from a page the update may change
+  memcpy(s->old_row, item.result.address, item.result.size);
+  span_t old[2] = {
+      {.address = s->old_row, .size = s->options->record_size}, key};
+  ycsb_fill_row(s, &key);
+  span_t entries[2] = {
+      {.address = s->row, .size = s->options->record_size}, key};
+  item.entries           = entries;
+  item.number_of_entries = 2;
+  ensure(table_update(tx, &item, old));
+  return success();
+}
+
+static result_t ycsb_scan_records(ycsb_state_t *s, txn_t *tx) {
+  char key_buf[YCSB_KEY_SIZE + 1];
+  span_t key       = ycsb_key(ycsb_next_record(s), key_buf);
+  size_t length    = 1 + ycsb_rand(s) % YCSB_MAX_SCAN;
+  table_range_t it = {.tx = tx,
+      .schema         = &s->schema,
+      .start          = key,
+      .index_to_use   = 1,
+      .key_order      = true};
+  defer(table_range_close, it);
+  size_t seen = 0;
+  while (seen < length) {
+    ensure(table_range_next(&it));
+    if (!it.count) break;
+    seen += it.count;
+  }
+  return success();
+}
+
+static result_t ycsb_run_op(
+    ycsb_state_t *s, txn_t *tx, ycsb_op_t op) {
+  char key_buf[YCSB_KEY_SIZE + 1];
+  table_item_t item;
+  switch (op) {
+    case ycsb_read: {
+      span_t key = ycsb_key(ycsb_next_record(s), key_buf);
+      ensure(ycsb_read_record(s, tx, &key, &item));
+      break;
+    }
+    case ycsb_insert:
+      ensure(ycsb_insert_record(s, tx));
+      break;
+    case ycsb_scan:
+      ensure(ycsb_scan_records(s, tx));
+      break;
+    case ycsb_update:
+    case ycsb_read_modify_write:
+      // an update needs the old row for the indexes, so the two
+      // differ only in the operations that YCSB counts
+      ensure(ycsb_update_record(s, tx));
+      break;
+    case ycsb_number_of_ops:
+    default:
+      failed(EINVAL, msg("Unknown operation"), with(op, "%d"));
+  }
+  return success();
+}
+
+static ycsb_op_t ycsb_choose_op(ycsb_state_t *s) {
+  uint64_t pick = ycsb_rand(s) % 100, total = 0;
+  for (size_t i = 0; i < ycsb_number_of_ops; i++) {
+    total += s->workload->mix[i];
+    if (pick < total) return (ycsb_op_t)i;
+  }
+  return ycsb_read;
+}
+// end::ycsb_ops[]
+
+// tag::ycsb_run[]
+// called between transactions, the ring holds more than the largest
+// of them, so nothing should be lost
+static result_t ycsb_drain_trace(ycsb_state_t *s) {
+  if (!s->trace) return success();
+  while (true) {
+    size_t read;
+    uint64_t lost;
+    ensure(db_page_trace_read(&s->db, &s->trace_position,
+        s->trace_entries, YCSB_TRACE_SIZE, &read, &lost));
+    s->trace_lost += lost;
+    if (!read && !lost) return success();
+    ensure(fwrite(s->trace_entries, sizeof(db_page_access_t), read,
+               s->trace) == read,
+        msg("Unable to write the trace"));
+  }
+}
+
+static result_t ycsb_record(ycsb_samples_t *samples, uint64_t ns) {
+  if (samples->count == samples->capacity) {
+    samples->capacity = MAX(1024, samples->capacity * 2);
+    ensure(mem_realloc((void *)&samples->ns,
+        samples->capacity * sizeof(uint64_t)));
+  }
+  samples->ns[samples->count++] = ns;
+  return success();
+}
+
+static result_t ycsb_load(ycsb_state_t *s, uint64_t *elapsed) {
+  uint64_t start = ycsb_now();
+  {
+    txn_t tx;
+    ensure(txn_create(&s->db, TX_WRITE, &tx));
+    defer(txn_close, tx);
+    s->schema = (table_schema_t){.name = "usertable",
+        .types                         = s->types,
+        .index_ids                     = s->index_ids,
+        .count                         = 2};
+    ensure(table_create(&tx, &s->schema));
+    ensure(txn_commit(&tx));
+  }
+  ensure(ycsb_drain_trace(s));
+  while (s->next_insert < s->options->records) {
+    txn_t load;
+    ensure(txn_create(&s->db, TX_WRITE, &load));
+    defer(txn_close, load);
+    for (size_t i = 0;
+         i < 10000 && s->next_insert < s->options->records; i++)
+      ensure(ycsb_insert_record(s, &load));
+    ensure(txn_commit(&load));
+    ensure(ycsb_drain_trace(s));
+  }
+  *elapsed = ycsb_now() - start;
+  return success();
+}
+
+static bool ycsb_is_read_only(ycsb_workload_t *workload) {
+  return !workload->mix[ycsb_update] && !workload->mix[ycsb_insert] &&
+         !workload->mix[ycsb_read_modify_write];
+}
+
+// each sample is an operation, the commit is timed with the last
+// operation of its batch
+static result_t ycsb_run_ops(ycsb_state_t *s, uint64_t *elapsed) {
+  db_flags_t flags =
+      ycsb_is_read_only(s->workload) ? TX_READ : TX_WRITE;
+  uint64_t start = ycsb_now();
+  size_t done    = 0;
+  while (done < s->options->operations) {
+    txn_t tx;
+    ensure(txn_create(&s->db, flags, &tx));
+    defer(txn_close, tx);
+    size_t batch = MIN(
+        s->options->batch_size, s->options->operations - done);
+    for (size_t i = 0; i < batch; i++) {
+      ycsb_op_t op      = ycsb_choose_op(s);
+      uint64_t op_start = ycsb_now();
+      ensure(ycsb_run_op(s, &tx, op));
+      if (i + 1 == batch && flags == TX_WRITE)
+        ensure(txn_commit(&tx));
+      ensure(ycsb_record(&s->samples[op], ycsb_now() - op_start));
+    }
+    done += batch;
+    ensure(ycsb_drain_trace(s));
+  }
+  *elapsed = ycsb_now() - start;
+  return success();
+}
+
+static int ycsb_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t ycsb_percentile(ycsb_samples_t *samples, double p) {
+  size_t i = (size_t)(p * (double)(samples->count - 1) + 0.5);
+  return samples->ns[MIN(i, samples->count - 1)];
+}
+
+static void ycsb_report(FILE *out, ycsb_state_t *s, uint64_t load_ns,
+    uint64_t run_ns) {
+  ycsb_options_t *o = s->options;
+  fprintf(out,
+      "{\"workload\": \"%c\", \"distribution\": \"%s\", "
+      "\"mode\": \"%s\", \"records\": %zu, \"record_size\": %zu, "
+      "\"operations\": %zu, \"batch_size\": %zu,\n"
+      " \"load_ns\": %lu, \"load_ops_per_sec\": %.1f,\n"
+      " \"run_ns\": %lu, \"ops_per_sec\": %.1f, \"results\": [",
+      s->workload->name, ycsb_distribution_names[o->distribution],
+      o->mode, o->records, o->record_size, o->operations,
+      o->batch_size, load_ns,
+      (double)o->records * 1e9 / (double)MAX(1, load_ns), run_ns,
+      (double)o->operations * 1e9 / (double)MAX(1, run_ns));
+  bool first = true;
+  for (size_t i = 0; i < ycsb_number_of_ops; i++) {
+    ycsb_samples_t *samples = &s->samples[i];
+    if (!samples->count) continue;
+    qsort(samples->ns, samples->count, sizeof(uint64_t), ycsb_cmp);
+    uint64_t total = 0;
+    for (size_t j = 0; j < samples->count; j++)
+      total += samples->ns[j];
+    fprintf(out,
+        "%s\n  {\"op\": \"%s\", \"count\": %zu, \"mean_ns\": %.1f, "
+        "\"p50_ns\": %lu, \"p95_ns\": %lu, \"p99_ns\": %lu, "
+        "\"p999_ns\": %lu, \"max_ns\": %lu}",
+        first ? "" : ",", ycsb_op_names[i], samples->count,
+        (double)total / (double)samples->count,
+        ycsb_percentile(samples, 0.5), ycsb_percentile(samples, 0.95),
+        ycsb_percentile(samples, 0.99),
+        ycsb_percentile(samples, 0.999),
+        samples->ns[samples->count - 1]);
+    first = false;
+  }
+  fprintf(out, "\n]}\n");
+}
+
+static result_t ycsb_free(ycsb_state_t *s) {
+  free(s->row);
+  free(s->old_row);
+  for (size_t i = 0; i < ycsb_number_of_ops; i++)
+    free(s->samples[i].ns);
+  free(s->trace_entries);
+  if (s->trace) fclose(s->trace);
+  return success();
+}
+enable_defer(ycsb_free);
+
+static result_t ycsb_run(ycsb_options_t *options) {
+  ycsb_state_t s = {.options = options,
+      .types     = {index_type_container, index_type_btree},
+      .rand      = options->seed};
+  defer(ycsb_free, s);
+  for (size_t i = 0;
+       i < sizeof(ycsb_workloads) / sizeof(ycsb_workloads[0]); i++) {
+    if (ycsb_workloads[i].name == options->workload)
+      s.workload = &ycsb_workloads[i];
+  }
+  ensure(s.workload, msg("Unknown workload"),
+      with(options->workload, "%c"));
+  if (!options->has_distribution)
+    options->distribution = s.workload->distribution;
+  ensure(mem_calloc((void *)&s.row, options->record_size));
+  ensure(mem_calloc((void *)&s.old_row, options->record_size));
+
+  db_options_t db_options = {.minimum_size = 64 * 1024 * 1024,
+      .wal_size                            = 64 * 1024 * 1024};
+  if (!strcmp(options->mode, "no_mmap")) {
+    db_options.flags = db_flags_avoid_mmap_io;
+  } else if (!strcmp(options->mode, "encrypted")) {
+    for (uint8_t i = 0; i < sizeof(db_options.encryption_key); i++)
+      db_options.encryption_key[i] = (uint8_t)(i + 1);
+  } else {
+    ensure(!strcmp(options->mode, "mmap"),
+        msg("Mode must be mmap, no_mmap or encrypted"),
+        with(options->mode, "%s"));
+  }
+  if (options->trace) {
+    db_options.page_trace_size = YCSB_TRACE_SIZE;
+    ensure(mem_calloc((void *)&s.trace_entries,
+        YCSB_TRACE_SIZE * sizeof(db_page_access_t)));
+    s.trace = fopen(options->trace, "wb");
+    ensure(s.trace, msg("Unable to open trace file"),
+        with(options->trace, "%s"));
+  }
+  char wal[PATH_MAX + 8];
+  unlink(options->path);
+  snprintf(wal, sizeof(wal), "%s-a.wal", options->path);
+  unlink(wal);
+  snprintf(wal, sizeof(wal), "%s-b.wal", options->path);
+  unlink(wal);
+  ensure(db_create(options->path, &db_options, &s.db));
+  defer(db_close, s.db);
+
+  uint64_t load_ns, run_ns;
+  ensure(ycsb_load(&s, &load_ns));
+  ycsb_zipfian_init(&s.zipfian, s.next_insert);
+  ensure(ycsb_run_ops(&s, &run_ns));
+
+  FILE *out = options->output ? fopen(options->output, "w") : stdout;
+  ensure(out, msg("Unable to open output file"),
+      with(options->output, "%s"));
+  ycsb_report(out, &s, load_ns, run_ns);
+  if (out != stdout) fclose(out);
+  if (s.trace_lost)
+    fprintf(stderr, "%lu page accesses were not traced\n",
+        s.trace_lost);
+  return success();
+}
+// end::ycsb_run[]
+
+static void ycsb_usage(void) {
+  fprintf(stderr,
+      "usage: gavran-ycsb [options] <db>\n"
+      "  -w, --workload X      a to f (default a)\n"
+      "  -r, --records N       records loaded (default 100000)\n"
+      "  -n, --operations N    operations run (default 100000)\n"
+      "  -s, --record-size N   bytes per record (default 1000)\n"
+      "  -d, --distribution D  uniform, zipfian or latest\n"
+      "  -b, --batch N         operations per transaction\n"
+      "  -m, --mode M          mmap, no_mmap or encrypted\n"
+      "  -S, --seed N          seed for keys and operations\n"
+      "  -o, --output FILE     write the JSON there\n"
+      "  -T, --trace FILE      write the page accesses there\n");
+}
+
+static result_t ycsb_parse_args(
+    int argc, char **argv, ycsb_options_t *options) {
+  options->workload    = 'a';
+  options->records     = 100000;
+  options->operations  = 100000;
+  options->record_size = 1000;
+  options->batch_size  = 1;
+  options->seed        = 42;
+  options->mode        = "mmap";
+  static struct option long_options[] = {
+      {"workload", required_argument, 0, 'w'},
+      {"records", required_argument, 0, 'r'},
+      {"operations", required_argument, 0, 'n'},
+      {"record-size", required_argument, 0, 's'},
+      {"distribution", required_argument, 0, 'd'},
+      {"batch", required_argument, 0, 'b'},
+      {"mode", required_argument, 0, 'm'},
+      {"seed", required_argument, 0, 'S'},
+      {"output", required_argument, 0, 'o'},
+      {"trace", required_argument, 0, 'T'}, {0, 0, 0, 0}};
+  int c;
+  while ((c = getopt_long(argc, argv, "w:r:n:s:d:b:m:S:o:T:",
+              long_options, 0)) != -1) {
+    switch (c) {
+      case 'w':
+        options->workload = optarg[0];
+        break;
+      case 'r':
+        options->records = strtoul(optarg, 0, 10);
+        break;
+      case 'n':
+        options->operations = strtoul(optarg, 0, 10);
+        break;
+      case 's':
+        options->record_size = strtoul(optarg, 0, 10);
+        break;
+      case 'd':
+        options->has_distribution = true;
+        if (!strcmp(optarg, "uniform")) {
+          options->distribution = ycsb_uniform;
+        } else if (!strcmp(optarg, "zipfian")) {
+          options->distribution = ycsb_zipfian;
+        } else if (!strcmp(optarg, "latest")) {
+          options->distribution = ycsb_latest;
+        } else {
+          failed(EINVAL, msg("Unknown distribution"),
+              with(optarg, "%s"));
+        }
+        break;
+      case 'b':
+        options->batch_size = strtoul(optarg, 0, 10);
+        break;
+      case 'm':
+        options->mode = optarg;
+        break;
+      case 'S':
+        options->seed = strtoul(optarg, 0, 10);
+        break;
+      case 'o':
+        options->output = optarg;
+        break;
+      case 'T':
+        options->trace = optarg;
+        break;
+      default:
+        failed(EINVAL, msg("Unknown option"));
+    }
+  }
+  ensure(argc - optind == 1, msg("Expected <db>"));
+  ensure(options->records > 1 && options->operations &&
+             options->batch_size && options->seed,
+      msg("Records, operations, batch and seed must be positive"));
+  ensure(options->record_size >= YCSB_KEY_SIZE &&
+             options->record_size <= 1024 * 1024,
+      msg("Record size must be between 20 bytes and 1MB"),
+      with(options->record_size, "%zu"));
+  options->path = argv[optind];
+  return success();
+}
+
+int main(int argc, char **argv) {
+  ycsb_options_t options = {0};
+  if (!ycsb_parse_args(argc, argv, &options)) {
+    errors_print_all();
+    ycsb_usage();
+    return 2;
+  }
+  if (!ycsb_run(&options)) {
+    errors_print_all();
+    return 1;
+  }
+  return 0;
+}
@@ -107,7 +107,8 @@ typedef struct hash_page {
   uint8_t depth;
   uint16_t number_of_entries;
   uint16_t bytes_used;
-  uint8_t _padding[2];
+  uint8_t layout;  // where the entries are placed, see hash.c
+  uint8_t _padding[1];
   uint64_t dir_page_num;
   nested_list_t nested;
 } hash_page_t;
@@ -187,6 +188,11 @@ _Static_assert(sizeof(page_metadata_t) == 64,
 typedef struct db_state db_state_t;
 typedef struct txn_state txn_state_t;
 typedef struct pages_hash_table pages_map_t;
+typedef struct db_row_cache db_row_cache_t;
+typedef struct db_page_trace db_page_trace_t;
+typedef struct table_refs table_refs_t;
+typedef struct table_stats_delta table_stats_delta_t;
+typedef struct db_op_scope db_op_scope_t;
 
 typedef struct db {
   db_state_t *state;
@@ -203,6 +209,8 @@ typedef enum db_flags {
   db_flags_page_validation_once   = 1 << 7,
   db_flags_page_validation_always = 1 << 8,
   db_flags_log_shipping_target    = 1 << 9,
+  db_flags_latency_stats          = 1 << 10,
+  db_flags_sys_counters           = 1 << 11,
   db_flags_page_validation_none =
       db_flags_page_validation_once | db_flags_page_validation_always,
   db_flags_page_validation_none_mask =
@@ -233,7 +241,20 @@ typedef struct db_options {
   uint64_t wal_size;
   uint8_t encryption_key[32];
   db_flags_t flags;
-  uint32_t _padding;
+  // largest value btree_set keeps in a leaf, up to
+  // BTREE_INLINE_LIMIT, 0 means BTREE_INLINE_MAX_SIZE. Checked on
+  // every open but not kept in the file: each entry marks its own
+  // value as inline, so a file reopened with a smaller size still
+  // reads the larger values, only new ones are held to it.
+  uint32_t inline_max_size;
+  // bytes of decoded rows kept across transactions when pages are
+  // read into a working set, 0 disables the row cache. Like the rest
+  // of the database, the cache isn't locked, a db_t is used from a
+  // single thread at a time.
+  uint64_t row_cache_size;
+  // number of page accesses kept for db_page_trace_read, rounded up
+  // to a power of two, 0 disables the tracing
+  uint64_t page_trace_size;
   wal_write_callback_t wal_write_callback;
   void *wal_write_callback_state;
 } db_options_t;
@@ -253,6 +274,117 @@ typedef struct wal_state {
 } wal_state_t;
 // end::wal_data_structs[]
 
+// tag::db_latency_stats_t[]
+// the phases of txn_commit, the writeback phases run when a
+// transaction is no longer in use and its pages are written to the
+// data file
+typedef enum db_latency_phase {
+  db_latency_commit,
+  db_latency_finalize_pages,
+  db_latency_wal_prepare,  // diff and compression
+  db_latency_wal_hash,
+  db_latency_wal_write,
+  db_latency_log_shipping,
+  db_latency_gc_writeback,
+  db_latency_gc_fsync,
+  db_latency_checkpoint,
+  db_latency_number_of_phases
+} db_latency_phase_t;
+
+// log linear buckets, 8 per power of two, up to 2^40 ns. A value is
+// reported at most 12.5% above what was measured.
+#define DB_LATENCY_SUB_BUCKETS (8)
+#define DB_LATENCY_BUCKETS ((40 - 2) * DB_LATENCY_SUB_BUCKETS)
+
+typedef struct db_latency_histogram {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[DB_LATENCY_BUCKETS];
+} db_latency_histogram_t;
+
+typedef struct db_latency_stats {
+  db_latency_histogram_t phases[db_latency_number_of_phases];
+} db_latency_stats_t;
+// end::db_latency_stats_t[]
+
+// tag::db_sys_stats_t[]
+// the calls that allocations and system calls are attributed to. Only
+// the outermost one counts, the btree_set calls that table_set makes
+// are part of the table_set.
+typedef enum db_op {
+  db_op_txn_create,
+  db_op_txn_commit,
+  db_op_txn_close,
+  db_op_container_item_put,
+  db_op_container_item_get,
+  db_op_container_item_update,
+  db_op_container_item_del,
+  db_op_hash_set,
+  db_op_hash_get,
+  db_op_hash_del,
+  db_op_btree_set,
+  db_op_btree_get,
+  db_op_btree_del,
+  db_op_table_set,
+  db_op_table_get,
+  db_op_table_update,
+  db_op_table_del,
+  db_op_table_scan_next,
+  db_op_table_range_next,
+  db_op_number_of_ops
+} db_op_t;
+
+// allocations and system calls made by the thread
+typedef enum sys_counter {
+  sys_counter_alloc,  // malloc, calloc, realloc and strdup
+  sys_counter_posix_memalign,
+  sys_counter_free,
+  sys_counter_pread,
+  sys_counter_pwrite,
+  sys_counter_mmap,
+  sys_counter_munmap,
+  sys_counter_mprotect,
+  sys_counter_fsync,  // fdatasync, and fsync of directories
+  sys_counter_number_of_counters
+} sys_counter_t;
+
+typedef struct sys_counters {
+  uint64_t calls[sys_counter_number_of_counters];
+} sys_counters_t;
+
+typedef struct db_op_counters {
+  uint64_t calls;
+  uint64_t sys[sys_counter_number_of_counters];
+} db_op_counters_t;
+
+typedef struct db_sys_stats {
+  db_op_counters_t ops[db_op_number_of_ops];
+} db_sys_stats_t;
+// end::db_sys_stats_t[]
+
+// tag::db_hooks_t[]
+// the layers above the transactions plug in here, unset hooks are
+// skipped. See the db_hooks_* calls in internal.h.
+typedef struct db_hooks {
+  // before the pages of a write transaction are finalized, it may
+  // still modify pages
+  result_t (*before_commit)(txn_t *tx);
+  // once a write transaction is committed and visible
+  void (*after_commit)(txn_state_t *state);
+  // before the pages in a transaction's working set are freed
+  void (*clear_working_set)(txn_t *tx);
+  // a phase of txn_commit is done, start is from db_latency_now()
+  void (*latency)(
+      db_state_t *db, db_latency_phase_t phase, uint64_t start);
+  // a page was found by txn_raw_get_page or txn_raw_modify_page
+  void (*page_access)(txn_t *tx, page_t *page, bool write);
+  // around the API calls, see counted_op
+  void (*op_begin)(db_op_scope_t *scope, db_state_t *db, db_op_t op);
+  void (*op_end)(db_op_scope_t *scope);
+} db_hooks_t;
+// end::db_hooks_t[]
+
 // tag::db_state_t[]
 typedef struct db_state {
   db_options_t options;
@@ -268,6 +400,13 @@ typedef struct db_state {
   uint64_t *first_read_bitmap;
   uint64_t original_number_of_pages;
   uint64_t oldest_active_tx;
+  db_row_cache_t *row_cache;
+  db_latency_stats_t latency;
+  uint64_t checkpoints;
+  uint64_t file_growths;
+  db_sys_stats_t sys_stats;
+  db_page_trace_t *page_trace;
+  db_hooks_t hooks;
 } db_state_t;
 // end::db_state_t[]
 
@@ -307,6 +446,8 @@ typedef struct txn_state {
   txn_state_t *next_tx;
   void *shipped_wal_record;
   uint64_t can_free_after_tx_id;
+  table_refs_t *table_refs;  // see table_scan_refs_acquire
+  table_stats_delta_t *table_stats;  // see table_stats_record
   struct {
     reusable_buffer_t buffer;
     btree_stack_t stack;
@@ -332,6 +473,82 @@ result_t txn_raw_get_page(txn_t *tx, page_t *page);
 result_t txn_raw_modify_page(txn_t *tx, page_t *page);
 // end::txn_api[]
 
+// tag::db_latency_api[]
+// copies the commit latency histograms, kept since the db was opened
+// with db_flags_latency_stats. They are all empty otherwise.
+result_t db_get_latency_stats(db_t *db, db_latency_stats_t *stats);
+// the upper bound of the bucket holding the given fraction (0.99 for
+// p99) of the samples, 0 if there are none
+uint64_t db_latency_percentile(
+    db_latency_histogram_t *histogram, double fraction);
+const char *db_latency_phase_name(db_latency_phase_t phase);
+// end::db_latency_api[]
+
+// tag::db_stats_api[]
+typedef struct db_stats {
+  uint64_t file_size;
+  uint64_t number_of_pages;
+  uint64_t free_pages;
+  uint64_t last_tx_id;
+  uint64_t oldest_active_tx;
+  uint64_t open_read_transactions;
+  // committed, but not yet written to the data file and freed
+  uint64_t pending_transactions;
+  uint64_t pending_version_bytes;  // the page copies they hold
+  uint64_t wal_current_file;
+  uint64_t wal_write_position[2];
+  uint64_t wal_file_size[2];
+  uint64_t checkpoints;
+  uint64_t file_growths;
+} db_stats_t;
+
+// opens a read transaction to count the free pages
+result_t db_get_stats(db_t *db, db_stats_t *stats);
+
+#define DB_STATS_NUMBER_OF_COUNTERS (15)
+typedef struct db_stats_counter {
+  const char *name;
+  uint64_t value;
+} db_stats_counter_t;
+// the stats as named counters, for exporting
+void db_stats_counters(db_stats_t *stats,
+    db_stats_counter_t counters[DB_STATS_NUMBER_OF_COUNTERS]);
+// end::db_stats_api[]
+
+// tag::db_sys_stats_api[]
+// the counts kept since the db was opened with db_flags_sys_counters,
+// all zero without it
+result_t db_get_sys_stats(db_t *db, db_sys_stats_t *stats);
+const char *db_op_name(db_op_t op);
+const char *db_sys_counter_name(sys_counter_t counter);
+// end::db_sys_stats_api[]
+
+// tag::db_page_trace_api[]
+// a single txn_raw_get_page (read) or txn_raw_modify_page (write)
+// that succeeded. The first modification of a page in a transaction
+// also reads the original. Pages that are being allocated may show up
+// as free. The trace never reads a page of its own, the flags are
+// DB_PAGE_TRACE_UNKNOWN_FLAGS if the page's metadata isn't in memory
+// already, as happens with db_flags_page_need_txn_working_set.
+#define DB_PAGE_TRACE_UNKNOWN_FLAGS (0xFF)
+
+typedef struct db_page_access {
+  uint64_t tx_id;
+  uint64_t page_num;
+  uint8_t page_flags;
+  bool write;
+  uint8_t padding[6];
+} db_page_access_t;
+
+// copies up to count accesses, starting from position (0 on the
+// first call), and moves position past them. The trace is a ring, so
+// accesses that were overwritten before they were read are counted
+// in lost instead.
+result_t db_page_trace_read(db_t *db, uint64_t *position,
+    db_page_access_t *entries, size_t count, size_t *read,
+    uint64_t *lost);
+// end::db_page_trace_api[]
+
 result_t txn_register_cleanup_action(cleanup_callback_t **head,
     void (*action)(void *), void *state_to_copy,
     size_t size_of_state);
@@ -377,6 +594,8 @@ typedef struct container_item {
 
 // CRUD operations
 result_t container_item_put(txn_t *tx, container_item_t *item);
+result_t container_item_put_many(
+    txn_t *tx, container_item_t *items, size_t count);
 result_t container_item_update(
     txn_t *tx, container_item_t *item, bool *in_place);
 result_t container_item_get(txn_t *tx, container_item_t *item);
@@ -423,10 +642,18 @@ result_t hash_multi_get_next(txn_t *tx, pages_map_t **state,
 // end::hash_multi_api[]
 
 // tag::btree_api[]
+#define BTREE_INLINE_MAX_SIZE (1024)
+// keeps an entry with the largest key under a quarter of a page, so
+// splitting a page always makes room for it
+#define BTREE_INLINE_LIMIT (PAGE_SIZE / 4 - 512 - 8)
+
 typedef struct btree_val {
   uint64_t tree_id;
   span_t key;
   uint64_t val;
+  // value bytes stored in the leaf, used instead of val when the
+  // address is set. Points into the page, valid until it changes.
+  span_t data;
   int16_t position;
   int8_t last_match;
   bool has_val;
@@ -436,10 +663,15 @@ typedef struct btree_val {
 
 result_t btree_create(txn_t *tx, uint64_t *tree_id);
 result_t btree_drop(txn_t *tx, uint64_t tree_id);
+// larger values go elsewhere, with the location in val
+size_t btree_inline_max_size(txn_t *tx);
 
 result_t btree_set(txn_t *tx, btree_val_t *set, btree_val_t *old);
 result_t btree_get(txn_t *tx, btree_val_t *kvp);
 result_t btree_del(txn_t *tx, btree_val_t *del);
+// looks up many keys at once, the kvps are filled as btree_get does
+result_t btree_get_many(
+    txn_t *tx, uint64_t tree_id, btree_val_t *kvps, size_t n);
 // end::btree_api[]
 
 // tag::btree_cursor_api[]
@@ -449,6 +681,7 @@ typedef struct btree_cursor {
   btree_stack_t stack;
   span_t key;
   uint64_t val;
+  span_t data;
   bool has_val;
   uint8_t flags;
   bool is_uniquifier_search;
@@ -464,6 +697,24 @@ result_t btree_free_cursor(btree_cursor_t *cursor);
 enable_defer(btree_free_cursor);
 // end::btree_cursor_api[]
 
+// tag::btree_bulk_api[]
+#define BTREE_BULK_MAX_DEPTH (16)
+
+typedef struct btree_bulk {
+  txn_t *tx;
+  uint64_t tree_id;
+  // the page being filled, for each level
+  page_t levels[BTREE_BULK_MAX_DEPTH];
+  uint8_t depth;
+  uint8_t padding[7];
+} btree_bulk_t;
+
+// builds an empty tree bottom up, keys must be appended in order
+result_t btree_bulk_append(
+    btree_bulk_t *bulk, span_t *key, uint64_t val);
+result_t btree_bulk_finish(btree_bulk_t *bulk);
+// end::btree_bulk_api[]
+
 // tag::btree_multi_api[]
 result_t btree_multi_append(txn_t *tx, btree_val_t *set);
 result_t btree_multi_del(txn_t *tx, btree_val_t *del);
@@ -475,13 +726,79 @@ result_t btree_multi_get_next(btree_cursor_t *cursor);
 typedef enum __attribute__((__packed__)) index_type {
   index_type_container,
   index_type_btree,
-  index_type_hash
+  index_type_hash,
+  // primary key btree holding the rows in its leaves, must be the
+  // second index, rows too large for the leaf go to the container
+  index_type_clustered
 } index_type_t;
 
+// a fixed range of bytes inside the row (entries[0])
+typedef struct table_field {
+  uint16_t offset;
+  uint16_t size;
+} table_field_t;
+
+// tag::table_key_api[]
+// Keys built from these compare with memcmp in the order of their
+// values. Each part is read from a field of the row.
+typedef enum __attribute__((__packed__)) table_key_type {
+  table_key_bytes,   // fixed size, compared as is
+  table_key_string,  // up to the first zero or the field's end
+  table_key_int,     // signed, 1, 2, 4 or 8 bytes
+  table_key_uint,    // unsigned, 1, 2, 4 or 8 bytes
+  table_key_float,   // float or double, by the field's size
+  table_key_timestamp  // int64_t, microseconds since the epoch
+} table_key_type_t;
+
+typedef struct table_key_part {
+  table_field_t field;
+  table_key_type_t type;
+  uint8_t padding[3];
+} table_key_part_t;
+
+#define TABLE_KEY_MAX_PARTS (4)
+#define TABLE_KEY_MAX_SIZE (512)
+
+typedef struct table_key {
+  table_key_part_t parts[TABLE_KEY_MAX_PARTS];
+  uint16_t number_of_parts;
+  uint8_t padding[6];
+} table_key_t;
+
+// each returns the end of the encoded value in the buffer
+uint8_t *table_key_append_int(uint8_t *buffer, int64_t value);
+uint8_t *table_key_append_uint(uint8_t *buffer, uint64_t value);
+uint8_t *table_key_append_double(uint8_t *buffer, double value);
+// zeros are escaped and the string is terminated, so a string is
+// never a prefix of a longer one
+uint8_t *table_key_append_string(uint8_t *buffer, span_t *value);
+
+uint8_t *table_key_read_int(uint8_t *buffer, int64_t *value);
+uint8_t *table_key_read_uint(uint8_t *buffer, uint64_t *value);
+uint8_t *table_key_read_double(uint8_t *buffer, double *value);
+// the value is copied to the output, which needs room for it
+uint8_t *table_key_read_string(uint8_t *buffer, span_t *value);
+
+// the buffer must hold TABLE_KEY_MAX_SIZE bytes
+result_t table_key_encode(
+    table_key_t *key, span_t *row, uint8_t *buffer, span_t *out);
+// end::table_key_api[]
+
 typedef struct table_schema {
   char *name;
   index_type_t *types;
   uint64_t *index_ids;
+  // optional, per index, the row bytes a btree index also stores
+  table_field_t *covers;
+  // optional, per index, the typed parts the key is built from,
+  // replacing the entry that is passed for the index
+  table_key_t *keys;
+  // container item holding the statistics, set by table_create
+  uint64_t stats_id;
+  // optional, per btree index, a small tree that buffers its writes
+  // until they are merged in a sorted batch. A non zero entry asks
+  // table_create for a buffer and is replaced with its tree id.
+  uint64_t *buffer_ids;
   uint16_t count;
   uint8_t padding[6];
 } table_schema_t;
@@ -506,5 +823,198 @@ typedef struct table_item {
 } table_item_t;
 result_t table_set(txn_t *tx, table_item_t *item);
 result_t table_del(txn_t *tx, table_item_t *item);
+result_t table_update(
+    txn_t *tx, table_item_t *item, span_t *old_entries);
+result_t table_set_many(txn_t *tx, table_schema_t *schema,
+    table_item_t *rows, size_t number_of_rows);
 
 result_t table_get(txn_t *tx, table_item_t *item);
+result_t table_get_covered(txn_t *tx, table_item_t *item);
+
+// tag::table_scan_api[]
+typedef enum __attribute__((__packed__)) table_predicate_op {
+  table_predicate_eq,
+  table_predicate_range,
+  table_predicate_prefix
+} table_predicate_op_t;
+
+typedef struct table_predicate {
+  table_field_t field;
+  table_predicate_op_t op;
+  uint8_t padding[3];
+  // eq & prefix: the value, range: inclusive lower bound
+  span_t value;
+  // range only: inclusive upper bound, empty means no bound
+  span_t upper;
+} table_predicate_t;
+
+#define TABLE_SCAN_BATCH_SIZE (64)
+
+typedef struct table_scan {
+  txn_t *tx;
+  table_schema_t *schema;
+  table_predicate_t *predicates;
+  // when set, each result is the concatenation of these fields
+  table_field_t *projection;
+  uint16_t number_of_predicates;
+  uint16_t number_of_fields;
+  // number of results in the current batch
+  uint16_t count;
+  uint16_t position;  // next slot to read on the current page
+  bool started;
+  uint8_t padding[7];
+  uint64_t page_num;
+  // ids of hash index references, which aren't rows. Shared with
+  // the other scans of the table in this transaction.
+  table_refs_t *refs;
+  uint8_t *projected;
+  btree_cursor_t cursor;  // clustered tables are read in key order
+  uint64_t item_ids[TABLE_SCAN_BATCH_SIZE];
+  span_t rows[TABLE_SCAN_BATCH_SIZE];
+} table_scan_t;
+
+// the rows that pass the predicates are projected, a row too short
+// for the projection fails the scan. Hash index references are kept
+// in the same container as the rows, so the first scan of a table in
+// a transaction reads every hash index and its collision chains to
+// tell them apart, before it returns any row.
+result_t table_scan_next(table_scan_t *scan);
+result_t table_scan_close(table_scan_t *scan);
+enable_defer(table_scan_close);
+// end::table_scan_api[]
+
+// tag::table_range_api[]
+#define TABLE_RANGE_BATCH_SIZE (64)
+
+typedef struct table_range {
+  txn_t *tx;
+  table_schema_t *schema;
+  span_t start;  // inclusive, empty means from the first key
+  span_t end;    // inclusive, empty means up to the last key
+  uint16_t index_to_use;
+  // return each batch in key order, instead of container order
+  bool key_order;
+  bool started;
+  bool done;
+  // include keys starting with the end, for prefix scans
+  bool end_is_prefix;
+  // number of results in the current batch
+  uint16_t count;
+  span_t lower;
+  span_t upper;
+  uint8_t *bounds;
+  btree_cursor_t cursor;
+  btree_cursor_t buffer;  // over the index's buffer, if it has one
+  uint64_t item_ids[TABLE_RANGE_BATCH_SIZE];
+  span_t rows[TABLE_RANGE_BATCH_SIZE];
+} table_range_t;
+
+result_t table_range_next(table_range_t *range);
+result_t table_range_close(table_range_t *range);
+enable_defer(table_range_close);
+// end::table_range_api[]
+
+// tag::table_query_api[]
+typedef struct table_condition {
+  uint16_t index_to_use;
+  uint8_t padding[6];
+  // btree: inclusive bounds, empty means unbounded
+  // hash: start is the key to match, end must be empty
+  span_t start;
+  span_t end;
+} table_condition_t;
+
+#define TABLE_QUERY_BATCH_SIZE (64)
+
+// rows matching all the conditions, in item id (page) order
+typedef struct table_query {
+  txn_t *tx;
+  table_schema_t *schema;
+  table_condition_t *conditions;
+  uint16_t number_of_conditions;
+  // number of results in the current batch
+  uint16_t count;
+  bool started;
+  uint8_t padding[3];
+  uint64_t *matches;
+  size_t number_of_matches;
+  size_t position;  // next match to fetch
+  uint64_t item_ids[TABLE_QUERY_BATCH_SIZE];
+  span_t rows[TABLE_QUERY_BATCH_SIZE];
+} table_query_t;
+
+result_t table_query_next(table_query_t *query);
+result_t table_query_close(table_query_t *query);
+enable_defer(table_query_close);
+// end::table_query_api[]
+
+// tag::table_stats_api[]
+#define TABLE_STATS_REGISTERS (128)
+#define TABLE_STATS_BOUNDS (16)
+#define TABLE_STATS_BOUND_SIZE (16)
+
+typedef struct table_index_stats {
+  // HyperLogLog sketch of the keys, updated on every write
+  uint8_t registers[TABLE_STATS_REGISTERS];
+  // btree only, the keys splitting the index into equal parts, as
+  // of the last table_analyze. Long keys are truncated.
+  uint8_t bounds[TABLE_STATS_BOUNDS][TABLE_STATS_BOUND_SIZE];
+  uint8_t bound_sizes[TABLE_STATS_BOUNDS];
+  uint16_t number_of_bounds;
+  uint8_t padding[6];
+} table_index_stats_t;
+
+typedef struct table_stats {
+  uint64_t rows;
+  uint16_t count;  // same as the schema's, indexes[0] is unused
+  uint8_t padding[6];
+  table_index_stats_t indexes[];
+} table_stats_t;
+
+// returns a copy, which the caller must free
+result_t table_get_stats(
+    txn_t *tx, table_schema_t *schema, table_stats_t **stats);
+uint64_t table_stats_distinct(table_index_stats_t *stats);
+// recomputes the row count, the sketches and the bounds
+result_t table_analyze(txn_t *tx, table_schema_t *schema);
+// rows expected to match the condition, see table_query_t
+result_t table_estimate(txn_t *tx, table_schema_t *schema,
+    table_condition_t *condition, uint64_t *rows);
+// the position of the condition expected to match the least rows
+result_t table_choose_index(txn_t *tx, table_schema_t *schema,
+    table_condition_t *conditions, size_t number_of_conditions,
+    size_t *best);
+// end::table_stats_api[]
+
+// tag::table_buffer_api[]
+// a buffer is merged when its tree outgrows this many leaves
+#define TABLE_BUFFER_MAX_LEAVES (16)
+
+// applies the buffered writes of all the indexes
+result_t table_merge_buffers(txn_t *tx, table_schema_t *schema);
+// end::table_buffer_api[]
+
+// tag::table_add_index_api[]
+// the key must remain valid until the index is built, such as a
+// pointer into the row
+typedef result_t (*table_key_extractor_t)(
+    void *state, span_t *row, span_t *key);
+
+typedef struct table_index_options {
+  table_key_extractor_t extract;
+  void *state;
+  // the size of each sorted run, the sort memory per thread. All the
+  // runs are kept in memory, nothing is spilled to disk.
+  size_t bytes_per_run;
+  uint16_t threads;
+  index_type_t type;
+  uint8_t padding[5];
+} table_index_options_t;
+
+// the rows are read by one scan of the table, then their keys are
+// extracted and sorted in runs on the threads, and merged into the
+// index. The schema isn't changed in place, it is loaded again once
+// the index is added, the same as table_get_schema would return it.
+result_t table_add_index(txn_t *tx, table_schema_t *schema,
+    table_index_options_t *options);
+// end::table_add_index_api[]
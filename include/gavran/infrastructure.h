@@ -43,6 +43,8 @@ typedef struct operation_result op_result_t;
 op_result_t* errors_push_new(const char* file, uint32_t line,
                              const char* func, int32_t code);
 
+// the format is kept until the messages are read, it must outlive
+// the error, string arguments are copied
 __attribute__((__format__(__printf__, 1, 2))) op_result_t*
 errors_append_message(const char* format, ...);
 
@@ -1,3 +1,5 @@
+#include <time.h>
+
 #include <gavran/db.h>
 
 #define implementation_detail __attribute__((visibility("hidden")))
@@ -48,6 +50,152 @@ implementation_detail result_t db_try_increase_file_size(
 implementation_detail void db_initialize_default_options(
     db_options_t *options);
 
+// tag::db_hooks[]
+static inline result_t db_hooks_before_commit(txn_t *tx) {
+  db_hooks_t *hooks = &tx->state->db->hooks;
+  if (!hooks->before_commit) return success();
+  return hooks->before_commit(tx);
+}
+
+static inline void db_hooks_after_commit(txn_state_t *state) {
+  db_hooks_t *hooks = &state->db->hooks;
+  if (hooks->after_commit) hooks->after_commit(state);
+}
+
+static inline void db_hooks_clear_working_set(txn_t *tx) {
+  db_hooks_t *hooks = &tx->state->db->hooks;
+  if (hooks->clear_working_set) hooks->clear_working_set(tx);
+}
+
+static inline void db_hooks_page_access(
+    txn_t *tx, page_t *page, bool write) {
+  db_hooks_t *hooks = &tx->state->db->hooks;
+  if (hooks->page_access) hooks->page_access(tx, page, write);
+}
+// end::db_hooks[]
+
+// tag::db_row_cache[]
+typedef struct db_row_cache_entry {
+  struct db_row_cache_entry *next;  // in the same bucket
+  struct db_row_cache_entry *newer;
+  struct db_row_cache_entry *older;
+  uint64_t container_id;
+  uint64_t item_id;
+  size_t size;
+  uint8_t data[];
+} db_row_cache_entry_t;
+
+typedef struct db_row_cache {
+  db_row_cache_entry_t **buckets;  // by the page of the item
+  db_row_cache_entry_t *newest;
+  db_row_cache_entry_t *oldest;
+  size_t number_of_buckets;
+  size_t capacity;
+  size_t used;
+  uint64_t hits;
+  uint64_t misses;
+  bool wipe;
+  uint8_t padding[7];
+} db_row_cache_t;
+
+implementation_detail result_t db_row_cache_init(db_state_t *db);
+implementation_detail void db_row_cache_free(db_state_t *db);
+// container_item_get, serving the newest snapshot from the cache
+implementation_detail result_t db_row_cache_get(
+    txn_t *tx, container_item_t *item);
+// end::db_row_cache[]
+
+// tag::probes[]
+// static tracepoints for perf and bpftrace, under the gavran
+// provider. They are built only with GAVRAN_USDT (make USDT=1),
+// otherwise the arguments aren't even evaluated. The durations that
+// txn_commit and txn_gc_writeback report need db_flags_latency_stats,
+// they are 0 without it.
+#ifdef GAVRAN_USDT
+#include <sys/sdt.h>
+#define probe(name, ...) STAP_PROBEV(gavran, name, ##__VA_ARGS__)
+#else
+#define probe(name, ...) ((void)0)
+#endif
+// end::probes[]
+
+// tag::db_latency[]
+static inline uint64_t db_latency_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+// records the time since start, taken from db_latency_now()
+implementation_detail void db_latency_record(
+    db_state_t *db, db_latency_phase_t phase, uint64_t start);
+
+// the clock is read only if the latency hook is set, which
+// db_flags_latency_stats does
+static inline uint64_t db_hooks_latency_start(db_state_t *db) {
+  if (!db->hooks.latency) return 0;
+  return db_latency_now();
+}
+
+static inline void db_hooks_latency(
+    db_state_t *db, db_latency_phase_t phase, uint64_t start) {
+  if (db->hooks.latency) db->hooks.latency(db, phase, start);
+}
+// end::db_latency[]
+
+// tag::db_op_scope[]
+typedef struct db_op_scope {
+  db_state_t *db;
+  sys_counters_t counters;
+  db_op_t op;
+  uint8_t padding[4];
+} db_op_scope_t;
+
+// the op hooks, set with db_flags_sys_counters. db_op_begin sets the
+// scope's db only if it counts this call.
+implementation_detail void db_op_begin(
+    db_op_scope_t *scope, db_state_t *db, db_op_t op);
+implementation_detail void db_op_end(db_op_scope_t *scope);
+
+static inline void db_hooks_op_begin(
+    db_op_scope_t *scope, db_state_t *db, db_op_t op) {
+  scope->db = 0;
+  if (db->hooks.op_begin) db->hooks.op_begin(scope, db, op);
+}
+
+static inline void db_hooks_op_end(db_op_scope_t *scope) {
+  if (scope->db) scope->db->hooks.op_end(scope);
+}
+
+// attributes what this thread does until the end of the scope to op,
+// unless an enclosing call is already counted
+#define counted_op(db, op)                                   \
+  db_op_scope_t CONCAT(op_scope_, __LINE__)                  \
+      __attribute__((__cleanup__(db_hooks_op_end)));         \
+  db_hooks_op_begin(&CONCAT(op_scope_, __LINE__), db, op)
+// end::db_op_scope[]
+
+// tag::db_page_trace[]
+typedef struct db_page_trace_slot {
+  uint64_t seq;  // position + 1 once written, 0 while writing
+  uint64_t tx_id;
+  uint64_t page_num;
+  uint64_t info;  // page flags, and the write bit above them
+} db_page_trace_slot_t;
+
+typedef struct db_page_trace {
+  uint64_t head;
+  uint64_t mask;
+  db_page_trace_slot_t slots[];
+} db_page_trace_t;
+
+implementation_detail result_t db_page_trace_init(db_state_t *db);
+implementation_detail void db_page_trace_free(db_state_t *db);
+// the page_access hook, set when the trace is enabled
+implementation_detail void db_page_trace_record(
+    txn_t *tx, page_t *page, bool write);
+// end::db_page_trace[]
+
 __attribute__((const)) static inline uint64_t next_power_of_two(
     uint64_t x) {
   return 1 << (64 - __builtin_clzll(x - 1));
@@ -95,6 +243,10 @@ enable_defer(wal_close);
 uint32_t varint_get_length(uint64_t n);
 uint8_t *varint_encode(uint64_t n, uint8_t *buf);
 uint8_t *varint_decode(uint8_t *buf, uint64_t *value);
+// decodes up to max consecutive values, stopping at end, and moves
+// buf past them. Nothing at or after end is read.
+size_t varint_decode_many(
+    uint8_t **buf, uint8_t *end, uint64_t *values, size_t max);
 // end::varint_api[]
 
 implementation_detail bool hash_page_get_next(
@@ -130,4 +282,91 @@ implementation_detail result_t txn_alloc_temp(
 implementation_detail result_t txn_get_metadata(
     txn_t *tx, uint64_t page_num, page_metadata_t **metadata);
 implementation_detail result_t txn_modify_metadata(
-    txn_t *tx, uint64_t page_num, page_metadata_t **metadata);
\ No newline at end of file
+    txn_t *tx, uint64_t page_num, page_metadata_t **metadata);
+implementation_detail void table_hash_ref_decode(
+    span_t *ref, uint64_t *item_id, span_t *key, uint64_t *next);
+// drops the references a scan of the table would reuse, called when
+// a write transaction changes a hash index of the table
+implementation_detail void table_scan_refs_changed(
+    txn_t *tx, uint64_t container_id);
+
+#define TABLE_COVERING_KEY_MAX_SIZE (512)
+implementation_detail bool table_is_covering(
+    table_schema_t *schema, size_t i);
+implementation_detail result_t table_index_key(
+    table_schema_t *schema, size_t i, span_t *key, span_t *row,
+    uint8_t *buffer, span_t *out);
+implementation_detail result_t table_index_add(txn_t *tx,
+    table_schema_t *schema, size_t i, span_t *key, span_t *row,
+    uint64_t item_id);
+implementation_detail result_t table_schema_update(
+    txn_t *tx, table_schema_t *schema);
+
+implementation_detail result_t table_hash_index_collect(txn_t *tx,
+    table_schema_t *schema, size_t i, span_t *key,
+    uint64_t **item_ids, size_t *count);
+implementation_detail result_t table_range_next_ids(
+    table_range_t *range, uint64_t *item_ids, size_t *count);
+
+// replaces the entries of indexes with typed keys, built from the
+// row. The buffer holds the new entries and must be freed.
+implementation_detail result_t table_key_derive(
+    table_schema_t *schema, span_t **entries, void **buffer);
+implementation_detail result_t table_key_derive_many(
+    table_schema_t *schema, table_item_t *rows,
+    size_t number_of_rows, table_item_t **derived);
+
+implementation_detail bool table_is_clustered(
+    table_schema_t *schema);
+implementation_detail result_t table_clustered_row(txn_t *tx,
+    table_schema_t *schema, btree_val_t *kvp, uint64_t *item_id,
+    span_t *row);
+implementation_detail result_t table_clustered_set(
+    txn_t *tx, table_item_t *item);
+implementation_detail result_t table_clustered_del(
+    txn_t *tx, table_item_t *item);
+implementation_detail result_t table_clustered_update(
+    txn_t *tx, table_item_t *item, span_t *old_entries);
+implementation_detail result_t table_clustered_get(
+    txn_t *tx, table_item_t *item);
+
+// writes to buffered indexes go to their buffer, reads check both
+// a buffered removal, the key is deleted from the index on merge
+#define TABLE_BUFFER_TOMBSTONE (1)
+implementation_detail bool table_is_buffered(
+    table_schema_t *schema, size_t i);
+implementation_detail result_t table_buffer_get(
+    txn_t *tx, table_schema_t *schema, size_t i, btree_val_t *kvp);
+implementation_detail result_t table_buffer_put(txn_t *tx,
+    table_schema_t *schema, size_t i, span_t *key, uint64_t item_id);
+implementation_detail result_t table_buffer_remove(
+    txn_t *tx, table_schema_t *schema, size_t i, span_t *key);
+implementation_detail result_t table_buffer_merge(
+    txn_t *tx, table_schema_t *schema, size_t i);
+
+// statistics are kept for tables with a stats_id, the hooks are
+// no-ops for the others
+implementation_detail result_t table_stats_create(
+    txn_t *tx, table_schema_t *schema);
+implementation_detail result_t table_stats_record(txn_t *tx,
+    table_schema_t *schema, table_item_t *rows,
+    size_t number_of_rows, int64_t delta);
+implementation_detail result_t table_stats_analyze_added(
+    txn_t *tx, table_schema_t *schema, size_t i);
+// writes the row counts the transaction changed, see db_hooks_t
+implementation_detail result_t table_stats_before_commit(txn_t *tx);
+implementation_detail void table_stats_dropped(
+    txn_t *tx, uint64_t container_id);
+
+typedef struct table_index_entry {
+  span_t key;
+  span_t row;
+  uint64_t item_id;
+  uint64_t order;
+} table_index_entry_t;
+implementation_detail uint64_t table_hash_key(span_t *key);
+implementation_detail uint64_t table_hash_order(span_t *key);
+implementation_detail int table_index_entry_cmp_key(
+    const void *a, const void *b);
+implementation_detail int table_index_entry_cmp_order(
+    const void *a, const void *b);
@@ -44,6 +44,8 @@ result_t pal_enable_writes(span_t *range);
 void defer_pal_disable_writes(cancel_defer_t *cd);
 result_t pal_unmap(span_t *range);
 void defer_pal_unmap(cancel_defer_t *cd);
+result_t pal_prefetch(file_handle_t *handle, span_t *map,
+                      uint64_t offset, size_t size);
 
 // reading and writing to a file
 result_t pal_write_file(file_handle_t *handle, uint64_t offset,
@@ -51,3 +53,32 @@ result_t pal_write_file(file_handle_t *handle, uint64_t offset,
 result_t pal_read_file(file_handle_t *handle, uint64_t offset,
                        void *buffer, size_t size);
 // end::pal_api[]
+
+// tag::pal_faults[]
+// crash simulation for tests, counts the writes to the matching files
+// and tears the chosen one. Everything after it is lost, as if the
+// process died mid write. Built only with GAVRAN_FAULTS (make
+// FAULTS=1), the PAL has no fault state without it.
+#ifdef GAVRAN_FAULTS
+typedef struct pal_faults {
+  // only files whose name ends with this are counted, 0 for all
+  const char *file_suffix;
+  // the write that crashes, 1 based, 0 to never crash
+  uint64_t crash_at_write;
+  // how much of the crashing write reaches the disk, rounded down to
+  // the direct I/O block size. The last block is always lost, and 0
+  // drops the write entirely
+  size_t torn_write_size;
+  // updated by the PAL
+  uint64_t writes;
+  uint64_t fsyncs;
+  bool crashed;
+  // report EIO after the crash, instead of silently dropping
+  bool fail_after_crash;
+  uint8_t padding[6];
+} pal_faults_t;
+
+// pass 0 to go back to normal I/O
+void pal_set_faults(pal_faults_t *faults);
+#endif
+// end::pal_faults[]